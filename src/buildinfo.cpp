@@ -24,7 +24,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *******************************************************************************/
 
 #include "buildinfo.hpp"
-#include <boost/format.hpp>
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -42,6 +42,27 @@ void BuildDescription::set_ignored_features(const std::vector<std::string> &feat
 	ignored_features = features;
 }
 
+/**
+ * Append a unit (a single line of space separated fields) to the BuildDescription,
+ * feeding it into the running digest as it is added.
+ *
+ * @param fields - The fields making up the unit.
+ */
+void BuildDescription::add_unit(std::initializer_list<std::string_view> fields)
+{
+	size_t start = this->text.size();
+	bool first = true;
+	for(auto field : fields) {
+		if(!first) {
+			this->text.push_back(' ');
+		}
+		this->text.append(field);
+		first = false;
+	}
+	this->text.push_back('\n');
+	this->digest.update(this->text.data() + start, this->text.size() - start);
+}
+
 /**
  * Add a feature value pair to the BuildDescription.
  *
@@ -54,8 +75,7 @@ void BuildDescription::add_feature_value(const std::string &feature,
 	bool is_ignored = (std::find(ignored_features.begin(), ignored_features.end(),
 	                             feature) != ignored_features.end());
 	if(!is_ignored) {
-		auto desc = boost::format{"FeatureValue %1% %2%"} % feature % value;
-		this->BUs.push_back(desc.str());
+		this->add_unit({"FeatureValue", feature, value});
 	}
 }
 
@@ -66,8 +86,7 @@ void BuildDescription::add_feature_value(const std::string &feature,
  */
 void BuildDescription::add_nil_feature_value(const std::string &feature)
 {
-	auto desc = boost::format{"FeatureNil %1%"} % feature;
-	this->BUs.push_back(desc.str());
+	this->add_unit({"FeatureNil", feature});
 }
 
 /**
@@ -78,8 +97,7 @@ void BuildDescription::add_nil_feature_value(const std::string &feature)
  */
 void BuildDescription::add_package_file(const std::string &fname, const std::string &hash)
 {
-	auto desc = boost::format{"PackageFile %1% %2%"} % fname % hash;
-	this->BUs.push_back(desc.str());
+	this->add_unit({"PackageFile", fname, hash});
 }
 
 /**
@@ -90,8 +108,7 @@ void BuildDescription::add_package_file(const std::string &fname, const std::str
  */
 void BuildDescription::add_require_file(const std::string &fname, const std::string &hash)
 {
-	auto desc = boost::format{"RequireFile %1% %2%"} % fname % hash;
-	this->BUs.push_back(desc.str());
+	this->add_unit({"RequireFile", fname, hash});
 }
 
 /**
@@ -103,8 +120,7 @@ void BuildDescription::add_require_file(const std::string &fname, const std::str
 void BuildDescription::add_output_info_file(const std::string &fname,
                                             const std::string &hash)
 {
-	auto desc = boost::format{"OutputInfoFile %1% %2%"} % fname % hash;
-	this->BUs.push_back(desc.str());
+	this->add_unit({"OutputInfoFile", fname, hash});
 }
 
 /**
@@ -116,8 +132,18 @@ void BuildDescription::add_output_info_file(const std::string &fname,
 void BuildDescription::add_build_info_file(const std::string &fname,
                                            const std::string &hash)
 {
-	auto desc = boost::format{"BuildInfoFile %1% %2%"} % fname % hash;
-	this->BUs.push_back(desc.str());
+	this->add_unit({"BuildInfoFile", fname, hash});
+}
+
+/**
+ * Add the build key file of a depended package to the BuildDescription.
+ *
+ * @param fname - The name of the build key file of a depended package.
+ * @param hash - The hash of the file.
+ */
+void BuildDescription::add_build_key_file(const std::string &fname, const std::string &hash)
+{
+	this->add_unit({"BuildKeyFile", fname, hash});
 }
 
 /**
@@ -129,8 +155,17 @@ void BuildDescription::add_build_info_file(const std::string &fname,
 void BuildDescription::add_extraction_info_file(const std::string &fname,
                                                 const std::string &hash)
 {
-	auto desc = boost::format{"ExtractionInfoFile %1% %2%"} % fname % hash;
-	this->BUs.push_back(desc.str());
+	this->add_unit({"ExtractionInfoFile", fname, hash});
+}
+
+/**
+ * Add a stage filter pattern of the package being built to the BuildDescription.
+ *
+ * @param pattern - The pattern of the files extracted from the staging packages.
+ */
+void BuildDescription::add_stage_filter(const std::string &pattern)
+{
+	this->add_unit({"StageFilter", pattern});
 }
 
 /**
@@ -140,7 +175,15 @@ void BuildDescription::add_extraction_info_file(const std::string &fname,
  */
 void BuildDescription::print(std::ostream &out) const
 {
-	for(auto &unit : this->BUs) {
-		out << unit << std::endl;
-	}
+	out << this->text;
+}
+
+/**
+ * Get the digest of the BuildDescription (i.e. the hash of what print() outputs).
+ *
+ * @returns The SHA-256 digest as a hex string.
+ */
+std::string BuildDescription::hash() const
+{
+	return this->digest.hex();
 }
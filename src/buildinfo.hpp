@@ -26,9 +26,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef BUILDINFO_HPP_
 #define BUILDINFO_HPP_
 
+#include "hash.hpp"
+#include <initializer_list>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace buildsys
@@ -40,7 +43,9 @@ namespace buildsys
 	class BuildDescription
 	{
 	private:
-		std::vector<std::string> BUs;
+		std::string text;
+		HashStream digest;
+		void add_unit(std::initializer_list<std::string_view> fields);
 
 	public:
 		static void set_ignored_features(const std::vector<std::string> &features);
@@ -50,8 +55,11 @@ namespace buildsys
 		void add_require_file(const std::string &fname, const std::string &hash);
 		void add_output_info_file(const std::string &fname, const std::string &hash);
 		void add_build_info_file(const std::string &fname, const std::string &hash);
+		void add_build_key_file(const std::string &fname, const std::string &hash);
 		void add_extraction_info_file(const std::string &fname, const std::string &hash);
+		void add_stage_filter(const std::string &pattern);
 		void print(std::ostream &out) const;
+		std::string hash() const;
 	};
 } // namespace buildsys
 
@@ -0,0 +1,159 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "cacheindex.hpp"
+#include "httpclient.hpp"
+#include "logger.hpp"
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/format.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+using namespace buildsys;
+
+/**
+ * Get the indexes. They are never destroyed, as the (detached) package build threads
+ * may still be using them while the program exits.
+ */
+CacheIndex *CacheIndex::get()
+{
+	static auto *index = new CacheIndex();
+	return index;
+}
+
+/**
+ * Fetch the index of a server.
+ *
+ * @param server - The server (a file:// or http:// URL).
+ * @param contents - Set to the index.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns false if the server has no index, or it could not be fetched.
+ */
+bool CacheIndex::fetch(const std::string &server, std::string *contents, Logger *logger)
+{
+	std::string url = server + "/index";
+	if(boost::algorithm::starts_with(url, "file://")) {
+		std::ifstream in(url.substr(7));
+		std::stringstream buffer;
+		buffer << in.rdbuf();
+		*contents = buffer.str();
+		return in.is_open() && !in.bad();
+	}
+	if(!HttpClient::supported(url)) {
+		return false;
+	}
+	int fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if(fd < 0) {
+		logger->log("/tmp: Cannot create: " + std::string(strerror(errno)));
+		return false;
+	}
+	bool result = HttpClient::get()->fetch(url, fd, logger) == 200;
+	contents->clear();
+	char buf[65536];
+	for(off_t offset = 0; result;) {
+		ssize_t len = pread(fd, buf, sizeof(buf), offset);
+		if(len < 0 && errno == EINTR) {
+			continue;
+		}
+		if(len <= 0) {
+			result = len == 0;
+			break;
+		}
+		contents->append(buf, static_cast<size_t>(len));
+		offset += len;
+	}
+	close(fd);
+	return result;
+}
+
+/**
+ * Check whether a server may have an entry. The index of the server is fetched on the
+ * first check, a server without one may have any entry.
+ *
+ * @param server - The server.
+ * @param key - The entry ("namespace/package/build info hash").
+ * @param logger - The logger to report errors to.
+ *
+ * @returns false if the server's index does not list the entry, true otherwise.
+ */
+bool CacheIndex::mayHave(const std::string &server, const std::string &key,
+                         Logger *logger)
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	Index &index = this->indexes[server];
+	if(!index.loaded) {
+		// Fetched while holding the lock, the other lookups need the index too
+		index.loaded = true;
+		std::string contents;
+		if(CacheIndex::fetch(server, &contents, logger)) {
+			index.available = true;
+			std::istringstream lines(contents);
+			std::string line;
+			while(lines >> line) {
+				index.keys.insert(line);
+			}
+			logger->log(boost::format{"Build cache %1%: %2% entries in the index"} %
+			            server % index.keys.size());
+		} else {
+			logger->log_verbose("Build cache " + server + ": No index");
+		}
+	}
+	return !index.available || index.keys.count(key) != 0;
+}
+
+/**
+ * Add an entry to the index of a build cache directory, if it has one.
+ *
+ * @param dir - The cache directory.
+ * @param key - The entry ("namespace/package/build info hash").
+ * @param logger - The logger to report errors to.
+ */
+void CacheIndex::add(const std::string &dir, const std::string &key, Logger *logger)
+{
+	std::string path = dir + "/index";
+	int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if(fd < 0) {
+		return;
+	}
+	// A single append, so the lines written by other workspaces are not mixed with it
+	std::string line = key + "\n";
+	if(write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+		logger->log(path + ": Cannot write: " + std::string(strerror(errno)));
+	}
+	close(fd);
+}
+
+//! Forget the indexes, so they are fetched again
+void CacheIndex::reset()
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	this->indexes.clear();
+}
@@ -0,0 +1,66 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef CACHEINDEX_HPP_
+#define CACHEINDEX_HPP_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+namespace buildsys
+{
+	class Logger;
+
+	/**
+	 * The lists of the entries on the build cache servers. Each server's "index" (a line
+	 * with the "namespace/package/build info hash" of each complete entry) is fetched
+	 * once, and lookups of the entries that are not listed are answered without asking
+	 * the server.
+	 */
+	class CacheIndex
+	{
+	private:
+		//! The index of a server
+		struct Index {
+			bool loaded{false};
+			bool available{false}; //!< The server has an index
+			std::unordered_set<std::string> keys;
+		};
+		std::mutex lock;
+		std::map<std::string, Index> indexes;
+		CacheIndex() = default;
+		static bool fetch(const std::string &server, std::string *contents, Logger *logger);
+
+	public:
+		static CacheIndex *get();
+		bool mayHave(const std::string &server, const std::string &key, Logger *logger);
+		void add(const std::string &dir, const std::string &key, Logger *logger);
+		void reset();
+	};
+} // namespace buildsys
+
+#endif // CACHEINDEX_HPP_
@@ -0,0 +1,339 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "cachepublish.hpp"
+#include "cacheindex.hpp"
+#include "chunkstore.hpp"
+#include "filecopy.hpp"
+#include "httpclient.hpp"
+#include "logger.hpp"
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/format.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+std::string CachePublisher::target;
+std::string CachePublisher::chunk_store;
+
+/**
+ * Get the publisher. It is never destroyed, as its (detached) thread may still be using
+ * it while the program exits.
+ */
+CachePublisher *CachePublisher::get()
+{
+	static auto *publisher = new CachePublisher();
+	return publisher;
+}
+
+/**
+ * Set where the outputs of local builds are published to.
+ *
+ * @param _target - A directory (a path or a file:// URL), or an http:// URL.
+ */
+void CachePublisher::set_target(const std::string &_target)
+{
+	target = _target;
+}
+
+/**
+ * Set the chunk store that archives are split into before being published, so that
+ * only the chunks the build cache does not already have are uploaded.
+ *
+ * @param store - The chunk store directory, or empty to publish whole archives.
+ */
+void CachePublisher::set_chunk_store(const std::string &store)
+{
+	chunk_store = store;
+}
+
+bool CachePublisher::enabled()
+{
+	return !target.empty();
+}
+
+/**
+ * Queue an entry to be published. The files are opened straight away, so the entry
+ * holds the outputs of this build even if the package is rebuilt (and its archives
+ * replaced) before the upload starts.
+ *
+ * @param key - The entry ("namespace/package/build info hash").
+ * @param files - The names of the files in the entry, and where to take them from.
+ * @param logger - The logger to report errors opening the files to.
+ * @param prefix - The log prefix for the upload.
+ *
+ * @returns true if the entry was queued, false otherwise.
+ */
+bool CachePublisher::publish(const std::string &key,
+                             const std::vector<std::array<std::string, 2>> &files,
+                             Logger *logger, const std::string &prefix)
+{
+	Job job{key, prefix, {}, {}};
+	for(const auto &file : files) {
+		int fd = open(file.at(1).c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) {
+			logger->log(file.at(1) + ": Cannot open: " + std::string(strerror(errno)));
+			for(int opened : job.fds) {
+				close(opened);
+			}
+			return false;
+		}
+		job.names.push_back(file.at(0));
+		job.fds.push_back(fd);
+	}
+
+	std::unique_lock<std::mutex> lk(this->lock);
+	this->queue.push_back(std::move(job));
+	if(!this->started) {
+		this->started = true;
+		std::thread(&CachePublisher::worker, this).detach();
+	}
+	this->cond.notify_all();
+	return true;
+}
+
+//! Whether any entries are still queued or being published
+bool CachePublisher::pending()
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	return this->busy || !this->queue.empty();
+}
+
+//! Wait for all of the queued entries to be published
+void CachePublisher::wait()
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	while(this->busy || !this->queue.empty()) {
+		this->cond.wait(lk);
+	}
+}
+
+void CachePublisher::worker()
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	while(true) {
+		while(this->queue.empty()) {
+			this->cond.wait(lk);
+		}
+		Job job = std::move(this->queue.front());
+		this->queue.pop_front();
+		this->busy = true;
+		lk.unlock();
+
+		Logger logger(job.prefix);
+		if(this->upload(job, &logger)) {
+			logger.log_verbose("Published to the build cache: " + job.key);
+		} else {
+			logger.log("Failed to publish to the build cache: " + job.key);
+		}
+		for(int fd : job.fds) {
+			close(fd);
+		}
+
+		lk.lock();
+		this->busy = false;
+		this->cond.notify_all();
+	}
+}
+
+//! The directory of a directory target, or empty for a server
+static std::string target_dir(const std::string &target)
+{
+	if(HttpClient::supported(target)) {
+		return "";
+	}
+	return boost::algorithm::starts_with(target, "file://") ? target.substr(7) : target;
+}
+
+/**
+ * Check whether a file is already in the build cache.
+ *
+ * @param path - The file, relative to the target.
+ * @param logger - The logger to report errors to.
+ */
+bool CachePublisher::has(const std::string &path, Logger *logger)
+{
+	std::string dir = target_dir(target);
+	if(dir.empty()) {
+		return HttpClient::get()->head(target + "/" + path, logger) == 200;
+	}
+	return access((dir + "/" + path).c_str(), F_OK) == 0;
+}
+
+/**
+ * Put a file in the build cache. In a directory it is written under a temporary name
+ * and renamed into place, a server gets a PUT request.
+ *
+ * @param path - The file, relative to the target.
+ * @param in - The contents (all of the file, whatever its offset).
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the file was put, false otherwise.
+ */
+bool CachePublisher::put(const std::string &path, int in, Logger *logger)
+{
+	std::string dir = target_dir(target);
+	if(dir.empty()) {
+		int status = HttpClient::get()->put(target + "/" + path, in, logger);
+		if(status != 200 && status != 201 && status != 204) {
+			if(status > 0) {
+				logger->log(boost::format{"%1%/%2%: Cannot upload: HTTP status %3%"} %
+				            target % path % status);
+			}
+			return false;
+		}
+		return true;
+	}
+
+	std::string dst = dir + "/" + path;
+	std::error_code ec;
+	auto parent = filesystem::path(dst).parent_path();
+	filesystem::create_directories(parent, ec);
+	if(ec) {
+		logger->log(parent.string() + ": Cannot create: " + ec.message());
+		return false;
+	}
+	std::string tmp = dst + ".XXXXXX";
+	int out = mkostemp(tmp.data(), O_CLOEXEC);
+	if(out < 0) {
+		logger->log(tmp + ": Cannot create: " + std::string(strerror(errno)));
+		return false;
+	}
+	// Read from the start, the file may have been read already
+	int res = lseek(in, 0, SEEK_SET) == 0 ? copy_contents(in, out) : -1;
+	if(res == 0 && (fchmod(out, 0644) != 0 || fsync(out) != 0)) {
+		res = -1;
+	}
+	int err = errno;
+	if(close(out) != 0 && res == 0) {
+		res = -1;
+		err = errno;
+	}
+	if(res == 0 && rename(tmp.c_str(), dst.c_str()) != 0) {
+		res = -1;
+		err = errno;
+	}
+	if(res != 0) {
+		logger->log(dst + ": Cannot write: " + std::string(strerror(err)));
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Put an archive in the build cache as chunks (those the cache does not already have),
+ * and the index of them.
+ *
+ * @param path - The archive, relative to the target (the index is named after it, with
+ *               ".chunks" appended).
+ * @param in - The archive.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the archive was put, false otherwise.
+ */
+bool CachePublisher::putChunked(const std::string &path, int in, Logger *logger)
+{
+	std::vector<ArchiveChunk> chunks;
+	if(!chunk_store_add(chunk_store, in, &chunks, logger)) {
+		return false;
+	}
+	std::set<std::string> seen;
+	for(const auto &chunk : chunks) {
+		std::string chunk_file = "chunks/" + chunk_path(chunk.hash);
+		if(!seen.insert(chunk.hash).second || this->has(chunk_file, logger)) {
+			continue;
+		}
+		std::string stored = chunk_store + "/" + chunk_path(chunk.hash);
+		int fd = open(stored.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd < 0) {
+			logger->log(stored + ": Cannot open: " + std::string(strerror(errno)));
+			return false;
+		}
+		bool result = this->put(chunk_file, fd, logger);
+		close(fd);
+		if(!result) {
+			return false;
+		}
+	}
+
+	int index = open(chunk_store.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0644);
+	if(index < 0) {
+		logger->log(chunk_store + ": Cannot create: " + std::string(strerror(errno)));
+		return false;
+	}
+	bool result =
+	    chunk_index_write(index, chunks) && this->put(path + ".chunks", index, logger);
+	close(index);
+	return result;
+}
+
+/**
+ * Publish an entry: the files (archives as chunks, when there is a chunk store), then
+ * the "usable" marker, so that the entry is only used once it is complete.
+ *
+ * @param job - The entry.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the entry is in the cache, false otherwise.
+ */
+bool CachePublisher::upload(const Job &job, Logger *logger)
+{
+	if(this->has(job.key + "/usable", logger)) {
+		// Already published (by this or another workspace)
+		return true;
+	}
+	for(size_t i = 0; i < job.names.size(); i++) {
+		std::string path = job.key + "/" + job.names.at(i);
+		bool chunked = !chunk_store.empty() &&
+		               boost::algorithm::ends_with(job.names.at(i), ".tar");
+		if(!(chunked ? this->putChunked(path, job.fds.at(i), logger)
+		             : this->put(path, job.fds.at(i), logger))) {
+			return false;
+		}
+	}
+	int empty = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	if(empty < 0) {
+		logger->log("/dev/null: Cannot open: " + std::string(strerror(errno)));
+		return false;
+	}
+	bool result = this->put(job.key + "/usable", empty, logger);
+	close(empty);
+	std::string dir = target_dir(target);
+	if(result && !dir.empty()) {
+		CacheIndex::get()->add(dir, job.key, logger);
+	}
+	return result;
+}
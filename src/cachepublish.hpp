@@ -0,0 +1,83 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef CACHEPUBLISH_HPP_
+#define CACHEPUBLISH_HPP_
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace buildsys
+{
+	class Logger;
+
+	/**
+	 * Publishes the outputs of local builds to a build cache (a directory, or an HTTP
+	 * server accepting PUT requests) from a background thread, so that builds never wait
+	 * for an upload. The "usable" marker of an entry is written last, so a reader of the
+	 * cache never sees an incomplete entry.
+	 */
+	class CachePublisher
+	{
+	private:
+		//! An entry waiting to be published
+		struct Job {
+			std::string key;    //!< The entry ("namespace/package/build info hash")
+			std::string prefix; //!< The log prefix of the package
+			std::vector<std::string> names;
+			std::vector<int> fds; //!< The files, opened when the entry was queued
+		};
+		static std::string target;
+		static std::string chunk_store;
+		std::mutex lock;
+		std::condition_variable cond;
+		std::deque<Job> queue;
+		bool busy{false};
+		bool started{false};
+		CachePublisher() = default;
+		void worker();
+		bool has(const std::string &path, Logger *logger);
+		bool put(const std::string &path, int in, Logger *logger);
+		bool putChunked(const std::string &path, int in, Logger *logger);
+		bool upload(const Job &job, Logger *logger);
+
+	public:
+		static CachePublisher *get();
+		static void set_target(const std::string &_target);
+		static void set_chunk_store(const std::string &store);
+		static bool enabled();
+		bool publish(const std::string &key,
+		             const std::vector<std::array<std::string, 2>> &files, Logger *logger,
+		             const std::string &prefix);
+		bool pending();
+		void wait();
+	};
+} // namespace buildsys
+
+#endif // CACHEPUBLISH_HPP_
@@ -0,0 +1,133 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "cachestats.hpp"
+#include "logger.hpp"
+#include <boost/format.hpp>
+#include <string>
+
+using namespace buildsys;
+
+/**
+ * Get the statistics. They are never destroyed, as the (detached) package build threads
+ * may still be using them while the program exits.
+ */
+CacheStats *CacheStats::get()
+{
+	static auto *stats = new CacheStats();
+	return stats;
+}
+
+//! Find the counts for a server, adding them if needed (lock must be held)
+CacheStats::Server *CacheStats::find(const std::string &url)
+{
+	for(auto &server : this->servers) {
+		if(server.url == url) {
+			return &server;
+		}
+	}
+	this->servers.push_back({url});
+	return &this->servers.back();
+}
+
+/**
+ * Add a server, so that the summary lists the servers in the order they are looked up
+ * in.
+ *
+ * @param url - The server.
+ */
+void CacheStats::add(const std::string &url)
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	this->find(url);
+}
+
+/**
+ * Count a lookup of a package.
+ *
+ * @param url - The server.
+ * @param hit - Whether the server had a complete entry for the package.
+ * @param latency - How long the server took to answer.
+ */
+void CacheStats::probed(const std::string &url, bool hit, std::chrono::nanoseconds latency)
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	Server *server = this->find(url);
+	server->probes++;
+	if(hit) {
+		server->hits++;
+	}
+	server->latency += latency;
+}
+
+/**
+ * Count a lookup of a package answered by the index of the server (always a miss).
+ *
+ * @param url - The server.
+ */
+void CacheStats::indexed(const std::string &url)
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	this->find(url)->indexed++;
+}
+
+/**
+ * Count the outputs of a package being got from a server.
+ *
+ * @param url - The server.
+ */
+void CacheStats::used(const std::string &url)
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	this->find(url)->used++;
+}
+
+/**
+ * Log the counts of each server that was looked up.
+ *
+ * @param logger - The logger to log to.
+ */
+void CacheStats::summary(Logger *logger)
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	for(const auto &server : this->servers) {
+		if(server.probes == 0 && server.indexed == 0) {
+			continue;
+		}
+		auto average = std::chrono::duration_cast<std::chrono::milliseconds>(
+		    server.latency / (server.probes != 0 ? server.probes : 1));
+		logger->log(boost::format{"Build cache %1%: %2% lookups (%3% answered by the "
+		                          "index), %4% hits, %5% used, %6%ms average latency"} %
+		            server.url % (server.probes + server.indexed) % server.indexed %
+		            server.hits % server.used % average.count());
+	}
+}
+
+//! Forget all of the counts
+void CacheStats::reset()
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	this->servers.clear();
+}
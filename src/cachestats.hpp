@@ -0,0 +1,71 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef CACHESTATS_HPP_
+#define CACHESTATS_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace buildsys
+{
+	class Logger;
+
+	/**
+	 * Counts how each build cache server answered the lookups of the packages, for the
+	 * summary at the end of the build.
+	 */
+	class CacheStats
+	{
+	private:
+		//! The counts for one server
+		struct Server {
+			std::string url;
+			unsigned int probes{0};  //!< Lookups answered (with a hit or a miss)
+			unsigned int indexed{0}; //!< Misses answered by the index of the server
+			unsigned int hits{0};    //!< Lookups that found a complete entry
+			unsigned int used{0};    //!< Entries the outputs were got from
+			std::chrono::nanoseconds latency{0}; //!< Total time taken by the lookups
+		};
+		std::mutex lock;
+		std::vector<Server> servers;
+		CacheStats() = default;
+		Server *find(const std::string &url);
+
+	public:
+		static CacheStats *get();
+		void add(const std::string &url);
+		void probed(const std::string &url, bool hit, std::chrono::nanoseconds latency);
+		void indexed(const std::string &url);
+		void used(const std::string &url);
+		void summary(Logger *logger);
+		void reset();
+	};
+} // namespace buildsys
+
+#endif // CACHESTATS_HPP_
@@ -0,0 +1,357 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "chunkstore.hpp"
+#include "filecopy.hpp"
+#include "hash.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+// Chunks are 64KiB on average, so that an archive differing in a few files shares most
+// of its chunks with the previous version, while the index stays small.
+static const size_t MIN_CHUNK = 16 * 1024;
+static const size_t AVG_CHUNK = 64 * 1024;
+static const size_t MAX_CHUNK = 256 * 1024;
+// Cut points are found in the high bits of the hash (which depend on the last 64
+// bytes), with a harder mask before the average size and an easier one after it.
+static const uint64_t MASK_SMALL = ~uint64_t{0} << 46;
+static const uint64_t MASK_LARGE = ~uint64_t{0} << 50;
+
+//! The random values of each byte for the gear hash, the same in every build
+static const std::array<uint64_t, 256> &gear_table()
+{
+	static const std::array<uint64_t, 256> table = [] {
+		std::array<uint64_t, 256> values{};
+		uint64_t state = 0x6275696c64737973; // splitmix64
+		for(auto &value : values) {
+			uint64_t z = (state += 0x9e3779b97f4a7c15);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+			value = z ^ (z >> 31);
+		}
+		return values;
+	}();
+	return table;
+}
+
+//! Find the length of the chunk at the start of data
+static size_t find_cut(const unsigned char *data, size_t len)
+{
+	if(len <= MIN_CHUNK) {
+		return len;
+	}
+	const auto &gear = gear_table();
+	size_t normal = std::min(AVG_CHUNK, len);
+	size_t limit = std::min(MAX_CHUNK, len);
+	uint64_t fp = 0;
+	size_t i = MIN_CHUNK;
+	for(; i < normal; i++) {
+		fp = (fp << 1) + gear.at(data[i]); // NOLINT
+		if((fp & MASK_SMALL) == 0) {
+			return i + 1;
+		}
+	}
+	for(; i < limit; i++) {
+		fp = (fp << 1) + gear.at(data[i]); // NOLINT
+		if((fp & MASK_LARGE) == 0) {
+			return i + 1;
+		}
+	}
+	return limit;
+}
+
+/**
+ * Split a file into chunks at points chosen by its contents (with a gear rolling hash),
+ * so that an insertion or removal only changes the chunks around it.
+ *
+ * @param fd - The file, it is read from the start whatever its offset.
+ * @param chunk - Called with the data of each chunk in turn, returns false to stop.
+ *
+ * @returns false if the file could not be read, or chunk returned false.
+ */
+bool buildsys::chunk_split(int fd, const std::function<bool(const char *, size_t)> &chunk)
+{
+	std::vector<char> buffer(MAX_CHUNK * 16);
+	size_t start = 0;
+	size_t len = 0;
+	off_t offset = 0;
+	bool eof = false;
+	while(true) {
+		if(!eof && len - start < MAX_CHUNK) {
+			std::memmove(buffer.data(), buffer.data() + start, len - start);
+			len -= start;
+			start = 0;
+			while(len < buffer.size()) {
+				ssize_t res = pread(fd, buffer.data() + len, buffer.size() - len, offset);
+				if(res < 0 && errno == EINTR) {
+					continue;
+				}
+				if(res < 0) {
+					return false;
+				}
+				if(res == 0) {
+					eof = true;
+					break;
+				}
+				len += static_cast<size_t>(res);
+				offset += res;
+			}
+		}
+		if(start == len) {
+			return true;
+		}
+		const auto *data = reinterpret_cast<const unsigned char *>(buffer.data() + start);
+		size_t cut = find_cut(data, len - start);
+		if(!chunk(buffer.data() + start, cut)) {
+			return false;
+		}
+		start += cut;
+	}
+}
+
+//! Where a chunk is kept, relative to the store (or the chunks of a cache server)
+std::string buildsys::chunk_path(const std::string &hash)
+{
+	return hash.substr(0, 2) + "/" + hash;
+}
+
+bool buildsys::chunk_store_has(const std::string &store, const std::string &hash)
+{
+	return access((store + "/" + chunk_path(hash)).c_str(), F_OK) == 0;
+}
+
+//! Add a chunk to the store, unless it is already there
+static bool store_chunk(const std::string &store, const std::string &hash, const char *data,
+                        size_t len, Logger *logger)
+{
+	if(chunk_store_has(store, hash)) {
+		return true;
+	}
+	std::string path = store + "/" + chunk_path(hash);
+	std::error_code ec;
+	filesystem::create_directories(filesystem::path(path).parent_path(), ec);
+	// Write to a temporary file first, so the chunk is either complete or not there
+	std::string tmp = path + ".XXXXXX";
+	int fd = mkostemp(tmp.data(), O_CLOEXEC);
+	if(fd < 0) {
+		logger->log(tmp + ": Cannot create: " + std::string(strerror(errno)));
+		return false;
+	}
+	bool ok = true;
+	for(size_t done = 0; ok && done < len;) {
+		ssize_t wrote = write(fd, data + done, len - done);
+		if(wrote < 0 && errno == EINTR) {
+			continue;
+		}
+		ok = wrote > 0;
+		done += ok ? static_cast<size_t>(wrote) : 0;
+	}
+	int err = errno;
+	if(close(fd) != 0 && ok) {
+		ok = false;
+		err = errno;
+	}
+	if(ok && (fchmodat(AT_FDCWD, tmp.c_str(), 0644, 0) != 0 ||
+	          rename(tmp.c_str(), path.c_str()) != 0)) {
+		ok = false;
+		err = errno;
+	}
+	if(!ok) {
+		logger->log(path + ": Cannot write: " + std::string(strerror(err)));
+		unlink(tmp.c_str());
+	}
+	return ok;
+}
+
+/**
+ * Split a file into chunks, adding any that are not already there to a chunk store.
+ *
+ * @param store - The chunk store directory.
+ * @param fd - The file.
+ * @param chunks - Set to the chunks of the file, in order.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if all of the chunks are in the store, false otherwise.
+ */
+bool buildsys::chunk_store_add(const std::string &store, int fd,
+                               std::vector<ArchiveChunk> *chunks, Logger *logger)
+{
+	chunks->clear();
+	bool stored = true;
+	bool read = chunk_split(fd, [&store, chunks, logger, &stored](const char *data,
+	                                                              size_t len) {
+		HashStream hs;
+		hs.update(data, len);
+		chunks->push_back({hs.hex(), len});
+		stored = store_chunk(store, chunks->back().hash, data, len, logger);
+		return stored;
+	});
+	if(!read && stored) {
+		logger->log("Cannot read the file to chunk: " + std::string(strerror(errno)));
+	}
+	return read;
+}
+
+/**
+ * Add a chunk fetched from elsewhere to a chunk store, checking that it has the
+ * expected contents.
+ *
+ * @param store - The chunk store directory.
+ * @param hash - The hash of the chunk.
+ * @param file - The fetched chunk, it is removed.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the chunk is in the store, false otherwise.
+ */
+bool buildsys::chunk_store_import(const std::string &store, const std::string &hash,
+                                  const std::string &file, Logger *logger)
+{
+	std::ifstream in(file, std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(in)),
+	                 std::istreambuf_iterator<char>());
+	bool read = !in.bad();
+	in.close();
+	unlink(file.c_str());
+	HashStream hs;
+	hs.update(data);
+	if(!read || hs.hex() != hash) {
+		logger->log(file + ": Chunk does not match its hash");
+		return false;
+	}
+	return store_chunk(store, hash, data.data(), data.size(), logger);
+}
+
+/**
+ * Join chunks from a chunk store into a file.
+ *
+ * @param store - The chunk store directory.
+ * @param chunks - The chunks of the file, in order.
+ * @param file - The file to create (any existing file is replaced).
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the file was created, false otherwise (nothing is left behind).
+ */
+bool buildsys::chunk_store_assemble(const std::string &store,
+                                    const std::vector<ArchiveChunk> &chunks,
+                                    const std::string &file, Logger *logger)
+{
+	int out = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if(out < 0) {
+		logger->log(file + ": Cannot create: " + std::string(strerror(errno)));
+		return false;
+	}
+	bool ok = true;
+	for(const auto &chunk : chunks) {
+		std::string path = store + "/" + chunk_path(chunk.hash);
+		int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st = {};
+		if(in < 0 || fstat(in, &st) != 0 ||
+		   static_cast<uint64_t>(st.st_size) != chunk.size || copy_contents(in, out) != 0) {
+			logger->log(path + ": Cannot read chunk: " +
+			            std::string(in < 0 ? strerror(errno) : "Wrong size"));
+			ok = false;
+		}
+		if(in >= 0) {
+			close(in);
+		}
+		if(!ok) {
+			break;
+		}
+	}
+	if(close(out) != 0 && ok) {
+		logger->log(file + ": Cannot write: " + std::string(strerror(errno)));
+		ok = false;
+	}
+	if(!ok) {
+		unlink(file.c_str());
+	}
+	return ok;
+}
+
+/**
+ * Write the index of the chunks of a file (a line with the hash and size of each).
+ *
+ * @param fd - The file to write the index to.
+ * @param chunks - The chunks.
+ *
+ * @returns true if the index was written, false otherwise.
+ */
+bool buildsys::chunk_index_write(int fd, const std::vector<ArchiveChunk> &chunks)
+{
+	std::string index;
+	for(const auto &chunk : chunks) {
+		index += chunk.hash + " " + std::to_string(chunk.size) + "\n";
+	}
+	for(size_t done = 0; done < index.size();) {
+		ssize_t wrote = write(fd, index.data() + done, index.size() - done);
+		if(wrote < 0 && errno == EINTR) {
+			continue;
+		}
+		if(wrote <= 0) {
+			return false;
+		}
+		done += static_cast<size_t>(wrote);
+	}
+	return true;
+}
+
+/**
+ * Load the index of the chunks of a file.
+ *
+ * @param file - The index.
+ * @param chunks - Set to the chunks.
+ *
+ * @returns true if the index was loaded, false if it could not be read or is malformed.
+ */
+bool buildsys::chunk_index_load(const std::string &file, std::vector<ArchiveChunk> *chunks)
+{
+	chunks->clear();
+	std::ifstream in(file);
+	if(!in.is_open()) {
+		return false;
+	}
+	ArchiveChunk chunk;
+	while(in >> chunk.hash >> chunk.size) {
+		// The hash names a file, so it must be nothing else
+		if(chunk.hash.size() != 64 ||
+		   chunk.hash.find_first_not_of("0123456789abcdef") != std::string::npos) {
+			return false;
+		}
+		chunks->push_back(chunk);
+	}
+	return in.eof();
+}
@@ -0,0 +1,57 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef CHUNKSTORE_HPP_
+#define CHUNKSTORE_HPP_
+
+#include "logger.hpp"
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace buildsys
+{
+	//! A piece of an archive, split at a point chosen by its contents
+	struct ArchiveChunk {
+		std::string hash; //!< SHA-256 of the data
+		uint64_t size{0};
+	};
+
+	bool chunk_split(int fd, const std::function<bool(const char *, size_t)> &chunk);
+	std::string chunk_path(const std::string &hash);
+	bool chunk_store_has(const std::string &store, const std::string &hash);
+	bool chunk_store_add(const std::string &store, int fd,
+	                     std::vector<ArchiveChunk> *chunks, Logger *logger);
+	bool chunk_store_import(const std::string &store, const std::string &hash,
+	                        const std::string &file, Logger *logger);
+	bool chunk_store_assemble(const std::string &store,
+	                          const std::vector<ArchiveChunk> &chunks,
+	                          const std::string &file, Logger *logger);
+	bool chunk_index_write(int fd, const std::vector<ArchiveChunk> &chunks);
+	bool chunk_index_load(const std::string &file, std::vector<ArchiveChunk> *chunks);
+} // namespace buildsys
+
+#endif // CHUNKSTORE_HPP_
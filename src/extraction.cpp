@@ -24,10 +24,37 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 *******************************************************************************/
 
 #include "include/buildsys.h"
+#include <algorithm>
+#include <sstream>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+std::string Extraction::source_cache;
+uint64_t Extraction::source_cache_limit = uint64_t{10240} * 1024 * 1024;
+
+/**
+ *  Set the location of the extracted source cache. When set, the sources extracted for
+ *  recent extraction descriptions are kept, and restored instead of extracting again.
+ *
+ *  @param cache - The location to set.
+ */
+void Extraction::setSourceCache(std::string cache)
+{
+	source_cache = std::move(cache);
+}
+
+/**
+ *  Set the size limit of the extracted source cache.
+ *
+ *  @param limit - The limit in bytes.
+ */
+void Extraction::setSourceCacheLimit(uint64_t limit)
+{
+	source_cache_limit = limit;
+}
+
 void Extraction::add(std::unique_ptr<ExtractionUnit> eu)
 {
 	this->EUs.push_back(std::move(eu));
@@ -53,41 +80,140 @@ void Extraction::prepareNewExtractInfo(Package *P, BuildDir *bd)
 	}
 
 	if(bd != nullptr) {
-		// Create the new extraction info file
-		std::string fname = bd->getPath() + "/.extraction.info.new";
-		std::ofstream exInfo(fname);
+		// Describe the extraction in memory and digest it there, only writing
+		// the new extraction info file if it differs from the existing one
+		std::ostringstream exInfo;
 		this->print(exInfo);
-		exInfo.close();
+		std::string info = exInfo.str();
+
+		HashStream hs;
+		hs.update(info);
+		this->info_hash = hs.hex();
+
+		std::string fname = bd->getPath() + "/.extraction.info";
+		this->info_changed =
+		    !filesystem::exists(fname) || hash_file(fname) != this->info_hash;
+		if(!this->info_changed) {
+			filesystem::remove(fname + ".new");
+			return;
+		}
+
+		std::ofstream exInfoFile(fname + ".new");
+		exInfoFile << info;
+		exInfoFile.close();
 	}
 }
 
-bool Extraction::extractionRequired(Package *P, BuildDir *bd) const
+bool Extraction::extractionRequired(Package *P) const
 {
 	if(this->extracted) {
 		return false;
 	}
 
-	auto cmd = boost::format{"cmp -s %1%/.extraction.info.new %1%/.extraction.info"} %
-	           bd->getPath();
-	int res = std::system(cmd.str().c_str());
-	return (res != 0 || P->isCodeUpdated());
+	return (this->info_changed || P->isCodeUpdated());
 }
 
-bool Extraction::extract(Package *P)
+/**
+ * Check whether the extracted sources can be kept in the source cache, that is whether
+ * they are fully described by the extraction description.
+ */
+bool Extraction::cacheable(Package *P)
+{
+	if(Extraction::source_cache.empty() || this->info_hash.empty() || P->isCodeUpdated()) {
+		return false;
+	}
+	return std::all_of(this->EUs.begin(), this->EUs.end(),
+	                   [](const auto &unit) { return unit->cacheable(); });
+}
+
+/**
+ * Run the extraction units. Units that say which files they change (patches) are run
+ * concurrently with the units around them that change other files, the rest are run on
+ * their own. Units that change the same files are always run in order, so the result is
+ * the same as running every unit in turn.
+ */
+bool Extraction::extractUnits(Package *P)
 {
-	P->log("Extracting sources and patching");
+	// Group the units into waves, each unit goes in the wave after the last one that
+	// holds a unit changing any of the same files
+	std::vector<std::vector<ExtractionUnit *>> waves;
+	std::unordered_map<std::string, size_t> last_wave;
+	size_t first = 0;
 	for(auto &unit : this->EUs) {
-		if(!unit->extract(P)) {
+		std::vector<std::string> files;
+		if(!unit->changes(P, &files)) {
+			waves.push_back({unit.get()});
+			first = waves.size();
+			continue;
+		}
+		size_t wave = first;
+		for(const auto &file : files) {
+			auto it = last_wave.find(file);
+			if(it != last_wave.end()) {
+				wave = std::max(wave, it->second + 1);
+			}
+		}
+		if(wave == waves.size()) {
+			waves.emplace_back();
+		}
+		waves[wave].push_back(unit.get());
+		for(const auto &file : files) {
+			last_wave[file] = wave;
+		}
+	}
+
+	for(const auto &wave : waves) {
+		if(wave.size() == 1) {
+			if(!wave.front()->extract(P)) {
+				return false;
+			}
+			continue;
+		}
+		IoBatch batch;
+		dev_t device = IoExecutor::device(P->builddir()->getPath());
+		for(auto *unit : wave) {
+			batch.add(device, [unit, P]() { return unit->extract(P); });
+		}
+		if(!batch.wait()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Extraction::extract(Package *P)
+{
+	const std::string &dir = P->builddir()->getPath();
+	bool cacheable = this->cacheable(P);
+	if(cacheable && source_cache_restore(Extraction::source_cache, this->info_hash, dir,
+	                                     P->getLogger())) {
+		P->log("Restored sources from the source cache");
+	} else {
+		P->log("Extracting sources and patching");
+		WorkSnapshot before;
+		if(cacheable) {
+			before = source_cache_snapshot(dir);
+		}
+		if(!this->extractUnits(P)) {
 			return false;
 		}
+		if(cacheable &&
+		   !source_cache_store(Extraction::source_cache, this->info_hash, dir, before,
+		                       Extraction::source_cache_limit, P->getLogger())) {
+			P->log("Failed to add the sources to the source cache");
+		}
 	}
 
 	// mv the file into the regular place. A silent failure here would leave a
 	// stale .extraction.info, which feeds cache-key and should-build decisions,
 	// so use filesystem::rename which throws on error.
+	// If there is no .extraction.info.new, the existing file already matches.
 	std::string oldfname = P->builddir()->getPath() + "/.extraction.info.new";
 	std::string newfname = P->builddir()->getPath() + "/.extraction.info";
-	filesystem::rename(oldfname, newfname);
+	if(filesystem::exists(oldfname)) {
+		filesystem::rename(oldfname, newfname);
+	}
+	this->info_changed = false;
 
 	return true;
 }
@@ -96,7 +222,7 @@ void Extraction::extractionInfo(BuildDir *bd, std::string *file_path,
                                 std::string *hash) const
 {
 	*file_path = bd->getShortPath() + "/.extraction.info";
-	*hash = hash_file(*file_path + ".new");
+	*hash = this->info_hash;
 }
 
 FetchInfo ExtractionUnit::fetchInfo()
@@ -149,11 +275,20 @@ FetchInfo CompressedFileExtractionUnit::fetchInfo()
 
 bool TarExtractionUnit::extract(Package *P)
 {
+	std::string archive = P->getPwd() + "/" + this->uri;
+	if(tar_can_extract(archive)) {
+		if(!tar_extract(archive, P->builddir()->getPath(), P->getLogger(), nullptr, true)) {
+			throw CustomException("Failed to extract file");
+		}
+		return true;
+	}
+
+	// Compressed with something this build can not decompress
 	PackageCmd pc(P->builddir()->getPath(), "tar");
 
 	pc.addArg("--no-same-owner");
 	pc.addArg("-xf");
-	pc.addArg(P->getPwd() + "/" + this->uri);
+	pc.addArg(archive);
 
 	if(!pc.Run(P->getLogger())) {
 		throw CustomException("Failed to extract file");
@@ -164,10 +299,18 @@ bool TarExtractionUnit::extract(Package *P)
 
 bool ZipExtractionUnit::extract(Package *P)
 {
+	std::string archive = P->getPwd() + "/" + this->uri;
+	if(zip_can_extract()) {
+		if(!zip_extract(archive, P->builddir()->getPath(), P->getLogger())) {
+			throw CustomException("Failed to extract file");
+		}
+		return true;
+	}
+
 	PackageCmd pc(P->builddir()->getPath(), "unzip");
 
 	pc.addArg("-o");
-	pc.addArg(P->getPwd() + "/" + this->uri);
+	pc.addArg(archive);
 
 	if(!pc.Run(P->getLogger())) {
 		throw CustomException("Failed to extract file");
@@ -187,8 +330,40 @@ PatchExtractionUnit::PatchExtractionUnit(int _level, const std::string &_patch_p
 	this->patch_path = _patch_path;
 }
 
+void PatchExtractionUnit::parse(Package *P)
+{
+	if(!this->parsed) {
+		this->parsed = true;
+		auto parsed_patch = std::make_unique<Patch>();
+		auto patch_file = P->getPwd() + "/" + this->uri;
+		if(parsed_patch->parse(patch_file, this->level, P->getLogger())) {
+			this->patch = std::move(parsed_patch);
+		}
+	}
+}
+
+bool PatchExtractionUnit::changes(Package *P, std::vector<std::string> *files)
+{
+	this->parse(P);
+	if(!this->patch) {
+		return false;
+	}
+	for(const auto &path : this->patch->paths()) {
+		files->push_back((filesystem::path(this->patch_path) / path).lexically_normal());
+	}
+	return true;
+}
+
 bool PatchExtractionUnit::extract(Package *P)
 {
+	this->parse(P);
+	if(this->patch && this->patch->apply(this->patch_path, P->getLogger())) {
+		return true;
+	}
+	auto pwd = P->getPwd();
+	// Let patch try, it can apply hunks with fuzz and knows more formats
+	P->log("Patch file: " + this->uri + ": Retrying with patch");
+
 	PackageCmd pc_dry(this->patch_path, "patch");
 	PackageCmd pc(this->patch_path, "patch");
 
@@ -201,7 +376,6 @@ bool PatchExtractionUnit::extract(Package *P)
 	pc_dry.addArg("-i");
 	pc.addArg("-i");
 
-	auto pwd = P->getPwd();
 	pc_dry.addArg(pwd + "/" + this->uri);
 	pc.addArg(pwd + "/" + this->uri);
 
@@ -237,19 +411,13 @@ FileCopyExtractionUnit::FileCopyExtractionUnit(const std::string &fname,
 bool FileCopyExtractionUnit::extract(Package *P)
 {
 	std::string path = this->uri;
-	PackageCmd pc(P->builddir()->getPath(), "cp");
-	pc.addArg("-pRLuf");
-
-	if(path.at(0) == '/') {
-		pc.addArg(path);
-	} else {
-		std::string arg = P->getPwd() + "/" + path;
-		pc.addArg(arg);
+	if(path.at(0) != '/') {
+		path = P->getPwd() + "/" + path;
 	}
 
-	pc.addArg(".");
-
-	if(!pc.Run(P->getLogger())) {
+	CopyOptions options;
+	options.dereference = true;
+	if(!copy_path(path, P->builddir()->getPath(), P->getLogger(), options)) {
 		throw CustomException("Failed to copy file");
 	}
 
@@ -290,18 +458,14 @@ FetchInfo FetchedFileCopyExtractionUnit::fetchInfo()
 
 bool FetchedFileCopyExtractionUnit::extract(Package *P)
 {
-	PackageCmd pc(P->builddir()->getPath(), "cp");
-	pc.addArg("-pRLuf");
-
-	if(boost::algorithm::starts_with(this->uri, "/")) {
-		pc.addArg(this->uri);
-	} else {
-		pc.addArg(P->getPwd() + "/" + this->uri);
+	std::string path = this->uri;
+	if(!boost::algorithm::starts_with(path, "/")) {
+		path = P->getPwd() + "/" + path;
 	}
 
-	pc.addArg(".");
-
-	if(!pc.Run(P->getLogger())) {
+	CopyOptions options;
+	options.dereference = true;
+	if(!copy_path(path, P->builddir()->getPath(), P->getLogger(), options)) {
 		throw CustomException("Failed to copy file");
 	}
 
@@ -390,11 +390,9 @@ bool GitExtractionUnit::extract(Package *_P)
 		}
 	}
 	// copy to work dir
-	PackageCmd pc(_P->builddir()->getPath(), "cp");
-	pc.addArg("-dpRuf");
-	pc.addArg(this->localPath());
-	pc.addArg(".");
-	if(!pc.Run(_P->getLogger())) {
+	const std::string &dir = _P->builddir()->getPath();
+	std::string source = (filesystem::path(dir) / this->localPath()).string();
+	if(!copy_path(source, dir, _P->getLogger())) {
 		throw CustomException("Failed to checkout");
 	}
 
@@ -424,18 +422,14 @@ bool LinkGitDirExtractionUnit::extract(Package *P)
 
 bool CopyGitDirExtractionUnit::extract(Package *P)
 {
-	PackageCmd pc(P->builddir()->getPath(), "cp");
-	pc.addArg("-dpRuf");
-
+	const std::string &dir = P->builddir()->getPath();
+	std::string source = (filesystem::path(dir) / this->uri).string();
 	if(this->uri.at(0) == '.') {
-		std::string arg = P->getPwd() + "/" + this->uri;
-		pc.addArg(arg);
-	} else {
-		pc.addArg(this->uri);
+		source = P->getPwd() + "/" + this->uri;
 	}
-	pc.addArg(this->toDir);
+	std::string dest = (filesystem::path(dir) / this->toDir).string();
 
-	if(!pc.Run(P->getLogger())) {
+	if(!copy_path(source, dest, P->getLogger())) {
 		throw CustomException("Operation failed");
 	}
 
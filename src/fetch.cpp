@@ -254,12 +254,8 @@ std::string LinkFetch::relative_path()
 
 bool CopyFetch::fetch(BuildDir *d)
 {
-	PackageCmd pc(d->getPath(), "cp");
-	pc.addArg("-dpRuf");
 	std::string l = P->absolute_fetch_path(this->fetch_uri);
-	pc.addArg(l);
-	pc.addArg(".");
-	if(!pc.Run(this->P->getLogger())) {
+	if(!copy_path(l, d->getPath(), this->P->getLogger())) {
 		throw CustomException("Failed to copy (recursively)");
 	}
 	P->log("Copied data in, considering code updated");
@@ -0,0 +1,434 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "filecopy.hpp"
+#include "ioexecutor.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <linux/fs.h>
+#include <map>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+//! Files are copied by the IoExecutor in batches of up to this many files
+static const size_t BATCH_FILES = 256;
+//! ... or this many bytes
+static const uint64_t BATCH_BYTES = 64 * 1024 * 1024;
+
+/**
+ * Copy the contents of a file (when it can not be reflinked), using copy_file_range
+ * where the filesystems support it, read and write otherwise.
+ *
+ * @param in - The file to copy from.
+ * @param out - The file to copy to.
+ *
+ * @returns 0 on success, -1 (with errno set) on failure.
+ */
+int buildsys::copy_contents(int in, int out)
+{
+	std::vector<char> buffer(1024 * 1024);
+	while(true) {
+		ssize_t res = copy_file_range(in, nullptr, out, nullptr, buffer.size(), 0);
+		if(res > 0) {
+			continue;
+		}
+		if(res == 0) {
+			return 0;
+		}
+		if(errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+			return -1;
+		}
+		break;
+	}
+	while(true) {
+		ssize_t res = read(in, buffer.data(), buffer.size());
+		if(res < 0 && errno == EINTR) {
+			continue;
+		}
+		if(res <= 0) {
+			return static_cast<int>(res);
+		}
+		for(ssize_t done = 0; done < res;) {
+			ssize_t wrote =
+			    write(out, buffer.data() + done, static_cast<size_t>(res - done));
+			if(wrote < 0) {
+				return -1;
+			}
+			done += wrote;
+		}
+	}
+}
+
+static bool is_older(const struct timespec &a, const struct timespec &b)
+{
+	return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+/**
+ * Create a non-directory, non-regular file. As cp -f, an existing file is removed
+ * and the creation tried again.
+ *
+ * @returns 0 on success, -1 (with errno set) on failure.
+ */
+static int create_special(const std::string &src, const std::string &dst,
+                          const struct stat &st)
+{
+	std::string target;
+	if(S_ISLNK(st.st_mode)) {
+		std::error_code ec;
+		target = filesystem::read_symlink(src, ec).string();
+		if(ec) {
+			errno = ec.value();
+			return -1;
+		}
+	}
+	for(int attempt = 0; attempt < 2; attempt++) {
+		int res = S_ISLNK(st.st_mode) ? symlink(target.c_str(), dst.c_str())
+		                              : mknod(dst.c_str(), st.st_mode, st.st_rdev);
+		if(res == 0 || errno != EEXIST || attempt != 0) {
+			return res;
+		}
+		if(unlink(dst.c_str()) != 0) {
+			return -1;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Give a copied file (or directory) the ownership, mode and timestamps of the source.
+ * As cp -p, failing to change the ownership is not an error, but any set-user-ID and
+ * set-group-ID bits are then dropped.
+ */
+static void preserve_path(const std::string &dst, const struct stat &st)
+{
+	mode_t mode = st.st_mode & 07777;
+	if(lchown(dst.c_str(), st.st_uid, st.st_gid) != 0) {
+		mode &= ~static_cast<mode_t>(S_ISUID | S_ISGID);
+	}
+	if(!S_ISLNK(st.st_mode)) {
+		chmod(dst.c_str(), mode);
+	}
+	struct timespec times[2] = {st.st_atim, st.st_mtim};
+	utimensat(AT_FDCWD, dst.c_str(), times, AT_SYMLINK_NOFOLLOW);
+}
+
+/**
+ * Copy a regular file, sharing the extents with the source (a reflink) where the
+ * filesystem supports it. As cp, an existing file is truncated and written in place,
+ * or (as cp -f) removed and created again if that is not possible.
+ *
+ * @returns 0 on success, -1 (with errno set) on failure.
+ */
+static int copy_file(const std::string &src, const std::string &dst, const struct stat &st,
+                     bool preserve)
+{
+	int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+	if(in < 0) {
+		return -1;
+	}
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+	int out = open(dst.c_str(), flags, st.st_mode & 0777);
+	if(out < 0 && errno != ENOENT && unlink(dst.c_str()) == 0) {
+		out = open(dst.c_str(), flags | O_EXCL, st.st_mode & 0777);
+	}
+	if(out < 0) {
+		int err = errno;
+		close(in);
+		errno = err;
+		return -1;
+	}
+	int res = ioctl(out, FICLONE, in);
+	if(res != 0) {
+		res = copy_contents(in, out);
+	}
+	if(res == 0 && preserve) {
+		mode_t mode = st.st_mode & 07777;
+		if(fchown(out, st.st_uid, st.st_gid) != 0) {
+			mode &= ~static_cast<mode_t>(S_ISUID | S_ISGID);
+		}
+		struct timespec times[2] = {st.st_atim, st.st_mtim};
+		fchmod(out, mode);
+		futimens(out, times);
+	}
+	int err = errno;
+	close(in);
+	if(close(out) != 0 && res == 0) {
+		err = errno;
+		res = -1;
+	}
+	if(res != 0) {
+		// Don't leave a partial copy, it would look up to date to cp -u
+		unlink(dst.c_str());
+	}
+	errno = err;
+	return res;
+}
+
+//! A regular file waiting to be copied
+struct CopyJob {
+	std::string src;
+	std::string dst;
+	struct stat st;
+};
+
+/**
+ * Copies a tree. The directories, symbolic links and special files are created as the
+ * tree is walked, the regular files are then copied (in parallel for large trees), and
+ * finally hard links are made and the directory metadata is applied.
+ */
+class TreeCopier
+{
+private:
+	const CopyOptions &options;
+	Logger *logger;
+	bool result{true};
+	std::map<std::pair<dev_t, ino_t>, std::string> links;
+	std::vector<CopyJob> files;
+	std::vector<std::pair<std::string, std::string>> hardlinks;
+	std::vector<std::pair<std::string, struct stat>> dirs;
+
+	void fail(const std::string &path, const std::string &action)
+	{
+		std::string error(strerror(errno));
+		this->logger->log(path + ": Cannot " + action + ": " + error);
+		this->result = false;
+	}
+	void copyDir(const std::string &src, const std::string &dst, const struct stat &st);
+	bool copyFiles(size_t begin, size_t end);
+
+public:
+	TreeCopier(const CopyOptions &_options, Logger *_logger)
+	    : options(_options), logger(_logger)
+	{
+	}
+	void copy(const std::string &src, const std::string &dst, const struct stat &st);
+	bool finish(dev_t device);
+};
+
+void TreeCopier::copy(const std::string &src, const std::string &dst, const struct stat &st)
+{
+	if(S_ISDIR(st.st_mode)) {
+		this->copyDir(src, dst, st);
+		return;
+	}
+
+	struct stat existing = {};
+	if(lstat(dst.c_str(), &existing) == 0) {
+		if(existing.st_dev == st.st_dev && existing.st_ino == st.st_ino) {
+			this->logger->log(dst + ": Is the same file as " + src);
+			this->result = false;
+			return;
+		}
+		if(this->options.update && !S_ISDIR(existing.st_mode) &&
+		   !is_older(existing.st_mtim, st.st_mtim)) {
+			return;
+		}
+	}
+
+	if(!this->options.dereference && st.st_nlink > 1) {
+		auto key = std::make_pair(st.st_dev, st.st_ino);
+		auto it = this->links.find(key);
+		if(it != this->links.end()) {
+			this->hardlinks.emplace_back(it->second, dst);
+			return;
+		}
+		this->links.emplace(key, dst);
+	}
+
+	if(S_ISREG(st.st_mode)) {
+		this->files.push_back({src, dst, st});
+	} else if(create_special(src, dst, st) != 0) {
+		this->fail(dst, "create");
+	} else if(this->options.preserve) {
+		preserve_path(dst, st);
+	}
+}
+
+void TreeCopier::copyDir(const std::string &src, const std::string &dst,
+                         const struct stat &st)
+{
+	struct stat existing = {};
+	if(mkdir(dst.c_str(), (st.st_mode & 0777) | S_IRWXU) != 0 &&
+	   (errno != EEXIST || stat(dst.c_str(), &existing) != 0 ||
+	    !S_ISDIR(existing.st_mode))) {
+		if(errno == EEXIST) {
+			errno = ENOTDIR;
+		}
+		this->fail(dst, "mkdir");
+		return;
+	}
+	if(this->options.preserve) {
+		this->dirs.emplace_back(dst, st);
+	}
+
+	DIR *dir = opendir(src.c_str());
+	if(dir == nullptr) {
+		this->fail(src, "open");
+		return;
+	}
+	std::vector<std::string> children;
+	while(struct dirent *de = readdir(dir)) {
+		std::string child(de->d_name); // NOLINT
+		if(child != "." && child != "..") {
+			children.push_back(child);
+		}
+	}
+	closedir(dir);
+
+	for(const auto &child : children) {
+		std::string from = src + "/" + child;
+		struct stat child_st = {};
+		int res = this->options.dereference ? stat(from.c_str(), &child_st)
+		                                    : lstat(from.c_str(), &child_st);
+		if(res != 0) {
+			this->fail(from, "stat");
+			continue;
+		}
+		this->copy(from, dst + "/" + child, child_st);
+	}
+}
+
+bool TreeCopier::copyFiles(size_t begin, size_t end)
+{
+	bool ret = true;
+	for(size_t i = begin; i < end; i++) {
+		const CopyJob &job = this->files[i];
+		if(copy_file(job.src, job.dst, job.st, this->options.preserve) != 0) {
+			this->logger->log(job.dst + ": Cannot copy: " + std::string(strerror(errno)));
+			ret = false;
+		}
+	}
+	return ret;
+}
+
+/**
+ * Copy the regular files found while walking the tree, then make the hard links and
+ * apply the directory metadata (last, as creating the contents changes the mtime).
+ *
+ * @param device - The device being copied to, for queueing work on the IoExecutor.
+ *
+ * @returns true if everything was copied, false otherwise.
+ */
+bool TreeCopier::finish(dev_t device)
+{
+	std::vector<std::pair<size_t, size_t>> batches;
+	size_t begin = 0;
+	uint64_t bytes = 0;
+	for(size_t i = 0; i < this->files.size(); i++) {
+		bytes += static_cast<uint64_t>(this->files[i].st.st_size);
+		if(i + 1 - begin >= BATCH_FILES || bytes >= BATCH_BYTES) {
+			batches.emplace_back(begin, i + 1);
+			begin = i + 1;
+			bytes = 0;
+		}
+	}
+	if(begin < this->files.size()) {
+		batches.emplace_back(begin, this->files.size());
+	}
+
+	if(batches.size() == 1) {
+		if(!this->copyFiles(batches[0].first, batches[0].second)) {
+			this->result = false;
+		}
+	} else if(batches.size() > 1) {
+		IoBatch batch;
+		for(const auto &range : batches) {
+			batch.add(device, [this, range] {
+				return this->copyFiles(range.first, range.second);
+			});
+		}
+		if(!batch.wait()) {
+			this->result = false;
+		}
+	}
+
+	for(const auto &link : this->hardlinks) {
+		if(::link(link.first.c_str(), link.second.c_str()) != 0 &&
+		   (errno != EEXIST || unlink(link.second.c_str()) != 0 ||
+		    ::link(link.first.c_str(), link.second.c_str()) != 0)) {
+			this->fail(link.second, "link");
+		}
+	}
+
+	for(auto it = this->dirs.rbegin(); it != this->dirs.rend(); ++it) {
+		preserve_path(it->first, it->second);
+	}
+	return this->result;
+}
+
+/**
+ * Copy a file or directory, as cp (by default cp -dpRuf). If the destination is an
+ * existing directory the source is copied into it, otherwise it is copied to the
+ * destination. Files are reflinked where the filesystem supports it.
+ *
+ * Large trees are copied in parallel on the IoExecutor, so a recursive copy must not
+ * be made from an IoExecutor task.
+ *
+ * @param src - The file or directory to copy.
+ * @param dst - Where to copy it to.
+ * @param logger - The logger to report errors to.
+ * @param options - How to copy.
+ *
+ * @returns true if everything was copied, false otherwise.
+ */
+bool buildsys::copy_path(const std::string &src, const std::string &dst, Logger *logger,
+                         const CopyOptions &options)
+{
+	struct stat st = {};
+	int res = options.dereference ? stat(src.c_str(), &st) : lstat(src.c_str(), &st);
+	if(res != 0) {
+		logger->log(src + ": Cannot stat: " + std::string(strerror(errno)));
+		return false;
+	}
+	if(S_ISDIR(st.st_mode) && !options.recursive) {
+		logger->log(src + ": Omitting directory");
+		return false;
+	}
+
+	std::string target = dst;
+	std::string parent = filesystem::path(dst).parent_path().string();
+	struct stat dst_st = {};
+	if(stat(dst.c_str(), &dst_st) == 0 && S_ISDIR(dst_st.st_mode)) {
+		std::string name = src.substr(0, src.find_last_not_of('/') + 1);
+		target = dst + "/" + name.substr(name.rfind('/') + 1);
+		parent = dst;
+	}
+
+	TreeCopier copier(options, logger);
+	copier.copy(src, target, st);
+	return copier.finish(IoExecutor::device(parent.empty() ? "." : parent));
+}
@@ -0,0 +1,47 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef FILECOPY_HPP_
+#define FILECOPY_HPP_
+
+#include "logger.hpp"
+#include <string>
+
+namespace buildsys
+{
+	//! How copy_path() copies, matching the options of cp
+	struct CopyOptions {
+		bool recursive{true};    //!< Copy directories recursively (-R)
+		bool dereference{false}; //!< Follow symbolic links (-L), otherwise copy them (-d)
+		bool preserve{true};     //!< Preserve mode, ownership and timestamps (-p)
+		bool update{true}; //!< Skip files that are not older than the source (-u)
+	};
+
+	int copy_contents(int in, int out);
+	bool copy_path(const std::string &src, const std::string &dst, Logger *logger,
+	               const CopyOptions &options = CopyOptions());
+} // namespace buildsys
+
+#endif // FILECOPY_HPP_
@@ -31,6 +31,66 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string>
 #include <vector>
 
+/**
+ * Create a new (empty) SHA-256 digest.
+ */
+buildsys::HashStream::HashStream() : ctx(EVP_MD_CTX_create())
+{
+	EVP_DigestInit_ex(this->ctx, EVP_sha256(), nullptr);
+}
+
+buildsys::HashStream::~HashStream()
+{
+	EVP_MD_CTX_destroy(this->ctx);
+}
+
+/**
+ * Feed more data into the digest.
+ *
+ * @param data - The data to add.
+ * @param len - The length of the data.
+ */
+void buildsys::HashStream::update(const void *data, size_t len)
+{
+	EVP_DigestUpdate(this->ctx, data, len);
+}
+
+/**
+ * Feed more data into the digest.
+ *
+ * @param data - The data to add.
+ */
+void buildsys::HashStream::update(const std::string &data)
+{
+	this->update(data.data(), data.size());
+}
+
+/**
+ * Get the digest of all the data fed in so far.
+ *
+ * @returns The digest as a lowercase hex string.
+ */
+std::string buildsys::HashStream::hex() const
+{
+	std::vector<unsigned char> md_value(EVP_MAX_MD_SIZE);
+	unsigned int md_len = 0;
+
+	// Finalise a copy, so more data can still be added to this digest
+	EVP_MD_CTX *copy = EVP_MD_CTX_create();
+	EVP_MD_CTX_copy_ex(copy, this->ctx);
+	EVP_DigestFinal_ex(copy, &md_value[0], &md_len);
+	EVP_MD_CTX_destroy(copy);
+
+	std::stringstream ss;
+
+	for(unsigned int i = 0; i < md_len; i++) {
+		ss << std::hex << std::setfill('0') << std::setw(2)
+		   << static_cast<int>(md_value[i]);
+	}
+
+	return ss.str();
+}
+
 void buildsys::hash_setup()
 {
 	OpenSSL_add_all_digests();
@@ -43,36 +103,19 @@ void buildsys::hash_shutdown()
 
 std::string buildsys::hash_file(const std::string &fname)
 {
-	EVP_MD_CTX *mdctx;
-	const EVP_MD *md;
-	std::vector<char> buff(4096);
-	std::vector<unsigned char> md_value(EVP_MAX_MD_SIZE);
-	unsigned int md_len;
-
-	md = EVP_get_digestbyname("sha256");
-
-	mdctx = EVP_MD_CTX_create();
-	EVP_DigestInit_ex(mdctx, md, nullptr);
+	std::vector<char> buff(65536);
 
 	std::ifstream input(fname, std::ios::in | std::ifstream::binary);
 	if(!input.is_open()) {
 		Logger("BuildSys").log("Failed opening: " + fname);
 		return std::string("");
 	}
+
+	HashStream hs;
 	while(!input.eof()) {
 		input.read(&buff[0], static_cast<std::streamsize>(buff.size()));
-		EVP_DigestUpdate(mdctx, &buff[0], static_cast<size_t>(input.gcount()));
+		hs.update(&buff[0], static_cast<size_t>(input.gcount()));
 	}
 
-	EVP_DigestFinal_ex(mdctx, &md_value[0], &md_len);
-	EVP_MD_CTX_destroy(mdctx);
-
-	std::stringstream ss;
-
-	for(unsigned int i = 0; i < md_len; i++) {
-		ss << std::hex << std::setfill('0') << std::setw(2)
-		   << static_cast<int>(md_value[i]);
-	}
-
-	return ss.str();
+	return hs.hex();
 }
@@ -26,10 +26,35 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef HASH_HPP_
 #define HASH_HPP_
 
+#include <cstddef>
 #include <string>
 
+using EVP_MD_CTX = struct evp_md_ctx_st;
+
 namespace buildsys
 {
+	/**
+	 * An incremental SHA-256 digest.
+	 * Data can be fed in as it is produced, and the digest of everything fed in so far
+	 * can be read at any point without disturbing the running state.
+	 */
+	class HashStream
+	{
+	private:
+		EVP_MD_CTX *ctx{nullptr};
+
+	public:
+		HashStream();
+		~HashStream();
+		HashStream(const HashStream &) = delete;
+		HashStream &operator=(const HashStream &) = delete;
+		HashStream(HashStream &&) = delete;
+		HashStream &operator=(HashStream &&) = delete;
+		void update(const void *data, size_t len);
+		void update(const std::string &data);
+		std::string hex() const;
+	};
+
 	void hash_setup();
 	std::string hash_file(const std::string &fname);
 	void hash_shutdown();
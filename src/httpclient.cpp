@@ -0,0 +1,602 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "httpclient.hpp"
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace buildsys;
+
+//! How long to wait for a server before giving up on it
+static const time_t TIMEOUT_SECONDS = 120;
+//! Error responses with bodies up to this size are read, so the connection can be reused
+static const uint64_t DISCARD_LIMIT = 65536;
+static const size_t LINE_LIMIT = 8192;
+static const int MAX_REDIRECTS = 5;
+//! Idle connections kept for each server
+static const size_t MAX_IDLE = 16;
+
+//! Buffered reads of a response from a connection
+class HttpReader
+{
+private:
+	int fd;
+	std::vector<char> buffer;
+	size_t pos{0};
+	size_t len{0};
+	bool fill();
+
+public:
+	std::string error;    //!< Why the last read failed
+	bool eof{false};      //!< Set once the server has closed the connection
+	uint64_t received{0}; //!< Bytes received on the connection
+	explicit HttpReader(int _fd) : fd(_fd), buffer(65536)
+	{
+	}
+	bool line(std::string *line);
+	bool copy(uint64_t size, int out);
+	bool copyAll(int out);
+	//! Has everything received been read ?
+	bool drained() const
+	{
+		return this->pos == this->len;
+	}
+};
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+	while(len > 0) {
+		ssize_t done = write(fd, data, len);
+		if(done < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += done;
+		len -= static_cast<size_t>(done);
+	}
+	return true;
+}
+
+bool HttpReader::fill()
+{
+	if(this->pos < this->len) {
+		return true;
+	}
+	ssize_t got = 0;
+	do {
+		got = recv(this->fd, this->buffer.data(), this->buffer.size(), 0);
+	} while(got < 0 && errno == EINTR);
+	if(got <= 0) {
+		this->eof = got == 0;
+		this->error = got == 0 ? "Connection closed" : strerror(errno);
+		return false;
+	}
+	this->pos = 0;
+	this->len = static_cast<size_t>(got);
+	this->received += this->len;
+	return true;
+}
+
+/**
+ * Read a line, without the line ending.
+ */
+bool HttpReader::line(std::string *line)
+{
+	line->clear();
+	while(this->fill()) {
+		const char *start = this->buffer.data() + this->pos;
+		const char *end = this->buffer.data() + this->len;
+		const char *newline = std::find(start, end, '\n');
+		line->append(start, newline);
+		if(newline != end) {
+			this->pos += static_cast<size_t>(newline - start) + 1;
+			if(!line->empty() && line->back() == '\r') {
+				line->pop_back();
+			}
+			return true;
+		}
+		this->pos = this->len;
+		if(line->size() > LINE_LIMIT) {
+			this->error = "Response line too long";
+			return false;
+		}
+	}
+	return false;
+}
+
+/**
+ * Copy part of the response to a file.
+ *
+ * @param size - How much to copy.
+ * @param out - The file to copy to, or -1 to discard the data.
+ */
+bool HttpReader::copy(uint64_t size, int out)
+{
+	while(size > 0) {
+		if(!this->fill()) {
+			return false;
+		}
+		size_t chunk = std::min(static_cast<size_t>(std::min(size, uint64_t{SIZE_MAX})),
+		                        this->len - this->pos);
+		if(out >= 0 && !write_all(out, this->buffer.data() + this->pos, chunk)) {
+			this->error = "Cannot write: " + std::string(strerror(errno));
+			return false;
+		}
+		this->pos += chunk;
+		size -= chunk;
+	}
+	return true;
+}
+
+/**
+ * Copy the rest of the response (until the server closes the connection) to a file.
+ */
+bool HttpReader::copyAll(int out)
+{
+	while(this->fill()) {
+		if(!write_all(out, this->buffer.data() + this->pos, this->len - this->pos)) {
+			this->error = "Cannot write: " + std::string(strerror(errno));
+			return false;
+		}
+		this->pos = this->len;
+	}
+	return this->eof;
+}
+
+static bool read_chunked(HttpReader *reader, int out)
+{
+	std::string line;
+	uint64_t total = 0;
+	while(true) {
+		if(!reader->line(&line)) {
+			return false;
+		}
+		char *end = nullptr;
+		uint64_t size = strtoull(line.c_str(), &end, 16);
+		if(end == line.c_str()) {
+			reader->error = "Malformed chunk size";
+			return false;
+		}
+		if(size == 0) {
+			break;
+		}
+		total += size;
+		if(out < 0 && total > DISCARD_LIMIT) {
+			reader->error = "Response too large to discard";
+			return false;
+		}
+		if(!reader->copy(size, out) || !reader->line(&line)) {
+			return false;
+		}
+		if(!line.empty()) {
+			reader->error = "Malformed chunk";
+			return false;
+		}
+	}
+	// Skip any trailers
+	do {
+		if(!reader->line(&line)) {
+			return false;
+		}
+	} while(!line.empty());
+	return true;
+}
+
+static bool send_all(int fd, const std::string &data)
+{
+	size_t done = 0;
+	while(done < data.size()) {
+		ssize_t len = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+		if(len < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		done += static_cast<size_t>(len);
+	}
+	return true;
+}
+
+//! The host of a URL, as it is written in a URL
+static std::string url_host(const HttpUrl &url)
+{
+	return url.host.find(':') != std::string::npos ? "[" + url.host + "]" : url.host;
+}
+
+//! Send a whole file, from its start
+static bool send_file(int fd, int in, off_t size)
+{
+	off_t offset = 0;
+	while(offset < size) {
+		ssize_t len = sendfile(fd, in, &offset, static_cast<size_t>(size - offset));
+		if(len < 0 && errno == EINTR) {
+			continue;
+		}
+		if(len <= 0) {
+			if(len == 0) {
+				errno = EIO;
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+static int connect_to(const HttpUrl &url, Logger *logger)
+{
+	struct addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *addrs = nullptr;
+	int ret = getaddrinfo(url.host.c_str(), url.port.c_str(), &hints, &addrs);
+	if(ret != 0) {
+		logger->log(url.host + ": Cannot resolve: " + std::string(gai_strerror(ret)));
+		return -1;
+	}
+	int fd = -1;
+	int err = 0;
+	for(auto *addr = addrs; addr != nullptr; addr = addr->ai_next) {
+		fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+		if(fd < 0) {
+			err = errno;
+			continue;
+		}
+		struct timeval timeout = {TIMEOUT_SECONDS, 0};
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if(connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+			break;
+		}
+		err = errno;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addrs);
+	if(fd < 0) {
+		logger->log(url.host + ":" + url.port + ": Cannot connect: " + strerror(err));
+	}
+	return fd;
+}
+
+/**
+ * Split an http:// URL into its parts.
+ *
+ * @param url - The URL.
+ * @param parsed - Set to the parts of the URL.
+ *
+ * @returns false if the URL is not one HttpClient can fetch.
+ */
+bool HttpUrl::parse(const std::string &url, HttpUrl *parsed)
+{
+	const std::string scheme = "http://";
+	if(!boost::algorithm::istarts_with(url, scheme)) {
+		return false;
+	}
+	std::string rest = url.substr(scheme.size());
+	rest.erase(std::min(rest.find('#'), rest.size()));
+	auto slash = rest.find('/');
+	std::string authority = rest.substr(0, slash);
+	parsed->path = slash == std::string::npos ? "/" : rest.substr(slash);
+	parsed->port = "80";
+	if(authority.find('@') != std::string::npos) {
+		return false;
+	}
+	std::string port;
+	if(!authority.empty() && authority[0] == '[') {
+		auto bracket = authority.find(']');
+		if(bracket == std::string::npos) {
+			return false;
+		}
+		parsed->host = authority.substr(1, bracket - 1);
+		port = authority.substr(bracket + 1);
+	} else {
+		auto colon = authority.find(':');
+		parsed->host = authority.substr(0, colon);
+		port = colon == std::string::npos ? "" : authority.substr(colon);
+	}
+	if(!port.empty()) {
+		if(port[0] != ':' || port.size() == 1 ||
+		   port.find_first_not_of("0123456789", 1) != std::string::npos) {
+			return false;
+		}
+		parsed->port = port.substr(1);
+	}
+	return !parsed->host.empty();
+}
+
+/**
+ * Get the client. It is never destroyed, as the (detached) package build threads may
+ * still be using it while the program exits.
+ */
+HttpClient *HttpClient::get()
+{
+	static auto *client = new HttpClient();
+	return client;
+}
+
+/**
+ * Check whether a URL can be fetched by the client (only http:// is supported).
+ */
+bool HttpClient::supported(const std::string &url)
+{
+	HttpUrl parsed;
+	return HttpUrl::parse(url, &parsed);
+}
+
+int HttpClient::take(const std::string &server)
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	auto &fds = this->idle[server];
+	if(fds.empty()) {
+		return -1;
+	}
+	int fd = fds.back();
+	fds.pop_back();
+	return fd;
+}
+
+void HttpClient::release(const std::string &server, int fd)
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	auto &fds = this->idle[server];
+	if(fds.size() < MAX_IDLE) {
+		fds.push_back(fd);
+	} else {
+		close(fd);
+	}
+}
+
+/**
+ * Make a single request.
+ *
+ * @param url - What to request.
+ * @param method - The method ("GET", "HEAD" or "PUT").
+ * @param body - A file to send as the body of the request (for a PUT), or -1.
+ * @param out - The file to write the body of a 200 response to.
+ * @param location - Set to the Location header of the response.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns The HTTP status, or -1 if the request failed.
+ */
+int HttpClient::request(const HttpUrl &url, const std::string &method, int body, int out,
+                        std::string *location, Logger *logger)
+{
+	std::string server = url.host + ":" + url.port;
+	std::string host = url_host(url);
+	if(url.port != "80") {
+		host += ":" + url.port;
+	}
+	std::string req = method + " " + url.path + " HTTP/1.1\r\nHost: " + host +
+	                  "\r\nUser-Agent: buildsys\r\nAccept-Encoding: identity\r\n";
+	struct stat st = {};
+	if(body >= 0) {
+		if(fstat(body, &st) != 0) {
+			logger->log(server + ": Cannot stat: " + std::string(strerror(errno)));
+			return -1;
+		}
+		req += "Content-Length: " + std::to_string(st.st_size) + "\r\n";
+	}
+	req += "\r\n";
+
+	for(int attempt = 0; attempt < 2; attempt++) {
+		int fd = this->take(server);
+		bool reused = fd >= 0;
+		if(!reused) {
+			fd = connect_to(url, logger);
+			if(fd < 0) {
+				return -1;
+			}
+		}
+
+		HttpReader reader(fd);
+		std::string line;
+		std::string error;
+		if(!send_all(fd, req) || (body >= 0 && !send_file(fd, body, st.st_size))) {
+			error = strerror(errno);
+		} else if(!reader.line(&line)) {
+			error = reader.error;
+		}
+		if(!error.empty()) {
+			close(fd);
+			// The server may have closed the idle connection, retry on a new one
+			if(reused && reader.received == 0) {
+				continue;
+			}
+			logger->log(server + ": " + error);
+			return -1;
+		}
+
+		bool http10 = boost::algorithm::starts_with(line, "HTTP/1.0 ");
+		if(!boost::algorithm::starts_with(line, "HTTP/1.") || line.size() < 12) {
+			logger->log(server + ": Malformed response: " + line);
+			close(fd);
+			return -1;
+		}
+		int status = static_cast<int>(strtol(line.c_str() + 9, nullptr, 10));
+
+		uint64_t length = 0;
+		bool has_length = false;
+		bool chunked = false;
+		bool keep_alive = !http10;
+		location->clear();
+		while(true) {
+			if(!reader.line(&line)) {
+				logger->log(server + ": " + reader.error);
+				close(fd);
+				return -1;
+			}
+			if(line.empty()) {
+				break;
+			}
+			auto colon = line.find(':');
+			if(colon == std::string::npos) {
+				continue;
+			}
+			std::string name = boost::algorithm::to_lower_copy(line.substr(0, colon));
+			std::string value = boost::algorithm::trim_copy(line.substr(colon + 1));
+			std::string lower_value = boost::algorithm::to_lower_copy(value);
+			if(name == "content-length") {
+				length = strtoull(value.c_str(), nullptr, 10);
+				has_length = true;
+			} else if(name == "transfer-encoding") {
+				chunked = lower_value.find("chunked") != std::string::npos;
+			} else if(name == "connection") {
+				if(lower_value.find("close") != std::string::npos) {
+					keep_alive = false;
+				} else if(lower_value.find("keep-alive") != std::string::npos) {
+					keep_alive = true;
+				}
+			} else if(name == "location") {
+				*location = value;
+			}
+		}
+
+		// Only a successful response is written out, other bodies are discarded
+		int sink = status == 200 ? out : -1;
+		bool ok = true;
+		if((status >= 100 && status < 200) || status == 204 || status == 304 ||
+		   method == "HEAD") {
+			// These never have a body
+		} else if(chunked) {
+			ok = read_chunked(&reader, sink);
+		} else if(has_length) {
+			if(sink < 0 && length > DISCARD_LIMIT) {
+				keep_alive = false;
+			} else {
+				ok = reader.copy(length, sink);
+			}
+		} else {
+			keep_alive = false;
+			ok = sink < 0 || reader.copyAll(sink);
+		}
+		if(!ok && sink < 0) {
+			ok = true;
+			keep_alive = false;
+		}
+		if(!ok) {
+			logger->log(server + ": " + reader.error);
+			close(fd);
+			return -1;
+		}
+		if(keep_alive && reader.drained()) {
+			this->release(server, fd);
+		} else {
+			close(fd);
+		}
+		return status;
+	}
+	return -1;
+}
+
+/**
+ * Get a URL, following any redirects. The body of a successful response is written to
+ * out as it arrives.
+ *
+ * @param url - The http:// URL to get.
+ * @param out - The file to write the body to.
+ * @param logger - The logger to report errors to (an HTTP error status is not reported).
+ *
+ * @returns The HTTP status (200 when the body was written), or -1 if the URL could not
+ *          be fetched.
+ */
+int HttpClient::fetch(const std::string &url, int out, Logger *logger)
+{
+	std::string current = url;
+	for(int redirects = 0; redirects <= MAX_REDIRECTS; redirects++) {
+		HttpUrl parsed;
+		if(!HttpUrl::parse(current, &parsed)) {
+			logger->log(current + ": Unsupported URL");
+			return -1;
+		}
+		std::string location;
+		int status = this->request(parsed, "GET", -1, out, &location, logger);
+		bool redirect = status == 301 || status == 302 || status == 303 || status == 307 ||
+		                status == 308;
+		if(!redirect || location.empty()) {
+			return status;
+		}
+		if(location[0] == '/') {
+			location = "http://" + url_host(parsed) + ":" + parsed.port + location;
+		}
+		current = location;
+	}
+	logger->log(url + ": Too many redirects");
+	return -1;
+}
+
+/**
+ * Upload a file with a PUT request.
+ *
+ * @param url - The http:// URL to upload to.
+ * @param in - The file to upload (all of it, whatever its offset).
+ * @param logger - The logger to report errors to (an HTTP error status is not reported).
+ *
+ * @returns The HTTP status, or -1 if the upload failed.
+ */
+int HttpClient::put(const std::string &url, int in, Logger *logger)
+{
+	HttpUrl parsed;
+	if(!HttpUrl::parse(url, &parsed)) {
+		logger->log(url + ": Unsupported URL");
+		return -1;
+	}
+	std::string location;
+	return this->request(parsed, "PUT", in, -1, &location, logger);
+}
+
+/**
+ * Check whether a URL exists with a HEAD request (redirects are not followed).
+ *
+ * @param url - The http:// URL to check.
+ * @param logger - The logger to report errors to (an HTTP error status is not reported).
+ *
+ * @returns The HTTP status, or -1 if the request failed.
+ */
+int HttpClient::head(const std::string &url, Logger *logger)
+{
+	HttpUrl parsed;
+	if(!HttpUrl::parse(url, &parsed)) {
+		logger->log(url + ": Unsupported URL");
+		return -1;
+	}
+	std::string location;
+	return this->request(parsed, "HEAD", -1, -1, &location, logger);
+}
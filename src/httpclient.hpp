@@ -0,0 +1,71 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef HTTPCLIENT_HPP_
+#define HTTPCLIENT_HPP_
+
+#include "logger.hpp"
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace buildsys
+{
+	//! The parts of an http:// URL
+	struct HttpUrl {
+		std::string host;
+		std::string port{"80"};
+		std::string path{"/"};
+		static bool parse(const std::string &url, HttpUrl *parsed);
+	};
+
+	/**
+	 * A minimal HTTP/1.1 client for the build cache (GET, HEAD and PUT). Connections are
+	 * kept alive after a request and reused by the next request to the same server, from
+	 * any thread.
+	 */
+	class HttpClient
+	{
+	private:
+		std::mutex lock;
+		//! Idle connections, by "host:port"
+		std::map<std::string, std::vector<int>> idle;
+		HttpClient() = default;
+		int take(const std::string &server);
+		void release(const std::string &server, int fd);
+		int request(const HttpUrl &url, const std::string &method, int body, int out,
+		            std::string *location, Logger *logger);
+
+	public:
+		static HttpClient *get();
+		static bool supported(const std::string &url);
+		int fetch(const std::string &url, int out, Logger *logger);
+		int put(const std::string &url, int in, Logger *logger);
+		int head(const std::string &url, Logger *logger);
+	};
+} // namespace buildsys
+
+#endif // HTTPCLIENT_HPP_
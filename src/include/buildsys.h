@@ -26,6 +26,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef INCLUDE_BUILDSYS_H_
 #define INCLUDE_BUILDSYS_H_
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
@@ -37,6 +38,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
@@ -64,14 +66,29 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <boost/utility.hpp>
 
 #include "../buildinfo.hpp"
+#include "../cacheindex.hpp"
+#include "../cachepublish.hpp"
+#include "../cachestats.hpp"
+#include "../chunkstore.hpp"
 #include "../dir/builddir.hpp"
 #include "../exceptions.hpp"
 #include "../featuremap.hpp"
+#include "../filecopy.hpp"
 #include "../hash.hpp"
+#include "../httpclient.hpp"
+#include "../interfacedigest.hpp"
+#include "../localcache.hpp"
+#include "../ioexecutor.hpp"
 #include "../logger.hpp"
 #include "../lua.hpp"
 #include "../namespace.hpp"
 #include "../packagecmd.hpp"
+#include "../patch.hpp"
+#include "../sourcecache.hpp"
+#include "../stagingmanifest.hpp"
+#include "../stagingstore.hpp"
+#include "../tar.hpp"
+#include "../zip.hpp"
 
 using Graph = boost::adjacency_list<boost::vecS, boost::vecS, boost::directedS>;
 using Vertex = boost::graph_traits<Graph>::vertex_descriptor;
@@ -250,6 +267,19 @@ namespace buildsys
 		virtual void print(std::ostream &out) = 0;
 		virtual std::string type() = 0;
 		virtual bool extract(Package *P) = 0;
+		//! Is what this unit extracts fully described by its hash ?
+		virtual bool cacheable()
+		{
+			return !this->HASH().empty();
+		}
+		/**
+		 * Get the files this unit changes, units that change different files are
+		 * extracted concurrently. Returns false when that is not known.
+		 */
+		virtual bool changes(Package * /*P*/, std::vector<std::string> * /*files*/)
+		{
+			return false;
+		}
 		virtual std::string URI()
 		{
 			return this->uri;
@@ -323,6 +353,9 @@ namespace buildsys
 		int level;
 		std::string patch_path;
 		std::string fname_short;
+		std::unique_ptr<Patch> patch; //!< The parsed patch, if it could be parsed
+		bool parsed{false};
+		void parse(Package *P);
 
 	public:
 		PatchExtractionUnit(int _level, const std::string &_patch_path,
@@ -338,6 +371,7 @@ namespace buildsys
 			return std::string("PatchFile");
 		}
 		bool extract(Package *P) override;
+		bool changes(Package *P, std::vector<std::string> *files) override;
 		FetchInfo fetchInfo() override;
 	};
 
@@ -405,6 +439,11 @@ namespace buildsys
 			return std::string("GitDir");
 		}
 		bool extract(Package *P) override = 0;
+		//! A local git dir may hold untracked files that its hash does not describe
+		bool cacheable() override
+		{
+			return false;
+		}
 		virtual bool isDirty();
 		virtual std::string dirtyHash();
 		virtual std::string localPath()
@@ -493,6 +532,10 @@ namespace buildsys
 		                  std::string _refspec, Package *_P);
 		bool fetch(BuildDir *d) override;
 		bool extract(Package *_P) override;
+		bool cacheable() override
+		{
+			return !this->HASH().empty();
+		}
 		std::string modeName() override
 		{
 			return "fetch";
@@ -542,8 +585,15 @@ namespace buildsys
 	class Extraction
 	{
 	private:
+		static std::string source_cache;
+		static uint64_t source_cache_limit;
 		std::vector<std::unique_ptr<ExtractionUnit>> EUs;
 		bool extracted{false};
+		//! Digest of the extraction description from prepareNewExtractInfo()
+		std::string info_hash;
+		//! Does the extraction description differ from the existing .extraction.info ?
+		bool info_changed{true};
+		bool extractUnits(Package *P);
 
 	public:
 		void add(std::unique_ptr<ExtractionUnit> eu);
@@ -555,10 +605,13 @@ namespace buildsys
 		}
 		bool extract(Package *P);
 		void prepareNewExtractInfo(Package *P, BuildDir *bd);
-		bool extractionRequired(Package *P, BuildDir *bd) const;
+		bool extractionRequired(Package *P) const;
 		void extractionInfo(BuildDir *bd, std::string *file_path, std::string *hash) const;
 		//! Collect the source info for every extraction unit (for .fetch.info)
 		std::vector<FetchInfo> sourceInfo();
+		bool cacheable(Package *P);
+		static void setSourceCache(std::string cache);
+		static void setSourceCacheLimit(uint64_t limit);
 	};
 
 	//! A dependency on another Package
@@ -567,10 +620,12 @@ namespace buildsys
 	private:
 		Package *p;
 		const bool locally;
+		const std::vector<std::string> outputs;
 
 	public:
 		//! Create a package dependency
-		PackageDepend(Package *_p, bool _locally) : p(_p), locally(_locally)
+		PackageDepend(Package *_p, bool _locally, std::vector<std::string> _outputs = {})
+		    : p(_p), locally(_locally), outputs(std::move(_outputs))
 		{
 		}
 		//! Get the package
@@ -583,6 +638,11 @@ namespace buildsys
 		{
 			return this->locally;
 		};
+		//! Get the named outputs depended on (empty for all of them)
+		const std::vector<std::string> &getOutputs() const
+		{
+			return this->outputs;
+		};
 	};
 
 	//! A package to build
@@ -591,8 +651,15 @@ namespace buildsys
 	private:
 		static bool quiet_packages;
 		static bool keep_staging;
-		static bool extract_in_parallel;
-		static std::string build_cache;
+		static bool all_staging_archives;
+		static std::vector<std::string> build_caches;
+		static std::string local_cache;
+		static std::string chunk_store;
+		static uint64_t local_cache_limit;
+		static ArchiveCodec archive_codec;
+		static ArchiveReproducible archive_reproducible;
+		static std::string staging_store;
+		static uint64_t staging_store_limit;
 		static bool clean_all_packages;
 		static std::list<std::string> overlays;
 		static std::list<std::string> forced_packages;
@@ -616,30 +683,59 @@ namespace buildsys
 		string_list installFiles;
 		bool processing_queued{false};
 		bool buildInfoPrepared{false};
+		bool buildInfoChanged{true};
 		std::atomic<bool> built{false};
 		std::atomic<bool> building{false};
 		std::atomic<bool> was_built{false};
 		bool codeUpdated{false};
 		bool hash_output{false};
+		bool hash_interface{false};
+		std::atomic<bool> depended_on{false};
+		//! Named parts of the staging output (patterns of the paths in each)
+		std::map<std::string, std::vector<std::string>> outputs;
+		//! Patterns of the paths extracted from the staging packages (all if empty)
+		std::vector<std::string> stage_filter;
 		bool suppress_remove_staging{false};
 		mutable std::mutex lock;
 		time_t run_secs{0};
 		Logger logger;
 		bool clean_before_build{false};
-		//! Write the assembled build description to the .build.info.new file
+		//! Hash of the staging archive (the key of its extracted tree in the staging store)
+		std::string staging_archive_hash;
+		std::mutex staging_store_lock;
+		//! Write the assembled build description to the .build.info.new file (if changed)
 		void writeBuildInfoFile();
-		//! Set the buildinfo file hash from the new .build.info.new file
-		void updateBuildInfoHash();
 		//! Set the buildinfo file hash from the existing .build.info file
 		void updateBuildInfoHashExisting();
-		bool extract_staging(const std::string &dir);
+		bool extract_staging(const std::string &dir,
+		                     std::vector<std::string> *members = nullptr,
+		                     const ArchiveMemberFilter &include = nullptr);
+		std::string stagingArchive() const;
+		std::string installArchive() const;
+		bool stagingArchiveNeeded() const;
+		std::unordered_map<Package *, ArchiveMemberFilter>
+		stagingFilters(const std::unordered_set<Package *> &packages);
+		bool checkOverlaps(
+		    const std::unordered_set<Package *> &packages, bool staging,
+		    const std::unordered_map<Package *, ArchiveMemberFilter> *filters = nullptr);
+		std::string stagingStoreTree(const std::string &archive);
+		void resetStagingArchiveHash();
 		bool extract_install(const std::string &dir);
 		void getStagingPackages(std::unordered_set<Package *> *);
 		void getDependedPackages(std::unordered_set<Package *> *packages,
 		                         bool include_children, bool ignore_intercept);
-		bool ff_file(const std::string &hash, const std::string &rfile,
-		             const std::string &path, const std::string &fname,
-		             const std::string &fext);
+		bool ff_file(const std::string &server, const std::string &hash,
+		             const std::string &rfile, const std::string &tmp);
+		bool ff_fetch(const std::string &url, const std::string &rfile,
+		              const std::string &tmp);
+		bool fetchChunked(const std::string &server, const std::string &rfile,
+		                  const std::string &tmp);
+		bool fetchFromServer(const std::string &server,
+		                     const std::vector<std::array<std::string, 2>> &files);
+		bool fetchFromServers(const std::vector<std::array<std::string, 2>> &files,
+		                      std::string *server);
+		void storeCaches();
+		void updateBuildKey();
 		void common_init();
 		bool should_suppress_building();
 
@@ -672,7 +768,7 @@ namespace buildsys
 		bool shouldBuild();
 
 	public:
-		enum class BuildInfoType { Output, Build };
+		enum class BuildInfoType { Output, Key, Build };
 		/**
 		 * Create a package.
 		 *
@@ -747,11 +843,18 @@ namespace buildsys
 
 		/** Depend on another package
 		 *  \param p The package to depend on
+		 *  \param names The named outputs of the package to depend on (empty for all)
 		 */
-		void depend(Package *P, bool locally)
+		void depend(Package *P, bool locally, const std::vector<std::string> &names = {})
 		{
-			this->depends.emplace_back(P, locally);
+			this->depends.emplace_back(P, locally, names);
+			P->depended_on = true;
 		};
+		//! Does another package depend on this one ?
+		bool isDependedOn() const
+		{
+			return this->depended_on;
+		}
 		/** Set the location to extract install directories to
 		 *  During the build, all files that all dependencies have installed
 		 *  will be extracted to the given path
@@ -834,8 +937,39 @@ namespace buildsys
 		{
 			return this->hash_output;
 		};
+		//! Hash the interface (rather than all) of the staging output for this package
+		void setHashInterface(bool set)
+		{
+			this->hash_interface = set;
+		};
+		//! Is this package hashing the interface of its' staging output ?
+		bool isHashingInterface() const
+		{
+			return this->hash_interface;
+		};
+		//! Does this package extract the installed files of a package hashing its
+		//! interface ?
+		bool extractsHashedInterface();
 		//! Return the build information for this package
 		BuildInfoType buildInfo(std::string *file_path, std::string *hash);
+		//! Name a part of the staging output
+		void addOutput(const std::string &output, const std::vector<std::string> &patterns);
+		//! Does the package have a named output ?
+		bool hasOutput(const std::string &output) const
+		{
+			return this->outputs.find(output) != this->outputs.end();
+		}
+		ArchiveMemberFilter outputFilter(const std::vector<std::string> &names) const;
+		//! Restrict the files extracted from the staging packages
+		void addStageFilter(const std::vector<std::string> &patterns);
+		//! Return the patterns of the files extracted from the staging packages
+		const std::vector<std::string> &getStageFilter() const
+		{
+			return this->stage_filter;
+		}
+		//! Return the key of a named output of this package (if it has one)
+		bool outputKey(const std::string &output, std::string *file_path,
+		               std::string *hash);
 		//! Build this package
 		bool build(bool locally = false, bool fetchOnly = false);
 		//! Has building of this package already started ?
@@ -909,8 +1043,15 @@ namespace buildsys
 		}
 		static void set_quiet_packages(bool set);
 		static void set_keep_all_staging(bool set);
-		static void set_extract_in_parallel(bool set);
-		static void set_build_cache(std::string cache);
+		static void set_all_staging_archives(bool set);
+		static void add_build_cache(std::string cache);
+		static void set_local_cache(std::string cache);
+		static void set_chunk_store(std::string store);
+		static void set_local_cache_limit(uint64_t limit);
+		static void set_archive_codec(const ArchiveCodec &codec);
+		static void set_archive_reproducible(const ArchiveReproducible &repro);
+		static void set_staging_store(std::string store);
+		static void set_staging_store_limit(uint64_t limit);
 		static void set_clean_packages(bool set);
 		static void add_overlay_path(std::string path, bool top = false);
 		static void add_forced_package(std::string name);
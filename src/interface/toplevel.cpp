@@ -29,6 +29,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <list>
 #include <string>
 #include <sys/stat.h>
+#include <vector>
 
 static int li_name(lua_State *L)
 {
@@ -214,7 +215,39 @@ static int li_keepstaging(lua_State *L)
 	return 0;
 }
 
-static void depend(Package *P, NameSpace *ns, bool locally, const std::string &name)
+/**
+ * Get a string, or a table of strings, from the stack.
+ *
+ * @param L - The lua state.
+ * @param index - The index of the value on the stack.
+ * @param error - The error to throw if the value is not a string or table of strings.
+ *
+ * @returns The strings.
+ */
+static std::vector<std::string> lua_string_list(lua_State *L, int index,
+                                                const std::string &error)
+{
+	std::vector<std::string> strings;
+	if(lua_type(L, index) == LUA_TSTRING) {
+		strings.emplace_back(lua_tostring(L, index));
+	} else if(lua_istable(L, index)) {
+		lua_pushnil(L);
+		// The table is one further down the stack once the key is pushed
+		while(lua_next(L, index < 0 ? index - 1 : index) != 0) {
+			if(lua_type(L, -1) != LUA_TSTRING) {
+				throw CustomException(error);
+			}
+			strings.emplace_back(lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+	} else {
+		throw CustomException(error);
+	}
+	return strings;
+}
+
+static void depend(Package *P, NameSpace *ns, bool locally, const std::string &name,
+                   const std::vector<std::string> &outputs = {})
 {
 	Package *p = nullptr;
 	// create the Package
@@ -227,7 +260,7 @@ static void depend(Package *P, NameSpace *ns, bool locally, const std::string &n
 		throw CustomException("Failed to create or find Package");
 	}
 
-	P->depend(p, locally);
+	P->depend(p, locally, outputs);
 }
 
 int li_depend(lua_State *L)
@@ -250,6 +283,7 @@ int li_depend(lua_State *L)
 		depend(P, ns, false, std::string(lua_tostring(L, 1)));
 	} else if(lua_istable(L, 1)) {
 		std::list<std::string> package_names;
+		std::vector<std::string> outputs;
 		bool locally = false;
 		lua_pushnil(L); /* first key */
 		while(lua_next(L, 1) != 0) {
@@ -287,6 +321,10 @@ int li_depend(lua_State *L)
 					    "depend() requires a boolean for the locally parameter");
 				}
 				locally = (lua_toboolean(L, -1) != 0);
+			} else if(key == "outputs") {
+				outputs = lua_string_list(L, -1,
+				                          "depend() requires a single output name or "
+				                          "table of output names");
 			} else {
 				throw CustomException("depend() called with unknown key '" + key + "'");
 			}
@@ -294,7 +332,7 @@ int li_depend(lua_State *L)
 			lua_pop(L, 1);
 		}
 		for(auto &package_name : package_names) {
-			depend(P, ns, locally, package_name);
+			depend(P, ns, locally, package_name, outputs);
 		}
 	} else {
 		throw CustomException("depend() takes a string or a table of strings");
@@ -320,6 +358,65 @@ static int li_hashoutput(lua_State *L)
 	return 0;
 }
 
+static int li_hashinterface(lua_State *L)
+{
+	if(lua_gettop(L) != 0) {
+		throw CustomException("hashinterface() takes no arguments");
+	}
+
+	Package *P = li_get_package();
+
+	// Get dependers to use a digest of the interface of the staging
+	// output (headers, exported symbols, ...) so they are not rebuilt
+	// when only the implementation of a library changes
+	P->setHashInterface(true);
+	return 0;
+}
+
+static int li_outputs(lua_State *L)
+{
+	if(lua_gettop(L) != 1 || !lua_istable(L, 1)) {
+		throw CustomException("outputs() takes a table of output names and patterns");
+	}
+
+	Package *P = li_get_package();
+
+	// Name parts of the staging output (e.g. dev = {"usr/include/*"}) so
+	// dependers can depend on (and extract) only those parts
+	lua_pushnil(L);
+	while(lua_next(L, 1) != 0) {
+		if(lua_type(L, -2) != LUA_TSTRING) {
+			throw CustomException("outputs() requires a table with strings as keys");
+		}
+		std::string name(lua_tostring(L, -2));
+		if(name.empty() || name.find_first_not_of("abcdefghijklmnopqrstuvwxyz"
+		                                          "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+		                                          "0123456789_-") != std::string::npos) {
+			throw CustomException("outputs() called with an invalid name '" + name + "'");
+		}
+		P->addOutput(name, lua_string_list(L, -1,
+		                                   "outputs() requires a single pattern or table "
+		                                   "of patterns for each output"));
+		lua_pop(L, 1);
+	}
+	return 0;
+}
+
+static int li_stage_filter(lua_State *L)
+{
+	if(lua_gettop(L) != 1) {
+		throw CustomException("stage_filter() takes 1 argument");
+	}
+
+	Package *P = li_get_package();
+
+	// Only extract the matching files of the staging packages
+	// (e.g. {"usr/include/*", "usr/lib/*.so*"})
+	P->addStageFilter(lua_string_list(
+	    L, 1, "stage_filter() requires a single pattern or table of patterns"));
+	return 0;
+}
+
 static int li_require(lua_State *L)
 {
 	if(lua_gettop(L) != 1) {
@@ -401,6 +498,9 @@ bool buildsys::interfaceSetup(Lua *lua)
 	lua->registerFunc("name", lua_guard<li_name>);
 	lua->registerFunc("package_name", lua_guard<li_package_name>);
 	lua->registerFunc("hashoutput", lua_guard<li_hashoutput>);
+	lua->registerFunc("hashinterface", lua_guard<li_hashinterface>);
+	lua->registerFunc("outputs", lua_guard<li_outputs>);
+	lua->registerFunc("stage_filter", lua_guard<li_stage_filter>);
 	lua->registerFunc("require", lua_guard<li_require>);
 	lua->registerFunc("optionally_require", lua_guard<li_optionally_require>);
 	lua->registerFunc("overlayadd", lua_guard<li_overlay_add>);
@@ -0,0 +1,415 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "interfacedigest.hpp"
+#include "exceptions.hpp"
+#include "hash.hpp"
+#include "logger.hpp"
+#include "tar.hpp"
+#include <algorithm>
+#include <boost/algorithm/string/predicate.hpp>
+#include <cstddef>
+#include <cstring>
+#include <elf.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace buildsys;
+
+//! Reads numbers (of either byte order) and strings from a file held in memory
+class BinaryReader
+{
+private:
+	const std::string &data;
+	bool big_endian;
+
+public:
+	BinaryReader(const std::string &_data, bool _big_endian)
+	    : data(_data), big_endian(_big_endian)
+	{
+	}
+
+	/**
+	 * Read an unsigned number.
+	 *
+	 * @param offset - The offset of the number.
+	 * @param size - The size of the number (in bytes).
+	 *
+	 * @returns The number. An exception is thrown if it is beyond the end of the file.
+	 */
+	uint64_t get(uint64_t offset, size_t size) const
+	{
+		if(offset > this->data.size() || size > this->data.size() - offset) {
+			throw CustomException("Truncated file");
+		}
+		uint64_t value = 0;
+		for(size_t i = 0; i < size; i++) {
+			size_t at = offset + (this->big_endian ? i : size - 1 - i);
+			value = (value << 8) | static_cast<unsigned char>(this->data[at]);
+		}
+		return value;
+	}
+
+	/**
+	 * Read a (nul terminated) string from a table of strings.
+	 *
+	 * @param table - The offset of the table.
+	 * @param size - The size of the table.
+	 * @param index - The offset of the string in the table.
+	 *
+	 * @returns The string. An exception is thrown if it is not within the table.
+	 */
+	std::string string(uint64_t table, uint64_t size, uint64_t index) const
+	{
+		if(table > this->data.size() || size > this->data.size() - table || index >= size) {
+			throw CustomException("Invalid string");
+		}
+		const char *start = this->data.data() + table + index;
+		const void *end = std::memchr(start, '\0', size - index);
+		if(end == nullptr) {
+			throw CustomException("Invalid string");
+		}
+		return std::string(start, static_cast<const char *>(end));
+	}
+};
+
+//! A section of an ELF file
+struct ElfSection {
+	uint64_t type{0};
+	uint64_t offset{0};
+	uint64_t size{0};
+	uint64_t link{0}; //!< The section holding the strings used by this section
+	uint64_t entsize{0};
+};
+
+/**
+ * Read the interface of a shared library (see elf_interface()).
+ *
+ * @param elf - The shared library.
+ * @param lines - Filled with the interface. An exception is thrown if it cannot be read.
+ */
+template <class Ehdr, class Shdr, class Sym, class Dyn>
+static void elf_read_interface(const BinaryReader &elf, std::vector<std::string> *lines)
+{
+	if(elf.get(offsetof(Ehdr, e_type), sizeof(Ehdr::e_type)) != ET_DYN) {
+		throw CustomException("Not a shared library");
+	}
+	uint64_t shoff = elf.get(offsetof(Ehdr, e_shoff), sizeof(Ehdr::e_shoff));
+	uint64_t shentsize = elf.get(offsetof(Ehdr, e_shentsize), sizeof(Ehdr::e_shentsize));
+	uint64_t shnum = elf.get(offsetof(Ehdr, e_shnum), sizeof(Ehdr::e_shnum));
+	if(shoff == 0 || shnum == 0 || shentsize < sizeof(Shdr)) {
+		throw CustomException("No section headers");
+	}
+	std::vector<ElfSection> sections(shnum);
+	for(uint64_t i = 0; i < shnum; i++) {
+		uint64_t base = shoff + i * shentsize;
+		ElfSection &section = sections.at(i);
+		section.type = elf.get(base + offsetof(Shdr, sh_type), sizeof(Shdr::sh_type));
+		section.offset = elf.get(base + offsetof(Shdr, sh_offset), sizeof(Shdr::sh_offset));
+		section.size = elf.get(base + offsetof(Shdr, sh_size), sizeof(Shdr::sh_size));
+		section.link = elf.get(base + offsetof(Shdr, sh_link), sizeof(Shdr::sh_link));
+		section.entsize =
+		    elf.get(base + offsetof(Shdr, sh_entsize), sizeof(Shdr::sh_entsize));
+	}
+	auto find = [&sections](uint64_t type) -> const ElfSection * {
+		for(const auto &section : sections) {
+			if(section.type == type) {
+				return &section;
+			}
+		}
+		return nullptr;
+	};
+	auto strings = [&sections](const ElfSection *section) -> const ElfSection & {
+		if(section->link >= sections.size()) {
+			throw CustomException("Invalid string table");
+		}
+		return sections.at(section->link);
+	};
+
+	const ElfSection *dynsym = find(SHT_DYNSYM);
+	if(dynsym == nullptr) {
+		throw CustomException("No dynamic symbols");
+	}
+	const ElfSection &names = strings(dynsym);
+
+	// The names of the versions defined by the library
+	std::map<uint64_t, std::string> versions;
+	const ElfSection *verdef = find(SHT_GNU_verdef);
+	if(verdef != nullptr) {
+		const ElfSection &version_names = strings(verdef);
+		uint64_t offset = verdef->offset;
+		for(uint64_t count = 0; count < shnum + verdef->size; count++) {
+			uint64_t ndx = elf.get(offset + offsetof(Elf64_Verdef, vd_ndx),
+			                       sizeof(Elf64_Verdef::vd_ndx));
+			uint64_t aux = elf.get(offset + offsetof(Elf64_Verdef, vd_aux),
+			                       sizeof(Elf64_Verdef::vd_aux));
+			uint64_t next = elf.get(offset + offsetof(Elf64_Verdef, vd_next),
+			                        sizeof(Elf64_Verdef::vd_next));
+			uint64_t name = elf.get(offset + aux + offsetof(Elf64_Verdaux, vda_name),
+			                        sizeof(Elf64_Verdaux::vda_name));
+			versions[ndx] = elf.string(version_names.offset, version_names.size, name);
+			if(next == 0) {
+				break;
+			}
+			offset += next;
+		}
+	}
+	const ElfSection *versym = find(SHT_GNU_versym);
+
+	uint64_t entsize = (dynsym->entsize != 0) ? dynsym->entsize : sizeof(Sym);
+	if(entsize < sizeof(Sym)) {
+		throw CustomException("Invalid dynamic symbols");
+	}
+	for(uint64_t i = 1; i < dynsym->size / entsize; i++) {
+		uint64_t base = dynsym->offset + i * entsize;
+		uint64_t info = elf.get(base + offsetof(Sym, st_info), sizeof(Sym::st_info));
+		uint64_t other = elf.get(base + offsetof(Sym, st_other), sizeof(Sym::st_other));
+		uint64_t shndx = elf.get(base + offsetof(Sym, st_shndx), sizeof(Sym::st_shndx));
+		uint64_t bind = info >> 4;
+		uint64_t type = info & 0xf;
+		uint64_t visibility = other & 0x3;
+		// Only the symbols the library defines for others to use
+		if(shndx == SHN_UNDEF ||
+		   (bind != STB_GLOBAL && bind != STB_WEAK && bind != STB_GNU_UNIQUE) ||
+		   visibility == STV_HIDDEN || visibility == STV_INTERNAL) {
+			continue;
+		}
+		uint64_t name = elf.get(base + offsetof(Sym, st_name), sizeof(Sym::st_name));
+		std::string line = "symbol " + elf.string(names.offset, names.size, name);
+		if(versym != nullptr) {
+			uint64_t version = elf.get(versym->offset + i * 2, 2);
+			auto it = versions.find(version & 0x7fff);
+			// Version 1 is the library itself
+			if((version & 0x7fff) > 1 && it != versions.end()) {
+				line += ((version & 0x8000) != 0 ? "@" : "@@") + it->second;
+			}
+		}
+		line += " " + std::to_string(type) + " " + std::to_string(bind);
+		// The size of data is part of the interface, the size of code is not
+		if(type == STT_OBJECT || type == STT_TLS || type == STT_COMMON) {
+			line += " " + std::to_string(elf.get(base + offsetof(Sym, st_size),
+			                                     sizeof(Sym::st_size)));
+		}
+		lines->push_back(line);
+	}
+
+	const ElfSection *dynamic = find(SHT_DYNAMIC);
+	if(dynamic != nullptr) {
+		const ElfSection &dynamic_names = strings(dynamic);
+		for(uint64_t i = 0; i < dynamic->size / sizeof(Dyn); i++) {
+			uint64_t base = dynamic->offset + i * sizeof(Dyn);
+			uint64_t tag = elf.get(base + offsetof(Dyn, d_tag), sizeof(Dyn::d_tag));
+			uint64_t value = elf.get(base + offsetof(Dyn, d_un), sizeof(Dyn::d_un));
+			if(tag == DT_NULL) {
+				break;
+			}
+			if(tag == DT_SONAME || tag == DT_NEEDED) {
+				std::string name =
+				    elf.string(dynamic_names.offset, dynamic_names.size, value);
+				lines->push_back((tag == DT_SONAME ? "soname " : "needed ") + name);
+			}
+		}
+	}
+	std::sort(lines->begin(), lines->end());
+}
+
+/**
+ * Get the interface of a shared library: its soname, the libraries it needs and the
+ * symbols it exports (with their versions, types, and for data their sizes). The code
+ * of the library does not contribute, so changing how it is implemented does not
+ * change the interface.
+ *
+ * @param data - The contents of the shared library (an ELF file of either class and
+ *               byte order).
+ * @param lines - Filled with the interface (sorted).
+ *
+ * @returns true if the interface was got, false if the data is not a shared library (or
+ *          has no section headers).
+ */
+bool buildsys::elf_interface(const std::string &data, std::vector<std::string> *lines)
+{
+	lines->clear();
+	if(data.size() < EI_NIDENT || std::memcmp(data.data(), ELFMAG, SELFMAG) != 0) {
+		return false;
+	}
+	if(data[EI_DATA] != ELFDATA2LSB && data[EI_DATA] != ELFDATA2MSB) {
+		return false;
+	}
+	BinaryReader elf(data, data[EI_DATA] == ELFDATA2MSB);
+	try {
+		if(data[EI_CLASS] == ELFCLASS64) {
+			elf_read_interface<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym, Elf64_Dyn>(elf, lines);
+		} else if(data[EI_CLASS] == ELFCLASS32) {
+			elf_read_interface<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym, Elf32_Dyn>(elf, lines);
+		} else {
+			return false;
+		}
+	} catch(CustomException &e) {
+		lines->clear();
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Get the symbols defined by a static library, from the symbol table at the start of
+ * the archive (as written by 'ar s').
+ *
+ * @param data - The contents of the static library.
+ * @param symbols - Filled with the symbols (sorted).
+ *
+ * @returns true if the symbols were got, false if the data is not a static library with
+ *          a (GNU format) symbol table.
+ */
+bool buildsys::ar_symbols(const std::string &data, std::vector<std::string> *symbols)
+{
+	const size_t magic_size = 8;
+	const size_t header_size = 60;
+	symbols->clear();
+	if(data.size() < magic_size + header_size ||
+	   data.compare(0, magic_size, "!<arch>\n") != 0) {
+		return false;
+	}
+	std::string name = data.substr(magic_size, 16);
+	size_t width = 0;
+	if(boost::algorithm::starts_with(name, "/ ")) {
+		width = 4;
+	} else if(boost::algorithm::starts_with(name, "/SYM64/")) {
+		width = 8;
+	} else {
+		return false;
+	}
+
+	BinaryReader table(data, true);
+	try {
+		uint64_t size = std::stoull(data.substr(magic_size + 48, 10));
+		uint64_t start = magic_size + header_size;
+		if(size > data.size() - start) {
+			return false;
+		}
+		// The number of symbols, the offset of the member defining each, then their names
+		uint64_t count = table.get(start, width);
+		if(size < width || count > (size - width) / width) {
+			return false;
+		}
+		uint64_t names = start + width + count * width;
+		uint64_t end = start + size;
+		for(uint64_t i = 0; i < count; i++) {
+			std::string symbol = table.string(names, end - names, 0);
+			names += symbol.size() + 1;
+			symbols->push_back(symbol);
+		}
+	} catch(std::logic_error &e) {
+		symbols->clear();
+		return false;
+	} catch(CustomException &e) {
+		symbols->clear();
+		return false;
+	}
+	std::sort(symbols->begin(), symbols->end());
+	return true;
+}
+
+/**
+ * Get the interface of a regular file in an archive: for a shared or static library the
+ * symbols it provides, otherwise a hash of its contents.
+ *
+ * @param reader - The archive, at the data of the file.
+ * @param path - The path of the file.
+ *
+ * @returns The interface.
+ */
+static std::string member_interface(TarReader *reader, const std::string &path)
+{
+	std::string name = path.substr(path.rfind('/') + 1);
+	bool shared = boost::algorithm::ends_with(name, ".so") ||
+	              name.find(".so.") != std::string::npos;
+	bool library = shared || boost::algorithm::ends_with(name, ".a");
+	const char *data = nullptr;
+	HashStream hash;
+	if(!library) {
+		while(size_t len = reader->readData(&data)) {
+			hash.update(data, len);
+		}
+		return "data " + hash.hex();
+	}
+
+	std::string contents;
+	while(size_t len = reader->readData(&data)) {
+		contents.append(data, len);
+	}
+	std::vector<std::string> lines;
+	if(shared ? elf_interface(contents, &lines) : ar_symbols(contents, &lines)) {
+		for(const auto &line : lines) {
+			hash.update(line + "\n");
+		}
+		return "library " + hash.hex();
+	}
+	// Not a library after all (e.g. a linker script)
+	hash.update(contents);
+	return "data " + hash.hex();
+}
+
+/**
+ * Get a digest of the interface that an archive provides to the packages that use it.
+ * Headers, pkg-config files and anything else contribute their contents, shared
+ * libraries contribute the symbols they export (see elf_interface()) and static
+ * libraries their symbol tables (see ar_symbols()). So rebuilding a library with a
+ * different implementation, but the same interface, gives the same digest.
+ *
+ * @param archive - The archive.
+ * @param digest - Set to the digest.
+ * @param logger - The logger to report errors to.
+ * @param include - If set, only the members (by their relative paths) it accepts
+ *                  contribute.
+ *
+ * @returns true if the digest was set, false otherwise.
+ */
+bool buildsys::archive_interface_digest(const std::string &archive, std::string *digest,
+                                        Logger *logger, const ArchiveMemberFilter &include)
+{
+	HashStream hash;
+	auto add = [&hash, &include](TarReader *reader, const TarEntry &entry) {
+		std::string path;
+		if(!archive_member_path(entry.path, &path) || path.empty() ||
+		   (include && !include(path))) {
+			return;
+		}
+		std::string line = std::string(1, entry.type) + '\0' +
+		                   std::to_string(entry.mode & 07777) + '\0' + path + '\0' +
+		                   entry.linkname + '\0';
+		if(entry.type == '0') {
+			line += member_interface(reader, path);
+		}
+		hash.update(line + "\n");
+	};
+	if(!tar_read(archive, add, logger)) {
+		return false;
+	}
+	*digest = hash.hex();
+	return true;
+}
@@ -0,0 +1,167 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "ioexecutor.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <sys/stat.h>
+#include <thread>
+#include <utility>
+
+using namespace buildsys;
+
+unsigned int IoExecutor::jobs = 0;
+
+/**
+ * Get the executor. It is never destroyed, as the (detached) package build threads may
+ * still be using it while the program exits.
+ */
+IoExecutor *IoExecutor::get()
+{
+	static auto *executor = new IoExecutor();
+	return executor;
+}
+
+/**
+ * Set the maximum number of tasks run at once. Defaults to the number of CPUs.
+ *
+ * @param _jobs - The number of tasks.
+ */
+void IoExecutor::set_jobs(unsigned int _jobs)
+{
+	jobs = _jobs;
+}
+
+/**
+ * Get the device a path is on, for queueing work on it.
+ *
+ * @param path - The path.
+ *
+ * @returns The device, or 0 if the path does not exist.
+ */
+dev_t IoExecutor::device(const std::string &path)
+{
+	struct stat st = {};
+	if(stat(path.c_str(), &st) != 0) {
+		return 0;
+	}
+	return st.st_dev;
+}
+
+void IoExecutor::worker()
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	while(true) {
+		while(this->queues.empty()) {
+			this->cond.wait(lk);
+		}
+		// Take the next task from the device after the last one served
+		auto it = this->queues.upper_bound(this->last_device);
+		if(it == this->queues.end()) {
+			it = this->queues.begin();
+		}
+		std::function<void()> task = std::move(it->second.front());
+		it->second.pop_front();
+		this->last_device = it->first;
+		if(it->second.empty()) {
+			this->queues.erase(it);
+		}
+
+		lk.unlock();
+		task();
+		lk.lock();
+	}
+}
+
+/**
+ * Queue a task to be run.
+ *
+ * @param device - The device the task does its I/O on.
+ * @param task - The task.
+ */
+void IoExecutor::submit(dev_t device, std::function<void()> task)
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	this->queues[device].push_back(std::move(task));
+
+	unsigned int limit = IoExecutor::jobs;
+	if(limit == 0) {
+		limit = std::max(std::thread::hardware_concurrency(), 1U);
+	}
+	if(this->workers < limit) {
+		this->workers++;
+		std::thread thr(&IoExecutor::worker, this);
+		thr.detach();
+	}
+	this->cond.notify_one();
+}
+
+IoBatch::~IoBatch()
+{
+	// The tasks refer to the batch, so it must outlive them
+	this->wait();
+}
+
+/**
+ * Add a task to the batch, it is queued to be run straight away.
+ *
+ * @param device - The device the task does its I/O on.
+ * @param task - The task, returning false on failure.
+ */
+void IoBatch::add(dev_t device, std::function<bool()> task)
+{
+	{
+		std::unique_lock<std::mutex> lk(this->lock);
+		this->pending++;
+	}
+	IoExecutor::get()->submit(device, [this, task = std::move(task)] {
+		bool ret = false;
+		try {
+			ret = task();
+		} catch(std::exception &e) {
+			Logger("BuildSys").log(e.what());
+		}
+		std::unique_lock<std::mutex> lk(this->lock);
+		if(!ret) {
+			this->result = false;
+		}
+		this->pending--;
+		this->cond.notify_all();
+	});
+}
+
+/**
+ * Wait for all the tasks in the batch to complete.
+ *
+ * @returns true if all the tasks succeeded, false otherwise.
+ */
+bool IoBatch::wait()
+{
+	std::unique_lock<std::mutex> lk(this->lock);
+	while(this->pending > 0) {
+		this->cond.wait(lk);
+	}
+	return this->result;
+}
@@ -0,0 +1,84 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef IOEXECUTOR_HPP_
+#define IOEXECUTOR_HPP_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+
+namespace buildsys
+{
+	/**
+	 * A bounded pool of threads that runs the I/O heavy work (extracting and creating
+	 * archives) of all packages. Work is queued per device, and the devices are served
+	 * in turn so that a backlog on one device does not hold up work on the others.
+	 */
+	class IoExecutor
+	{
+	private:
+		static unsigned int jobs;
+		std::mutex lock;
+		std::condition_variable cond;
+		std::map<dev_t, std::deque<std::function<void()>>> queues;
+		dev_t last_device{0};
+		unsigned int workers{0};
+		IoExecutor() = default;
+		void worker();
+
+	public:
+		static IoExecutor *get();
+		static void set_jobs(unsigned int _jobs);
+		static dev_t device(const std::string &path);
+		void submit(dev_t device, std::function<void()> task);
+	};
+
+	//! A set of tasks run by the IoExecutor that are waited for together
+	class IoBatch
+	{
+	private:
+		std::mutex lock;
+		std::condition_variable cond;
+		size_t pending{0};
+		bool result{true};
+
+	public:
+		IoBatch() = default;
+		~IoBatch();
+		IoBatch(const IoBatch &) = delete;
+		IoBatch &operator=(const IoBatch &) = delete;
+		IoBatch(IoBatch &&) = delete;
+		IoBatch &operator=(IoBatch &&) = delete;
+		void add(dev_t device, std::function<bool()> task);
+		bool wait();
+	};
+} // namespace buildsys
+
+#endif // IOEXECUTOR_HPP_
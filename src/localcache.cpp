@@ -0,0 +1,260 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "localcache.hpp"
+#include "filecopy.hpp"
+#include <algorithm>
+#include <atomic>
+#include <boost/format.hpp>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+//! A name for a temporary file or directory, unique to this process
+static std::string unique_name(const std::string &prefix)
+{
+	static std::atomic<unsigned int> counter{0};
+	return (boost::format{"%1%.%2%.%3%"} % prefix % getpid() % counter++).str();
+}
+
+//! Read the names in a directory, other than hidden ones
+static std::vector<std::string> read_dir(const std::string &path)
+{
+	std::vector<std::string> children;
+	DIR *dir = opendir(path.c_str());
+	if(dir == nullptr) {
+		return children;
+	}
+	while(struct dirent *de = readdir(dir)) {
+		std::string child(de->d_name); // NOLINT
+		if(child.at(0) != '.') {
+			children.push_back(child);
+		}
+	}
+	closedir(dir);
+	return children;
+}
+
+/**
+ * Evict the least recently used entries from the cache until it fits in the limit.
+ * Entries are moved out of the way before being removed, so another workspace using
+ * the cache never sees part of an entry.
+ *
+ * @param cache - The cache directory.
+ * @param keep - An entry not to evict (the one just added).
+ * @param limit - The size limit.
+ */
+static void evict(const std::string &cache, const std::string &keep, uint64_t limit)
+{
+	struct Entry {
+		std::string key;
+		int64_t used;
+		uint64_t size;
+	};
+	std::vector<Entry> entries;
+	uint64_t total = 0;
+	for(const auto &ns : read_dir(cache)) {
+		for(const auto &name : read_dir(cache + "/" + ns)) {
+			for(const auto &hash : read_dir(cache + "/" + ns + "/" + name)) {
+				std::string key = ns + "/" + name + "/" + hash;
+				struct stat st = {};
+				uint64_t size = 0;
+				std::ifstream size_file(cache + "/" + key + "/size");
+				if(stat((cache + "/" + key).c_str(), &st) != 0 || !(size_file >> size)) {
+					continue;
+				}
+				int64_t used = int64_t{st.st_mtim.tv_sec} * 1000000000 + st.st_mtim.tv_nsec;
+				entries.push_back({key, used, size});
+				total += size;
+			}
+		}
+	}
+	std::sort(entries.begin(), entries.end(),
+	          [](const Entry &a, const Entry &b) { return a.used < b.used; });
+
+	for(const auto &entry : entries) {
+		if(total <= limit) {
+			break;
+		}
+		if(entry.key == keep) {
+			continue;
+		}
+		std::string trash = cache + "/" + unique_name(".evict");
+		if(rename((cache + "/" + entry.key).c_str(), trash.c_str()) == 0) {
+			std::error_code ec;
+			filesystem::remove_all(trash, ec);
+		}
+		total -= entry.size;
+	}
+}
+
+/**
+ * Link a file to a new name, copying it (reflinked where the filesystem supports it)
+ * when it can not be linked, such as across filesystems. The files in the cache and
+ * the archives in the output directories are only ever replaced by renaming over them,
+ * never written to, so they can share an inode.
+ *
+ * @param src - The file to link.
+ * @param dst - The new name, any existing file is replaced.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns false if src does not exist, or it could not be linked or copied.
+ */
+bool buildsys::local_cache_link(const std::string &src, const std::string &dst,
+                                Logger *logger)
+{
+	struct stat st = {};
+	if(stat(src.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+	unlink(dst.c_str());
+	if(link(src.c_str(), dst.c_str()) == 0) {
+		return true;
+	}
+	CopyOptions options;
+	options.recursive = false;
+	options.dereference = true;
+	options.preserve = false;
+	options.update = false;
+	return copy_path(src, dst, logger, options);
+}
+
+/**
+ * Get the files of an entry from the local build cache.
+ *
+ * @param cache - The cache directory.
+ * @param key - The entry to get ("namespace/package/build info hash").
+ * @param files - The files to get, and where to put them.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if all of the (non-optional) files were got, false otherwise (none of
+ *          them are left behind).
+ */
+bool buildsys::local_cache_get(const std::string &cache, const std::string &key,
+                               const std::vector<LocalCacheFile> &files, Logger *logger)
+{
+	std::string entry = cache + "/" + key;
+	struct stat st = {};
+	if(stat(entry.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+		return false;
+	}
+	// Mark the entry as recently used
+	utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+
+	for(const auto &file : files) {
+		std::string src = entry + "/" + file.name;
+		if(file.optional && access(src.c_str(), F_OK) != 0) {
+			unlink(file.path.c_str());
+			continue;
+		}
+		if(!local_cache_link(src, file.path, logger)) {
+			// The entry may have been evicted by another workspace
+			for(const auto &got : files) {
+				unlink(got.path.c_str());
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Add an entry to the local build cache, then evict the least recently used entries
+ * beyond the size limit. The entry is assembled under a temporary name and renamed into
+ * place, so it is either complete or not there at all.
+ *
+ * @param cache - The cache directory.
+ * @param key - The entry to add ("namespace/package/build info hash").
+ * @param files - The files to add, and where to take them from.
+ * @param limit - The size limit of the cache, in bytes.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the entry is in the cache, false otherwise.
+ */
+bool buildsys::local_cache_put(const std::string &cache, const std::string &key,
+                               const std::vector<LocalCacheFile> &files, uint64_t limit,
+                               Logger *logger)
+{
+	std::string entry = cache + "/" + key;
+	std::error_code ec;
+	if(filesystem::is_directory(entry, ec)) {
+		return true;
+	}
+	auto parent = filesystem::path(entry).parent_path();
+	std::string tmp = (parent / unique_name(".tmp")).string();
+	filesystem::create_directories(tmp, ec);
+	if(ec) {
+		logger->log(tmp + ": Cannot create: " + ec.message());
+		return false;
+	}
+
+	bool result = true;
+	uint64_t size = 0;
+	for(const auto &file : files) {
+		struct stat st = {};
+		if(stat(file.path.c_str(), &st) != 0) {
+			if(file.optional) {
+				continue;
+			}
+			logger->log(file.path + ": Cannot stat: " + std::string(strerror(errno)));
+			result = false;
+			break;
+		}
+		if(!local_cache_link(file.path, tmp + "/" + file.name, logger)) {
+			result = false;
+			break;
+		}
+		size += static_cast<uint64_t>(st.st_size);
+	}
+	if(result) {
+		std::ofstream size_file(tmp + "/size");
+		size_file << size << "\n";
+		size_file.close();
+		result = size_file.good();
+	}
+	if(result && rename(tmp.c_str(), entry.c_str()) != 0) {
+		int err = errno;
+		// Another workspace may have added the same entry first
+		if(!filesystem::is_directory(entry, ec)) {
+			logger->log(entry + ": Cannot rename: " + std::string(strerror(err)));
+			result = false;
+		}
+	}
+	filesystem::remove_all(tmp, ec);
+	if(result) {
+		evict(cache, key, limit);
+	}
+	return result;
+}
@@ -0,0 +1,51 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef LOCALCACHE_HPP_
+#define LOCALCACHE_HPP_
+
+#include "logger.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace buildsys
+{
+	//! A file kept in an entry of the local build cache
+	struct LocalCacheFile {
+		std::string name;     //!< Name in the entry (e.g. "staging.tar")
+		std::string path;     //!< Where the file is put (or taken from)
+		bool optional{false}; //!< An entry without the file is still complete
+	};
+
+	bool local_cache_link(const std::string &src, const std::string &dst, Logger *logger);
+	bool local_cache_get(const std::string &cache, const std::string &key,
+	                     const std::vector<LocalCacheFile> &files, Logger *logger);
+	bool local_cache_put(const std::string &cache, const std::string &key,
+	                     const std::vector<LocalCacheFile> &files, uint64_t limit,
+	                     Logger *logger);
+} // namespace buildsys
+
+#endif // LOCALCACHE_HPP_
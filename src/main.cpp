@@ -43,6 +43,17 @@ static void signal_handler([[maybe_unused]] int signal)
 	std::_Exit(EXIT_FAILURE);
 }
 
+/**
+ * Wait for the outputs of the packages built to be published to the build cache.
+ */
+static void wait_for_publish(Logger *logger)
+{
+	if(CachePublisher::get()->pending()) {
+		logger->log("Waiting for build cache uploads");
+		CachePublisher::get()->wait();
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	steady_clock::time_point start = steady_clock::now();
@@ -91,6 +102,7 @@ int main(int argc, char *argv[])
 
 	if(!WORLD.basePackage(filename)) {
 		logger.log("Building: Failed");
+		wait_for_publish(&logger);
 		if(WORLD.areKeepGoing()) {
 			hash_shutdown();
 		}
@@ -108,7 +120,10 @@ int main(int argc, char *argv[])
 	graph.fill();
 	graph.output();
 
+	wait_for_publish(&logger);
+
 	logger.log("Finished: " + target);
+	CacheStats::get()->summary(&logger);
 
 	steady_clock::time_point end = steady_clock::now();
 	auto duration = duration_cast<std::chrono::milliseconds>(end - start).count();
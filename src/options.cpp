@@ -27,6 +27,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "exceptions.hpp"
 #include "include/buildsys.h"
 #include "interface/luainterface.h"
+#include <cstdlib>
 #include <string>
 #include <vector>
 
@@ -64,7 +65,31 @@ std::string buildsys::parse_command_line(int argc, char *argv[], World *WORLD)
 		if(argList[a] == "--clean") {
 			Package::set_clean_packages(true);
 		} else if(argList[a] == "--cache-server") {
-			Package::set_build_cache(next());
+			Package::add_build_cache(next());
+		} else if(argList[a] == "--cache-publish") {
+			CachePublisher::set_target(next());
+		} else if(argList[a] == "--cache-chunks") {
+			Package::set_chunk_store(next());
+		} else if(argList[a] == "--local-cache") {
+			Package::set_local_cache(next());
+		} else if(argList[a] == "--local-cache-size") {
+			// In MiB
+			Package::set_local_cache_limit(uint64_t{std::stoul(next())} * 1024 * 1024);
+		} else if(argList[a] == "--archive-codec") {
+			Package::set_archive_codec(ArchiveCodec::parse(next()));
+		} else if(argList[a] == "--reproducible") {
+			Package::set_archive_reproducible(
+			    ArchiveReproducible::parse(std::getenv("SOURCE_DATE_EPOCH")));
+		} else if(argList[a] == "--staging-store") {
+			Package::set_staging_store(next());
+		} else if(argList[a] == "--staging-store-size") {
+			// In MiB
+			Package::set_staging_store_limit(uint64_t{std::stoul(next())} * 1024 * 1024);
+		} else if(argList[a] == "--source-cache") {
+			Extraction::setSourceCache(next());
+		} else if(argList[a] == "--source-cache-size") {
+			// In MiB
+			Extraction::setSourceCacheLimit(uint64_t{std::stoul(next())} * 1024 * 1024);
 		} else if(argList[a] == "--tarball-cache") {
 			DownloadFetch::setTarballCache(next());
 		} else if(argList[a] == "--overlay") {
@@ -83,11 +108,12 @@ std::string buildsys::parse_command_line(int argc, char *argv[], World *WORLD)
 			Logger::set_verbose(true);
 		} else if(argList[a] == "--keep-staging") {
 			Package::set_keep_all_staging(true);
+		} else if(argList[a] == "--all-staging-archives") {
+			Package::set_all_staging_archives(true);
 		} else if(argList[a] == "--parallel-packages") {
 			WORLD->setThreadsLimit(std::stoi(next()));
-			// If a thread limit is specified then don't allow packages to extract
-			// in parallel.
-			Package::set_extract_in_parallel(false);
+		} else if(argList[a] == "--io-jobs") {
+			IoExecutor::set_jobs(static_cast<unsigned int>(std::stoul(next())));
 		} else if(argList[a] == "--git-local-mirror-map") {
 			GitExtractionUnit::add_ref_if_able_pattern(next());
 		} else if(argList[a] == "--") {
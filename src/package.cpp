@@ -25,24 +25,38 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "include/buildsys.h"
 #include "interface/luainterface.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <list>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
-#ifndef TAR_CMD
-#define TAR_CMD "/bin/tar"
-#endif
 
 using std::chrono::duration_cast;
 using std::chrono::steady_clock;
 
 bool Package::quiet_packages = false;
 bool Package::keep_staging = false;
-bool Package::extract_in_parallel = true;
-std::string Package::build_cache;
+bool Package::all_staging_archives = false;
+std::vector<std::string> Package::build_caches;
+std::string Package::local_cache;
+std::string Package::chunk_store;
+uint64_t Package::local_cache_limit = uint64_t{10240} * 1024 * 1024;
+ArchiveCodec Package::archive_codec;
+ArchiveReproducible Package::archive_reproducible;
+std::string Package::staging_store;
+uint64_t Package::staging_store_limit = uint64_t{10240} * 1024 * 1024;
 bool Package::clean_all_packages = false;
 std::list<std::string> Package::overlays = {"."};
 std::list<std::string> Package::forced_packages;
@@ -68,23 +82,101 @@ void Package::set_keep_all_staging(bool set)
 }
 
 /**
- * Configure packages to extract in parallel.
+ * Configure packages to always create their staging archives, even when nothing
+ * extracts them.
  *
  * @param set - true to enable, false to disable.
  */
-void Package::set_extract_in_parallel(bool set)
+void Package::set_all_staging_archives(bool set)
 {
-	extract_in_parallel = set;
+	all_staging_archives = set;
 }
 
 /**
- *  Set the location of the build output cache
+ *  Add a location of the build output cache. All of the locations are looked up at
+ *  once, and the outputs are got from the first one that has them.
+ *
+ *  @param cache - The location to add.
+ */
+void Package::add_build_cache(std::string cache)
+{
+	CacheStats::get()->add(cache);
+	build_caches.push_back(std::move(cache));
+}
+
+/**
+ *  Set the location of the local build cache, which is shared by the workspaces on a
+ *  host and consulted before the build output cache.
  *
  *  @param cache - The location to set.
  */
-void Package::set_build_cache(std::string cache)
+void Package::set_local_cache(std::string cache)
+{
+	local_cache = std::move(cache);
+}
+
+/**
+ *  Set the chunk store, which makes the archives in the build cache be split into
+ *  chunks, so that only the chunks that are not already in the store are fetched (and
+ *  published).
+ *
+ *  @param store - The chunk store directory.
+ */
+void Package::set_chunk_store(std::string store)
+{
+	CachePublisher::set_chunk_store(store);
+	chunk_store = std::move(store);
+}
+
+/**
+ *  Set the size limit of the local build cache
+ *
+ *  @param limit - The limit in bytes.
+ */
+void Package::set_local_cache_limit(uint64_t limit)
+{
+	local_cache_limit = limit;
+}
+
+/**
+ *  Set the compression used for the staging and install archives
+ *
+ *  @param codec - The codec to use.
+ */
+void Package::set_archive_codec(const ArchiveCodec &codec)
 {
-	build_cache = std::move(cache);
+	archive_codec = codec;
+}
+
+/**
+ *  Set how the staging and install archives are made reproducible
+ *
+ *  @param repro - The settings to use.
+ */
+void Package::set_archive_reproducible(const ArchiveReproducible &repro)
+{
+	archive_reproducible = repro;
+}
+
+/**
+ *  Set the location of the extracted staging store. When set, each staging archive is
+ *  extracted into the store once, and staging directories are assembled from it.
+ *
+ *  @param store - The location to set.
+ */
+void Package::set_staging_store(std::string store)
+{
+	staging_store = std::move(store);
+}
+
+/**
+ *  Set the size limit of the extracted staging store
+ *
+ *  @param limit - The limit in bytes.
+ */
+void Package::set_staging_store_limit(uint64_t limit)
+{
+	staging_store_limit = limit;
 }
 
 /**
@@ -327,21 +419,36 @@ bool Package::process()
  * Extract the staging output for the package into the given directory.
  *
  * @param dir - The directory to extract the staging output into.
+ * @param members - If set, filled with the paths (relative to dir) of the extracted
+ *                  files.
+ * @param include - If set, only the files it accepts are extracted (not using the
+ *                  staging store).
  *
  * @returns true if the extraction was successful, false otherwise.
  */
-bool Package::extract_staging(const std::string &dir)
+bool Package::extract_staging(const std::string &dir, std::vector<std::string> *members,
+                              const ArchiveMemberFilter &include)
 {
-	PackageCmd pc(dir, TAR_CMD);
-	pc.addArg("--no-same-owner");
-	pc.addArg("-b");
-	pc.addArg("256");
-	pc.addArg("-xkf");
-	std::string arg = this->pwd + "/output/" + this->getNS()->getName() + "/staging/" +
-	                  this->name + ".tar";
-	pc.addArg(arg);
+	std::string arg = this->stagingArchive();
 
-	if(!pc.Run(&this->logger)) {
+	// When the index shows none of the files are wanted, the archive is not read at all
+	std::vector<ArchiveIndexEntry> entries;
+	auto wanted = [&include](const ArchiveIndexEntry &entry) {
+		return include(entry.path);
+	};
+	if(include && archive_index_load(arg + ".idx", &entries) &&
+	   std::none_of(entries.begin(), entries.end(), wanted)) {
+		return true;
+	}
+
+	bool ret = false;
+	if(Package::staging_store.empty() || include) {
+		ret = tar_extract(arg, dir, &this->logger, members, false, include);
+	} else {
+		std::string tree = this->stagingStoreTree(arg);
+		ret = !tree.empty() && staging_store_materialise(tree, dir, &this->logger, members);
+	}
+	if(!ret) {
 		this->log("Failed to extract staging_dir");
 		return false;
 	}
@@ -349,6 +456,76 @@ bool Package::extract_staging(const std::string &dir)
 	return true;
 }
 
+/**
+ * Get the extracted staging output for the package from the staging store, adding it
+ * to the store if required.
+ *
+ * @param archive - The staging archive of the package.
+ *
+ * @returns The path of the extracted tree, or an empty string on failure.
+ */
+std::string Package::stagingStoreTree(const std::string &archive)
+{
+	std::unique_lock<std::mutex> lk(this->staging_store_lock);
+	if(this->staging_archive_hash.empty()) {
+		this->staging_archive_hash = hash_file(archive);
+		if(this->staging_archive_hash.empty()) {
+			return std::string("");
+		}
+	}
+	return staging_store_populate(Package::staging_store, archive,
+	                              this->staging_archive_hash, Package::staging_store_limit,
+	                              &this->logger);
+}
+
+/**
+ * Get the path of the staging archive of the package.
+ */
+std::string Package::stagingArchive() const
+{
+	return this->pwd + "/output/" + this->ns->getName() + "/staging/" + this->name + ".tar";
+}
+
+/**
+ * Is the staging archive of the package needed ? It is when another package depends on
+ * this one (and so extracts it), when the outputs go to a build cache, or when all the
+ * staging archives were asked for. Otherwise a marker (stagingArchive() + ".omitted")
+ * is written in its place.
+ */
+bool Package::stagingArchiveNeeded() const
+{
+	return this->depended_on || Package::all_staging_archives ||
+	       !Package::local_cache.empty() || CachePublisher::enabled();
+}
+
+/**
+ * Get the path of the install archive of the package.
+ */
+std::string Package::installArchive() const
+{
+	return this->pwd + "/output/" + this->ns->getName() + "/install/" + this->name + ".tar";
+}
+
+/**
+ * Forget the hash of the staging archive, as the archive is being replaced.
+ */
+void Package::resetStagingArchiveHash()
+{
+	std::unique_lock<std::mutex> lk(this->staging_store_lock);
+	this->staging_archive_hash.clear();
+}
+
+//! Options for copying install files, as a plain cp
+static CopyOptions plain_copy()
+{
+	CopyOptions options;
+	options.recursive = false;
+	options.dereference = true;
+	options.preserve = false;
+	options.update = false;
+	return options;
+}
+
 /**
  * Extract the install output for the package into the given directory.
  *
@@ -360,27 +537,16 @@ bool Package::extract_install(const std::string &dir)
 {
 	if(!this->installFiles.empty()) {
 		for(const auto &install_file : this->installFiles) {
-			PackageCmd pc(dir, "cp");
 			std::string arg = this->pwd + "/output/" + this->getNS()->getName() +
 			                  "/install/" + install_file;
-			pc.addArg(arg);
-			pc.addArg(install_file);
-
-			if(!pc.Run(&this->logger)) {
+			if(!copy_path(arg, dir + "/" + install_file, &this->logger, plain_copy())) {
 				this->log(boost::format{"Failed to copy %1% (for install)"} % install_file);
 				return false;
 			}
 		}
 	} else {
-		PackageCmd pc(dir, TAR_CMD);
-		pc.addArg("--no-same-owner");
-		pc.addArg("-b");
-		pc.addArg("256");
-		pc.addArg("-xkf");
-		std::string arg = this->pwd + "/output/" + this->getNS()->getName() + "/install/" +
-		                  this->name + ".tar";
-		pc.addArg(arg);
-		if(!pc.Run(&this->logger)) {
+		std::string arg = this->installArchive();
+		if(!tar_extract(arg, dir, &this->logger)) {
 			this->log("Failed to extract install_dir");
 			return false;
 		}
@@ -404,25 +570,54 @@ bool Package::canBuild()
 	return true;
 }
 
-bool Package::ff_file(const std::string &hash, const std::string &rfile,
-                      const std::string &path, const std::string &fname,
-                      const std::string &fext)
+bool Package::ff_file(const std::string &server, const std::string &hash,
+                      const std::string &rfile, const std::string &tmp)
 {
-	std::string url = Package::build_cache + "/" + this->getNS()->getName() + "/" +
-	                  this->getName() + "/" + hash + "/" + rfile;
-	std::string dest = path + "/" + fname + fext;
-	std::string tmp = dest + ".tmp";
+	std::string url = server + "/" + this->getNS()->getName() + "/" + this->getName() +
+	                  "/" + hash + "/" + rfile;
+	return this->ff_fetch(url, rfile, tmp);
+}
 
-	// Download to a temporary file and promote it only once wget succeeds:
-	// "wget -O <file>" leaves a truncated/empty file behind on an HTTP error
-	// (e.g. a cache miss returning 404), which later stages would extract as if
-	// it were a valid cache artifact. Using PackageCmd also avoids building a
-	// shell command line. Returns true on failure, false on success.
+bool Package::ff_fetch(const std::string &url, const std::string &rfile,
+                       const std::string &tmp)
+{
+	// Download to a temporary file, fetchFrom() promotes it only once every file was
+	// fetched: a failed download leaves a truncated/empty file behind (e.g. a cache
+	// miss returning 404), which later stages would extract as if it were a valid
+	// cache artifact. Returns true on failure, false on success.
 	//
 	// A build-cache miss must never be fatal, so use the non-throwing
 	// filesystem overloads and return true (build locally) on any error --
 	// fetchFrom() runs before the staging/install dirs are created, so the temp
 	// file's directory may not even exist yet.
+	std::error_code ec;
+	if(boost::algorithm::starts_with(url, "file://")) {
+		// A cache on a local (or mounted) filesystem is linked or copied directly
+		if(!local_cache_link(url.substr(7), tmp, &this->logger)) {
+			this->log("Failed to get " + rfile);
+			filesystem::remove(tmp, ec);
+			return true;
+		}
+		return false;
+	}
+	if(HttpClient::supported(url)) {
+		// Fetch in-process, reusing a kept-alive connection to the cache server
+		int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		int status = -1;
+		if(fd >= 0) {
+			status = HttpClient::get()->fetch(url, fd, &this->logger);
+			if(close(fd) != 0) {
+				status = -1;
+			}
+		}
+		if(status != 200) {
+			this->log("Failed to get " + rfile);
+			filesystem::remove(tmp, ec);
+			return true;
+		}
+		return false;
+	}
+
 	PackageCmd pc(this->pwd, "wget");
 	pc.addArg("-q");
 	pc.addArg(url);
@@ -432,19 +627,11 @@ bool Package::ff_file(const std::string &hash, const std::string &rfile,
 	// log -- we already log a concise "Failed to get" line below.
 	pc.allowFailure();
 
-	std::error_code ec;
 	if(!pc.Run(&this->logger)) {
 		this->log("Failed to get " + rfile);
 		filesystem::remove(tmp, ec);
 		return true;
 	}
-
-	filesystem::rename(tmp, dest, ec);
-	if(ec) {
-		this->log("Failed to store " + rfile + ": " + ec.message());
-		filesystem::remove(tmp, ec);
-		return true;
-	}
 	return false;
 }
 
@@ -456,14 +643,6 @@ void Package::updateBuildInfoHashExisting()
 	this->log_verbose("Hash: " + this->buildinfo_hash);
 }
 
-void Package::updateBuildInfoHash()
-{
-	// populate the build.info hash
-	std::string build_info_file = this->bd.getPath() + "/.build.info.new";
-	this->buildinfo_hash = hash_file(build_info_file);
-	this->log_verbose("Hash: " + this->buildinfo_hash);
-}
-
 Package::BuildInfoType Package::buildInfo(std::string *file_path, std::string *hash)
 {
 	if(this->isHashingOutput()) {
@@ -472,34 +651,53 @@ Package::BuildInfoType Package::buildInfo(std::string *file_path, std::string *h
 		return BuildInfoType::Output;
 	}
 
+	// A package that wrote a build key is described by its outputs
+	std::string key_file = this->bd.getShortPath() + "/.build.key";
+	if(filesystem::exists(key_file)) {
+		*file_path = key_file;
+		*hash = hash_file(key_file);
+		return BuildInfoType::Key;
+	}
+
 	*file_path = this->bd.getShortPath() + "/.build.info";
 	*hash = this->buildinfo_hash;
 	return BuildInfoType::Build;
 }
 
 /**
- * Write the (already assembled) BuildDescription to .build.info.new and
- * update the buildinfo hash to match.
+ * Set the buildinfo hash from the (already assembled) BuildDescription, and write
+ * it to .build.info.new if it differs from the existing .build.info.
  */
 void Package::writeBuildInfoFile()
 {
-	std::string buildInfoFname = this->bd.getPath() + "/.build.info.new";
-	std::ofstream _buildInfo(buildInfoFname.c_str());
+	this->buildinfo_hash = this->build_description.hash();
+	this->log_verbose("Hash: " + this->buildinfo_hash);
+
+	std::string buildInfoFname = this->bd.getPath() + "/.build.info";
+	std::string newBuildInfoFname = buildInfoFname + ".new";
+	this->buildInfoChanged = !filesystem::exists(buildInfoFname) ||
+	                         hash_file(buildInfoFname) != this->buildinfo_hash;
+	if(!this->buildInfoChanged) {
+		// Nothing to write, just make sure a stale file from an earlier
+		// (failed) run is not picked up by updateBuildInfo()
+		filesystem::remove(newBuildInfoFname);
+		return;
+	}
+
+	std::ofstream _buildInfo(newBuildInfoFname.c_str());
 	this->build_description.print(_buildInfo);
 	_buildInfo.close();
-	this->updateBuildInfoHash();
 }
 
 void Package::prepareBuildInfo()
 {
 	if(this->buildInfoPrepared) {
-		// The build description is already assembled, but updateBuildInfo()
-		// may have consumed the .build.info.new file since (e.g. a build-cache
-		// restore followed by a locally-triggered rebuild). Re-write it from
-		// the assembled description; the content (and hash) are unchanged.
-		if(!filesystem::exists(this->bd.getPath() + "/.build.info.new")) {
-			this->writeBuildInfoFile();
-		}
+		// The build description is already assembled, but the work directory
+		// may have been cleaned, or updateBuildInfo() may have consumed the
+		// .build.info.new file since (e.g. a build-cache restore followed by a
+		// locally-triggered rebuild). Re-check it against the assembled
+		// description; the content (and hash) are unchanged.
+		this->writeBuildInfoFile();
 		return;
 	}
 	// Add the extraction info file
@@ -511,6 +709,24 @@ void Package::prepareBuildInfo()
 
 	// Add each of our dependencies build info files
 	for(auto &dp : this->depends) {
+		// Depending on some named outputs of a package uses the keys of those outputs
+		std::vector<std::array<std::string, 2>> output_keys;
+		for(const auto &output : dp.getOutputs()) {
+			std::string file_path;
+			std::string hash;
+			if(!dp.getPackage()->outputKey(output, &file_path, &hash)) {
+				output_keys.clear();
+				break;
+			}
+			output_keys.push_back({file_path, hash});
+		}
+		for(const auto &output_key : output_keys) {
+			this->build_description.add_build_key_file(output_key.at(0), output_key.at(1));
+		}
+		if(!output_keys.empty()) {
+			continue;
+		}
+
 		std::string file_path;
 		std::string hash;
 		auto type = dp.getPackage()->buildInfo(&file_path, &hash);
@@ -522,11 +738,17 @@ void Package::prepareBuildInfo()
 
 		if(type == BuildInfoType::Output) {
 			this->build_description.add_output_info_file(file_path, hash);
+		} else if(type == BuildInfoType::Key) {
+			this->build_description.add_build_key_file(file_path, hash);
 		} else {
 			this->build_description.add_build_info_file(file_path, hash);
 		}
 	}
 
+	for(const auto &pattern : this->stage_filter) {
+		this->build_description.add_stage_filter(pattern);
+	}
+
 	// Create the new build info file
 	this->writeBuildInfoFile();
 	this->buildInfoPrepared = true;
@@ -570,9 +792,13 @@ void Package::updateBuildInfo(bool updateOutputHash)
 	// mv the build info file into the regular place. A silent failure here
 	// would leave a stale .build.info, which feeds the cache-key and
 	// should-build logic, so use filesystem::rename which throws on error.
+	// If there is no .build.info.new, the existing .build.info already matches.
 	std::string oldfname = this->bd.getPath() + "/.build.info.new";
 	std::string newfname = this->bd.getPath() + "/.build.info";
-	filesystem::rename(oldfname, newfname);
+	if(filesystem::exists(oldfname)) {
+		filesystem::rename(oldfname, newfname);
+	}
+	this->buildInfoChanged = false;
 
 	if(updateOutputHash && this->isHashingOutput()) {
 		// Hash the entire new path
@@ -585,6 +811,196 @@ void Package::updateBuildInfo(bool updateOutputHash)
 	}
 }
 
+/**
+ * Fetch the outputs of the package from a build cache server into temporary files
+ * (named after their destination, with ".tmp" appended).
+ *
+ * @param server - The server.
+ * @param files - The names of the files in the cache, and their destinations (other
+ *                than the "usable" marker, which was already fetched).
+ *
+ * @returns true if any of the files could not be fetched, false otherwise.
+ */
+bool Package::fetchFromServer(const std::string &server,
+                              const std::vector<std::array<std::string, 2>> &files)
+{
+	std::vector<char> failed(files.size(), 0);
+	auto fetch = [this, &server, &files, &failed](size_t i) {
+		const std::string &rfile = files.at(i).at(0);
+		std::string tmp = files.at(i).at(1) + ".tmp";
+		bool chunked = !Package::chunk_store.empty() &&
+		               boost::algorithm::ends_with(rfile, ".tar") &&
+		               !this->fetchChunked(server, rfile, tmp);
+		failed.at(i) = static_cast<char>(
+		    !chunked && this->ff_file(server, this->buildinfo_hash, rfile, tmp));
+	};
+	std::vector<std::thread> threads;
+	for(size_t i = 1; i < files.size(); i++) {
+		threads.emplace_back(fetch, i);
+	}
+	for(auto &thread : threads) {
+		thread.join();
+	}
+	return std::any_of(failed.begin() + 1, failed.end(),
+	                   [](char miss) { return miss != 0; });
+}
+
+/**
+ * Fetch an archive from a build cache server as chunks, getting only the chunks that
+ * are not already in the chunk store.
+ *
+ * @param server - The server.
+ * @param rfile - The name of the archive in the cache.
+ * @param tmp - Where to put the archive.
+ *
+ * @returns true if the archive could not be fetched (such as when it was not published
+ *          as chunks), false otherwise.
+ */
+bool Package::fetchChunked(const std::string &server, const std::string &rfile,
+                           const std::string &tmp)
+{
+	std::vector<ArchiveChunk> chunks;
+	bool ret = this->ff_file(server, this->buildinfo_hash, rfile + ".chunks",
+	                         tmp + ".chunks") ||
+	           !chunk_index_load(tmp + ".chunks", &chunks);
+	unlink((tmp + ".chunks").c_str());
+	if(ret) {
+		return true;
+	}
+
+	std::vector<std::string> missing;
+	for(const auto &chunk : chunks) {
+		if(!chunk_store_has(Package::chunk_store, chunk.hash) &&
+		   std::find(missing.begin(), missing.end(), chunk.hash) == missing.end()) {
+			missing.push_back(chunk.hash);
+		}
+	}
+	this->log_verbose(boost::format{"%1%: Fetching %2% of %3% chunks"} % rfile %
+	                  missing.size() % chunks.size());
+
+	// Fetch the missing chunks over a few connections at once
+	std::atomic<size_t> next{0};
+	std::atomic<bool> failed{false};
+	auto fetch = [this, &server, &tmp, &missing, &next, &failed]() {
+		for(size_t i = next++; i < missing.size() && !failed; i = next++) {
+			const std::string &hash = missing.at(i);
+			std::string chunk_tmp = tmp + "." + hash;
+			if(this->ff_fetch(server + "/chunks/" + chunk_path(hash), hash, chunk_tmp) ||
+			   !chunk_store_import(Package::chunk_store, hash, chunk_tmp, &this->logger)) {
+				failed = true;
+			}
+		}
+	};
+	std::vector<std::thread> threads;
+	for(size_t i = 0; i < std::min(missing.size(), size_t{4}); i++) {
+		threads.emplace_back(fetch);
+	}
+	for(auto &thread : threads) {
+		thread.join();
+	}
+	return failed ||
+	       !chunk_store_assemble(Package::chunk_store, chunks, tmp, &this->logger);
+}
+
+/**
+ * Fetch the outputs of the package from the build cache servers into temporary files
+ * (named after their destination, with ".tmp" appended).
+ *
+ * "usable" marks a complete cache entry, so all of the servers are asked for it at
+ * once (other than those whose index does not list the entry). The rest of the files
+ * are fetched from the first server to answer with a hit, without waiting for the
+ * others. Only if that fails are the other hits used, in the order they answered. The
+ * answers of the servers that are still to answer after that are not used.
+ *
+ * @param files - The names of the files in the cache, and their destinations (the
+ *                "usable" marker first).
+ * @param server - Set to the server the files were fetched from.
+ *
+ * @returns true if any of the files could not be fetched, false otherwise.
+ */
+bool Package::fetchFromServers(const std::vector<std::array<std::string, 2>> &files,
+                               std::string *server)
+{
+	//! Shared with the probes, which may outlive this call
+	struct Probes {
+		std::mutex lock;
+		std::condition_variable cond;
+		std::deque<size_t> hits;
+		std::vector<bool> answered;
+		size_t count{0};
+		bool done{false};
+	};
+	auto probes = std::make_shared<Probes>();
+	probes->answered.resize(Package::build_caches.size());
+	std::string marker = files.at(0).at(1);
+	std::string rfile = files.at(0).at(0);
+	std::string key =
+	    this->getNS()->getName() + "/" + this->name + "/" + this->buildinfo_hash;
+	std::string hash = this->buildinfo_hash;
+
+	auto probe = [this, probes, marker, rfile, key, hash](size_t i,
+	                                                      const std::string &url) {
+		std::string tmp = marker + "." + std::to_string(i) + ".tmp";
+		bool miss = true;
+		if(CacheIndex::get()->mayHave(url, key, &this->logger)) {
+			steady_clock::time_point start = steady_clock::now();
+			miss = this->ff_file(url, hash, rfile, tmp);
+			CacheStats::get()->probed(url, !miss, steady_clock::now() - start);
+		} else {
+			CacheStats::get()->indexed(url);
+		}
+		std::unique_lock<std::mutex> lk(probes->lock);
+		if(probes->done) {
+			// Answered too late to be used
+			std::error_code ec;
+			filesystem::remove(tmp, ec);
+			return;
+		}
+		if(!miss) {
+			probes->hits.push_back(i);
+		}
+		probes->answered.at(i) = true;
+		probes->count++;
+		probes->cond.notify_all();
+	};
+	// Not joined, so a slow server does not hold up the package once another has
+	// answered with a hit
+	for(size_t i = 0; i < Package::build_caches.size(); i++) {
+		std::thread(probe, i, Package::build_caches.at(i)).detach();
+	}
+
+	bool ret = true;
+	std::error_code ec;
+	std::unique_lock<std::mutex> lk(probes->lock);
+	while(ret) {
+		while(probes->hits.empty() && probes->count < Package::build_caches.size()) {
+			probes->cond.wait(lk);
+		}
+		if(probes->hits.empty()) {
+			break;
+		}
+		size_t i = probes->hits.front();
+		probes->hits.pop_front();
+		lk.unlock();
+		filesystem::rename(marker + "." + std::to_string(i) + ".tmp", marker + ".tmp", ec);
+		ret = ec || this->fetchFromServer(Package::build_caches.at(i), files);
+		if(!ret) {
+			*server = Package::build_caches.at(i);
+			CacheStats::get()->used(*server);
+		}
+		lk.lock();
+	}
+
+	// The servers yet to answer remove their own temporary files
+	probes->done = true;
+	for(size_t i = 0; i < Package::build_caches.size(); i++) {
+		if(probes->answered.at(i)) {
+			filesystem::remove(marker + "." + std::to_string(i) + ".tmp", ec);
+		}
+	}
+	return ret;
+}
+
 bool Package::fetchFrom()
 {
 	// Without a build info hash there is nothing to look up in the build
@@ -596,43 +1012,344 @@ bool Package::fetchFrom()
 		return true;
 	}
 
-	bool ret = false;
-	std::string staging_dir = this->getNS()->getStagingDir();
-	std::string install_dir = this->getNS()->getInstallDir();
-	std::vector<std::array<std::string, 4>> files = {
-	    {"usable", staging_dir, this->name, ".tar.ff"},
-	    {"staging.tar", staging_dir, this->name, ".tar"},
-	    {"install.tar", install_dir, this->name, ".tar"},
-	    {"output.info", this->bd.getPath(), ".output", ".info"},
+	bool ret = true;
+	std::string staging_archive = this->stagingArchive();
+	std::string install_archive = this->installArchive();
+	std::vector<std::array<std::string, 2>> files = {
+	    {"usable", staging_archive + ".ff"},
+	    {"staging.tar", staging_archive},
+	    {"install.tar", install_archive},
+	    {"output.info", this->bd.getPath() + "/.output.info"},
 	};
 
-	std::string ff_url = (boost::format{"%1%/%2%/%3%/%4%"} % Package::build_cache %
-	                      this->getNS()->getName() % this->name % this->buildinfo_hash)
-	                         .str();
+	std::string key =
+	    this->getNS()->getName() + "/" + this->name + "/" + this->buildinfo_hash;
+	std::string ff_url = key;
 
 	if(!this->isHashingOutput()) {
 		files.pop_back();
 	}
 
-	for(auto &element : files) {
-		ret = this->ff_file(this->buildinfo_hash, element.at(0), element.at(1),
-		                    element.at(2), element.at(3));
+	this->resetStagingArchiveHash();
+
+	std::error_code ec;
+	for(const auto &element : files) {
+		filesystem::create_directories(filesystem::path(element.at(1)).parent_path(), ec);
+	}
+
+	// The local cache also keeps the indexes of the archives (when they were built
+	// locally), it does not need the "usable" marker.
+	std::vector<LocalCacheFile> cached;
+	for(size_t i = 1; i < files.size(); i++) {
+		cached.push_back({files.at(i).at(0), files.at(i).at(1) + ".tmp", false});
+	}
+	cached.push_back({"staging.tar.idx", staging_archive + ".idx.tmp", true});
+	cached.push_back({"install.tar.idx", install_archive + ".idx.tmp", true});
+
+	if(!Package::local_cache.empty() &&
+	   local_cache_get(Package::local_cache, key, cached, &this->logger)) {
+		ret = false;
+		ff_url = Package::local_cache + "/" + key;
+	} else if(!Package::build_caches.empty()) {
+		std::string server;
+		ret = this->fetchFromServers(files, &server);
+		ff_url = server + "/" + key;
+		if(!ret && !Package::local_cache.empty() &&
+		   !local_cache_put(Package::local_cache, key, cached, Package::local_cache_limit,
+		                    &this->logger)) {
+			this->log("Failed to add the outputs to the local build cache");
+		}
+	}
+
+	// Only move the files into place once all of them were got. An archive index that
+	// was not got is removed, it belongs to the archive being replaced.
+	std::vector<std::string> dests;
+	for(const auto &element : files) {
+		dests.push_back(element.at(1));
+	}
+	dests.push_back(staging_archive + ".idx");
+	dests.push_back(install_archive + ".idx");
+	for(const auto &dest : dests) {
+		std::string tmp = dest + ".tmp";
 		if(ret) {
-			break;
+			filesystem::remove(tmp, ec);
+			continue;
+		}
+		if(!filesystem::exists(tmp, ec)) {
+			filesystem::remove(dest, ec);
+			continue;
+		}
+		filesystem::rename(tmp, dest, ec);
+		if(ec) {
+			this->log("Failed to store " + dest + ": " + ec.message());
+			filesystem::remove(tmp, ec);
+			ret = true;
 		}
 	}
 
+	if(!ret) {
+		filesystem::remove(staging_archive + ".omitted", ec);
+	}
+
 	if(ret) {
 		this->log("No build cache: " + ff_url);
 	} else {
 		this->log("Build cache used: " + ff_url);
 
 		this->updateBuildInfo(false);
+		this->updateBuildKey();
 	}
 
 	return ret;
 }
 
+/**
+ * Add the outputs of a local build to the local build cache, and queue them to be
+ * published to the build cache (in the background).
+ */
+void Package::storeCaches()
+{
+	if((Package::local_cache.empty() && !CachePublisher::enabled()) ||
+	   this->buildinfo_hash.empty() || this->codeUpdated || !this->installFiles.empty()) {
+		return;
+	}
+	std::string key =
+	    this->getNS()->getName() + "/" + this->name + "/" + this->buildinfo_hash;
+
+	if(!Package::local_cache.empty()) {
+		std::vector<LocalCacheFile> files = {
+		    {"staging.tar", this->stagingArchive(), false},
+		    {"staging.tar.idx", this->stagingArchive() + ".idx", true},
+		    {"install.tar", this->installArchive(), false},
+		    {"install.tar.idx", this->installArchive() + ".idx", true},
+		};
+		if(this->isHashingOutput()) {
+			files.push_back({"output.info", this->bd.getPath() + "/.output.info", false});
+		}
+		if(!local_cache_put(Package::local_cache, key, files, Package::local_cache_limit,
+		                    &this->logger)) {
+			this->log("Failed to add the outputs to the local build cache");
+		}
+	}
+
+	if(CachePublisher::enabled()) {
+		std::vector<std::array<std::string, 2>> files = {
+		    {"staging.tar", this->stagingArchive()},
+		    {"install.tar", this->installArchive()},
+		};
+		if(this->isHashingOutput()) {
+			files.push_back({"output.info", this->bd.getPath() + "/.output.info"});
+		}
+		std::string prefix = this->getNS()->getName() + "," + this->name;
+		if(!CachePublisher::get()->publish(key, files, &this->logger, prefix)) {
+			this->log("Failed to publish the outputs to the build cache");
+		}
+	}
+}
+
+/**
+ * Make a pattern relative to the staging directory, as the paths in the archive index.
+ *
+ * @param pattern - The pattern.
+ *
+ * @returns The relative pattern.
+ */
+static std::string staging_pattern(std::string pattern)
+{
+	while(boost::algorithm::starts_with(pattern, "/") ||
+	      boost::algorithm::starts_with(pattern, "./")) {
+		pattern.erase(0, pattern.find_first_not_of('/', 1));
+	}
+	return pattern;
+}
+
+/**
+ * Get a filter selecting the paths that match any of the given patterns.
+ *
+ * @param patterns - Patterns (as fnmatch(), where '*' also matches '/').
+ *
+ * @returns The filter.
+ */
+static ArchiveMemberFilter pattern_filter(const std::vector<std::string> &patterns)
+{
+	return [patterns](const std::string &path) {
+		return std::any_of(patterns.begin(), patterns.end(), [&path](const auto &pattern) {
+			return fnmatch(pattern.c_str(), path.c_str(), 0) == 0;
+		});
+	};
+}
+
+/**
+ * Name a part of the staging output of the package, so that packages depending on this
+ * one can depend on (and extract) only that part.
+ *
+ * @param output - The name of the part.
+ * @param patterns - Patterns (as fnmatch(), where '*' also matches '/') of the paths in
+ *                   the part, relative to the staging directory.
+ */
+void Package::addOutput(const std::string &output, const std::vector<std::string> &patterns)
+{
+	std::vector<std::string> &paths = this->outputs[output];
+	for(const auto &pattern : patterns) {
+		paths.push_back(staging_pattern(pattern));
+	}
+}
+
+/**
+ * Restrict the files of the staging packages that are extracted into the staging
+ * directory of this package.
+ *
+ * @param patterns - Patterns (as fnmatch(), where '*' also matches '/') of the paths to
+ *                   extract, relative to the staging directory.
+ */
+void Package::addStageFilter(const std::vector<std::string> &patterns)
+{
+	for(const auto &pattern : patterns) {
+		this->stage_filter.push_back(staging_pattern(pattern));
+	}
+}
+
+/**
+ * Get a filter selecting the files of the staging output that are in any of the given
+ * named outputs.
+ *
+ * @param names - The names of the outputs.
+ *
+ * @returns The filter. An exception is thrown if an output is not named by the package.
+ */
+ArchiveMemberFilter Package::outputFilter(const std::vector<std::string> &names) const
+{
+	std::vector<std::string> patterns;
+	for(const auto &output : names) {
+		auto it = this->outputs.find(output);
+		if(it == this->outputs.end()) {
+			throw CustomException(this->getName() + " has no output named '" + output +
+			                      "'");
+		}
+		patterns.insert(patterns.end(), it->second.begin(), it->second.end());
+	}
+	return pattern_filter(patterns);
+}
+
+/**
+ * Get the key of a named output of the package. The key is written with the build key
+ * (see updateBuildKey()), but only has the part of the staging output that is named.
+ *
+ * @param output - The name of the output.
+ * @param file_path - Set to the (relative) path of the key.
+ * @param hash - Set to the hash of the key.
+ *
+ * @returns true if the key was set, false if there is no key (the build info of the
+ *          package should be used instead). An exception is thrown if the output is not
+ *          named by the package.
+ */
+bool Package::outputKey(const std::string &output, std::string *file_path,
+                        std::string *hash)
+{
+	if(!this->hasOutput(output)) {
+		throw CustomException(this->getName() + " has no output named '" + output + "'");
+	}
+	std::string key_file = this->bd.getShortPath() + "/.build.key." + output;
+	if(this->isHashingOutput() || !filesystem::exists(key_file)) {
+		return false;
+	}
+	*file_path = key_file;
+	*hash = hash_file(key_file);
+	return true;
+}
+
+/**
+ * Write the build key of the package (.build.key). Unlike the build info, the key
+ * describes what the package produced: the keys of its dependencies and digests of its
+ * staging and install archives. Packages that depend on this one use the key in place
+ * of the build info, so a rebuild that produces the same outputs does not cause them to
+ * be rebuilt.
+ *
+ * For a package hashing its interface, the key has a digest of the interface of the
+ * staging archive instead (see archive_interface_digest()). The install archive is left
+ * out, it is only used by packages extracting the installed files of their
+ * dependencies, and shouldBuild() always rebuilds those that extract the installed files
+ * of a package hashing its interface (see extractsHashedInterface()).
+ *
+ * A key is also written for each named output (.build.key.<name>), with a digest of
+ * only the part of the staging archive that is named.
+ */
+void Package::updateBuildKey()
+{
+	std::string key_file = this->bd.getPath() + "/.build.key";
+	std::error_code ec;
+	filesystem::remove(key_file, ec);
+	for(const auto &output : this->outputs) {
+		filesystem::remove(key_file + "." + output.first, ec);
+	}
+	// Packages hashing their output already have a key (.output.info), an install file
+	// is not an archive that can be indexed
+	if(this->isHashingOutput() || !this->installFiles.empty()) {
+		return;
+	}
+	// Without a staging archive nothing depends on the package
+	if(!this->stagingArchiveNeeded()) {
+		return;
+	}
+
+	auto digest = [this](std::string *result, const ArchiveMemberFilter &include) {
+		if(this->isHashingInterface()) {
+			return archive_interface_digest(this->stagingArchive(), result, &this->logger,
+			                                include);
+		}
+		return archive_index_digest(this->stagingArchive(), result, &this->logger,
+		                            include);
+	};
+	auto write = [this](const std::string &path, const std::string &key) {
+		std::string tmp = path + ".tmp";
+		std::ofstream out(tmp);
+		out << key;
+		out.close();
+		std::error_code error;
+		if(out.good()) {
+			filesystem::rename(tmp, path, error);
+		}
+		if(!out.good() || error) {
+			this->log("Cannot write " + path + ", using the build info");
+			filesystem::remove(tmp, error);
+		}
+	};
+
+	std::string depend_keys;
+	for(auto &dp : this->depends) {
+		std::string file_path;
+		std::string hash;
+		dp.getPackage()->buildInfo(&file_path, &hash);
+		depend_keys += "Depend " + file_path + " " + hash + "\n";
+	}
+	std::string type = this->isHashingInterface() ? "Interface" : "Archive";
+
+	std::string staging_digest;
+	std::string install_digest;
+	if(!digest(&staging_digest, nullptr) ||
+	   (!this->isHashingInterface() &&
+	    !archive_index_digest(this->installArchive(), &install_digest, &this->logger))) {
+		this->log("Cannot compute the build key, using the build info");
+		return;
+	}
+	std::string key = depend_keys + type + " staging " + staging_digest + "\n";
+	if(!this->isHashingInterface()) {
+		key += "Archive install " + install_digest + "\n";
+	}
+	write(key_file, key);
+
+	for(const auto &output : this->outputs) {
+		std::string output_digest;
+		if(!digest(&output_digest, this->outputFilter({output.first}))) {
+			this->log("Cannot compute the key of output " + output.first +
+			          ", using the build info");
+			continue;
+		}
+		write(key_file + "." + output.first,
+		      depend_keys + type + " staging:" + output.first + " " + output_digest + "\n");
+	}
+}
+
 bool Package::shouldBuild()
 {
 	// we need to rebuild if the code is updated
@@ -643,6 +1360,10 @@ bool Package::shouldBuild()
 	if(!this->installFiles.empty()) {
 		return true;
 	}
+	// the key of a package hashing its interface does not change with its installed files
+	if(this->extractsHashedInterface()) {
+		return true;
+	}
 
 	// lets make sure the install file (still) exists
 	bool ret = false;
@@ -654,22 +1375,26 @@ bool Package::shouldBuild()
 		ret = true;
 	}
 
-	// Now lets check that the staging file (still) exists
+	// Now lets check that the staging file (still) exists, or that it was omitted and is
+	// (still) not needed
 	fname = this->pwd + "/output/" + this->getNS()->getName() + "/staging/" + this->name +
 	        ".tar";
 
-	if(!filesystem::exists(fname)) {
+	if(!filesystem::exists(fname) &&
+	   (this->stagingArchiveNeeded() || !filesystem::exists(fname + ".omitted"))) {
 		ret = true;
 	}
 
-	auto cmd =
-	    boost::format{"cmp -s %1%/.build.info.new %1%/.build.info"} % this->bd.getPath();
-	int res = std::system(cmd.str().c_str());
+	// The build description digest was compared against the existing
+	// .build.info when the build info was prepared
+	if(this->buildInfoChanged) {
+		ret = true;
+	}
 
 	// if there are changes,
-	if(res != 0 || ret) {
+	if(ret) {
 		// see if we can grab new staging/install files
-		if(!Package::build_cache.empty()) {
+		if(!Package::build_caches.empty() || !Package::local_cache.empty()) {
 			ret = this->fetchFrom();
 		} else {
 			// otherwise, make sure we get (re)built
@@ -680,6 +1405,22 @@ bool Package::shouldBuild()
 	return ret;
 }
 
+/**
+ * Does this package extract the installed files of a package hashing its interface ?
+ * The build key of such a package does not cover its install archive, so a change to
+ * only its implementation would not otherwise rebuild this package.
+ */
+bool Package::extractsHashedInterface()
+{
+	if(this->depsExtraction.empty()) {
+		return false;
+	}
+	std::unordered_set<Package *> packages;
+	this->getDependedPackages(&packages, !this->depsExtractionDirectOnly, false);
+	return std::any_of(packages.begin(), packages.end(),
+	                   [](const Package *p) { return p->isHashingInterface(); });
+}
+
 /**
  * Get the set of packages that this package depends on.
  *
@@ -731,6 +1472,59 @@ void Package::getStagingPackages(std::unordered_set<Package *> *packages)
 	}
 }
 
+/**
+ * Get filters for the staging packages of which only some files are extracted: those
+ * this package depends on only some named outputs of (and that are not otherwise
+ * extracted in full, as a dependency of another staging package), and all of them when
+ * the package has a stage filter.
+ *
+ * @param packages - The staging packages.
+ *
+ * @returns The filters, by package.
+ */
+std::unordered_map<Package *, ArchiveMemberFilter>
+Package::stagingFilters(const std::unordered_set<Package *> &packages)
+{
+	std::unordered_set<Package *> whole;
+	for(auto &dp : this->depends) {
+		if(!dp.getPackage()->getInterceptStaging()) {
+			dp.getPackage()->getStagingPackages(&whole);
+		}
+	}
+	std::unordered_map<Package *, std::vector<std::string>> depend_outputs;
+	for(auto &dp : this->depends) {
+		if(dp.getOutputs().empty()) {
+			whole.insert(dp.getPackage());
+		} else {
+			std::vector<std::string> &names = depend_outputs[dp.getPackage()];
+			names.insert(names.end(), dp.getOutputs().begin(), dp.getOutputs().end());
+		}
+	}
+
+	std::unordered_map<Package *, ArchiveMemberFilter> filters;
+	for(const auto &output : depend_outputs) {
+		if(whole.find(output.first) == whole.end()) {
+			filters[output.first] = output.first->outputFilter(output.second);
+		}
+	}
+
+	if(!this->stage_filter.empty()) {
+		ArchiveMemberFilter stage = pattern_filter(this->stage_filter);
+		for(auto p : packages) {
+			auto it = filters.find(p);
+			if(it == filters.end()) {
+				filters[p] = stage;
+			} else {
+				ArchiveMemberFilter output = it->second;
+				it->second = [stage, output](const std::string &path) {
+					return stage(path) && output(path);
+				};
+			}
+		}
+	}
+	return filters;
+}
+
 static void cleanDir(const std::string &dir)
 {
 	filesystem::remove_all(dir);
@@ -744,40 +1538,131 @@ bool Package::prepareBuildDirs()
 	// Clean out the (new) staging/install directories
 	cleanDir(this->bd.getNewInstall());
 	cleanDir(this->bd.getNewStaging());
-	cleanDir(this->bd.getStaging());
 
 	std::unordered_set<Package *> packages;
 	this->getStagingPackages(&packages);
+	std::unordered_map<Package *, ArchiveMemberFilter> filters =
+	    this->stagingFilters(packages);
 
-	std::list<std::thread> threads;
-	std::atomic<bool> result{true};
-	for(auto p : packages) {
-		if(Package::extract_in_parallel) {
-			std::thread th([p, this, &result] {
-				bool ret = p->extract_staging(this->bd.getStaging());
-				if(!ret) {
-					result = false;
-				}
-			});
-			threads.push_back(std::move(th));
-		} else {
-			result = p->extract_staging(this->bd.getStaging());
-			if(!result) {
-				break;
-			}
+	if(!this->checkOverlaps(packages, true, &filters)) {
+		return false;
+	}
+
+	// When the staging directory is kept between builds, only the content of the
+	// dependencies that have changed since it was prepared is replaced. The manifest
+	// records whole archives, so not when only some outputs of a package are extracted.
+	std::string manifest_file = this->bd.getPath() + "/.staging.manifest";
+	bool incremental =
+	    (Package::keep_staging || this->suppress_remove_staging) && filters.empty();
+	StagingManifest manifest;
+	std::vector<Package *> extract;
+	if(incremental && manifest.load(manifest_file) &&
+	   filesystem::is_directory(this->bd.getStaging())) {
+		std::map<std::string, Package *> archives;
+		for(auto p : packages) {
+			archives[p->stagingArchive()] = p;
+		}
+		std::vector<std::string> names;
+		for(const auto &archive : archives) {
+			names.push_back(archive.first);
 		}
+		for(const auto &archive :
+		    manifest.update(this->bd.getStaging(), names, &this->logger)) {
+			extract.push_back(archives[archive]);
+		}
+	} else {
+		manifest = StagingManifest();
+		cleanDir(this->bd.getStaging());
+		extract.assign(packages.begin(), packages.end());
+	}
+	// Only valid once the staging directory has been fully prepared
+	std::error_code ec;
+	filesystem::remove(manifest_file, ec);
+
+	IoBatch batch;
+	dev_t device = IoExecutor::device(this->bd.getStaging());
+	std::vector<std::vector<std::string>> members(extract.size());
+	for(size_t i = 0; i < extract.size(); i++) {
+		Package *p = extract[i];
+		std::vector<std::string> *m = incremental ? &members[i] : nullptr;
+		auto filter = filters.find(p);
+		ArchiveMemberFilter include = (filter != filters.end()) ? filter->second : nullptr;
+		batch.add(device, [p, m, include, this] {
+			return p->extract_staging(this->bd.getStaging(), m, include);
+		});
 	}
-	for(auto &t : threads) {
-		t.join();
+	bool result = batch.wait();
+
+	if(result && incremental) {
+		bool recorded = true;
+		for(size_t i = 0; i < extract.size() && recorded; i++) {
+			recorded = manifest.record(extract[i]->stagingArchive(), this->bd.getStaging(),
+			                           members[i], &this->logger);
+		}
+		if(!recorded || !manifest.save(manifest_file)) {
+			this->log("Failed to save the staging manifest, the next build will prepare "
+			          "the staging directory from scratch");
+		}
 	}
 
 	if(result) {
-		this->log_verbose(boost::format{"Done (%1%)"} % packages.size());
+		this->log_verbose(boost::format{"Done (%1%, %2% unchanged)"} % packages.size() %
+		                  (packages.size() - extract.size()));
 	}
 
 	return result;
 }
 
+/**
+ * Check that no two of a set of packages provide the same file (other than
+ * directories), using the indexes of their staging or install archives. Such files
+ * can't all be extracted, so the conflicts are reported before extracting anything.
+ * Packages without an archive index are not checked.
+ *
+ * @param packages - The packages to check.
+ * @param staging - true to check the staging archives, false for the install archives.
+ * @param filters - If set, the files of each package (that has a filter) to check.
+ *
+ * @returns true if there are no conflicts, false otherwise.
+ */
+bool Package::checkOverlaps(
+    const std::unordered_set<Package *> &packages, bool staging,
+    const std::unordered_map<Package *, ArchiveMemberFilter> *filters)
+{
+	std::vector<Package *> sorted(packages.begin(), packages.end());
+	std::sort(sorted.begin(), sorted.end(),
+	          [](Package *a, Package *b) { return a->getName() < b->getName(); });
+
+	bool result = true;
+	std::unordered_map<std::string, Package *> providers;
+	for(auto p : sorted) {
+		if(!staging && !p->installFiles.empty()) {
+			continue;
+		}
+		std::string archive = staging ? p->stagingArchive() : p->installArchive();
+		std::vector<ArchiveIndexEntry> entries;
+		if(!archive_index_load(archive + ".idx", &entries)) {
+			continue;
+		}
+		ArchiveMemberFilter include;
+		if(filters != nullptr && filters->find(p) != filters->end()) {
+			include = filters->at(p);
+		}
+		for(const auto &entry : entries) {
+			if(entry.type == '5' || (include && !include(entry.path))) {
+				continue;
+			}
+			auto res = providers.emplace(entry.path, p);
+			if(!res.second) {
+				this->log(boost::format{"Conflict: %1% is provided by both %2% and %3%"} %
+				          entry.path % res.first->second->getName() % p->getName());
+				result = false;
+			}
+		}
+	}
+	return result;
+}
+
 bool Package::extractInstallDepends()
 {
 	if(this->depsExtraction.empty()) {
@@ -803,27 +1688,16 @@ bool Package::extractInstallDepends()
 	std::unordered_set<Package *> packages;
 	this->getDependedPackages(&packages, !this->depsExtractionDirectOnly, false);
 
-	std::list<std::thread> threads;
-	std::atomic<bool> result{true};
-	for(auto p : packages) {
-		if(Package::extract_in_parallel) {
-			std::thread th([p, this, &result] {
-				bool ret = p->extract_install(this->depsExtraction);
-				if(!ret) {
-					result = false;
-				}
-			});
-			threads.push_back(std::move(th));
-		} else {
-			result = p->extract_install(this->depsExtraction);
-			if(!result) {
-				break;
-			}
-		}
+	if(!this->checkOverlaps(packages, false)) {
+		return false;
 	}
-	for(auto &t : threads) {
-		t.join();
+
+	IoBatch batch;
+	dev_t device = IoExecutor::device(this->depsExtraction);
+	for(auto p : packages) {
+		batch.add(device, [p, this] { return p->extract_install(this->depsExtraction); });
 	}
+	bool result = batch.wait();
 
 	if(result) {
 		this->log("Dependency install files extracted");
@@ -833,20 +1707,29 @@ bool Package::extractInstallDepends()
 
 bool Package::packageNewStaging()
 {
-	PackageCmd pc(this->bd.getNewStaging(), TAR_CMD);
-	pc.addArg("--numeric-owner");
-	pc.addArg("-b");
-	pc.addArg("256");
-	pc.addArg("-cf");
-	std::string arg = this->pwd + "/output/" + this->getNS()->getName() + "/staging/" +
-	                  this->name + ".tar";
-	pc.addArg(arg);
-	pc.addArg(".");
+	std::string arg = this->stagingArchive();
+	std::string omitted = arg + ".omitted";
+	std::error_code ec;
 
-	if(!pc.Run(&this->logger)) {
+	this->resetStagingArchiveHash();
+	if(!this->stagingArchiveNeeded()) {
+		// Nothing would extract it, just record that it was not created
+		filesystem::remove(arg, ec);
+		filesystem::remove(arg + ".idx", ec);
+		std::ofstream marker(omitted);
+		if(!marker.is_open()) {
+			this->log(omitted + ": Cannot create");
+			return false;
+		}
+		this->log_verbose("Staging archive not needed");
+		return true;
+	}
+	if(!tar_create(this->bd.getNewStaging(), arg, &this->logger, Package::archive_codec,
+	               Package::archive_reproducible)) {
 		this->log("Failed to compress staging directory");
 		return false;
 	}
+	filesystem::remove(omitted, ec);
 	return true;
 }
 
@@ -856,30 +1739,20 @@ bool Package::packageNewInstall()
 		for(const auto &install_file : this->installFiles) {
 			this->log("Copying " + install_file + " to output/" + this->getNS()->getName() +
 			          "/install/");
-			PackageCmd pc(this->bd.getNewInstall(), "cp");
-			pc.addArg(install_file);
 			std::string arg = this->pwd + "/output/" + this->getNS()->getName() +
 			                  "/install/" + install_file;
-			pc.addArg(arg);
-
-			if(!pc.Run(&this->logger)) {
+			if(!copy_path(this->bd.getNewInstall() + "/" + install_file, arg,
+			              &this->logger, plain_copy())) {
 				this->log(boost::format{"Failed to copy install file (%1%)"} %
 				          install_file);
 				return false;
 			}
 		}
 	} else {
-		PackageCmd pc(this->bd.getNewInstall(), TAR_CMD);
-		pc.addArg("--numeric-owner");
-		pc.addArg("-b");
-		pc.addArg("256");
-		pc.addArg("-cf");
-		std::string arg = this->pwd + "/output/" + this->getNS()->getName() + "/install/" +
-		                  this->name + ".tar";
-		pc.addArg(arg);
-		pc.addArg(".");
-
-		if(!pc.Run(&this->logger)) {
+		std::string arg = this->installArchive();
+
+		if(!tar_create(this->bd.getNewInstall(), arg, &this->logger,
+		               Package::archive_codec, Package::archive_reproducible)) {
 			this->log("Failed to compress install directory");
 			return false;
 		}
@@ -978,7 +1851,7 @@ bool Package::build(bool locally, bool fetchOnly)
 	steady_clock::time_point start = steady_clock::now();
 
 	if(!fetchOnly) {
-		if(this->Extract.extractionRequired(this, &this->bd)) {
+		if(this->Extract.extractionRequired(this)) {
 			if(!this->Extract.extract(this)) {
 				return false;
 			}
@@ -1005,17 +1878,20 @@ bool Package::build(bool locally, bool fetchOnly)
 		}
 		this->log_verbose("Done Commands");
 
-		if(!this->packageNewStaging()) {
-			return false;
-		}
-
-		if(!this->packageNewInstall()) {
+		// Create the staging and install archives at the same time
+		IoBatch batch;
+		dev_t device = IoExecutor::device(this->pwd + "/output");
+		batch.add(device, [this] { return this->packageNewStaging(); });
+		batch.add(device, [this] { return this->packageNewInstall(); });
+		if(!batch.wait()) {
 			return false;
 		}
 
 		this->cleanStaging();
 
 		this->updateBuildInfo();
+		this->updateBuildKey();
+		this->storeCaches();
 	}
 
 	steady_clock::time_point end = steady_clock::now();
@@ -0,0 +1,627 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "patch.hpp"
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+using boost::algorithm::starts_with;
+
+//! The contents of a file being patched
+struct PatchTarget {
+	bool exists{false};
+	mode_t mode{0}; //!< 0 to create the file with the default mode
+	std::vector<std::string> lines;
+	bool newline{true}; //!< Whether the last line ends with a newline
+	bool changed{false};
+};
+
+static bool read_file(const std::string &path, std::string *contents)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		return false;
+	}
+	char buf[65536];
+	ssize_t len = 0;
+	while((len = read(fd, buf, sizeof(buf))) > 0) {
+		contents->append(buf, static_cast<size_t>(len));
+	}
+	int err = errno;
+	close(fd);
+	errno = err;
+	return len == 0;
+}
+
+static bool write_all(int fd, const std::string &contents)
+{
+	size_t done = 0;
+	while(done < contents.size()) {
+		ssize_t len = write(fd, contents.data() + done, contents.size() - done);
+		if(len < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		done += static_cast<size_t>(len);
+	}
+	return true;
+}
+
+static void split_lines(const std::string &contents, std::vector<std::string> *lines,
+                        bool *newline)
+{
+	size_t start = 0;
+	*newline = true;
+	while(start < contents.size()) {
+		size_t end = contents.find('\n', start);
+		if(end == std::string::npos) {
+			lines->push_back(contents.substr(start));
+			*newline = false;
+			break;
+		}
+		lines->push_back(contents.substr(start, end - start));
+		start = end + 1;
+	}
+}
+
+/**
+ * Get the file name from a '--- ' or '+++ ' line, with the leading components removed
+ * like 'patch -p'.
+ *
+ * @param line - The line to get the name from.
+ * @param level - How many leading components to remove.
+ * @param name - Set to the name, or cleared for /dev/null.
+ *
+ * @returns false if the name can not be used.
+ */
+static bool parse_name(const std::string &line, int level, std::string *name)
+{
+	std::string path = line.substr(4);
+	auto tab = path.find('\t');
+	if(tab != std::string::npos) {
+		path.erase(tab);
+	} else {
+		boost::algorithm::trim_right(path);
+	}
+	if(path == "/dev/null") {
+		name->clear();
+		return true;
+	}
+	if(path.empty() || path[0] == '"') {
+		return false;
+	}
+	for(int i = 0; i < level; i++) {
+		auto slash = path.find('/');
+		if(slash == std::string::npos) {
+			return false;
+		}
+		path.erase(0, path.find_first_not_of('/', slash));
+	}
+	// Refuse anything that would patch outside the directory
+	if(path.empty() || path[0] == '/') {
+		return false;
+	}
+	std::vector<std::string> parts;
+	boost::algorithm::split(parts, path, [](char c) { return c == '/'; });
+	for(const auto &part : parts) {
+		if(part == "..") {
+			return false;
+		}
+	}
+	*name = path;
+	return true;
+}
+
+static bool parse_range(const char **pos, char sign, size_t *start, size_t *count)
+{
+	if(**pos != sign) {
+		return false;
+	}
+	const char *num = *pos + 1;
+	char *end = nullptr;
+	*start = strtoul(num, &end, 10);
+	if(end == num) {
+		return false;
+	}
+	*count = 1;
+	if(*end == ',') {
+		num = end + 1;
+		*count = strtoul(num, &end, 10);
+		if(end == num) {
+			return false;
+		}
+	}
+	*pos = end;
+	return true;
+}
+
+//! Parse a '@@ -start,count +start,count @@' hunk header
+static bool parse_hunk_header(const std::string &line, PatchHunk *hunk, size_t *old_count,
+                              size_t *new_count)
+{
+	const char *pos = line.c_str() + 3;
+	if(!parse_range(&pos, '-', &hunk->old_start, old_count) || *pos != ' ') {
+		return false;
+	}
+	pos++;
+	if(!parse_range(&pos, '+', &hunk->new_start, new_count)) {
+		return false;
+	}
+	return strncmp(pos, " @@", 3) == 0;
+}
+
+/**
+ * Parse a patch file. Anything that is not part of a unified diff (such as the message
+ * of a git commit) is ignored, like patch does.
+ *
+ * @param patch_file - The patch to parse.
+ * @param level - How many leading components to remove from file names (-p).
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the patch was parsed, false if it can not be applied by apply().
+ */
+bool Patch::parse(const std::string &patch_file, int level, Logger *logger)
+{
+	this->name = patch_file;
+	this->files.clear();
+
+	std::string contents;
+	if(!read_file(patch_file, &contents)) {
+		logger->log(patch_file + ": Cannot read: " + std::string(strerror(errno)));
+		return false;
+	}
+	std::vector<std::string> lines;
+	bool newline = true;
+	split_lines(contents, &lines, &newline);
+
+	auto error = [&](size_t line, const std::string &msg) {
+		logger->log(boost::format{"%1%:%2%: %3%"} % patch_file % (line + 1) % msg);
+		return false;
+	};
+
+	// A git header that creates or removes a file does not need any hunks
+	bool git_header = false;
+	bool git_empty = false;
+	mode_t mode = 0;
+	size_t i = 0;
+	while(i < lines.size()) {
+		const std::string &line = lines[i];
+		if(starts_with(line, "diff --git ")) {
+			if(git_empty) {
+				return error(i, "Files without any contents are not supported");
+			}
+			git_header = true;
+			mode = 0;
+			i++;
+			continue;
+		}
+		if(git_header) {
+			if(starts_with(line, "new file mode ")) {
+				mode = static_cast<mode_t>(strtoul(line.c_str() + 14, nullptr, 8) & 07777);
+				git_empty = true;
+			} else if(starts_with(line, "deleted file mode ")) {
+				git_empty = true;
+			} else if(starts_with(line, "old mode ") || starts_with(line, "rename from ") ||
+			          starts_with(line, "copy from ") ||
+			          starts_with(line, "Binary files ") ||
+			          starts_with(line, "GIT binary patch")) {
+				return error(i, "Unsupported git diff: " + line);
+			}
+		}
+		if(starts_with(line, "*** ") && i + 1 < lines.size() &&
+		   starts_with(lines[i + 1], "--- ")) {
+			return error(i, "Context diffs are not supported");
+		}
+		if(!starts_with(line, "--- ") || i + 2 >= lines.size() ||
+		   !starts_with(lines[i + 1], "+++ ") || !starts_with(lines[i + 2], "@@ ")) {
+			i++;
+			continue;
+		}
+
+		PatchFile file;
+		file.line = i + 1;
+		file.mode = mode;
+		git_header = false;
+		git_empty = false;
+		mode = 0;
+		if(!parse_name(line, level, &file.old_name) ||
+		   !parse_name(lines[i + 1], level, &file.new_name) ||
+		   (file.old_name.empty() && file.new_name.empty())) {
+			return error(i, "Cannot use the file name with -p" + std::to_string(level));
+		}
+		i += 2;
+		while(i < lines.size() && starts_with(lines[i], "@@ ")) {
+			PatchHunk hunk;
+			size_t old_count = 0;
+			size_t new_count = 0;
+			size_t header = i++;
+			if(!parse_hunk_header(lines[header], &hunk, &old_count, &new_count)) {
+				return error(header, "Malformed hunk header");
+			}
+			char last = ' ';
+			while(old_count > 0 || new_count > 0 ||
+			      (i < lines.size() && starts_with(lines[i], "\\"))) {
+				if(i >= lines.size()) {
+					return error(header, "Truncated hunk");
+				}
+				// Some editors remove the space from empty context lines
+				const std::string &hunk_line = lines[i];
+				char type = hunk_line.empty() ? ' ' : hunk_line[0];
+				std::string text = hunk_line.empty() ? hunk_line : hunk_line.substr(1);
+				if(type == '\\') {
+					hunk.old_newline = hunk.old_newline && last == '+';
+					hunk.new_newline = hunk.new_newline && last == '-';
+					i++;
+					continue;
+				}
+				bool in_old = type == ' ' || type == '-';
+				bool in_new = type == ' ' || type == '+';
+				if((!in_old && !in_new) || (in_old && old_count == 0) ||
+				   (in_new && new_count == 0)) {
+					return error(i, "Malformed hunk");
+				}
+				if(in_old) {
+					hunk.old_lines.push_back(text);
+					old_count--;
+				}
+				if(in_new) {
+					hunk.new_lines.push_back(text);
+					new_count--;
+				}
+				last = type;
+				i++;
+			}
+			file.hunks.push_back(std::move(hunk));
+		}
+		this->files.push_back(std::move(file));
+	}
+	if(git_empty) {
+		return error(lines.size() - 1, "Files without any contents are not supported");
+	}
+	if(this->files.empty()) {
+		logger->log(patch_file + ": Only garbage was found in the patch");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Get every file the patch may change, relative to the directory it is applied in.
+ */
+std::vector<std::string> Patch::paths() const
+{
+	std::vector<std::string> result;
+	for(const auto &file : this->files) {
+		for(const auto &path : {file.old_name, file.new_name}) {
+			if(!path.empty() &&
+			   std::find(result.begin(), result.end(), path) == result.end()) {
+				result.push_back(path);
+			}
+		}
+	}
+	return result;
+}
+
+static bool hunk_matches(const PatchTarget &target, const PatchHunk &hunk, size_t pos)
+{
+	const auto &lines = target.lines;
+	if(pos + hunk.old_lines.size() == lines.size()) {
+		if(!hunk.old_lines.empty() && hunk.old_newline != target.newline) {
+			return false;
+		}
+	} else if(!hunk.old_newline) {
+		return false;
+	}
+	return std::equal(hunk.old_lines.begin(), hunk.old_lines.end(),
+	                  lines.begin() + static_cast<ptrdiff_t>(pos));
+}
+
+/**
+ * Find where a hunk applies, without any fuzz. Like patch the hunk may have moved from
+ * where the patch expects it, the closest match is used.
+ *
+ * @param target - The file being patched.
+ * @param hunk - The hunk to find.
+ * @param first - The first line the hunk may start at.
+ * @param want - The line the hunk is expected to start at.
+ * @param pos - Set to the line the hunk starts at.
+ *
+ * @returns false if the hunk does not match anywhere.
+ */
+static bool find_hunk(const PatchTarget &target, const PatchHunk &hunk, size_t first,
+                      size_t want, size_t *pos)
+{
+	size_t size = target.lines.size();
+	if(hunk.old_lines.size() > size) {
+		return false;
+	}
+	size_t last = size - hunk.old_lines.size();
+	if(first > last) {
+		return false;
+	}
+	want = std::min(std::max(want, first), last);
+	if(hunk.old_lines.empty()) {
+		*pos = want;
+		return true;
+	}
+	for(size_t distance = 0; want + distance <= last || want >= first + distance;
+	    distance++) {
+		if(want + distance <= last && hunk_matches(target, hunk, want + distance)) {
+			*pos = want + distance;
+			return true;
+		}
+		if(distance > 0 && want >= first + distance &&
+		   hunk_matches(target, hunk, want - distance)) {
+			*pos = want - distance;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Apply the hunks for one file to its contents.
+ *
+ * @returns false (after reporting which hunk) if a hunk does not apply.
+ */
+static bool apply_hunks(PatchTarget *target, const PatchFile &file, const std::string &path,
+                        const std::string &patch_name, Logger *logger)
+{
+	std::vector<std::string> result;
+	bool newline = target->newline;
+	size_t cursor = 0;
+	ptrdiff_t offset = 0;
+	size_t number = 0;
+	for(const auto &hunk : file.hunks) {
+		number++;
+		// An empty old range starts after the given line, otherwise on it
+		size_t expected = hunk.old_start;
+		if(!hunk.old_lines.empty() && expected > 0) {
+			expected--;
+		}
+		ptrdiff_t want = std::max(static_cast<ptrdiff_t>(expected) + offset, ptrdiff_t{0});
+		size_t pos = 0;
+		if(!find_hunk(*target, hunk, cursor, static_cast<size_t>(want), &pos)) {
+			logger->log(boost::format{"%1%: Hunk #%2% for %3% does not apply at line %4%"} %
+			            patch_name % number % path % hunk.old_start);
+			return false;
+		}
+		offset = static_cast<ptrdiff_t>(pos) - static_cast<ptrdiff_t>(expected);
+		auto begin = target->lines.begin();
+		result.insert(result.end(), begin + static_cast<ptrdiff_t>(cursor),
+		              begin + static_cast<ptrdiff_t>(pos));
+		result.insert(result.end(), hunk.new_lines.begin(), hunk.new_lines.end());
+		cursor = pos + hunk.old_lines.size();
+		if(cursor == target->lines.size()) {
+			newline = hunk.new_lines.empty() ? true : hunk.new_newline;
+		}
+	}
+	result.insert(result.end(), target->lines.begin() + static_cast<ptrdiff_t>(cursor),
+	              target->lines.end());
+	target->lines = std::move(result);
+	target->newline = newline || target->lines.empty();
+	return true;
+}
+
+static bool load_target(const std::string &path, PatchTarget *target, Logger *logger)
+{
+	struct stat st = {};
+	if(lstat(path.c_str(), &st) != 0) {
+		if(errno == ENOENT) {
+			return true;
+		}
+		logger->log(path + ": Cannot stat: " + std::string(strerror(errno)));
+		return false;
+	}
+	if(!S_ISREG(st.st_mode)) {
+		logger->log(path + ": Not a regular file, refusing to patch it");
+		return false;
+	}
+	std::string contents;
+	if(!read_file(path, &contents)) {
+		logger->log(path + ": Cannot read: " + std::string(strerror(errno)));
+		return false;
+	}
+	target->exists = true;
+	target->mode = st.st_mode & 07777;
+	split_lines(contents, &target->lines, &target->newline);
+	return true;
+}
+
+static bool write_target(const std::string &path, const PatchTarget &target, Logger *logger)
+{
+	if(!target.exists) {
+		if(unlink(path.c_str()) != 0 && errno != ENOENT) {
+			logger->log(path + ": Cannot remove: " + std::string(strerror(errno)));
+			return false;
+		}
+		return true;
+	}
+
+	std::string contents;
+	for(const auto &line : target.lines) {
+		contents += line;
+		contents += '\n';
+	}
+	if(!target.newline && !contents.empty()) {
+		contents.pop_back();
+	}
+
+	// Write existing files to a temporary file first, so they are replaced atomically
+	struct stat st = {};
+	bool replace = lstat(path.c_str(), &st) == 0;
+	std::string out_path = path;
+	int fd = -1;
+	if(replace) {
+		std::string tmp = path + ".XXXXXX";
+		fd = mkostemp(tmp.data(), O_CLOEXEC);
+		out_path = tmp;
+	} else {
+		std::error_code ec;
+		filesystem::create_directories(filesystem::path(path).parent_path(), ec);
+		fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	}
+	if(fd < 0) {
+		logger->log(out_path + ": Cannot create: " + std::string(strerror(errno)));
+		return false;
+	}
+	bool ok = write_all(fd, contents) && (target.mode == 0 || fchmod(fd, target.mode) == 0);
+	int err = errno;
+	if(close(fd) != 0 && ok) {
+		ok = false;
+		err = errno;
+	}
+	if(ok && replace && rename(out_path.c_str(), path.c_str()) != 0) {
+		ok = false;
+		err = errno;
+	}
+	if(!ok) {
+		logger->log(path + ": Cannot write: " + std::string(strerror(err)));
+		if(replace) {
+			unlink(out_path.c_str());
+		}
+	}
+	return ok;
+}
+
+/**
+ * Apply the patch to a directory (the equivalent of 'patch -pN -N' run in dir, without
+ * any fuzz). Every hunk is checked first, nothing is changed unless the whole patch
+ * applies.
+ *
+ * @param dir - The directory to apply the patch in.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the patch was applied, false otherwise.
+ */
+bool Patch::apply(const std::string &dir, Logger *logger) const
+{
+	std::map<std::string, PatchTarget> targets;
+	std::vector<std::string> order;
+	auto get_target = [&](const std::string &path) -> PatchTarget * {
+		auto it = targets.find(path);
+		if(it != targets.end()) {
+			return &it->second;
+		}
+		PatchTarget target;
+		if(!load_target(dir + "/" + path, &target, logger)) {
+			return nullptr;
+		}
+		order.push_back(path);
+		return &targets.emplace(path, std::move(target)).first->second;
+	};
+
+	for(const auto &file : this->files) {
+		std::string path = file.new_name;
+		if(file.new_name.empty()) {
+			path = file.old_name;
+		} else if(!file.old_name.empty()) {
+			// Like patch, prefer the existing name with the fewest components, then the
+			// shortest base name, then the shortest name
+			auto rank = [](const std::string &file_name) {
+				auto components = std::count(file_name.begin(), file_name.end(), '/');
+				auto base = file_name.size() - file_name.rfind('/');
+				return std::make_tuple(components, base, file_name.size());
+			};
+			PatchTarget *old_target = get_target(file.old_name);
+			PatchTarget *new_target = get_target(file.new_name);
+			if(old_target == nullptr || new_target == nullptr) {
+				return false;
+			}
+			if(old_target->exists &&
+			   (!new_target->exists || rank(file.old_name) <= rank(file.new_name))) {
+				path = file.old_name;
+			} else if(!new_target->exists) {
+				logger->log(this->name + ": Cannot find file to patch: " + file.old_name);
+				return false;
+			}
+		}
+		PatchTarget *target = get_target(path);
+		if(target == nullptr) {
+			return false;
+		}
+		if(file.old_name.empty()) {
+			if(target->exists && !target->lines.empty()) {
+				logger->log(this->name + ": File to create already exists: " + path);
+				return false;
+			}
+			target->mode = file.mode;
+		}
+		if(!apply_hunks(target, file, path, this->name, logger)) {
+			return false;
+		}
+		target->changed = true;
+		if(file.new_name.empty()) {
+			if(!target->lines.empty()) {
+				logger->log(this->name + ": File to remove is not empty: " + path);
+				return false;
+			}
+			target->exists = false;
+		} else {
+			target->exists = true;
+		}
+	}
+
+	for(const auto &path : order) {
+		const PatchTarget &target = targets[path];
+		if(target.changed && !write_target(dir + "/" + path, target, logger)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Apply a patch file to a directory, see Patch::apply().
+ *
+ * @param patch_file - The patch to apply.
+ * @param dir - The directory to apply the patch in.
+ * @param level - How many leading components to remove from file names (-p).
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the patch was applied, false otherwise.
+ */
+bool buildsys::patch_apply(const std::string &patch_file, const std::string &dir, int level,
+                           Logger *logger)
+{
+	Patch patch;
+	return patch.parse(patch_file, level, logger) && patch.apply(dir, logger);
+}
@@ -0,0 +1,76 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef PATCH_HPP_
+#define PATCH_HPP_
+
+#include "logger.hpp"
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace buildsys
+{
+	//! A hunk of a unified diff
+	struct PatchHunk {
+		size_t old_start{0};
+		size_t new_start{0};
+		std::vector<std::string> old_lines; //!< Context and removed lines
+		std::vector<std::string> new_lines; //!< Context and added lines
+		bool old_newline{true};             //!< Whether the old lines end with a newline
+		bool new_newline{true};             //!< Whether the new lines end with a newline
+	};
+
+	//! The changes a unified diff makes to one file
+	struct PatchFile {
+		std::string old_name; //!< Empty when the file is created
+		std::string new_name; //!< Empty when the file is removed
+		mode_t mode{0};       //!< Mode of a created file (from a git header)
+		size_t line{0};       //!< Line of the patch the changes start on
+		std::vector<PatchHunk> hunks;
+	};
+
+	/**
+	 * A unified diff (as applied by 'patch -pN -N'), which is applied without fuzz. All
+	 * the hunks are checked before any file is changed, so a patch that does not apply
+	 * leaves the directory untouched.
+	 */
+	class Patch
+	{
+	private:
+		std::string name;
+		std::vector<PatchFile> files;
+
+	public:
+		bool parse(const std::string &patch_file, int level, Logger *logger);
+		std::vector<std::string> paths() const;
+		bool apply(const std::string &dir, Logger *logger) const;
+	};
+
+	bool patch_apply(const std::string &patch_file, const std::string &dir, int level,
+	                 Logger *logger);
+} // namespace buildsys
+
+#endif // PATCH_HPP_
@@ -0,0 +1,328 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "sourcecache.hpp"
+#include "filecopy.hpp"
+#include <algorithm>
+#include <atomic>
+#include <boost/format.hpp>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+//! Held (shared) while restoring from the cache, and (exclusively) while evicting
+static std::shared_mutex cache_lock;
+
+//! Read the names in a directory
+static std::vector<std::string> read_dir(const std::string &path)
+{
+	std::vector<std::string> children;
+	DIR *dir = opendir(path.c_str());
+	if(dir == nullptr) {
+		return children;
+	}
+	while(struct dirent *de = readdir(dir)) {
+		std::string child(de->d_name); // NOLINT
+		if(child != "." && child != "..") {
+			children.push_back(child);
+		}
+	}
+	closedir(dir);
+	return children;
+}
+
+static WorkFileState file_state(const struct stat &st)
+{
+	WorkFileState state;
+	state.dev = st.st_dev;
+	state.ino = st.st_ino;
+	state.mode = st.st_mode;
+	state.size = st.st_size;
+	state.mtime = int64_t{st.st_mtim.tv_sec} * 1000000000 + st.st_mtim.tv_nsec;
+	return state;
+}
+
+static bool same_state(const WorkFileState &a, const WorkFileState &b)
+{
+	return a.dev == b.dev && a.ino == b.ino && a.mode == b.mode && a.size == b.size &&
+	       a.mtime == b.mtime;
+}
+
+/**
+ * Whether a path in the work directory is skipped. These are the bookkeeping files
+ * buildsys keeps at the top of the work directory, not the sources.
+ */
+static bool skip_path(const std::string &rel, const std::string &child)
+{
+	static const std::set<std::string> names = {
+	    ".extraction.info", ".extraction.info.new", ".build.info", ".build.info.new",
+	    ".fetch.info",      ".output.info",         ".staging.manifest"};
+	return rel.empty() && (names.count(child) != 0 || child.rfind(".build.key", 0) == 0);
+}
+
+static void snapshot_dir(const std::string &dir, const std::string &rel,
+                         WorkSnapshot *snapshot)
+{
+	std::string path = rel.empty() ? dir : dir + "/" + rel;
+	for(const auto &child : read_dir(path)) {
+		if(skip_path(rel, child)) {
+			continue;
+		}
+		std::string child_rel = rel.empty() ? child : rel + "/" + child;
+		struct stat st = {};
+		if(lstat((path + "/" + child).c_str(), &st) != 0) {
+			continue;
+		}
+		(*snapshot)[child_rel] = file_state(st);
+		if(S_ISDIR(st.st_mode)) {
+			snapshot_dir(dir, child_rel, snapshot);
+		}
+	}
+}
+
+/**
+ * Record the state of a work directory before extracting into it, so that what the
+ * extraction changed can be stored in the cache.
+ *
+ * @param dir - The work directory.
+ *
+ * @returns The snapshot.
+ */
+WorkSnapshot buildsys::source_cache_snapshot(const std::string &dir)
+{
+	WorkSnapshot snapshot;
+	snapshot_dir(dir, "", &snapshot);
+	return snapshot;
+}
+
+/**
+ * Restore the sources extracted for an extraction description from the cache. The files
+ * the extraction created or changed are copied (reflinked where the filesystem supports
+ * it) into the work directory, replacing any existing ones, and the files it removed are
+ * removed.
+ *
+ * @param cache - The cache directory.
+ * @param key - The hash of the extraction description.
+ * @param dir - The work directory.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the sources were restored, false if they are not in the cache (or
+ *          could not be restored).
+ */
+bool buildsys::source_cache_restore(const std::string &cache, const std::string &key,
+                                    const std::string &dir, Logger *logger)
+{
+	std::shared_lock<std::shared_mutex> lk(cache_lock);
+	std::string entry = cache + "/" + key;
+	std::error_code ec;
+	if(!filesystem::is_directory(entry + "/tree", ec)) {
+		return false;
+	}
+	// Mark the entry as recently used
+	utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+
+	std::ifstream removed(entry + "/removed");
+	std::string line;
+	while(std::getline(removed, line)) {
+		filesystem::remove_all(dir + "/" + line, ec);
+	}
+
+	CopyOptions options;
+	options.update = false;
+	return copy_path(entry + "/tree/.", dir, logger, options);
+}
+
+//! The total size of the files in a tree
+static uint64_t tree_size(const std::string &path)
+{
+	uint64_t size = 0;
+	std::error_code ec;
+	for(auto it = filesystem::recursive_directory_iterator(path, ec);
+	    it != filesystem::recursive_directory_iterator(); it.increment(ec)) {
+		if(it->is_regular_file(ec) && !it->is_symlink(ec)) {
+			size += it->file_size(ec);
+		}
+	}
+	return size;
+}
+
+/**
+ * Copy what an extraction created or changed in the work directory into a tree.
+ *
+ * @returns true if everything was copied, false otherwise.
+ */
+static bool collect_changes(const std::string &dir, const std::string &rel,
+                            const WorkSnapshot &before, const std::string &tree,
+                            Logger *logger)
+{
+	std::string path = rel.empty() ? dir : dir + "/" + rel;
+	bool result = true;
+	for(const auto &child : read_dir(path)) {
+		if(skip_path(rel, child)) {
+			continue;
+		}
+		std::string child_rel = rel.empty() ? child : rel + "/" + child;
+		struct stat st = {};
+		if(lstat((path + "/" + child).c_str(), &st) != 0) {
+			continue;
+		}
+		auto it = before.find(child_rel);
+		if(S_ISDIR(st.st_mode) && it != before.end() && S_ISDIR(it->second.mode)) {
+			if(!collect_changes(dir, child_rel, before, tree, logger)) {
+				result = false;
+			}
+			continue;
+		}
+		if(it != before.end() && same_state(it->second, file_state(st))) {
+			continue;
+		}
+		std::error_code ec;
+		auto parent = filesystem::path(tree + "/" + child_rel).parent_path();
+		filesystem::create_directories(parent, ec);
+		CopyOptions options;
+		options.update = false;
+		if(!copy_path(path + "/" + child, tree + "/" + child_rel, logger, options)) {
+			result = false;
+		}
+	}
+	return result;
+}
+
+/**
+ * Remove the least recently used entries from the cache until it fits in the limit.
+ */
+static void evict(const std::string &cache, const std::string &keep, uint64_t limit)
+{
+	struct Entry {
+		std::string name;
+		int64_t used;
+		uint64_t size;
+	};
+	std::vector<Entry> entries;
+	uint64_t total = 0;
+	for(const auto &name : read_dir(cache)) {
+		struct stat st = {};
+		uint64_t size = 0;
+		std::ifstream size_file(cache + "/" + name + "/size");
+		if(name.find(".tmp.") != std::string::npos ||
+		   stat((cache + "/" + name).c_str(), &st) != 0 || !(size_file >> size)) {
+			continue;
+		}
+		int64_t used = int64_t{st.st_mtim.tv_sec} * 1000000000 + st.st_mtim.tv_nsec;
+		entries.push_back({name, used, size});
+		total += size;
+	}
+	std::sort(entries.begin(), entries.end(),
+	          [](const Entry &a, const Entry &b) { return a.used < b.used; });
+
+	std::unique_lock<std::shared_mutex> lk(cache_lock);
+	for(const auto &entry : entries) {
+		if(total <= limit) {
+			break;
+		}
+		if(entry.name == keep) {
+			continue;
+		}
+		std::error_code ec;
+		filesystem::remove_all(cache + "/" + entry.name, ec);
+		total -= entry.size;
+	}
+}
+
+/**
+ * Store what an extraction created, changed and removed in the work directory in the
+ * cache, then evict the least recently used entries beyond the size limit.
+ *
+ * @param cache - The cache directory.
+ * @param key - The hash of the extraction description.
+ * @param dir - The work directory.
+ * @param before - The snapshot of the work directory taken before the extraction.
+ * @param limit - The size limit of the cache in bytes.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the sources were stored, false otherwise.
+ */
+bool buildsys::source_cache_store(const std::string &cache, const std::string &key,
+                                  const std::string &dir, const WorkSnapshot &before,
+                                  uint64_t limit, Logger *logger)
+{
+	static std::atomic<unsigned int> counter{0};
+	std::string entry = cache + "/" + key;
+	std::string tmp =
+	    (boost::format{"%1%.tmp.%2%.%3%"} % entry % getpid() % counter++).str();
+
+	std::error_code ec;
+	filesystem::create_directories(tmp + "/tree", ec);
+	if(ec) {
+		logger->log(tmp + ": Cannot create: " + ec.message());
+		return false;
+	}
+	bool result = collect_changes(dir, "", before, tmp + "/tree", logger);
+
+	std::ofstream removed(tmp + "/removed");
+	for(const auto &file : before) {
+		struct stat st = {};
+		if(lstat((dir + "/" + file.first).c_str(), &st) != 0 && errno == ENOENT) {
+			if(file.first.find('\n') != std::string::npos) {
+				result = false;
+			}
+			removed << file.first << "\n";
+		}
+	}
+	removed.close();
+	uint64_t size = tree_size(tmp + "/tree");
+	std::ofstream size_file(tmp + "/size");
+	size_file << size << "\n";
+	size_file.close();
+
+	if(!result || !removed || !size_file) {
+		filesystem::remove_all(tmp, ec);
+		return false;
+	}
+	if(rename(tmp.c_str(), entry.c_str()) != 0) {
+		int err = errno;
+		filesystem::remove_all(tmp, ec);
+		// Someone else got there first
+		if(filesystem::is_directory(entry, ec)) {
+			return true;
+		}
+		logger->log(entry + ": Cannot rename: " + std::string(strerror(err)));
+		return false;
+	}
+	evict(cache, key, limit);
+	return true;
+}
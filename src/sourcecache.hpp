@@ -0,0 +1,57 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef SOURCECACHE_HPP_
+#define SOURCECACHE_HPP_
+
+#include "logger.hpp"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <sys/types.h>
+
+namespace buildsys
+{
+	//! The state of a file in a work directory, used to find what an extraction changed
+	struct WorkFileState {
+		dev_t dev{0};
+		ino_t ino{0};
+		mode_t mode{0};
+		off_t size{0};
+		int64_t mtime{0}; //!< In nanoseconds
+	};
+
+	//! The state of every file in a work directory, by relative path
+	using WorkSnapshot = std::map<std::string, WorkFileState>;
+
+	WorkSnapshot source_cache_snapshot(const std::string &dir);
+	bool source_cache_restore(const std::string &cache, const std::string &key,
+	                          const std::string &dir, Logger *logger);
+	bool source_cache_store(const std::string &cache, const std::string &key,
+	                        const std::string &dir, const WorkSnapshot &before,
+	                        uint64_t limit, Logger *logger);
+} // namespace buildsys
+
+#endif // SOURCECACHE_HPP_
@@ -0,0 +1,402 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "stagingmanifest.hpp"
+#include "hash.hpp"
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <cstring>
+#include <dirent.h>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+/**
+ * Get the details of a file that are checked to find out if it has changed.
+ *
+ * @returns true if the file exists, false otherwise.
+ */
+static bool stat_entry(const std::string &path, char *type, uint64_t *size, int64_t *mtime)
+{
+	struct stat st = {};
+	if(lstat(path.c_str(), &st) != 0) {
+		return false;
+	}
+	*size = 0;
+	*mtime = 0;
+	if(S_ISDIR(st.st_mode)) {
+		// The contents of directories are checked instead
+		*type = 'd';
+		return true;
+	}
+	if(S_ISREG(st.st_mode)) {
+		*type = 'f';
+	} else if(S_ISLNK(st.st_mode)) {
+		*type = 'l';
+	} else {
+		*type = 'o';
+	}
+	*size = static_cast<uint64_t>(st.st_size);
+	*mtime = int64_t{st.st_mtim.tv_sec} * 1000000000 + st.st_mtim.tv_nsec;
+	return true;
+}
+
+//! Find a source by its archive, returns the number of sources if not found
+size_t StagingManifest::findSource(const std::string &archive) const
+{
+	auto it = std::find_if(this->sources.begin(), this->sources.end(),
+	                       [&archive](const Source &s) { return s.archive == archive; });
+	return static_cast<size_t>(it - this->sources.begin());
+}
+
+/**
+ * Fill in the details of a source from its archive. The archive is only hashed if it
+ * is not unchanged (same size and mtime) from a previous description of it.
+ *
+ * @returns true if the archive could be described, false otherwise.
+ */
+bool StagingManifest::describeSource(Source *source, const Source *previous,
+                                     Logger *logger) const
+{
+	char type = '\0';
+	if(!stat_entry(source->archive, &type, &source->size, &source->mtime)) {
+		logger->log(source->archive + ": Cannot stat: " + std::string(strerror(errno)));
+		return false;
+	}
+	if(previous != nullptr && !previous->hash.empty() && previous->size == source->size &&
+	   previous->mtime == source->mtime) {
+		source->hash = previous->hash;
+		return true;
+	}
+	source->hash = hash_file(source->archive);
+	return !source->hash.empty();
+}
+
+/**
+ * Load a manifest file.
+ *
+ * @param file - The file to load.
+ *
+ * @returns true if the manifest was loaded, false if it is missing or invalid (in which
+ *          case the manifest is left empty).
+ */
+bool StagingManifest::load(const std::string &file)
+{
+	this->sources.clear();
+	this->entries.clear();
+
+	std::ifstream input(file);
+	if(!input.is_open()) {
+		return false;
+	}
+
+	try {
+		std::string line;
+		while(std::getline(input, line)) {
+			std::vector<std::string> fields;
+			boost::split(fields, line, boost::is_any_of("\t"));
+			if(fields.size() == 5 && fields[0] == "S") {
+				Source source;
+				source.hash = fields[1];
+				source.size = std::stoull(fields[2]);
+				source.mtime = std::stoll(fields[3]);
+				source.archive = fields[4];
+				this->sources.push_back(source);
+			} else if(fields.size() == 6 && fields[0] == "E" && fields[2].size() == 1) {
+				size_t index = std::stoul(fields[1]);
+				if(index >= this->sources.size()) {
+					throw std::invalid_argument("source");
+				}
+				Entry &entry = this->entries[fields[5]];
+				entry.sources.push_back(index);
+				entry.type = fields[2][0];
+				entry.size = std::stoull(fields[3]);
+				entry.mtime = std::stoll(fields[4]);
+			} else {
+				throw std::invalid_argument("line");
+			}
+		}
+	} catch(std::logic_error &e) {
+		this->sources.clear();
+		this->entries.clear();
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Save the manifest to a file.
+ *
+ * @param file - The file to save to.
+ *
+ * @returns true if the manifest was saved, false otherwise.
+ */
+bool StagingManifest::save(const std::string &file) const
+{
+	std::string tmp = file + ".new";
+	{
+		std::ofstream output(tmp);
+		for(const auto &source : this->sources) {
+			output << "S\t" << source.hash << "\t" << source.size << "\t" << source.mtime
+			       << "\t" << source.archive << "\n";
+		}
+		for(const auto &entry : this->entries) {
+			// Such names can't be represented, so don't save a manifest at all
+			if(entry.first.find_first_of("\t\n") != std::string::npos) {
+				output.close();
+				unlink(tmp.c_str());
+				return false;
+			}
+			for(auto index : entry.second.sources) {
+				output << "E\t" << index << "\t" << entry.second.type << "\t"
+				       << entry.second.size << "\t" << entry.second.mtime << "\t"
+				       << entry.first << "\n";
+			}
+		}
+		if(!output.good()) {
+			return false;
+		}
+	}
+	return rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+/**
+ * Scan a directory for files that are not (unmodified) from one of the kept sources,
+ * removing them.
+ *
+ * @param dir - The staging directory.
+ * @param prefix - The path (relative to dir) of the directory to scan.
+ * @param is_kept - Check whether an entry is from a kept source.
+ * @param modified - Called with each entry that has been modified since it was recorded.
+ * @param seen - Filled with the entries found.
+ * @param dirs - Filled with the directories found.
+ */
+template <typename K, typename M>
+static void scan_dir(const std::string &dir, const std::string &prefix, const K &is_kept,
+                     const M &modified, std::set<std::string> *seen,
+                     std::vector<std::string> *dirs)
+{
+	std::string path = prefix.empty() ? dir : dir + "/" + prefix;
+	std::vector<std::string> children;
+	DIR *d = opendir(path.c_str());
+	if(d == nullptr) {
+		return;
+	}
+	while(struct dirent *de = readdir(d)) {
+		std::string child(de->d_name); // NOLINT
+		if(child != "." && child != "..") {
+			children.push_back(child);
+		}
+	}
+	closedir(d);
+
+	for(const auto &child : children) {
+		std::string rel = prefix.empty() ? child : prefix + "/" + child;
+		std::string full = dir + "/" + rel;
+		char type = '\0';
+		uint64_t size = 0;
+		int64_t mtime = 0;
+		if(!stat_entry(full, &type, &size, &mtime)) {
+			continue;
+		}
+		const auto *entry = is_kept(rel);
+		if(type == 'd' && (entry == nullptr || entry->type == 'd')) {
+			scan_dir(dir, rel, is_kept, modified, seen, dirs);
+			dirs->push_back(rel);
+		} else if(entry == nullptr) {
+			std::error_code ec;
+			filesystem::remove_all(full, ec);
+		} else if(entry->type != type || entry->size != size || entry->mtime != mtime) {
+			std::error_code ec;
+			filesystem::remove_all(full, ec);
+			modified(*entry);
+			continue;
+		}
+		if(entry != nullptr) {
+			seen->insert(rel);
+		}
+	}
+}
+
+/**
+ * Bring the contents of a staging directory up to date with a new set of dependency
+ * staging archives.
+ *
+ * Anything in the directory that is not from an unchanged archive (including anything
+ * added by the previous build) is removed. An archive some of whose files have been
+ * modified or removed since they were recorded has all of its files removed, so it can
+ * be extracted again in full. The manifest is left describing the files that remain.
+ *
+ * @param dir - The staging directory.
+ * @param archives - The staging archives that the directory should now contain.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns The archives that need to be extracted (and then recorded).
+ */
+std::vector<std::string> StagingManifest::update(const std::string &dir,
+                                                 const std::vector<std::string> &archives,
+                                                 Logger *logger)
+{
+	std::vector<Source> current;
+	// For each previous source, its index in current if it is unchanged
+	std::vector<size_t> kept(this->sources.size(), SIZE_MAX);
+	for(const auto &archive : archives) {
+		Source source;
+		source.archive = archive;
+		size_t index = this->findSource(archive);
+		const Source *previous =
+		    (index < this->sources.size()) ? &this->sources[index] : nullptr;
+		if(!this->describeSource(&source, previous, logger)) {
+			// Extracting it will report the error
+			source.hash.clear();
+		} else if(previous != nullptr && source.hash == previous->hash) {
+			kept[index] = current.size();
+		}
+		current.push_back(source);
+	}
+
+	auto is_kept = [this, &kept](const std::string &path) -> const Entry * {
+		auto it = this->entries.find(path);
+		if(it == this->entries.end()) {
+			return nullptr;
+		}
+		for(auto index : it->second.sources) {
+			if(kept[index] != SIZE_MAX) {
+				return &it->second;
+			}
+		}
+		return nullptr;
+	};
+	std::vector<bool> dirty(this->sources.size(), false);
+	auto modified = [&dirty](const Entry &entry) {
+		for(auto index : entry.sources) {
+			dirty[index] = true;
+		}
+	};
+
+	std::set<std::string> seen;
+	std::vector<std::string> dirs;
+	scan_dir(dir, "", is_kept, modified, &seen, &dirs);
+	for(const auto &entry : this->entries) {
+		if(seen.find(entry.first) == seen.end() && is_kept(entry.first) != nullptr) {
+			modified(entry.second);
+		}
+	}
+	for(size_t index = 0; index < kept.size(); index++) {
+		if(dirty[index]) {
+			kept[index] = SIZE_MAX;
+		}
+	}
+
+	// Remove the remaining files of the modified sources, and any directories that are
+	// no longer used (deepest first)
+	for(const auto &entry : this->entries) {
+		if(entry.second.type != 'd' && is_kept(entry.first) == nullptr) {
+			unlink((dir + "/" + entry.first).c_str());
+		}
+	}
+	std::sort(dirs.rbegin(), dirs.rend());
+	for(const auto &d : dirs) {
+		if(is_kept(d) == nullptr) {
+			rmdir((dir + "/" + d).c_str());
+		}
+	}
+
+	// Keep the entries of the unchanged sources
+	std::map<std::string, Entry> remaining;
+	for(const auto &entry : this->entries) {
+		Entry updated = entry.second;
+		updated.sources.clear();
+		for(auto index : entry.second.sources) {
+			if(kept[index] != SIZE_MAX) {
+				updated.sources.push_back(kept[index]);
+			}
+		}
+		if(!updated.sources.empty()) {
+			remaining.emplace(entry.first, updated);
+		}
+	}
+	this->entries = std::move(remaining);
+
+	std::vector<std::string> extract;
+	std::vector<bool> is_current_kept(current.size(), false);
+	for(auto index : kept) {
+		if(index != SIZE_MAX) {
+			is_current_kept[index] = true;
+		}
+	}
+	for(size_t index = 0; index < current.size(); index++) {
+		if(!is_current_kept[index]) {
+			extract.push_back(current[index].archive);
+		}
+	}
+	this->sources = std::move(current);
+	return extract;
+}
+
+/**
+ * Record the files extracted from an archive into the staging directory.
+ *
+ * @param archive - The archive the files were extracted from.
+ * @param dir - The staging directory.
+ * @param members - The files extracted (relative to dir).
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the files were recorded, false otherwise.
+ */
+bool StagingManifest::record(const std::string &archive, const std::string &dir,
+                             const std::vector<std::string> &members, Logger *logger)
+{
+	size_t index = this->findSource(archive);
+	if(index == this->sources.size()) {
+		this->sources.emplace_back();
+		this->sources.back().archive = archive;
+	}
+	Source &source = this->sources[index];
+	if(source.hash.empty() && !this->describeSource(&source, nullptr, logger)) {
+		return false;
+	}
+
+	for(const auto &member : members) {
+		Entry details;
+		if(!stat_entry(dir + "/" + member, &details.type, &details.size, &details.mtime)) {
+			logger->log(member + ": Cannot stat: " + std::string(strerror(errno)));
+			return false;
+		}
+		Entry &entry = this->entries[member];
+		entry.type = details.type;
+		entry.size = details.size;
+		entry.mtime = details.mtime;
+		entry.sources.push_back(index);
+	}
+	return true;
+}
@@ -0,0 +1,75 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef STAGINGMANIFEST_HPP_
+#define STAGINGMANIFEST_HPP_
+
+#include "logger.hpp"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace buildsys
+{
+	/**
+	 * A record of which dependency staging archive populated which files of a staging
+	 * directory. It allows a staging directory that is kept between builds to be
+	 * brought up to date by replacing only the content of the archives that changed.
+	 */
+	class StagingManifest
+	{
+	private:
+		//! A dependency staging archive
+		struct Source {
+			std::string archive;
+			std::string hash;
+			uint64_t size{0};
+			int64_t mtime{0};
+		};
+		//! A file in the staging directory
+		struct Entry {
+			std::vector<size_t> sources; //!< Only directories have more than one
+			char type{'f'};
+			uint64_t size{0};
+			int64_t mtime{0};
+		};
+		std::vector<Source> sources;
+		std::map<std::string, Entry> entries;
+		size_t findSource(const std::string &archive) const;
+		bool describeSource(Source *source, const Source *previous, Logger *logger) const;
+
+	public:
+		bool load(const std::string &file);
+		bool save(const std::string &file) const;
+		std::vector<std::string> update(const std::string &dir,
+		                                const std::vector<std::string> &archives,
+		                                Logger *logger);
+		bool record(const std::string &archive, const std::string &dir,
+		            const std::vector<std::string> &members, Logger *logger);
+	};
+} // namespace buildsys
+
+#endif // STAGINGMANIFEST_HPP_
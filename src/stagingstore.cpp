@@ -0,0 +1,397 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "stagingstore.hpp"
+#include "filecopy.hpp"
+#include "tar.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <linux/fs.h>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+//! The keys of the trees used by this process, which are never evicted by it
+static std::set<std::string> keys_in_use;
+//! Held while adding to keys_in_use, and while evicting
+static std::mutex store_lock;
+
+//! Read the names in a directory
+static std::vector<std::string> read_dir(const std::string &path)
+{
+	std::vector<std::string> children;
+	DIR *dir = opendir(path.c_str());
+	if(dir == nullptr) {
+		return children;
+	}
+	while(struct dirent *de = readdir(dir)) {
+		std::string child(de->d_name); // NOLINT
+		if(child != "." && child != "..") {
+			children.push_back(child);
+		}
+	}
+	closedir(dir);
+	return children;
+}
+
+//! The total size of the files in a tree
+static uint64_t tree_size(const std::string &path)
+{
+	uint64_t size = 0;
+	std::error_code ec;
+	for(auto it = filesystem::recursive_directory_iterator(path, ec);
+	    it != filesystem::recursive_directory_iterator(); it.increment(ec)) {
+		if(it->is_regular_file(ec) && !it->is_symlink(ec)) {
+			size += it->file_size(ec);
+		}
+	}
+	return size;
+}
+
+/**
+ * Remove a tree from the store. The directories in it have the modes from the archive,
+ * so they are made writable first.
+ */
+static void remove_tree(const std::string &path)
+{
+	std::error_code ec;
+	for(auto it = filesystem::recursive_directory_iterator(path, ec);
+	    it != filesystem::recursive_directory_iterator(); it.increment(ec)) {
+		if(it->is_directory(ec) && !it->is_symlink(ec)) {
+			filesystem::permissions(it->path(), filesystem::perms::owner_all,
+			                        filesystem::perm_options::add, ec);
+		}
+	}
+	filesystem::remove_all(path, ec);
+}
+
+/**
+ * Remove the least recently used trees from the store until it fits in the limit. Trees
+ * used by this process are kept, as staging directories are still being assembled from
+ * them.
+ */
+static void evict(const std::string &store, uint64_t limit)
+{
+	struct Entry {
+		std::string name;
+		int64_t used;
+		uint64_t size;
+	};
+	std::vector<Entry> entries;
+	uint64_t total = 0;
+	for(const auto &name : read_dir(store)) {
+		struct stat st = {};
+		uint64_t size = 0;
+		std::ifstream size_file(store + "/" + name + "/size");
+		if(name.find(".tmp.") != std::string::npos ||
+		   stat((store + "/" + name).c_str(), &st) != 0 || !(size_file >> size)) {
+			continue;
+		}
+		int64_t used = int64_t{st.st_mtim.tv_sec} * 1000000000 + st.st_mtim.tv_nsec;
+		entries.push_back({name, used, size});
+		total += size;
+	}
+	std::sort(entries.begin(), entries.end(),
+	          [](const Entry &a, const Entry &b) { return a.used < b.used; });
+
+	std::unique_lock<std::mutex> lk(store_lock);
+	for(const auto &entry : entries) {
+		if(total <= limit) {
+			break;
+		}
+		if(keys_in_use.count(entry.name) != 0) {
+			continue;
+		}
+		remove_tree(store + "/" + entry.name);
+		total -= entry.size;
+	}
+}
+
+/**
+ * Ensure the extracted tree of a staging archive is in the store, then evict the least
+ * recently used trees beyond the size limit.
+ *
+ * The archive is extracted to a temporary directory which is then renamed into
+ * place, so a tree in the store is always complete, and concurrent populates of the
+ * same archive (by this or another buildsys process) are harmless.
+ *
+ * @param store - The store directory.
+ * @param archive - The staging archive.
+ * @param key - The hash of the archive, the name of the entry in the store.
+ * @param limit - The size limit of the store in bytes.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns The path of the tree, or an empty string if it is not in the store.
+ */
+std::string buildsys::staging_store_populate(const std::string &store,
+                                             const std::string &archive,
+                                             const std::string &key, uint64_t limit,
+                                             Logger *logger)
+{
+	static std::atomic<unsigned int> counter{0};
+	std::string entry = store + "/" + key;
+	{
+		std::unique_lock<std::mutex> lk(store_lock);
+		keys_in_use.insert(key);
+	}
+
+	std::error_code ec;
+	if(filesystem::is_directory(entry + "/tree", ec)) {
+		// Mark the entry as recently used
+		utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+		return entry + "/tree";
+	}
+
+	std::string tmp =
+	    (boost::format{"%1%.tmp.%2%.%3%"} % entry % getpid() % counter++).str();
+	filesystem::create_directories(tmp + "/tree", ec);
+	if(ec) {
+		logger->log(tmp + ": Cannot create: " + ec.message());
+		return std::string("");
+	}
+	if(!tar_extract(archive, tmp + "/tree", logger)) {
+		remove_tree(tmp);
+		return std::string("");
+	}
+	std::ofstream size_file(tmp + "/size");
+	size_file << tree_size(tmp + "/tree") << "\n";
+	size_file.close();
+	if(!size_file) {
+		logger->log(tmp + "/size: Cannot write");
+		remove_tree(tmp);
+		return std::string("");
+	}
+	if(rename(tmp.c_str(), entry.c_str()) != 0) {
+		int err = errno;
+		remove_tree(tmp);
+		// Someone else got there first
+		if(filesystem::is_directory(entry + "/tree", ec)) {
+			return entry + "/tree";
+		}
+		logger->log(entry + ": Cannot rename: " + std::string(strerror(err)));
+		return std::string("");
+	}
+	evict(store, limit);
+	return entry + "/tree";
+}
+
+/**
+ * Create a new file with the same contents, mode and mtime as an existing one, either
+ * as a reflink (sharing the extents) or as a copy.
+ *
+ * @returns 0 on success, -1 (with errno set) on failure.
+ */
+static int clone_file(const std::string &src, const std::string &dst, const struct stat &st,
+                      bool reflink)
+{
+	int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+	if(in < 0) {
+		return -1;
+	}
+	int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if(out < 0) {
+		int err = errno;
+		close(in);
+		errno = err;
+		return -1;
+	}
+	int res = reflink ? ioctl(out, FICLONE, in) : copy_contents(in, out);
+	if(res == 0) {
+		struct timespec times[2] = {{0, UTIME_NOW}, st.st_mtim};
+		fchmod(out, st.st_mode & 07777);
+		futimens(out, times);
+	}
+	int err = errno;
+	close(in);
+	if(close(out) != 0 && res == 0) {
+		err = errno;
+		res = -1;
+	}
+	if(res != 0) {
+		unlink(dst.c_str());
+	}
+	errno = err;
+	return res;
+}
+
+//! How files are being materialised, moving down the list as methods fail
+enum class LinkMethod { Reflink, Hardlink, Copy };
+
+/**
+ * Materialise a single (non-directory) file.
+ *
+ * @returns 0 on success, -1 (with errno set) on failure.
+ */
+static int materialise_file(const std::string &src, const std::string &dst,
+                            const struct stat &st, LinkMethod *method)
+{
+	if(*method == LinkMethod::Reflink && S_ISREG(st.st_mode)) {
+		if(clone_file(src, dst, st, true) == 0) {
+			return 0;
+		}
+		if(errno != EOPNOTSUPP && errno != EXDEV && errno != EINVAL && errno != ENOTTY) {
+			return -1;
+		}
+		// Not supported by this filesystem, don't keep trying
+		*method = LinkMethod::Hardlink;
+	}
+	if(*method != LinkMethod::Copy || !S_ISREG(st.st_mode)) {
+		if(link(src.c_str(), dst.c_str()) == 0) {
+			return 0;
+		}
+		if(errno != EXDEV && errno != EMLINK && errno != EPERM) {
+			return -1;
+		}
+		if(S_ISREG(st.st_mode)) {
+			*method = LinkMethod::Copy;
+		}
+	}
+	if(S_ISLNK(st.st_mode)) {
+		std::error_code ec;
+		filesystem::path target = filesystem::read_symlink(src, ec);
+		return ec ? -1 : symlink(target.c_str(), dst.c_str());
+	}
+	if(!S_ISREG(st.st_mode)) {
+		return mknod(dst.c_str(), st.st_mode, st.st_rdev);
+	}
+	return clone_file(src, dst, st, false);
+}
+
+//! A directory whose mode and mtime are set after its contents are materialised
+struct DelayedDir {
+	std::string path;
+	mode_t mode;
+	struct timespec mtime;
+};
+
+/**
+ * Materialise the contents of a directory from the store.
+ *
+ * @returns true if everything was materialised, false otherwise.
+ */
+static bool materialise_dir(const std::string &src, const std::string &dst,
+                            const std::string &name, LinkMethod *method, Logger *logger,
+                            std::vector<std::string> *members,
+                            std::vector<DelayedDir> *dirs)
+{
+	DIR *dir = opendir(src.c_str());
+	if(dir == nullptr) {
+		logger->log(src + ": Cannot open: " + std::string(strerror(errno)));
+		return false;
+	}
+	std::vector<std::string> children;
+	while(struct dirent *de = readdir(dir)) {
+		std::string child(de->d_name); // NOLINT
+		if(child != "." && child != "..") {
+			children.push_back(child);
+		}
+	}
+	closedir(dir);
+
+	bool result = true;
+	for(const auto &child : children) {
+		std::string from = src + "/" + child;
+		std::string to = dst + "/" + child;
+		std::string child_name = name.empty() ? child : name + "/" + child;
+		struct stat st = {};
+		if(lstat(from.c_str(), &st) != 0) {
+			logger->log(from + ": Cannot stat: " + std::string(strerror(errno)));
+			result = false;
+			continue;
+		}
+		if(S_ISDIR(st.st_mode)) {
+			// Created writable, the mode (and mtime) are set once the children are in
+			// place. Existing directories are merged into, and left as they are.
+			struct stat existing = {};
+			if(mkdir(to.c_str(), 0700) == 0) {
+				dirs->push_back({to, st.st_mode & 07777, st.st_mtim});
+			} else if(errno != EEXIST || lstat(to.c_str(), &existing) != 0 ||
+			          !S_ISDIR(existing.st_mode)) {
+				logger->log(child_name + ": Cannot mkdir: " + std::string(strerror(errno)));
+				result = false;
+				continue;
+			}
+			if(members != nullptr) {
+				members->push_back(child_name);
+			}
+			if(!materialise_dir(from, to, child_name, method, logger, members, dirs)) {
+				result = false;
+			}
+		} else if(materialise_file(from, to, st, method) != 0) {
+			// As with extracting the archive, existing files are never replaced
+			logger->log(child_name + ": Cannot create: " + std::string(strerror(errno)));
+			result = false;
+		} else if(members != nullptr) {
+			members->push_back(child_name);
+		}
+	}
+	return result;
+}
+
+/**
+ * Materialise a tree from the store into a directory. Each file is reflinked where
+ * the filesystem supports it, hard linked otherwise (or copied if the store is on a
+ * different filesystem). Existing files are never replaced; each one is reported as an
+ * error, the rest of the tree is still materialised.
+ *
+ * Hard linked files are shared with the store, so they must not be modified in place.
+ *
+ * @param tree - The tree in the store.
+ * @param dir - The directory to materialise into.
+ * @param logger - The logger to report errors to.
+ * @param members - If set, filled with the paths (relative to dir) of the materialised
+ *                  files.
+ *
+ * @returns true if everything was materialised, false otherwise.
+ */
+bool buildsys::staging_store_materialise(const std::string &tree, const std::string &dir,
+                                         Logger *logger, std::vector<std::string> *members)
+{
+	LinkMethod method = LinkMethod::Reflink;
+	std::vector<DelayedDir> dirs;
+	bool result = materialise_dir(tree, dir, "", &method, logger, members, &dirs);
+
+	// Deepest first, so setting the mtime of a directory is not undone by a change
+	// inside it
+	for(auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+		struct timespec times[2] = {{0, UTIME_NOW}, it->mtime};
+		chmod(it->path.c_str(), it->mode);
+		utimensat(AT_FDCWD, it->path.c_str(), times, 0);
+	}
+	return result;
+}
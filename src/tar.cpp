@@ -0,0 +1,1863 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "tar.hpp"
+#include "exceptions.hpp"
+#include "hash.hpp"
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <dirent.h>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#ifdef BUILDSYS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef BUILDSYS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef BUILDSYS_HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef BUILDSYS_HAVE_LZMA
+#include <lzma.h>
+#endif
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+static const size_t BLOCK_SIZE = 512;
+//! Archives are padded to a multiple of this (the equivalent of 'tar -b 256')
+static const size_t RECORD_SIZE = 256 * BLOCK_SIZE;
+//! Size of the buffer used for reading and writing archives
+static const size_t BUFFER_SIZE = 8 * RECORD_SIZE;
+
+// ustar header field offsets and sizes
+static const size_t NAME_OFF = 0;
+static const size_t NAME_LEN = 100;
+static const size_t MODE_OFF = 100;
+static const size_t UID_OFF = 108;
+static const size_t GID_OFF = 116;
+static const size_t ID_LEN = 8;
+static const size_t SIZE_OFF = 124;
+static const size_t MTIME_OFF = 136;
+static const size_t NUM_LEN = 12;
+static const size_t CHKSUM_OFF = 148;
+static const size_t TYPE_OFF = 156;
+static const size_t LINKNAME_OFF = 157;
+static const size_t MAGIC_OFF = 257;
+static const size_t VERSION_OFF = 263;
+static const size_t DEVMAJOR_OFF = 329;
+static const size_t DEVMINOR_OFF = 337;
+static const size_t PREFIX_OFF = 345;
+static const size_t PREFIX_LEN = 155;
+
+/**
+ * Write a number as a NUL terminated octal string into a header field.
+ *
+ * @returns false if the value does not fit in the field.
+ */
+static bool put_octal(char *field, size_t width, uint64_t value)
+{
+	if(width < 22 && value >= (static_cast<uint64_t>(1) << (3 * (width - 1)))) {
+		return false;
+	}
+	field[width - 1] = '\0';
+	for(size_t i = width - 1; i > 0; i--) {
+		field[i - 1] = static_cast<char>('0' + (value & 7));
+		value >>= 3;
+	}
+	return true;
+}
+
+/**
+ * Parse a numeric header field, either octal or GNU base-256.
+ */
+static uint64_t get_number(const char *field, size_t width)
+{
+	uint64_t value = 0;
+	if((static_cast<unsigned char>(field[0]) & 0x80) != 0) {
+		// base-256, the first byte holds the flag (and is otherwise zero for the
+		// positive values found in practice)
+		for(size_t i = 1; i < width; i++) {
+			value = (value << 8) | static_cast<unsigned char>(field[i]);
+		}
+		return value;
+	}
+	size_t i = 0;
+	while(i < width && (field[i] == ' ' || field[i] == '\0')) {
+		i++;
+	}
+	for(; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+		value = (value << 3) | static_cast<uint64_t>(field[i] - '0');
+	}
+	return value;
+}
+
+//! Get a (possibly not NUL terminated) string header field
+static std::string get_string(const char *field, size_t width)
+{
+	return std::string(field, strnlen(field, width));
+}
+
+//! Calculate the checksum of a header block (the checksum field counts as spaces)
+static uint64_t header_checksum(const char *header, bool is_signed)
+{
+	uint64_t sum = 0;
+	for(size_t i = 0; i < BLOCK_SIZE; i++) {
+		if(i >= CHKSUM_OFF && i < CHKSUM_OFF + ID_LEN) {
+			sum += ' ';
+		} else if(is_signed) {
+			auto value = static_cast<int64_t>(static_cast<signed char>(header[i]));
+			sum += static_cast<uint64_t>(value);
+		} else {
+			sum += static_cast<unsigned char>(header[i]);
+		}
+	}
+	return sum;
+}
+
+//! Create a pax extended header record ("<length> <key>=<value>\n")
+static std::string pax_record(const std::string &key, const std::string &value)
+{
+	std::string record = " " + key + "=" + value + "\n";
+	size_t length = record.size();
+	// The length includes its own digits
+	while(std::to_string(length).size() + record.size() != length) {
+		length = std::to_string(length).size() + record.size();
+	}
+	return std::to_string(length) + record;
+}
+
+
+//! Escape a path for the archive index (which is tab and newline separated)
+static std::string index_escape(const std::string &path)
+{
+	std::string escaped;
+	for(char c : path) {
+		if(c == '\\') {
+			escaped += "\\\\";
+		} else if(c == '\t') {
+			escaped += "\\t";
+		} else if(c == '\n') {
+			escaped += "\\n";
+		} else {
+			escaped += c;
+		}
+	}
+	return escaped;
+}
+
+//! Reverse index_escape()
+static std::string index_unescape(const std::string &escaped)
+{
+	std::string path;
+	for(size_t i = 0; i < escaped.size(); i++) {
+		if(escaped[i] == '\\' && i + 1 < escaped.size()) {
+			i++;
+			if(escaped[i] == 't') {
+				path += '\t';
+			} else if(escaped[i] == 'n') {
+				path += '\n';
+			} else {
+				path += escaped[i];
+			}
+		} else {
+			path += escaped[i];
+		}
+	}
+	return path;
+}
+
+//! Write an entire buffer to a file descriptor
+static void write_all(int fd, const char *data, size_t len)
+{
+	while(len > 0) {
+		ssize_t res = write(fd, data, len);
+		if(res < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			throw CustomException("write failed: " + std::string(strerror(errno)));
+		}
+		data += res;
+		len -= static_cast<size_t>(res);
+	}
+}
+
+/**
+ * Parse an archive codec specification, "none" or "zstd[:level[:threads]]".
+ *
+ * @param spec - The specification to parse.
+ *
+ * @returns The codec. An exception is thrown if the specification is invalid or the
+ *          codec is not supported.
+ */
+ArchiveCodec ArchiveCodec::parse(const std::string &spec)
+{
+	ArchiveCodec codec;
+	if(spec == "none") {
+		return codec;
+	}
+
+	std::vector<std::string> parts;
+	boost::split(parts, spec, boost::is_any_of(":"));
+	if(parts.at(0) != "zstd" || parts.size() > 3) {
+		throw CustomException("Invalid archive codec: " + spec);
+	}
+#ifndef BUILDSYS_HAVE_ZSTD
+	throw CustomException("zstd archive compression is not supported by this build");
+#else
+	codec.zstd = true;
+	try {
+		if(parts.size() > 1) {
+			codec.level = std::stoi(parts.at(1));
+		}
+		if(parts.size() > 2) {
+			codec.threads = std::stoi(parts.at(2));
+		}
+	} catch(std::logic_error &e) {
+		throw CustomException("Invalid archive codec: " + spec);
+	}
+	if(codec.level < ZSTD_minCLevel() || codec.level > ZSTD_maxCLevel() ||
+	   codec.threads < 0) {
+		throw CustomException("Invalid archive codec: " + spec);
+	}
+	return codec;
+#endif
+}
+
+/**
+ * Get the settings for reproducible archives.
+ *
+ * @param epoch - The time (in seconds since the epoch, as SOURCE_DATE_EPOCH) to clamp
+ *                modification times to, nullptr or empty for the epoch itself.
+ *
+ * @returns The settings. An exception is thrown if the time is invalid.
+ */
+ArchiveReproducible ArchiveReproducible::parse(const char *epoch)
+{
+	ArchiveReproducible repro;
+	repro.enabled = true;
+	if(epoch == nullptr || *epoch == '\0') {
+		return repro;
+	}
+	std::string value(epoch);
+	size_t used = 0;
+	try {
+		repro.mtime = static_cast<time_t>(std::stoll(value, &used));
+	} catch(std::logic_error &e) {
+		used = 0;
+	}
+	if(used != value.size() || repro.mtime < 0) {
+		throw CustomException("Invalid SOURCE_DATE_EPOCH: " + value);
+	}
+	return repro;
+}
+
+//! Writes an archive straight to a file
+class FileArchiveOutput : public ArchiveOutput
+{
+private:
+	int fd;
+
+public:
+	explicit FileArchiveOutput(int _fd) : fd(_fd)
+	{
+	}
+	void write(const char *data, size_t len) override
+	{
+		write_all(this->fd, data, len);
+	}
+};
+
+//! Reads an archive straight from a file
+class FileArchiveInput : public ArchiveInput
+{
+private:
+	int fd;
+
+public:
+	explicit FileArchiveInput(int _fd) : fd(_fd)
+	{
+	}
+	size_t read(char *data, size_t len) override
+	{
+		while(true) {
+			ssize_t res = ::read(this->fd, data, len);
+			if(res < 0 && errno == EINTR) {
+				continue;
+			}
+			if(res < 0) {
+				throw CustomException("read failed: " + std::string(strerror(errno)));
+			}
+			return static_cast<size_t>(res);
+		}
+	}
+};
+
+#ifdef BUILDSYS_HAVE_ZSTD
+//! Compresses an archive with zstd as it is written to a file
+class ZstdArchiveOutput : public ArchiveOutput
+{
+private:
+	int fd;
+	ZSTD_CCtx *ctx;
+	std::vector<char> buffer;
+
+	void compress(const char *data, size_t len, ZSTD_EndDirective mode)
+	{
+		ZSTD_inBuffer input = {data, len, 0};
+		size_t remaining = 0;
+		do {
+			ZSTD_outBuffer output = {this->buffer.data(), this->buffer.size(), 0};
+			remaining = ZSTD_compressStream2(this->ctx, &output, &input, mode);
+			if(ZSTD_isError(remaining) != 0) {
+				throw CustomException("zstd compression failed: " +
+				                      std::string(ZSTD_getErrorName(remaining)));
+			}
+			write_all(this->fd, this->buffer.data(), output.pos);
+		} while(mode == ZSTD_e_end ? remaining != 0 : input.pos != input.size);
+	}
+
+public:
+	ZstdArchiveOutput(int _fd, const ArchiveCodec &codec)
+	    : fd(_fd), ctx(ZSTD_createCCtx()), buffer(ZSTD_CStreamOutSize())
+	{
+		if(this->ctx == nullptr) {
+			throw CustomException("zstd compression failed: out of memory");
+		}
+		ZSTD_CCtx_setParameter(this->ctx, ZSTD_c_compressionLevel, codec.level);
+		ZSTD_CCtx_setParameter(this->ctx, ZSTD_c_checksumFlag, 1);
+		// Fails (and so compresses in this thread) if libzstd was built without
+		// multi-threading support
+		ZSTD_CCtx_setParameter(this->ctx, ZSTD_c_nbWorkers, codec.threads);
+	}
+	~ZstdArchiveOutput() override
+	{
+		ZSTD_freeCCtx(this->ctx);
+	}
+	ZstdArchiveOutput(const ZstdArchiveOutput &) = delete;
+	ZstdArchiveOutput &operator=(const ZstdArchiveOutput &) = delete;
+	void write(const char *data, size_t len) override
+	{
+		this->compress(data, len, ZSTD_e_continue);
+	}
+	void finish() override
+	{
+		this->compress(nullptr, 0, ZSTD_e_end);
+	}
+};
+#endif
+
+/**
+ * Decompresses an archive as it is read from a file. Concatenated compressed streams
+ * are decompressed as a single archive.
+ */
+class DecompressingArchiveInput : public ArchiveInput
+{
+private:
+	FileArchiveInput file;
+	std::vector<char> buffer;
+
+protected:
+	const char *next{nullptr}; //!< The compressed data not yet decompressed
+	size_t available{0};
+	bool input_done{false}; //!< Set once all the compressed data has been read
+	/**
+	 * Decompress some of the available data.
+	 *
+	 * @returns The number of bytes written to data.
+	 */
+	virtual size_t decompress(char *data, size_t len) = 0;
+	//! Whether the data decompressed so far ends a complete stream
+	virtual bool complete() = 0;
+
+public:
+	explicit DecompressingArchiveInput(int _fd) : file(_fd), buffer(BUFFER_SIZE)
+	{
+	}
+	size_t read(char *data, size_t len) override
+	{
+		while(true) {
+			if(this->available == 0 && !this->input_done) {
+				this->available = this->file.read(this->buffer.data(), this->buffer.size());
+				this->next = this->buffer.data();
+				this->input_done = (this->available == 0);
+			}
+			size_t count = this->decompress(data, len);
+			if(count > 0) {
+				return count;
+			}
+			if(this->input_done && this->available == 0) {
+				if(!this->complete()) {
+					throw CustomException("Unexpected end of compressed archive");
+				}
+				return 0;
+			}
+		}
+	}
+};
+
+#ifdef BUILDSYS_HAVE_ZSTD
+//! Decompresses a zstd compressed archive
+class ZstdArchiveInput : public DecompressingArchiveInput
+{
+private:
+	ZSTD_DCtx *ctx;
+	//! Set once a frame has been fully decoded (and before the next one starts)
+	bool frame_done{false};
+
+protected:
+	size_t decompress(char *data, size_t len) override
+	{
+		ZSTD_inBuffer input = {this->next, this->available, 0};
+		ZSTD_outBuffer output = {data, len, 0};
+		size_t res = ZSTD_decompressStream(this->ctx, &output, &input);
+		if(ZSTD_isError(res) != 0) {
+			throw CustomException("zstd decompression failed: " +
+			                      std::string(ZSTD_getErrorName(res)));
+		}
+		if(input.pos > 0 || output.pos > 0) {
+			this->frame_done = (res == 0);
+		}
+		this->next += input.pos;
+		this->available -= input.pos;
+		return output.pos;
+	}
+	bool complete() override
+	{
+		return this->frame_done;
+	}
+
+public:
+	explicit ZstdArchiveInput(int _fd)
+	    : DecompressingArchiveInput(_fd), ctx(ZSTD_createDCtx())
+	{
+		if(this->ctx == nullptr) {
+			throw CustomException("zstd decompression failed: out of memory");
+		}
+	}
+	~ZstdArchiveInput() override
+	{
+		ZSTD_freeDCtx(this->ctx);
+	}
+	ZstdArchiveInput(const ZstdArchiveInput &) = delete;
+	ZstdArchiveInput &operator=(const ZstdArchiveInput &) = delete;
+};
+#endif
+
+#ifdef BUILDSYS_HAVE_ZLIB
+//! Decompresses a gzip compressed archive
+class GzipArchiveInput : public DecompressingArchiveInput
+{
+private:
+	z_stream stream{};
+	bool stream_done{false};
+
+protected:
+	size_t decompress(char *data, size_t len) override
+	{
+		if(this->stream_done && this->available > 0) {
+			if(static_cast<unsigned char>(*this->next) != 0x1f) {
+				// As gzip, trailing garbage (usually padding) is ignored
+				this->available = 0;
+				return 0;
+			}
+			inflateReset(&this->stream);
+			this->stream_done = false;
+		}
+		if(this->stream_done) {
+			return 0;
+		}
+		size_t in_len = std::min<size_t>(this->available, UINT_MAX);
+		this->stream.next_in =
+		    reinterpret_cast<Bytef *>(const_cast<char *>(this->next)); // NOLINT
+		this->stream.avail_in = static_cast<uInt>(in_len);
+		this->stream.next_out = reinterpret_cast<Bytef *>(data); // NOLINT
+		this->stream.avail_out = static_cast<uInt>(std::min<size_t>(len, UINT_MAX));
+		uInt out_len = this->stream.avail_out;
+		int res = inflate(&this->stream, Z_NO_FLUSH);
+		if(res == Z_STREAM_END) {
+			this->stream_done = true;
+		} else if(res != Z_OK && res != Z_BUF_ERROR) {
+			throw CustomException(
+			    "gzip decompression failed: " +
+			    std::string(this->stream.msg != nullptr ? this->stream.msg : "error"));
+		}
+		this->next += in_len - this->stream.avail_in;
+		this->available -= in_len - this->stream.avail_in;
+		return out_len - this->stream.avail_out;
+	}
+	bool complete() override
+	{
+		return this->stream_done;
+	}
+
+public:
+	explicit GzipArchiveInput(int _fd) : DecompressingArchiveInput(_fd)
+	{
+		if(inflateInit2(&this->stream, 16 + MAX_WBITS) != Z_OK) {
+			throw CustomException("gzip decompression failed: out of memory");
+		}
+	}
+	~GzipArchiveInput() override
+	{
+		inflateEnd(&this->stream);
+	}
+	GzipArchiveInput(const GzipArchiveInput &) = delete;
+	GzipArchiveInput &operator=(const GzipArchiveInput &) = delete;
+};
+#endif
+
+#ifdef BUILDSYS_HAVE_BZIP2
+//! Decompresses a bzip2 compressed archive
+class Bzip2ArchiveInput : public DecompressingArchiveInput
+{
+private:
+	bz_stream stream{};
+	bool stream_done{false};
+
+protected:
+	size_t decompress(char *data, size_t len) override
+	{
+		if(this->stream_done) {
+			if(this->available == 0) {
+				return 0;
+			}
+			// Another stream follows
+			BZ2_bzDecompressEnd(&this->stream);
+			this->stream = bz_stream{};
+			if(BZ2_bzDecompressInit(&this->stream, 0, 0) != BZ_OK) {
+				throw CustomException("bzip2 decompression failed: out of memory");
+			}
+			this->stream_done = false;
+		}
+		size_t in_len = std::min<size_t>(this->available, UINT_MAX);
+		this->stream.next_in = const_cast<char *>(this->next); // NOLINT
+		this->stream.avail_in = static_cast<unsigned int>(in_len);
+		this->stream.next_out = data;
+		this->stream.avail_out = static_cast<unsigned int>(std::min<size_t>(len, UINT_MAX));
+		unsigned int out_len = this->stream.avail_out;
+		int res = BZ2_bzDecompress(&this->stream);
+		if(res == BZ_STREAM_END) {
+			this->stream_done = true;
+		} else if(res != BZ_OK) {
+			throw CustomException(
+			    (boost::format{"bzip2 decompression failed: error %1%"} % res).str());
+		}
+		this->next += in_len - this->stream.avail_in;
+		this->available -= in_len - this->stream.avail_in;
+		return out_len - this->stream.avail_out;
+	}
+	bool complete() override
+	{
+		return this->stream_done;
+	}
+
+public:
+	explicit Bzip2ArchiveInput(int _fd) : DecompressingArchiveInput(_fd)
+	{
+		if(BZ2_bzDecompressInit(&this->stream, 0, 0) != BZ_OK) {
+			throw CustomException("bzip2 decompression failed: out of memory");
+		}
+	}
+	~Bzip2ArchiveInput() override
+	{
+		BZ2_bzDecompressEnd(&this->stream);
+	}
+	Bzip2ArchiveInput(const Bzip2ArchiveInput &) = delete;
+	Bzip2ArchiveInput &operator=(const Bzip2ArchiveInput &) = delete;
+};
+#endif
+
+#ifdef BUILDSYS_HAVE_LZMA
+//! Decompresses an xz compressed archive
+class XzArchiveInput : public DecompressingArchiveInput
+{
+private:
+	lzma_stream stream = LZMA_STREAM_INIT;
+	bool stream_done{false};
+
+protected:
+	size_t decompress(char *data, size_t len) override
+	{
+		if(this->stream_done) {
+			return 0;
+		}
+		this->stream.next_in = reinterpret_cast<const uint8_t *>(this->next); // NOLINT
+		this->stream.avail_in = this->available;
+		this->stream.next_out = reinterpret_cast<uint8_t *>(data); // NOLINT
+		this->stream.avail_out = len;
+		lzma_ret res = lzma_code(&this->stream, this->input_done ? LZMA_FINISH : LZMA_RUN);
+		if(res == LZMA_STREAM_END) {
+			this->stream_done = true;
+		} else if(res != LZMA_OK && res != LZMA_BUF_ERROR) {
+			throw CustomException(
+			    (boost::format{"xz decompression failed: error %1%"} % res).str());
+		}
+		this->next += this->available - this->stream.avail_in;
+		this->available = this->stream.avail_in;
+		return len - this->stream.avail_out;
+	}
+	bool complete() override
+	{
+		return this->stream_done;
+	}
+
+public:
+	explicit XzArchiveInput(int _fd) : DecompressingArchiveInput(_fd)
+	{
+		if(lzma_stream_decoder(&this->stream, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+			throw CustomException("xz decompression failed: out of memory");
+		}
+	}
+	~XzArchiveInput() override
+	{
+		lzma_end(&this->stream);
+	}
+	XzArchiveInput(const XzArchiveInput &) = delete;
+	XzArchiveInput &operator=(const XzArchiveInput &) = delete;
+};
+#endif
+
+/**
+ * Runs another input on its own thread, so decompressing the archive overlaps with
+ * creating the extracted files.
+ */
+class ThreadedArchiveInput : public ArchiveInput
+{
+private:
+	//! How many decompressed chunks can be waiting to be read
+	static const size_t DEPTH = 4;
+	std::unique_ptr<ArchiveInput> in;
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<std::vector<char>> chunks;
+	std::vector<char> current;
+	size_t current_pos{0};
+	bool done{false};
+	bool stop{false};
+	std::exception_ptr error;
+	std::thread thread;
+
+	void run()
+	{
+		try {
+			while(true) {
+				std::vector<char> chunk(BUFFER_SIZE);
+				size_t len = 0;
+				while(len < chunk.size()) {
+					size_t count = this->in->read(chunk.data() + len, chunk.size() - len);
+					if(count == 0) {
+						break;
+					}
+					len += count;
+				}
+				chunk.resize(len);
+				std::unique_lock<std::mutex> lk(this->lock);
+				while(this->chunks.size() >= DEPTH && !this->stop) {
+					this->cond.wait(lk);
+				}
+				if(this->stop || len == 0) {
+					this->done = true;
+					this->cond.notify_all();
+					return;
+				}
+				this->chunks.push_back(std::move(chunk));
+				this->cond.notify_all();
+			}
+		} catch(...) {
+			std::unique_lock<std::mutex> lk(this->lock);
+			this->error = std::current_exception();
+			this->done = true;
+			this->cond.notify_all();
+		}
+	}
+
+public:
+	explicit ThreadedArchiveInput(std::unique_ptr<ArchiveInput> _in)
+	    : in(std::move(_in)), thread(&ThreadedArchiveInput::run, this)
+	{
+	}
+	~ThreadedArchiveInput() override
+	{
+		{
+			std::unique_lock<std::mutex> lk(this->lock);
+			this->stop = true;
+			this->cond.notify_all();
+		}
+		this->thread.join();
+	}
+	ThreadedArchiveInput(const ThreadedArchiveInput &) = delete;
+	ThreadedArchiveInput &operator=(const ThreadedArchiveInput &) = delete;
+	size_t read(char *data, size_t len) override
+	{
+		while(this->current_pos == this->current.size()) {
+			std::unique_lock<std::mutex> lk(this->lock);
+			while(this->chunks.empty() && !this->done) {
+				this->cond.wait(lk);
+			}
+			if(this->chunks.empty()) {
+				if(this->error) {
+					std::rethrow_exception(this->error);
+				}
+				return 0;
+			}
+			this->current = std::move(this->chunks.front());
+			this->chunks.pop_front();
+			this->current_pos = 0;
+			this->cond.notify_all();
+		}
+		size_t count = std::min(len, this->current.size() - this->current_pos);
+		std::memcpy(data, this->current.data() + this->current_pos, count);
+		this->current_pos += count;
+		return count;
+	}
+};
+
+/**
+ * Create a tar writer.
+ *
+ * @param _out - Where to write the archive to.
+ * @param _index - If set, where to write the index of the archive to.
+ */
+TarWriter::TarWriter(ArchiveOutput *_out, std::ostream *_index)
+    : out(_out), index(_index), buffer(BUFFER_SIZE)
+{
+}
+
+/**
+ * Write the index line of an entry. Each line has the type, mode (octal), size, offset
+ * of the data in the (uncompressed) archive and SHA-256 of the data (regular files
+ * only) of the entry, followed by its path and the target of a link.
+ */
+static void put_index_line(std::ostream *index, const TarEntry &entry, uint64_t offset,
+                           const std::string &hash)
+{
+	std::string path;
+	if(!archive_member_path(entry.path, &path) || path.empty()) {
+		return;
+	}
+	*index << entry.type << '\t' << std::oct << (entry.mode & 07777) << std::dec << '\t'
+	       << entry.size << '\t' << offset << '\t' << (hash.empty() ? "-" : hash) << '\t'
+	       << index_escape(path) << '\t' << index_escape(entry.linkname) << '\n';
+}
+
+//! Add an entry to the index
+void TarWriter::putIndex(const TarEntry &entry, uint64_t offset, const std::string &hash)
+{
+	if(this->index != nullptr) {
+		put_index_line(this->index, entry, offset, hash);
+	}
+}
+
+//! Write out any buffered data
+void TarWriter::flush()
+{
+	this->out->write(this->buffer.data(), this->used);
+	this->used = 0;
+}
+
+//! Append data to the archive
+void TarWriter::put(const char *data, size_t len)
+{
+	while(len > 0) {
+		size_t count = std::min(len, this->buffer.size() - this->used);
+		std::memcpy(this->buffer.data() + this->used, data, count);
+		this->used += count;
+		this->total += count;
+		data += count;
+		len -= count;
+		if(this->used == this->buffer.size()) {
+			this->flush();
+		}
+	}
+}
+
+//! Pad the archive with zeros to the next block boundary
+void TarWriter::pad()
+{
+	static const std::vector<char> zeros(BLOCK_SIZE);
+	size_t rem = this->total % BLOCK_SIZE;
+	if(rem != 0) {
+		this->put(zeros.data(), BLOCK_SIZE - rem);
+	}
+}
+
+//! Write a single ustar header block for an entry
+void TarWriter::putHeader(const TarEntry &entry, const std::string &name)
+{
+	std::vector<char> header(BLOCK_SIZE);
+	std::memcpy(&header[NAME_OFF], name.data(), std::min(name.size(), NAME_LEN));
+	put_octal(&header[MODE_OFF], ID_LEN, entry.mode & 07777);
+	put_octal(&header[UID_OFF], ID_LEN, entry.uid);
+	put_octal(&header[GID_OFF], ID_LEN, entry.gid);
+	put_octal(&header[SIZE_OFF], NUM_LEN, entry.size);
+	put_octal(&header[MTIME_OFF], NUM_LEN, static_cast<uint64_t>(entry.mtime));
+	header[TYPE_OFF] = entry.type;
+	std::memcpy(&header[LINKNAME_OFF], entry.linkname.data(),
+	            std::min(entry.linkname.size(), NAME_LEN));
+	std::memcpy(&header[MAGIC_OFF], "ustar", 6);
+	std::memcpy(&header[VERSION_OFF], "00", 2);
+	if(entry.type == '3' || entry.type == '4') {
+		put_octal(&header[DEVMAJOR_OFF], ID_LEN, entry.devmajor);
+		put_octal(&header[DEVMINOR_OFF], ID_LEN, entry.devminor);
+	}
+	put_octal(&header[CHKSUM_OFF], 7, header_checksum(header.data(), false));
+	header[CHKSUM_OFF + 7] = ' ';
+	this->put(header.data(), header.size());
+}
+
+/**
+ * Add an entry to the archive.
+ *
+ * @param entry - The entry to add.
+ * @param source - The file to read the data of a regular file entry from.
+ */
+void TarWriter::add(const TarEntry &entry, const std::string &source)
+{
+	// Anything that does not fit in the ustar header goes in a pax header
+	std::string pax;
+	if(entry.path.size() > NAME_LEN) {
+		pax += pax_record("path", entry.path);
+	}
+	if(entry.linkname.size() > NAME_LEN) {
+		pax += pax_record("linkpath", entry.linkname);
+	}
+	std::vector<char> field(NUM_LEN);
+	if(!put_octal(field.data(), NUM_LEN, entry.size)) {
+		pax += pax_record("size", std::to_string(entry.size));
+	}
+	if(entry.mtime < 0 ||
+	   !put_octal(field.data(), NUM_LEN, static_cast<uint64_t>(entry.mtime))) {
+		pax += pax_record("mtime", std::to_string(entry.mtime));
+	}
+	if(!put_octal(field.data(), ID_LEN, entry.uid)) {
+		pax += pax_record("uid", std::to_string(entry.uid));
+	}
+	if(!put_octal(field.data(), ID_LEN, entry.gid)) {
+		pax += pax_record("gid", std::to_string(entry.gid));
+	}
+
+	if(!pax.empty()) {
+		std::string base = entry.path;
+		base.erase(base.find_last_not_of('/') + 1);
+		base = base.substr(base.rfind('/') + 1);
+		TarEntry pax_entry;
+		pax_entry.type = 'x';
+		pax_entry.mode = 0644;
+		pax_entry.size = pax.size();
+		pax_entry.mtime = std::max<time_t>(entry.mtime, 0);
+		this->putHeader(pax_entry, "./PaxHeaders/" + base);
+		this->put(pax.data(), pax.size());
+		this->pad();
+	}
+
+	TarEntry header = entry;
+	if(header.mtime < 0) {
+		header.mtime = 0;
+	}
+	this->putHeader(header, entry.path);
+	uint64_t offset = this->total;
+
+	HashStream hash;
+	if(entry.size == 0) {
+		this->putIndex(entry, offset, (entry.type == '0') ? hash.hex() : "");
+		return;
+	}
+
+	int in = open(source.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if(in < 0) {
+		throw CustomException(source + ": Cannot open: " + std::string(strerror(errno)));
+	}
+	posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+	// Read straight into the output buffer
+	uint64_t left = entry.size;
+	while(left > 0) {
+		size_t count = static_cast<size_t>(
+		    std::min<uint64_t>(left, this->buffer.size() - this->used));
+		ssize_t res = read(in, this->buffer.data() + this->used, count);
+		if(res < 0 && errno == EINTR) {
+			continue;
+		}
+		if(res <= 0) {
+			std::string err = (res < 0) ? std::string(strerror(errno)) : "File shrank";
+			close(in);
+			throw CustomException(source + ": Read failed: " + err);
+		}
+		hash.update(this->buffer.data() + this->used, static_cast<size_t>(res));
+		this->used += static_cast<size_t>(res);
+		this->total += static_cast<uint64_t>(res);
+		left -= static_cast<uint64_t>(res);
+		if(this->used == this->buffer.size()) {
+			this->flush();
+		}
+	}
+	close(in);
+	this->pad();
+	this->putIndex(entry, offset, hash.hex());
+}
+
+/**
+ * Finish the archive, writing the end of archive marker and padding it to a whole
+ * record.
+ */
+void TarWriter::finish()
+{
+	static const std::vector<char> zeros(RECORD_SIZE);
+	this->put(zeros.data(), 2 * BLOCK_SIZE);
+	size_t rem = this->total % RECORD_SIZE;
+	if(rem != 0) {
+		this->put(zeros.data(), RECORD_SIZE - rem);
+	}
+	this->flush();
+	this->out->finish();
+}
+
+/**
+ * Create a tar reader.
+ *
+ * @param _in - Where to read the archive from.
+ */
+TarReader::TarReader(ArchiveInput *_in) : in(_in), buffer(BUFFER_SIZE)
+{
+}
+
+//! Refill the (empty) buffer, returns false at the end of the archive
+bool TarReader::fill()
+{
+	this->consumed += this->len;
+	this->pos = 0;
+	this->len = this->in->read(this->buffer.data(), this->buffer.size());
+	return this->len != 0;
+}
+
+//! Read exactly size bytes from the archive
+void TarReader::readExact(char *data, size_t size)
+{
+	while(size > 0) {
+		if(this->pos == this->len && !this->fill()) {
+			throw CustomException("Unexpected end of archive");
+		}
+		size_t count = std::min(size, this->len - this->pos);
+		std::memcpy(data, this->buffer.data() + this->pos, count);
+		this->pos += count;
+		data += count;
+		size -= count;
+	}
+}
+
+//! Skip over size bytes of the archive
+void TarReader::skip(uint64_t size)
+{
+	while(size > 0) {
+		if(this->pos == this->len && !this->fill()) {
+			throw CustomException("Unexpected end of archive");
+		}
+		size_t count = static_cast<size_t>(std::min<uint64_t>(size, this->len - this->pos));
+		this->pos += count;
+		size -= count;
+	}
+}
+
+//! Read the (padded) data of a metadata entry as a string
+std::string TarReader::readString(uint64_t size)
+{
+	if(size > 16 * 1024 * 1024) {
+		throw CustomException("Extended header too large");
+	}
+	std::string data(size, '\0');
+	this->readExact(&data[0], data.size());
+	this->skip((BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE);
+	return data;
+}
+
+/**
+ * Move to the next entry in the archive. Any unread data of the current entry is
+ * skipped.
+ *
+ * @param entry - Where to store the details of the entry.
+ *
+ * @returns false at the end of the archive.
+ */
+bool TarReader::next(TarEntry *entry)
+{
+	this->skipData();
+	this->skip(this->padding);
+	this->padding = 0;
+
+	std::map<std::string, std::string> pax;
+	std::string long_name;
+	std::string long_link;
+	std::vector<char> header(BLOCK_SIZE);
+
+	while(true) {
+		if(this->pos == this->len && !this->fill()) {
+			// No end of archive marker, but nothing is missing either
+			return false;
+		}
+		this->readExact(header.data(), BLOCK_SIZE);
+		if(std::all_of(header.begin(), header.end(), [](char c) { return c == '\0'; })) {
+			return false;
+		}
+
+		uint64_t chksum = get_number(&header[CHKSUM_OFF], ID_LEN);
+		if(chksum != header_checksum(header.data(), false) &&
+		   chksum != header_checksum(header.data(), true)) {
+			throw CustomException("Corrupt archive (header checksum mismatch)");
+		}
+
+		*entry = TarEntry();
+		entry->type = header[TYPE_OFF];
+		entry->mode = static_cast<mode_t>(get_number(&header[MODE_OFF], ID_LEN));
+		entry->uid = static_cast<uid_t>(get_number(&header[UID_OFF], ID_LEN));
+		entry->gid = static_cast<gid_t>(get_number(&header[GID_OFF], ID_LEN));
+		entry->size = get_number(&header[SIZE_OFF], NUM_LEN);
+		entry->mtime = static_cast<time_t>(get_number(&header[MTIME_OFF], NUM_LEN));
+		entry->devmajor =
+		    static_cast<unsigned int>(get_number(&header[DEVMAJOR_OFF], ID_LEN));
+		entry->devminor =
+		    static_cast<unsigned int>(get_number(&header[DEVMINOR_OFF], ID_LEN));
+		entry->linkname = get_string(&header[LINKNAME_OFF], NAME_LEN);
+		entry->path = get_string(&header[NAME_OFF], NAME_LEN);
+		// Only POSIX ustar has a prefix field, the old GNU format uses that space for
+		// other things
+		if(std::memcmp(&header[MAGIC_OFF], "ustar", 6) == 0) {
+			std::string prefix = get_string(&header[PREFIX_OFF], PREFIX_LEN);
+			if(!prefix.empty()) {
+				entry->path = prefix + "/" + entry->path;
+			}
+		}
+
+		if(entry->type == 'x' || entry->type == 'g') {
+			// pax extended header (global headers are applied like local ones, as
+			// nothing we create uses them)
+			std::string data = this->readString(entry->size);
+			size_t offset = 0;
+			while(offset < data.size()) {
+				size_t space = data.find(' ', offset);
+				if(space == std::string::npos) {
+					throw CustomException("Corrupt pax extended header");
+				}
+				size_t length = std::stoul(data.substr(offset, space - offset));
+				size_t equals = data.find('=', space);
+				if(length == 0 || offset + length > data.size() ||
+				   equals == std::string::npos || equals > offset + length) {
+					throw CustomException("Corrupt pax extended header");
+				}
+				pax[data.substr(space + 1, equals - space - 1)] =
+				    data.substr(equals + 1, offset + length - equals - 2);
+				offset += length;
+			}
+			continue;
+		}
+		if(entry->type == 'L' || entry->type == 'K') {
+			// GNU long name/link name
+			std::string data = this->readString(entry->size);
+			data = data.substr(0, strnlen(data.c_str(), data.size()));
+			if(entry->type == 'L') {
+				long_name = data;
+			} else {
+				long_link = data;
+			}
+			continue;
+		}
+		break;
+	}
+
+	if(!long_name.empty()) {
+		entry->path = long_name;
+	}
+	if(!long_link.empty()) {
+		entry->linkname = long_link;
+	}
+	for(const auto &record : pax) {
+		if(record.first == "path") {
+			entry->path = record.second;
+		} else if(record.first == "linkpath") {
+			entry->linkname = record.second;
+		} else if(record.first == "size") {
+			entry->size = std::stoull(record.second);
+		} else if(record.first == "uid") {
+			entry->uid = static_cast<uid_t>(std::stoul(record.second));
+		} else if(record.first == "gid") {
+			entry->gid = static_cast<gid_t>(std::stoul(record.second));
+		} else if(record.first == "mtime") {
+			entry->mtime = static_cast<time_t>(std::stoll(record.second));
+		}
+	}
+
+	// Only these member types carry data
+	if(entry->type == '1' || entry->type == '2' || entry->type == '3' ||
+	   entry->type == '4' || entry->type == '5' || entry->type == '6') {
+		this->remaining = 0;
+		this->padding = 0;
+	} else {
+		this->remaining = entry->size;
+		this->padding = (BLOCK_SIZE - entry->size % BLOCK_SIZE) % BLOCK_SIZE;
+	}
+	return true;
+}
+
+/**
+ * Read the data of the current entry.
+ *
+ * @param data - Set to point at the data read (valid until the next call).
+ *
+ * @returns The number of bytes available, 0 once all the data has been read.
+ */
+size_t TarReader::readData(const char **data)
+{
+	if(this->remaining == 0) {
+		return 0;
+	}
+	if(this->pos == this->len && !this->fill()) {
+		throw CustomException("Unexpected end of archive");
+	}
+	size_t count =
+	    static_cast<size_t>(std::min<uint64_t>(this->remaining, this->len - this->pos));
+	*data = this->buffer.data() + this->pos;
+	this->pos += count;
+	this->remaining -= count;
+	return count;
+}
+
+//! The offset in the (uncompressed) archive of the next data to be read
+uint64_t TarReader::offset() const
+{
+	return this->consumed + this->pos;
+}
+
+//! Skip any unread data of the current entry
+void TarReader::skipData()
+{
+	this->skip(this->remaining);
+	this->remaining = 0;
+}
+
+/**
+ * Add a file (and for a directory, everything below it) to an archive.
+ *
+ * @param writer - The archive to add to.
+ * @param root - The directory the archive is being created from.
+ * @param name - The name of the file relative to root (starting with ".").
+ * @param links - Hard linked files already in the archive.
+ * @param repro - How to make the archive reproducible.
+ * @param logger - Where to report anything skipped.
+ */
+static void add_tree(TarWriter *writer, const std::string &root, const std::string &name,
+                     std::map<std::pair<dev_t, ino_t>, std::string> *links,
+                     const ArchiveReproducible &repro, Logger *logger)
+{
+	std::string path = root + "/" + name;
+	struct stat st = {};
+	if(lstat(path.c_str(), &st) != 0) {
+		throw CustomException(name + ": Cannot stat: " + std::string(strerror(errno)));
+	}
+
+	TarEntry entry;
+	entry.path = name;
+	entry.mode = st.st_mode & 07777;
+	entry.uid = st.st_uid;
+	entry.gid = st.st_gid;
+	entry.mtime = st.st_mtime;
+	if(repro.enabled) {
+		// Nothing about who built the tree, or when
+		entry.uid = 0;
+		entry.gid = 0;
+		entry.mtime = std::min(entry.mtime, repro.mtime);
+	}
+
+	if(S_ISDIR(st.st_mode)) {
+		entry.type = '5';
+		entry.path += "/";
+		writer->add(entry, path);
+
+		std::vector<std::string> children;
+		DIR *dir = opendir(path.c_str());
+		if(dir == nullptr) {
+			throw CustomException(name + ": Cannot open: " + std::string(strerror(errno)));
+		}
+		while(struct dirent *de = readdir(dir)) {
+			std::string child(de->d_name); // NOLINT
+			if(child != "." && child != "..") {
+				children.push_back(child);
+			}
+		}
+		closedir(dir);
+		// Sorted, so the archive does not depend on the directory order on disk
+		std::sort(children.begin(), children.end());
+		for(const auto &child : children) {
+			add_tree(writer, root, name + "/" + child, links, repro, logger);
+		}
+		return;
+	}
+
+	if(S_ISREG(st.st_mode)) {
+		if(st.st_nlink > 1) {
+			auto key = std::make_pair(st.st_dev, st.st_ino);
+			auto existing = links->find(key);
+			if(existing != links->end()) {
+				entry.type = '1';
+				entry.linkname = existing->second;
+				writer->add(entry, path);
+				return;
+			}
+			links->emplace(key, name);
+		}
+		entry.type = '0';
+		entry.size = static_cast<uint64_t>(st.st_size);
+	} else if(S_ISLNK(st.st_mode)) {
+		std::vector<char> target(static_cast<size_t>(st.st_size) + 1);
+		ssize_t res = readlink(path.c_str(), target.data(), target.size());
+		if(res < 0 || static_cast<size_t>(res) >= target.size()) {
+			throw CustomException(name + ": Cannot readlink");
+		}
+		entry.type = '2';
+		entry.linkname = std::string(target.data(), static_cast<size_t>(res));
+	} else if(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+		entry.type = S_ISCHR(st.st_mode) ? '3' : '4';
+		entry.devmajor = major(st.st_rdev);
+		entry.devminor = minor(st.st_rdev);
+	} else if(S_ISFIFO(st.st_mode)) {
+		entry.type = '6';
+	} else {
+		logger->log(name + ": socket ignored");
+		return;
+	}
+	writer->add(entry, path);
+}
+
+/**
+ * Create an archive of a directory (the equivalent of 'tar --numeric-owner -cf
+ * archive .' run in dir). The archive is written to a temporary file and renamed
+ * into place once complete. An index of the archive is written alongside it, to
+ * archive + ".idx".
+ *
+ * @param dir - The directory to archive.
+ * @param archive - The archive file to create.
+ * @param logger - The logger to report errors to.
+ * @param codec - How to compress the archive.
+ * @param repro - How to make the archive reproducible. When enabled, all members are
+ *                owned by root and modification times are clamped, so the same tree
+ *                always gives the same archive.
+ *
+ * @returns true if the archive was created, false otherwise.
+ */
+bool buildsys::tar_create(const std::string &dir, const std::string &archive,
+                          Logger *logger, const ArchiveCodec &codec,
+                          const ArchiveReproducible &repro)
+{
+	std::string tmp = archive + ".tmp";
+	std::string index_file = archive + ".idx";
+	std::string index_tmp = index_file + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if(fd < 0) {
+		logger->log(tmp + ": Cannot open: " + std::string(strerror(errno)));
+		return false;
+	}
+	std::ofstream index(index_tmp);
+
+	try {
+		std::unique_ptr<ArchiveOutput> out;
+		if(codec.zstd) {
+#ifdef BUILDSYS_HAVE_ZSTD
+			out = std::make_unique<ZstdArchiveOutput>(fd, codec);
+#else
+			throw CustomException("zstd archive compression is not supported by this "
+			                      "build");
+#endif
+		} else {
+			out = std::make_unique<FileArchiveOutput>(fd);
+		}
+		TarWriter writer(out.get(), &index);
+		std::map<std::pair<dev_t, ino_t>, std::string> links;
+		add_tree(&writer, dir, ".", &links, repro, logger);
+		writer.finish();
+		index.close();
+		if(!index.good()) {
+			throw CustomException(index_tmp + ": Cannot write");
+		}
+	} catch(CustomException &e) {
+		logger->log(e.what());
+		close(fd);
+		unlink(tmp.c_str());
+		unlink(index_tmp.c_str());
+		return false;
+	}
+
+	// Never leave the index of the previous archive next to the new one
+	unlink(index_file.c_str());
+	if(close(fd) != 0 || rename(tmp.c_str(), archive.c_str()) != 0 ||
+	   rename(index_tmp.c_str(), index_file.c_str()) != 0) {
+		logger->log(archive + ": Cannot write: " + std::string(strerror(errno)));
+		unlink(tmp.c_str());
+		unlink(index_tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Load the index written alongside an archive by tar_create().
+ *
+ * @param file - The index file.
+ * @param entries - Filled with the entries of the archive.
+ *
+ * @returns true if the index was loaded, false if it is missing or invalid.
+ */
+bool buildsys::archive_index_load(const std::string &file,
+                                  std::vector<ArchiveIndexEntry> *entries)
+{
+	entries->clear();
+	std::ifstream input(file);
+	if(!input.is_open()) {
+		return false;
+	}
+
+	std::string line;
+	try {
+		while(std::getline(input, line)) {
+			std::vector<std::string> fields;
+			boost::split(fields, line, boost::is_any_of("\t"));
+			// Indexes written before link targets were added have no seventh field
+			if((fields.size() != 6 && fields.size() != 7) || fields[0].size() != 1) {
+				throw std::invalid_argument("line");
+			}
+			ArchiveIndexEntry entry;
+			entry.type = fields[0][0];
+			entry.mode = static_cast<mode_t>(std::stoul(fields[1], nullptr, 8));
+			entry.size = std::stoull(fields[2]);
+			entry.offset = std::stoull(fields[3]);
+			entry.hash = (fields[4] == "-") ? "" : fields[4];
+			entry.path = index_unescape(fields[5]);
+			entry.linkname = (fields.size() == 7) ? index_unescape(fields[6]) : "";
+			entries->push_back(entry);
+		}
+	} catch(std::logic_error &e) {
+		entries->clear();
+		return false;
+	}
+	return true;
+}
+
+//! The umask (which can only be read via umask() by changing it, racing other threads)
+static mode_t process_umask()
+{
+	static const mode_t mask = [] {
+		std::ifstream status("/proc/self/status");
+		std::string line;
+		while(std::getline(status, line)) {
+			if(line.compare(0, 6, "Umask:") == 0) {
+				return static_cast<mode_t>(std::stoul(line.substr(6), nullptr, 8));
+			}
+		}
+		return static_cast<mode_t>(022);
+	}();
+	return mask;
+}
+
+/**
+ * The mode an extracted file gets (as tar: the archived mode when run by root,
+ * otherwise the permission bits less the umask).
+ */
+mode_t buildsys::archive_extract_mode(mode_t mode)
+{
+	if(geteuid() == 0) {
+		return mode & 07777;
+	}
+	return mode & 0777 & ~process_umask();
+}
+
+/**
+ * Convert a member name into a path relative to the extraction directory,
+ * dropping any leading '/' and '.' components.
+ *
+ * @returns false if the name tries to escape the extraction directory.
+ */
+bool buildsys::archive_member_path(const std::string &name, std::string *path)
+{
+	path->clear();
+	size_t start = 0;
+	while(start <= name.size()) {
+		size_t end = name.find('/', start);
+		if(end == std::string::npos) {
+			end = name.size();
+		}
+		std::string component = name.substr(start, end - start);
+		if(component == "..") {
+			return false;
+		}
+		if(!component.empty() && component != ".") {
+			if(!path->empty()) {
+				path->push_back('/');
+			}
+			path->append(component);
+		}
+		start = end + 1;
+	}
+	return true;
+}
+
+//! Create the missing parent directories of path
+static void make_parents(const std::string &path)
+{
+	std::error_code ec;
+	filesystem::create_directories(filesystem::path(path).parent_path(), ec);
+}
+
+/**
+ * Run a create operation, creating any missing parent directories and retrying if
+ * required. When replacing, an existing file is removed and the operation retried.
+ */
+template <typename F>
+static int create_with_parents(const std::string &path, bool replace, F op)
+{
+	int res = op();
+	if(res < 0 && errno == ENOENT) {
+		make_parents(path);
+		res = op();
+	} else if(res < 0 && errno == EEXIST && replace && unlink(path.c_str()) == 0) {
+		res = op();
+	}
+	return res;
+}
+
+//! A directory whose mode and mtime are set once everything has been extracted
+struct DelayedDir {
+	std::string path;
+	mode_t mode;
+	time_t mtime;
+};
+
+/**
+ * Extract a single entry from an archive.
+ *
+ * @returns false if the entry could not be extracted.
+ */
+static bool extract_entry(TarReader *reader, const TarEntry &entry, const std::string &dir,
+                          bool replace, std::vector<DelayedDir> *dirs, Logger *logger)
+{
+	std::string name;
+	if(!archive_member_path(entry.path, &name)) {
+		logger->log(entry.path + ": Member name contains '..'");
+		return false;
+	}
+	if(name.empty()) {
+		// The top level directory already exists
+		return true;
+	}
+	std::string path = dir + "/" + name;
+	struct timespec times[2] = {{0, UTIME_NOW}, {entry.mtime, 0}};
+	int res = 0;
+
+	switch(entry.type) {
+	case '0':
+	case '\0':
+	case '7': {
+		int out = create_with_parents(path, replace, [&path] {
+			return open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW,
+			            0600);
+		});
+		if(out < 0) {
+			res = out;
+			break;
+		}
+		try {
+			const char *data = nullptr;
+			size_t count = 0;
+			while((count = reader->readData(&data)) > 0) {
+				write_all(out, data, count);
+			}
+		} catch(CustomException &e) {
+			close(out);
+			throw CustomException(entry.path + ": " + e.what());
+		}
+		fchmod(out, archive_extract_mode(entry.mode));
+		futimens(out, times);
+		res = close(out);
+		break;
+	}
+	case '1': {
+		std::string target;
+		if(!archive_member_path(entry.linkname, &target)) {
+			logger->log(entry.path + ": Link target contains '..'");
+			return false;
+		}
+		target = dir + "/" + target;
+		res = create_with_parents(path, replace,
+		                          [&] { return link(target.c_str(), path.c_str()); });
+		break;
+	}
+	case '2':
+		res = create_with_parents(
+		    path, replace, [&] { return symlink(entry.linkname.c_str(), path.c_str()); });
+		if(res == 0) {
+			utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+		}
+		break;
+	case '3':
+	case '4':
+	case '6': {
+		mode_t type = S_IFIFO;
+		if(entry.type == '3') {
+			type = S_IFCHR;
+		} else if(entry.type == '4') {
+			type = S_IFBLK;
+		}
+		dev_t dev = makedev(entry.devmajor, entry.devminor);
+		res = create_with_parents(path, replace, [&] {
+			return mknod(path.c_str(), type | archive_extract_mode(entry.mode), dev);
+		});
+		if(res == 0) {
+			utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+		}
+		break;
+	}
+	case '5': {
+		struct stat st = {};
+		if(lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+			// Existing directories are merged into, and (unless replacing) left as they
+			// are
+			if(replace) {
+				dirs->push_back({path, archive_extract_mode(entry.mode), entry.mtime});
+			}
+			return true;
+		}
+		res = create_with_parents(path, replace,
+		                          [&path] { return mkdir(path.c_str(), 0700); });
+		if(res == 0) {
+			dirs->push_back({path, archive_extract_mode(entry.mode), entry.mtime});
+		}
+		break;
+	}
+	default:
+		logger->log(boost::format{"%1%: Unsupported member type '%2%'"} % entry.path %
+		            entry.type);
+		return false;
+	}
+
+	if(res < 0) {
+		// Unless replacing, as 'tar -k', existing files are never replaced
+		logger->log(entry.path + ": Cannot create: " + std::string(strerror(errno)));
+		return false;
+	}
+	return true;
+}
+
+//! The compression of an archive
+enum class Compression { None, Zstd, Gzip, Bzip2, Xz, Unknown };
+
+//! Work out how an archive is compressed from its magic number
+static Compression archive_compression(int fd)
+{
+	unsigned char start[6] = {};
+	if(pread(fd, start, sizeof(start), 0) != sizeof(start)) {
+		// Too short to be compressed (or an empty tar file)
+		return Compression::None;
+	}
+	if(std::memcmp(start, "\x28\xb5\x2f\xfd", 4) == 0) {
+		return Compression::Zstd;
+	}
+	if(std::memcmp(start, "\x1f\x8b", 2) == 0) {
+		return Compression::Gzip;
+	}
+	if(std::memcmp(start, "BZh", 3) == 0) {
+		return Compression::Bzip2;
+	}
+	if(std::memcmp(start, "\xfd" "7zXZ\x00", 6) == 0) {
+		return Compression::Xz;
+	}
+	// Other compressors (compress, lzip, lz4, ...)
+	if(start[0] == 0x1f || std::memcmp(start, "LZIP", 4) == 0 ||
+	   std::memcmp(start, "\x04\x22\x4d\x18", 4) == 0 || start[0] == 0x5d) {
+		return Compression::Unknown;
+	}
+	return Compression::None;
+}
+
+/**
+ * Open an archive for reading, decompressing it (on another thread) if required.
+ *
+ * @returns The input, or nullptr if the compression is not supported by this build.
+ */
+static std::unique_ptr<ArchiveInput> open_input(int fd)
+{
+	std::unique_ptr<ArchiveInput> in;
+	switch(archive_compression(fd)) {
+	case Compression::None:
+		return std::make_unique<FileArchiveInput>(fd);
+#ifdef BUILDSYS_HAVE_ZSTD
+	case Compression::Zstd:
+		in = std::make_unique<ZstdArchiveInput>(fd);
+		break;
+#endif
+#ifdef BUILDSYS_HAVE_ZLIB
+	case Compression::Gzip:
+		in = std::make_unique<GzipArchiveInput>(fd);
+		break;
+#endif
+#ifdef BUILDSYS_HAVE_BZIP2
+	case Compression::Bzip2:
+		in = std::make_unique<Bzip2ArchiveInput>(fd);
+		break;
+#endif
+#ifdef BUILDSYS_HAVE_LZMA
+	case Compression::Xz:
+		in = std::make_unique<XzArchiveInput>(fd);
+		break;
+#endif
+	default:
+		return nullptr;
+	}
+	return std::make_unique<ThreadedArchiveInput>(std::move(in));
+}
+
+/**
+ * Check whether an archive can be extracted by tar_extract(), that is whether it is
+ * uncompressed, or compressed with something supported by this build.
+ *
+ * @param archive - The archive.
+ *
+ * @returns true if the archive can be extracted (or does not exist), false otherwise.
+ */
+bool buildsys::tar_can_extract(const std::string &archive)
+{
+	int fd = open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		return true;
+	}
+	bool result = (open_input(fd) != nullptr);
+	close(fd);
+	return result;
+}
+
+/**
+ * Extract an archive into a directory (the equivalent of 'tar --no-same-owner -xkf
+ * archive' run in dir, or -xf when replacing). The archive may be compressed (with
+ * zstd, gzip, bzip2 or xz, as supported by this build), it is decompressed on another
+ * thread as it is extracted. Unless replacing, existing files are never replaced; each
+ * one is reported as an error, the rest of the archive is still extracted.
+ *
+ * @param archive - The archive to extract.
+ * @param dir - The directory to extract into.
+ * @param logger - The logger to report errors to.
+ * @param members - If set, filled with the paths (relative to dir) of the extracted
+ *                  members.
+ * @param replace - Whether to replace existing files.
+ * @param include - If set, only the members (by their relative paths) it accepts are
+ *                  extracted.
+ *
+ * @returns true if everything was extracted, false otherwise.
+ */
+bool buildsys::tar_extract(const std::string &archive, const std::string &dir,
+                           Logger *logger, std::vector<std::string> *members, bool replace,
+                           const ArchiveMemberFilter &include)
+{
+	int fd = open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		logger->log(archive + ": Cannot open: " + std::string(strerror(errno)));
+		return false;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	bool result = true;
+	std::vector<DelayedDir> dirs;
+	try {
+		std::unique_ptr<ArchiveInput> in = open_input(fd);
+		if(!in) {
+			throw CustomException("The compression is not supported by this build");
+		}
+		TarReader reader(in.get());
+		TarEntry entry;
+		while(reader.next(&entry)) {
+			std::string name;
+			if(include && (!archive_member_path(entry.path, &name) || !include(name))) {
+				continue;
+			}
+			if(!extract_entry(&reader, entry, dir, replace, &dirs, logger)) {
+				result = false;
+			} else if(members != nullptr && archive_member_path(entry.path, &name) &&
+			          !name.empty()) {
+				members->push_back(name);
+			}
+		}
+	} catch(CustomException &e) {
+		logger->log(archive + ": " + e.what());
+		result = false;
+	}
+	close(fd);
+
+	// Deepest first, so setting the mtime of a directory is not undone by a change
+	// inside it
+	for(auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+		struct timespec times[2] = {{0, UTIME_NOW}, {it->mtime, 0}};
+		chmod(it->path.c_str(), it->mode);
+		utimensat(AT_FDCWD, it->path.c_str(), times, 0);
+	}
+
+	return result;
+}
+
+/**
+ * Read each member of an archive (which may be compressed, as for tar_extract()).
+ *
+ * @param archive - The archive.
+ * @param member - Called with each member, it may read the data of the member from the
+ *                 reader. It may throw a CustomException to stop reading.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if all the archive was read, false otherwise.
+ */
+bool buildsys::tar_read(const std::string &archive,
+                        const std::function<void(TarReader *, const TarEntry &)> &member,
+                        Logger *logger)
+{
+	int fd = open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		logger->log(archive + ": Cannot open: " + std::string(strerror(errno)));
+		return false;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	bool result = true;
+	try {
+		std::unique_ptr<ArchiveInput> in = open_input(fd);
+		if(!in) {
+			throw CustomException("The compression is not supported by this build");
+		}
+		TarReader reader(in.get());
+		TarEntry entry;
+		while(reader.next(&entry)) {
+			member(&reader, entry);
+		}
+	} catch(CustomException &e) {
+		logger->log(archive + ": " + e.what());
+		result = false;
+	}
+	close(fd);
+	return result;
+}
+
+/**
+ * Write the index of an existing archive to archive + ".idx", the same as the index
+ * written by tar_create(), for an archive that was got without one.
+ *
+ * @param archive - The archive.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if the index was written, false otherwise.
+ */
+bool buildsys::archive_index_create(const std::string &archive, Logger *logger)
+{
+	std::string index_file = archive + ".idx";
+	std::string index_tmp = index_file + ".tmp";
+	std::ofstream index(index_tmp);
+	auto add = [&index](TarReader *reader, const TarEntry &entry) {
+		uint64_t offset = reader->offset();
+		std::string hash;
+		if(entry.type == '0') {
+			HashStream hs;
+			const char *data = nullptr;
+			while(size_t len = reader->readData(&data)) {
+				hs.update(data, len);
+			}
+			hash = hs.hex();
+		}
+		put_index_line(&index, entry, offset, hash);
+	};
+	bool result = tar_read(archive, add, logger);
+	index.close();
+	if(result && !index.good()) {
+		logger->log(index_tmp + ": Cannot write");
+		result = false;
+	}
+
+	if(result && rename(index_tmp.c_str(), index_file.c_str()) != 0) {
+		logger->log(index_file + ": Cannot write: " + std::string(strerror(errno)));
+		result = false;
+	}
+	if(!result) {
+		unlink(index_tmp.c_str());
+	}
+	return result;
+}
+
+/**
+ * Get a digest of the contents of an archive from its index (creating the index if it
+ * is missing). Only what the archive holds contributes (the type, mode, size, data hash,
+ * path and link target of each member), so two archives of the same tree have the same
+ * digest.
+ *
+ * @param archive - The archive.
+ * @param digest - Set to the digest.
+ * @param logger - The logger to report errors to.
+ * @param include - If set, only the members (by their relative paths) it accepts
+ *                  contribute.
+ *
+ * @returns true if the digest was set, false otherwise.
+ */
+bool buildsys::archive_index_digest(const std::string &archive, std::string *digest,
+                                    Logger *logger, const ArchiveMemberFilter &include)
+{
+	std::vector<ArchiveIndexEntry> entries;
+	if(!archive_index_load(archive + ".idx", &entries)) {
+		if(!archive_index_create(archive, logger) ||
+		   !archive_index_load(archive + ".idx", &entries)) {
+			return false;
+		}
+	}
+	HashStream hash;
+	for(const auto &entry : entries) {
+		if(include && !include(entry.path)) {
+			continue;
+		}
+		std::string line = std::string(1, entry.type) + '\0' +
+		                   std::to_string(entry.mode & 07777) + '\0' +
+		                   std::to_string(entry.size) + '\0' + entry.hash + '\0' +
+		                   entry.path + '\0' + entry.linkname + '\0';
+		hash.update(line);
+	}
+	*digest = hash.hex();
+	return true;
+}
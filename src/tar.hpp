@@ -0,0 +1,173 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#ifndef TAR_HPP_
+#define TAR_HPP_
+
+#include "logger.hpp"
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace buildsys
+{
+	//! A single member of a tar archive
+	struct TarEntry {
+		std::string path;     //!< Member name (e.g. "./usr/include/foo.h")
+		std::string linkname; //!< Target of a hard or symbolic link
+		char type{'0'};       //!< ustar typeflag
+		mode_t mode{0};
+		uid_t uid{0};
+		gid_t gid{0};
+		uint64_t size{0}; //!< Size of the member data
+		time_t mtime{0};
+		unsigned int devmajor{0};
+		unsigned int devminor{0};
+	};
+
+	//! An entry in the index of an archive
+	struct ArchiveIndexEntry {
+		std::string path; //!< Relative path (e.g. "usr/include/foo.h")
+		char type{'0'};   //!< ustar typeflag
+		mode_t mode{0};
+		uint64_t size{0};
+		uint64_t offset{0};   //!< Offset of the data in the uncompressed archive
+		std::string hash;     //!< SHA-256 of the data (regular files only)
+		std::string linkname; //!< Target of a hard or symbolic link
+	};
+
+	//! The compression applied to created archives
+	struct ArchiveCodec {
+		bool zstd{false};
+		int level{3};   //!< zstd compression level
+		int threads{0}; //!< zstd worker threads (0 compresses in the calling thread)
+		static ArchiveCodec parse(const std::string &spec);
+	};
+
+	//! How created archives are made reproducible
+	struct ArchiveReproducible {
+		bool enabled{false};
+		time_t mtime{0}; //!< Later modification times are clamped to this
+		static ArchiveReproducible parse(const char *epoch);
+	};
+
+	//! Selects members of an archive by their relative paths (e.g. "usr/include/foo.h")
+	using ArchiveMemberFilter = std::function<bool(const std::string &)>;
+
+	//! Somewhere a TarWriter sends the archive to
+	class ArchiveOutput
+	{
+	public:
+		virtual ~ArchiveOutput() = default;
+		virtual void write(const char *data, size_t len) = 0;
+		//! Called once all the archive has been written
+		virtual void finish()
+		{
+		}
+	};
+
+	//! Somewhere a TarReader gets the archive from
+	class ArchiveInput
+	{
+	public:
+		virtual ~ArchiveInput() = default;
+		//! Read up to len bytes, returns 0 at the end of the archive
+		virtual size_t read(char *data, size_t len) = 0;
+	};
+
+	/**
+	 * Writes a ustar archive (with pax extended headers for anything that does not fit
+	 * in a ustar header), using large sequential writes.
+	 */
+	class TarWriter
+	{
+	private:
+		ArchiveOutput *out;
+		std::ostream *index;
+		std::vector<char> buffer;
+		size_t used{0};
+		uint64_t total{0};
+		void flush();
+		void put(const char *data, size_t len);
+		void pad();
+		void putHeader(const TarEntry &entry, const std::string &name);
+		void putIndex(const TarEntry &entry, uint64_t offset, const std::string &hash);
+
+	public:
+		explicit TarWriter(ArchiveOutput *_out, std::ostream *_index = nullptr);
+		void add(const TarEntry &entry, const std::string &source);
+		void finish();
+	};
+
+	/**
+	 * Reads a ustar/pax/GNU tar archive, using large sequential reads.
+	 */
+	class TarReader
+	{
+	private:
+		ArchiveInput *in;
+		std::vector<char> buffer;
+		size_t pos{0};
+		size_t len{0};
+		uint64_t consumed{0}; //!< Bytes of the archive read before the buffer
+		uint64_t remaining{0};
+		uint64_t padding{0};
+		bool fill();
+		void readExact(char *data, size_t size);
+		void skip(uint64_t size);
+		std::string readString(uint64_t size);
+
+	public:
+		explicit TarReader(ArchiveInput *_in);
+		bool next(TarEntry *entry);
+		size_t readData(const char **data);
+		uint64_t offset() const;
+		void skipData();
+	};
+
+	bool tar_create(const std::string &dir, const std::string &archive, Logger *logger,
+	                const ArchiveCodec &codec = ArchiveCodec(),
+	                const ArchiveReproducible &repro = ArchiveReproducible());
+	bool archive_index_load(const std::string &file,
+	                        std::vector<ArchiveIndexEntry> *entries);
+	bool tar_read(const std::string &archive,
+	              const std::function<void(TarReader *, const TarEntry &)> &member,
+	              Logger *logger);
+	bool archive_index_create(const std::string &archive, Logger *logger);
+	bool archive_index_digest(const std::string &archive, std::string *digest,
+	                          Logger *logger, const ArchiveMemberFilter &include = nullptr);
+	bool archive_member_path(const std::string &name, std::string *path);
+	mode_t archive_extract_mode(mode_t mode);
+	bool tar_can_extract(const std::string &archive);
+	bool tar_extract(const std::string &archive, const std::string &dir, Logger *logger,
+	                 std::vector<std::string> *members = nullptr, bool replace = false,
+	                 const ArchiveMemberFilter &include = nullptr);
+} // namespace buildsys
+
+#endif // TAR_HPP_
@@ -0,0 +1,469 @@
+/******************************************************************************
+ Copyright 2020 Allied Telesis Labs Ltd. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in the
+       documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*******************************************************************************/
+
+#include "zip.hpp"
+#include "exceptions.hpp"
+#include "tar.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#ifdef BUILDSYS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+/**
+ * Check whether zip archives can be extracted by zip_extract(), they need zlib.
+ */
+bool buildsys::zip_can_extract()
+{
+#ifdef BUILDSYS_HAVE_ZLIB
+	return true;
+#else
+	return false;
+#endif
+}
+
+#ifdef BUILDSYS_HAVE_ZLIB
+static const uint32_t LOCAL_HEADER_SIG = 0x04034b50;
+static const uint32_t CENTRAL_HEADER_SIG = 0x02014b50;
+static const uint32_t END_SIG = 0x06054b50;
+static const uint32_t END64_SIG = 0x06064b50;
+static const uint32_t END64_LOCATOR_SIG = 0x07064b50;
+static const size_t END_LEN = 22;
+//! The end of central directory record is followed by a comment of up to 64k
+static const size_t END_SEARCH_LEN = END_LEN + 0xffff;
+static const uint16_t HOST_UNIX = 3;
+
+//! A member of a zip archive, from its central directory entry
+struct ZipEntry {
+	std::string name;
+	uint16_t host{0};
+	uint16_t flags{0};
+	uint16_t method{0};
+	uint32_t crc{0};
+	uint64_t compressed_size{0};
+	uint64_t size{0};
+	uint64_t offset{0}; //!< Offset of the local header
+	uint32_t attributes{0};
+	time_t mtime{0};
+};
+
+static uint16_t get16(const unsigned char *p)
+{
+	return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return static_cast<uint32_t>(get16(p)) | (static_cast<uint32_t>(get16(p + 2)) << 16);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return static_cast<uint64_t>(get32(p)) | (static_cast<uint64_t>(get32(p + 4)) << 32);
+}
+
+//! Read exactly len bytes from the given offset, throwing an exception on failure
+static void read_at(int fd, unsigned char *data, size_t len, uint64_t offset)
+{
+	while(len > 0) {
+		ssize_t res = pread(fd, data, len, static_cast<off_t>(offset));
+		if(res < 0 && errno == EINTR) {
+			continue;
+		}
+		if(res < 0) {
+			throw CustomException("read failed: " + std::string(strerror(errno)));
+		}
+		if(res == 0) {
+			throw CustomException("Unexpected end of archive");
+		}
+		data += res;
+		len -= static_cast<size_t>(res);
+		offset += static_cast<uint64_t>(res);
+	}
+}
+
+//! Convert an MS-DOS date and time (in local time) to a time_t
+static time_t dos_time(uint16_t date, uint16_t time)
+{
+	struct tm tm = {};
+	tm.tm_year = ((date >> 9) & 0x7f) + 80;
+	tm.tm_mon = ((date >> 5) & 0x0f) - 1;
+	tm.tm_mday = date & 0x1f;
+	tm.tm_hour = (time >> 11) & 0x1f;
+	tm.tm_min = (time >> 5) & 0x3f;
+	tm.tm_sec = (time & 0x1f) * 2;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+/**
+ * Apply the extra fields of a central directory entry: the zip64 sizes and offset, and
+ * the unix modification time.
+ */
+static void parse_extra(const unsigned char *extra, size_t len, ZipEntry *entry)
+{
+	while(len >= 4) {
+		uint16_t id = get16(extra);
+		size_t size = std::min<size_t>(get16(extra + 2), len - 4);
+		const unsigned char *data = extra + 4;
+		if(id == 0x0001) {
+			// Only the fields that did not fit are present, in this order
+			size_t pos = 0;
+			for(uint64_t *field : {&entry->size, &entry->compressed_size, &entry->offset}) {
+				if(*field == UINT32_MAX && pos + 8 <= size) {
+					*field = get64(data + pos);
+					pos += 8;
+				}
+			}
+		} else if(id == 0x5455 && size >= 5 && (data[0] & 1) != 0) {
+			entry->mtime = static_cast<int32_t>(get32(data + 1));
+		}
+		extra += 4 + size;
+		len -= 4 + size;
+	}
+}
+
+//! Read the central directory of a zip archive
+static std::vector<ZipEntry> read_central_directory(int fd)
+{
+	struct stat st = {};
+	if(fstat(fd, &st) != 0) {
+		throw CustomException("stat failed: " + std::string(strerror(errno)));
+	}
+	auto file_size = static_cast<uint64_t>(st.st_size);
+	if(file_size < END_LEN) {
+		throw CustomException("Not a zip archive");
+	}
+	size_t tail_len = static_cast<size_t>(std::min<uint64_t>(file_size, END_SEARCH_LEN));
+	std::vector<unsigned char> tail(tail_len);
+	read_at(fd, tail.data(), tail.size(), file_size - tail_len);
+
+	size_t end = tail_len - END_LEN + 1;
+	do {
+		end--;
+	} while(end > 0 && get32(&tail[end]) != END_SIG);
+	if(get32(&tail[end]) != END_SIG) {
+		throw CustomException("Not a zip archive");
+	}
+	uint64_t count = get16(&tail[end + 10]);
+	uint64_t cd_size = get32(&tail[end + 12]);
+	uint64_t cd_offset = get32(&tail[end + 16]);
+	uint64_t end_offset = file_size - tail_len + end;
+
+	if(count == UINT16_MAX || cd_size == UINT32_MAX || cd_offset == UINT32_MAX) {
+		// A zip64 archive, the real values are in the zip64 end of central directory
+		unsigned char locator[20];
+		unsigned char end64[56];
+		if(end_offset < sizeof(locator)) {
+			throw CustomException("Invalid zip64 archive");
+		}
+		read_at(fd, locator, sizeof(locator), end_offset - sizeof(locator));
+		if(get32(locator) != END64_LOCATOR_SIG) {
+			throw CustomException("Invalid zip64 archive");
+		}
+		read_at(fd, end64, sizeof(end64), get64(locator + 8));
+		if(get32(end64) != END64_SIG) {
+			throw CustomException("Invalid zip64 archive");
+		}
+		count = get64(end64 + 32);
+		cd_size = get64(end64 + 40);
+		cd_offset = get64(end64 + 48);
+	}
+	if(cd_offset > file_size || cd_size > file_size - cd_offset) {
+		throw CustomException("Invalid central directory");
+	}
+
+	std::vector<unsigned char> cd(cd_size);
+	read_at(fd, cd.data(), cd.size(), cd_offset);
+	std::vector<ZipEntry> entries;
+	size_t pos = 0;
+	for(uint64_t i = 0; i < count; i++) {
+		if(pos + 46 > cd.size() || get32(&cd[pos]) != CENTRAL_HEADER_SIG) {
+			throw CustomException("Invalid central directory");
+		}
+		const unsigned char *header = &cd[pos];
+		size_t name_len = get16(header + 28);
+		size_t extra_len = get16(header + 30);
+		size_t comment_len = get16(header + 32);
+		if(pos + 46 + name_len + extra_len + comment_len > cd.size()) {
+			throw CustomException("Invalid central directory");
+		}
+		ZipEntry entry;
+		entry.host = static_cast<uint16_t>(get16(header + 4) >> 8);
+		entry.flags = get16(header + 8);
+		entry.method = get16(header + 10);
+		entry.mtime = dos_time(get16(header + 14), get16(header + 12));
+		entry.crc = get32(header + 16);
+		entry.compressed_size = get32(header + 20);
+		entry.size = get32(header + 24);
+		entry.attributes = get32(header + 38);
+		entry.offset = get32(header + 42);
+		entry.name.assign(reinterpret_cast<const char *>(header + 46), name_len); // NOLINT
+		parse_extra(header + 46 + name_len, extra_len, &entry);
+		entries.push_back(entry);
+		pos += 46 + name_len + extra_len + comment_len;
+	}
+	return entries;
+}
+
+/**
+ * Read the (decompressed) data of a member, passing it to a function in pieces.
+ */
+template <typename F> static void read_member(int fd, const ZipEntry &entry, F consume)
+{
+	if((entry.flags & 1) != 0) {
+		throw CustomException("Encrypted members are not supported");
+	}
+	if(entry.method != 0 && entry.method != 8) {
+		throw CustomException("Unsupported compression method " +
+		                      std::to_string(entry.method));
+	}
+	unsigned char local[30];
+	read_at(fd, local, sizeof(local), entry.offset);
+	if(get32(local) != LOCAL_HEADER_SIG) {
+		throw CustomException("Invalid local header");
+	}
+	uint64_t offset = entry.offset + sizeof(local) + get16(local + 26) + get16(local + 28);
+
+	std::vector<unsigned char> in(1024 * 1024);
+	std::vector<unsigned char> out(entry.method == 8 ? in.size() : 0);
+	z_stream stream{};
+	if(entry.method == 8 && inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+		throw CustomException("Decompression failed: out of memory");
+	}
+	uLong crc = crc32(0, nullptr, 0);
+	uint64_t size = 0;
+	try {
+		int res = Z_OK;
+		for(uint64_t done = 0; done < entry.compressed_size && res != Z_STREAM_END;) {
+			size_t len = static_cast<size_t>(
+			    std::min<uint64_t>(in.size(), entry.compressed_size - done));
+			read_at(fd, in.data(), len, offset + done);
+			done += len;
+			if(entry.method == 0) {
+				crc = crc32(crc, in.data(), static_cast<uInt>(len));
+				size += len;
+				consume(reinterpret_cast<const char *>(in.data()), len); // NOLINT
+				continue;
+			}
+			stream.next_in = in.data();
+			stream.avail_in = static_cast<uInt>(len);
+			do {
+				stream.next_out = out.data();
+				stream.avail_out = static_cast<uInt>(out.size());
+				res = inflate(&stream, Z_NO_FLUSH);
+				if(res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+					throw CustomException("Decompression failed");
+				}
+				size_t produced = out.size() - stream.avail_out;
+				crc = crc32(crc, out.data(), static_cast<uInt>(produced));
+				size += produced;
+				consume(reinterpret_cast<const char *>(out.data()), produced); // NOLINT
+			} while(stream.avail_out == 0 && res != Z_STREAM_END);
+		}
+	} catch(...) {
+		inflateEnd(&stream);
+		throw;
+	}
+	if(entry.method == 8) {
+		inflateEnd(&stream);
+	}
+	if(size != entry.size || crc != entry.crc) {
+		throw CustomException("Bad CRC or size");
+	}
+}
+
+//! Write an entire buffer to a file descriptor
+static void write_all(int fd, const char *data, size_t len)
+{
+	while(len > 0) {
+		ssize_t res = write(fd, data, len);
+		if(res < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			throw CustomException("write failed: " + std::string(strerror(errno)));
+		}
+		data += res;
+		len -= static_cast<size_t>(res);
+	}
+}
+
+/**
+ * Create a file (or symbolic link), creating any missing parent directories and
+ * replacing an existing file as required.
+ */
+template <typename F> static int create_replacing(const std::string &path, F op)
+{
+	int res = op();
+	if(res < 0 && errno == ENOENT) {
+		std::error_code ec;
+		filesystem::create_directories(filesystem::path(path).parent_path(), ec);
+		res = op();
+	} else if(res < 0 && errno == EEXIST && unlink(path.c_str()) == 0) {
+		res = op();
+	}
+	return res;
+}
+
+/**
+ * Extract a single member of a zip archive, throwing an exception on failure. The mode
+ * and mtime of directories are set later, once everything has been extracted.
+ */
+static void extract_member(int fd, const ZipEntry &entry, const std::string &path,
+                           std::vector<std::pair<std::string, ZipEntry>> *dirs)
+{
+	mode_t mode = entry.attributes >> 16;
+	bool is_dir = (entry.name.back() == '/');
+	if(entry.host != HOST_UNIX || (mode & S_IFMT) == 0) {
+		mode = is_dir ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+	}
+	struct timespec times[2] = {{0, UTIME_NOW}, {entry.mtime, 0}};
+
+	if(is_dir || S_ISDIR(mode)) {
+		std::error_code ec;
+		filesystem::create_directories(path, ec);
+		if(ec) {
+			throw CustomException("Cannot create: " + ec.message());
+		}
+		dirs->emplace_back(path, entry);
+		return;
+	}
+	if(S_ISLNK(mode)) {
+		std::string target;
+		read_member(fd, entry, [&target](const char *data, size_t len) {
+			target.append(data, len);
+		});
+		if(create_replacing(path, [&] { return symlink(target.c_str(), path.c_str()); }) !=
+		   0) {
+			throw CustomException("Cannot create: " + std::string(strerror(errno)));
+		}
+		utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+		return;
+	}
+
+	int out = create_replacing(path, [&path] {
+		return open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW,
+		            0600);
+	});
+	if(out < 0) {
+		throw CustomException("Cannot create: " + std::string(strerror(errno)));
+	}
+	try {
+		read_member(fd, entry,
+		            [out](const char *data, size_t len) { write_all(out, data, len); });
+	} catch(CustomException &) {
+		close(out);
+		unlink(path.c_str());
+		throw;
+	}
+	fchmod(out, archive_extract_mode(mode));
+	futimens(out, times);
+	if(close(out) != 0) {
+		throw CustomException("Cannot write: " + std::string(strerror(errno)));
+	}
+}
+#endif
+
+/**
+ * Extract a zip archive into a directory (the equivalent of 'unzip -o archive' run in
+ * dir). Existing files are replaced. Each member that can not be extracted is reported
+ * as an error, the rest of the archive is still extracted.
+ *
+ * @param archive - The archive to extract.
+ * @param dir - The directory to extract into.
+ * @param logger - The logger to report errors to.
+ *
+ * @returns true if everything was extracted, false otherwise.
+ */
+bool buildsys::zip_extract(const std::string &archive, const std::string &dir,
+                           Logger *logger)
+{
+#ifndef BUILDSYS_HAVE_ZLIB
+	logger->log(archive + ": Cannot extract into " + dir +
+	            ": zip archives are not supported by this build");
+	return false;
+#else
+	int fd = open(archive.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		logger->log(archive + ": Cannot open: " + std::string(strerror(errno)));
+		return false;
+	}
+
+	bool result = true;
+	std::vector<std::pair<std::string, ZipEntry>> dirs;
+	try {
+		for(const auto &entry : read_central_directory(fd)) {
+			std::string name;
+			if(!archive_member_path(entry.name, &name)) {
+				logger->log(entry.name + ": Member name contains '..'");
+				result = false;
+				continue;
+			}
+			if(name.empty()) {
+				continue;
+			}
+			try {
+				extract_member(fd, entry, dir + "/" + name, &dirs);
+			} catch(CustomException &e) {
+				logger->log(entry.name + ": " + e.what());
+				result = false;
+			}
+		}
+	} catch(CustomException &e) {
+		logger->log(archive + ": " + e.what());
+		result = false;
+	}
+	close(fd);
+
+	// Deepest first, so setting the mtime of a directory is not undone by a change
+	// inside it
+	for(auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+		struct timespec times[2] = {{0, UTIME_NOW}, {it->second.mtime, 0}};
+		if(it->second.host == HOST_UNIX && (it->second.attributes >> 16) != 0) {
+			chmod(it->first.c_str(),
+			      archive_extract_mode(it->second.attributes >> 16));
+		}
+		utimensat(AT_FDCWD, it->first.c_str(), times, 0);
+	}
+
+	return result;
+#endif
+}
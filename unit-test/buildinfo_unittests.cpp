@@ -96,6 +96,17 @@ TEST_CASE_METHOD(BuildDescriptionTestsFixture, "Test add_build_info_file() funct
 	REQUIRE(buffer.str() == "BuildInfoFile test_build_info_file test_hash_abc123\n");
 }
 
+TEST_CASE_METHOD(BuildDescriptionTestsFixture, "Test add_build_key_file() function", "")
+{
+	BuildDescription desc;
+
+	desc.add_build_key_file("test_build_key_file", "test_hash_abc123");
+
+	std::stringstream buffer;
+	desc.print(buffer);
+	REQUIRE(buffer.str() == "BuildKeyFile test_build_key_file test_hash_abc123\n");
+}
+
 TEST_CASE_METHOD(BuildDescriptionTestsFixture, "Test add_extraction_info_file() function",
                  "")
 {
@@ -108,3 +119,38 @@ TEST_CASE_METHOD(BuildDescriptionTestsFixture, "Test add_extraction_info_file()
 	REQUIRE(buffer.str() ==
 	        "ExtractionInfoFile test_extraction_info_file test_hash_abc123\n");
 }
+
+TEST_CASE_METHOD(BuildDescriptionTestsFixture, "Test add_stage_filter() function", "")
+{
+	BuildDescription desc;
+
+	desc.add_stage_filter("usr/include/*");
+
+	std::stringstream buffer;
+	desc.print(buffer);
+	REQUIRE(buffer.str() == "StageFilter usr/include/*\n");
+}
+
+TEST_CASE_METHOD(BuildDescriptionTestsFixture, "Test hash() function", "")
+{
+	BuildDescription desc;
+
+	// The digest of an empty description is the digest of no data
+	REQUIRE(desc.hash() ==
+	        "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+
+	desc.add_package_file("test_package_file", "test_hash_abc123");
+	desc.add_feature_value("test_feature1", "test_value1");
+
+	std::stringstream buffer;
+	desc.print(buffer);
+
+	HashStream hs;
+	hs.update(buffer.str());
+	REQUIRE(desc.hash() == hs.hex());
+
+	// Adding more units changes the digest
+	std::string before = desc.hash();
+	desc.add_nil_feature_value("test_feature2");
+	REQUIRE(desc.hash() != before);
+}
@@ -0,0 +1,61 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "cacheindex.hpp"
+#include "logger.hpp"
+#include <catch2/catch.hpp>
+#include <fstream>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class CacheIndexTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("cacheindex_test_dir")};
+	std::string server{"file://" + cwd};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+public:
+	CacheIndexTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->cwd);
+		CacheIndex::get()->reset();
+	}
+	~CacheIndexTestsFixture()
+	{
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(CacheIndexTestsFixture, "Test a server without an index", "")
+{
+	REQUIRE(CacheIndex::get()->mayHave(this->server, "ns/pkg/abcd", &this->logger));
+	// Not adding to an index that does not exist
+	CacheIndex::get()->add(this->cwd, "ns/pkg/abcd", &this->logger);
+	REQUIRE(!filesystem::exists(this->cwd + "/index"));
+	REQUIRE(CacheIndex::get()->mayHave(this->server, "ns/other/abcd", &this->logger));
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(CacheIndexTestsFixture, "Test a server with an index", "")
+{
+	std::ofstream(this->cwd + "/index") << "ns/pkg/abcd\nns/pkg/ef01\n";
+	REQUIRE(CacheIndex::get()->mayHave(this->server, "ns/pkg/abcd", &this->logger));
+	REQUIRE(!CacheIndex::get()->mayHave(this->server, "ns/pkg/2345", &this->logger));
+	// The index is only fetched once
+	CacheIndex::get()->add(this->cwd, "ns/pkg/2345", &this->logger);
+	REQUIRE(!CacheIndex::get()->mayHave(this->server, "ns/pkg/2345", &this->logger));
+	REQUIRE(this->stdout_buffer.str() ==
+	        "test: Build cache " + this->server + ": 2 entries in the index\n");
+
+	CacheIndex::get()->reset();
+	REQUIRE(CacheIndex::get()->mayHave(this->server, "ns/pkg/2345", &this->logger));
+}
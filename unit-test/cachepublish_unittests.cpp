@@ -0,0 +1,140 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "cachepublish.hpp"
+#include "chunkstore.hpp"
+#include "logger.hpp"
+#include <catch2/catch.hpp>
+#include <cstdio>
+#include <fstream>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class CachePublishTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("cachepublish_test_dir")};
+	std::string cache{cwd + "/cache"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	void write_file(const std::string &path, const std::string &contents)
+	{
+		filesystem::create_directories(filesystem::path(path).parent_path());
+		std::ofstream file(path);
+		file << contents;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+public:
+	CachePublishTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->cwd);
+	}
+	~CachePublishTestsFixture()
+	{
+		CachePublisher::set_target("");
+		CachePublisher::set_chunk_store("");
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(CachePublishTestsFixture, "Test publishing to a directory", "")
+{
+	REQUIRE(!CachePublisher::enabled());
+	CachePublisher::set_target("file://" + this->cache);
+	REQUIRE(CachePublisher::enabled());
+
+	std::string key = "ns/pkg/abcd";
+	this->write_file(this->cache + "/index", "ns/other/abcd\n");
+	this->write_file(this->cwd + "/build/staging.tar", "staging");
+	this->write_file(this->cwd + "/build/install.tar", "install");
+	std::vector<std::array<std::string, 2>> files = {
+	    {"staging.tar", this->cwd + "/build/staging.tar"},
+	    {"install.tar", this->cwd + "/build/install.tar"},
+	};
+	REQUIRE(CachePublisher::get()->publish(key, files, &this->logger, "pkg"));
+	// The archive being replaced by a rebuild does not change what is published
+	this->write_file(this->cwd + "/build/new.tar", "rebuilt");
+	REQUIRE(rename((this->cwd + "/build/new.tar").c_str(),
+	               (this->cwd + "/build/staging.tar").c_str()) == 0);
+	CachePublisher::get()->wait();
+	REQUIRE(!CachePublisher::get()->pending());
+
+	std::string entry = this->cache + "/" + key;
+	REQUIRE(this->read_file(entry + "/staging.tar") == "staging");
+	REQUIRE(this->read_file(entry + "/install.tar") == "install");
+	REQUIRE(filesystem::exists(entry + "/usable"));
+	REQUIRE(std::distance(filesystem::directory_iterator(entry),
+	                      filesystem::directory_iterator()) == 3);
+	REQUIRE(this->read_file(this->cache + "/index") == "ns/other/abcd\nns/pkg/abcd\n");
+
+	// A complete entry is kept
+	REQUIRE(CachePublisher::get()->publish(key, files, &this->logger, "pkg"));
+	CachePublisher::get()->wait();
+	REQUIRE(this->read_file(entry + "/staging.tar") == "staging");
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(CachePublishTestsFixture, "Test publishing errors", "")
+{
+	CachePublisher::set_target(this->cache);
+	std::vector<std::array<std::string, 2>> files = {
+	    {"staging.tar", this->cwd + "/missing.tar"},
+	};
+	REQUIRE(!CachePublisher::get()->publish("ns/pkg/abcd", files, &this->logger, "pkg"));
+
+	// The entry can not be created under a file
+	this->write_file(this->cache + "/ns", "not a directory");
+	this->write_file(this->cwd + "/staging.tar", "staging");
+	files = {{"staging.tar", this->cwd + "/staging.tar"}};
+	REQUIRE(CachePublisher::get()->publish("ns/pkg/abcd", files, &this->logger, "pkg"));
+	CachePublisher::get()->wait();
+	std::string output = this->stdout_buffer.str();
+	REQUIRE(output.find("test: " + this->cwd + "/missing.tar: Cannot open: No such file or "
+	                    "directory\n") == 0);
+	REQUIRE(output.find("pkg: Failed to publish to the build cache: ns/pkg/abcd\n") !=
+	        std::string::npos);
+}
+
+TEST_CASE_METHOD(CachePublishTestsFixture, "Test publishing archives as chunks", "")
+{
+	CachePublisher::set_target(this->cache);
+	CachePublisher::set_chunk_store(this->cwd + "/chunks");
+
+	this->write_file(this->cwd + "/build/staging.tar", std::string(100000, 's'));
+	this->write_file(this->cwd + "/build/output.info", "info");
+	std::vector<std::array<std::string, 2>> files = {
+	    {"staging.tar", this->cwd + "/build/staging.tar"},
+	    {"output.info", this->cwd + "/build/output.info"},
+	};
+	REQUIRE(CachePublisher::get()->publish("ns/pkg/abcd", files, &this->logger, "pkg"));
+	CachePublisher::get()->wait();
+
+	std::string entry = this->cache + "/ns/pkg/abcd";
+	REQUIRE(!filesystem::exists(entry + "/staging.tar"));
+	REQUIRE(this->read_file(entry + "/output.info") == "info");
+	REQUIRE(filesystem::exists(entry + "/usable"));
+	std::vector<ArchiveChunk> chunks;
+	REQUIRE(chunk_index_load(entry + "/staging.tar.chunks", &chunks));
+	uint64_t size = 0;
+	for(const auto &chunk : chunks) {
+		REQUIRE(filesystem::exists(this->cache + "/chunks/" + chunk_path(chunk.hash)));
+		size += chunk.size;
+	}
+	REQUIRE(size == 100000);
+	REQUIRE(this->stdout_buffer.str() == "");
+}
@@ -0,0 +1,56 @@
+#define CATCH_CONFIG_MAIN
+
+#include "cachestats.hpp"
+#include "logger.hpp"
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <sstream>
+
+using namespace buildsys;
+using std::chrono::milliseconds;
+
+class CacheStatsTestsFixture
+{
+protected:
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+public:
+	CacheStatsTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		CacheStats::get()->reset();
+	}
+	~CacheStatsTestsFixture()
+	{
+		std::cout.rdbuf(this->coutbuf);
+	}
+};
+
+TEST_CASE_METHOD(CacheStatsTestsFixture, "Test CacheStats::summary()", "")
+{
+	CacheStats::get()->add("http://central");
+	CacheStats::get()->add("http://mirror");
+	CacheStats::get()->add("file:///unused");
+	CacheStats::get()->summary(&this->logger);
+	REQUIRE(this->stdout_buffer.str() == "");
+
+	CacheStats::get()->probed("http://mirror", true, milliseconds(10));
+	CacheStats::get()->probed("http://central", false, milliseconds(40));
+	CacheStats::get()->probed("http://mirror", false, milliseconds(20));
+	CacheStats::get()->probed("http://central", true, milliseconds(50));
+	CacheStats::get()->probed("http://central", true, milliseconds(60));
+	CacheStats::get()->indexed("http://mirror");
+	CacheStats::get()->used("http://mirror");
+	CacheStats::get()->used("http://central");
+	CacheStats::get()->summary(&this->logger);
+	REQUIRE(this->stdout_buffer.str() ==
+	        "test: Build cache http://central: 3 lookups (0 answered by the index), "
+	        "2 hits, 1 used, 50ms average latency\n"
+	        "test: Build cache http://mirror: 3 lookups (1 answered by the index), "
+	        "1 hits, 1 used, 15ms average latency\n");
+}
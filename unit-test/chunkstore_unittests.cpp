@@ -0,0 +1,169 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "chunkstore.hpp"
+#include <catch2/catch.hpp>
+#include <fcntl.h>
+#include <fstream>
+#include <random>
+#include <set>
+#include <unistd.h>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class ChunkStoreTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("chunkstore_test_dir")};
+	std::string store{cwd + "/store"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	//! Write a file of random (but always the same) data
+	std::string write_random(const std::string &name, size_t size, size_t insert_at = 0)
+	{
+		std::mt19937 gen(1234);
+		std::string data(size, '\0');
+		for(auto &c : data) {
+			c = static_cast<char>(gen());
+		}
+		if(insert_at != 0) {
+			data.insert(insert_at, "inserted");
+		}
+		std::string path = this->cwd + "/" + name;
+		std::ofstream(path, std::ios::binary) << data;
+		return path;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+	std::vector<ArchiveChunk> add(const std::string &path)
+	{
+		std::vector<ArchiveChunk> chunks;
+		int fd = open(path.c_str(), O_RDONLY);
+		REQUIRE(chunk_store_add(this->store, fd, &chunks, &this->logger));
+		close(fd);
+		return chunks;
+	}
+
+public:
+	ChunkStoreTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->cwd);
+	}
+	~ChunkStoreTestsFixture()
+	{
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(ChunkStoreTestsFixture, "Test chunk_split()", "")
+{
+	std::string path = this->write_random("data", 8 * 1024 * 1024);
+	int fd = open(path.c_str(), O_RDONLY);
+	std::vector<size_t> sizes;
+	REQUIRE(chunk_split(fd, [&sizes](const char *, size_t len) {
+		sizes.push_back(len);
+		return true;
+	}));
+	close(fd);
+	size_t total = 0;
+	for(size_t i = 0; i < sizes.size(); i++) {
+		if(i + 1 < sizes.size()) {
+			REQUIRE(sizes.at(i) >= 16 * 1024);
+		}
+		REQUIRE(sizes.at(i) <= 256 * 1024);
+		total += sizes.at(i);
+	}
+	REQUIRE(total == 8 * 1024 * 1024);
+	// Around 64KiB on average
+	REQUIRE(sizes.size() > 64);
+	REQUIRE(sizes.size() < 256);
+}
+
+TEST_CASE_METHOD(ChunkStoreTestsFixture, "Test an insertion only changes nearby chunks", "")
+{
+	auto before = this->add(this->write_random("before", 4 * 1024 * 1024));
+	auto after = this->add(this->write_random("after", 4 * 1024 * 1024, 2 * 1024 * 1024));
+	std::set<std::string> known;
+	for(const auto &chunk : before) {
+		known.insert(chunk.hash);
+	}
+	size_t changed = 0;
+	for(const auto &chunk : after) {
+		changed += known.count(chunk.hash) == 0 ? 1 : 0;
+	}
+	REQUIRE(changed >= 1);
+	REQUIRE(changed <= 2);
+}
+
+TEST_CASE_METHOD(ChunkStoreTestsFixture, "Test chunk_store_assemble()", "")
+{
+	std::string path = this->write_random("data", 1024 * 1024);
+	auto chunks = this->add(path);
+	for(const auto &chunk : chunks) {
+		REQUIRE(chunk_store_has(this->store, chunk.hash));
+	}
+	REQUIRE(chunk_store_assemble(this->store, chunks, this->cwd + "/out", &this->logger));
+	REQUIRE(this->read_file(this->cwd + "/out") == this->read_file(path));
+
+	// A missing chunk fails, leaving nothing behind
+	filesystem::remove(this->store + "/" + chunk_path(chunks.back().hash));
+	REQUIRE(!chunk_store_assemble(this->store, chunks, this->cwd + "/out", &this->logger));
+	REQUIRE(!filesystem::exists(this->cwd + "/out"));
+	REQUIRE(this->stdout_buffer.str().find("Cannot read chunk") != std::string::npos);
+}
+
+TEST_CASE_METHOD(ChunkStoreTestsFixture, "Test chunk_store_import()", "")
+{
+	std::string path = this->write_random("data", 1000);
+	auto chunks = this->add(path);
+	REQUIRE(chunks.size() == 1);
+	filesystem::remove_all(this->store);
+
+	std::string fetched = this->cwd + "/fetched";
+	filesystem::copy_file(path, fetched);
+	REQUIRE(chunk_store_import(this->store, chunks.at(0).hash, fetched, &this->logger));
+	REQUIRE(chunk_store_has(this->store, chunks.at(0).hash));
+	REQUIRE(!filesystem::exists(fetched));
+
+	std::ofstream(fetched) << "corrupt";
+	std::string other(64, 'a');
+	REQUIRE(!chunk_store_import(this->store, other, fetched, &this->logger));
+	REQUIRE(!chunk_store_has(this->store, other));
+	REQUIRE(this->stdout_buffer.str() ==
+	        "test: " + fetched + ": Chunk does not match its hash\n");
+}
+
+TEST_CASE_METHOD(ChunkStoreTestsFixture, "Test chunk_index_load()", "")
+{
+	std::vector<ArchiveChunk> chunks = {
+	    {std::string(64, 'a'), 10},
+	    {std::string(64, 'b'), 20},
+	};
+	std::string index = this->cwd + "/index";
+	int fd = open(index.c_str(), O_WRONLY | O_CREAT, 0644);
+	REQUIRE(chunk_index_write(fd, chunks));
+	close(fd);
+	std::vector<ArchiveChunk> loaded;
+	REQUIRE(chunk_index_load(index, &loaded));
+	REQUIRE(loaded.size() == 2);
+	REQUIRE(loaded.at(1).hash == std::string(64, 'b'));
+	REQUIRE(loaded.at(1).size == 20);
+
+	std::ofstream(index) << "../../etc/passwd 10\n";
+	REQUIRE(!chunk_index_load(index, &loaded));
+	REQUIRE(!chunk_index_load(this->cwd + "/missing", &loaded));
+}
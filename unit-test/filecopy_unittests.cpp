@@ -0,0 +1,169 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "filecopy.hpp"
+#include <catch2/catch.hpp>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/stat.h>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class FileCopyTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("filecopy_test_dir")};
+	std::string src{cwd + "/src"};
+	std::string dst{cwd + "/dst"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	void write_file(const std::string &path, const std::string &contents)
+	{
+		filesystem::create_directories(filesystem::path(path).parent_path());
+		std::ofstream file(path);
+		file << contents;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+	void set_mtime(const std::string &path, time_t mtime)
+	{
+		struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+		utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW);
+	}
+
+	time_t get_mtime(const std::string &path)
+	{
+		struct stat st = {};
+		lstat(path.c_str(), &st);
+		return st.st_mtim.tv_sec;
+	}
+
+public:
+	FileCopyTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->src);
+		filesystem::create_directories(this->dst);
+	}
+	~FileCopyTestsFixture()
+	{
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(FileCopyTestsFixture, "Test copy_path() copies a tree", "")
+{
+	this->write_file(this->src + "/usr/bin/tool", "#!/bin/sh\n");
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", std::string(100000, 'x'));
+	filesystem::create_directories(this->src + "/usr/share/empty_dir");
+	filesystem::create_symlink("libfoo.so.1", this->src + "/usr/lib/libfoo.so");
+	filesystem::create_hard_link(this->src + "/usr/bin/tool", this->src + "/usr/bin/tool2");
+	filesystem::permissions(this->src + "/usr/bin/tool", filesystem::perms::owner_all);
+	this->set_mtime(this->src + "/usr/bin/tool", 1000000);
+	this->set_mtime(this->src + "/usr", 2000000);
+
+	REQUIRE(copy_path(this->src + "/usr", this->dst, &this->logger));
+	REQUIRE(this->stdout_buffer.str() == "");
+
+	std::string usr = this->dst + "/usr";
+	REQUIRE(this->read_file(usr + "/bin/tool") == "#!/bin/sh\n");
+	REQUIRE(this->read_file(usr + "/lib/libfoo.so.1") == std::string(100000, 'x'));
+	REQUIRE(filesystem::is_directory(usr + "/share/empty_dir"));
+	REQUIRE(filesystem::read_symlink(usr + "/lib/libfoo.so") == "libfoo.so.1");
+	REQUIRE(filesystem::equivalent(usr + "/bin/tool", usr + "/bin/tool2"));
+	REQUIRE(filesystem::status(usr + "/bin/tool").permissions() ==
+	        filesystem::perms::owner_all);
+	REQUIRE(this->get_mtime(usr + "/bin/tool") == 1000000);
+	REQUIRE(this->get_mtime(usr) == 2000000);
+
+	// Copying to a path that does not exist creates it
+	REQUIRE(copy_path(this->src + "/usr/", this->dst + "/other", &this->logger));
+	REQUIRE(this->read_file(this->dst + "/other/bin/tool") == "#!/bin/sh\n");
+}
+
+TEST_CASE_METHOD(FileCopyTestsFixture, "Test copy_path() following symbolic links", "")
+{
+	this->write_file(this->src + "/dir/file", "data");
+	filesystem::create_symlink("file", this->src + "/dir/link");
+	filesystem::create_symlink("dir", this->src + "/dirlink");
+
+	CopyOptions options;
+	options.dereference = true;
+	REQUIRE(copy_path(this->src + "/dirlink", this->dst, &this->logger, options));
+	REQUIRE(filesystem::is_directory(this->dst + "/dirlink"));
+	REQUIRE(!filesystem::is_symlink(this->dst + "/dirlink/link"));
+	REQUIRE(this->read_file(this->dst + "/dirlink/link") == "data");
+}
+
+TEST_CASE_METHOD(FileCopyTestsFixture, "Test copy_path() only replaces older files", "")
+{
+	this->write_file(this->src + "/dir/newer", "new");
+	this->write_file(this->src + "/dir/older", "new");
+	this->write_file(this->dst + "/dir/newer", "old");
+	this->write_file(this->dst + "/dir/older", "old");
+	this->set_mtime(this->src + "/dir/newer", 2000000);
+	this->set_mtime(this->dst + "/dir/newer", 1000000);
+	this->set_mtime(this->src + "/dir/older", 1000000);
+	this->set_mtime(this->dst + "/dir/older", 2000000);
+
+	REQUIRE(copy_path(this->src + "/dir", this->dst, &this->logger));
+	REQUIRE(this->read_file(this->dst + "/dir/newer") == "new");
+	REQUIRE(this->read_file(this->dst + "/dir/older") == "old");
+
+	CopyOptions options;
+	options.update = false;
+	REQUIRE(copy_path(this->src + "/dir", this->dst, &this->logger, options));
+	REQUIRE(this->read_file(this->dst + "/dir/older") == "new");
+}
+
+TEST_CASE_METHOD(FileCopyTestsFixture, "Test copy_path() replaces read-only files", "")
+{
+	this->write_file(this->src + "/file", "new");
+	this->write_file(this->dst + "/file", "old");
+	filesystem::permissions(this->dst + "/file", filesystem::perms::owner_read);
+
+	CopyOptions options;
+	options.update = false;
+	REQUIRE(copy_path(this->src + "/file", this->dst, &this->logger, options));
+	REQUIRE(this->read_file(this->dst + "/file") == "new");
+}
+
+TEST_CASE_METHOD(FileCopyTestsFixture, "Test copy_path() with many files", "")
+{
+	for(int i = 0; i < 1000; i++) {
+		this->write_file(this->src + "/tree/" + std::to_string(i % 10) + "/" +
+		                     std::to_string(i),
+		                 std::to_string(i));
+	}
+
+	REQUIRE(copy_path(this->src + "/tree", this->dst, &this->logger));
+	REQUIRE(this->stdout_buffer.str() == "");
+	for(int i = 0; i < 1000; i++) {
+		REQUIRE(this->read_file(this->dst + "/tree/" + std::to_string(i % 10) + "/" +
+		                        std::to_string(i)) == std::to_string(i));
+	}
+}
+
+TEST_CASE_METHOD(FileCopyTestsFixture, "Test copy_path() errors", "")
+{
+	REQUIRE(!copy_path(this->src + "/missing", this->dst, &this->logger));
+	REQUIRE(this->stdout_buffer.str().find("missing: Cannot stat") != std::string::npos);
+
+	CopyOptions options;
+	options.recursive = false;
+	REQUIRE(!copy_path(this->src, this->dst, &this->logger, options));
+	REQUIRE(this->stdout_buffer.str().find("Omitting directory") != std::string::npos);
+}
@@ -70,3 +70,23 @@ TEST_CASE_METHOD(HashTestsFixture, "Test hash_file() function for existent file"
 	std::string expected_hash = output.substr(0, output.find(' '));
 	REQUIRE(expected_hash == hash);
 }
+
+TEST_CASE_METHOD(HashTestsFixture, "Test HashStream class", "")
+{
+	HashStream hs;
+	REQUIRE(hs.hex() == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+
+	// Data may be added in pieces, and reading the digest does not disturb it
+	hs.update(std::string("This is some "));
+	std::string partial = hs.hex();
+	hs.update(std::string("test data.\n"));
+	REQUIRE(hs.hex() != partial);
+
+	std::string file_path = this->cwd + "/test_file.txt";
+	std::ofstream test_file;
+	test_file.open(file_path);
+	test_file << "This is some test data.\n";
+	test_file.close();
+
+	REQUIRE(hs.hex() == hash_file(file_path));
+}
@@ -0,0 +1,305 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "httpclient.hpp"
+#include <arpa/inet.h>
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <fcntl.h>
+#include <fstream>
+#include <mutex>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+//! A local HTTP server that serves one connection at a time
+class TestServer
+{
+private:
+	int listen_fd{-1};
+	std::thread thread;
+
+	static bool send_all(int fd, const std::string &data)
+	{
+		return send(fd, data.data(), data.size(), MSG_NOSIGNAL) ==
+		       static_cast<ssize_t>(data.size());
+	}
+
+	static std::string response(const std::string &status, const std::string &body,
+	                            const std::string &headers = "")
+	{
+		return "HTTP/1.1 " + status + "\r\nContent-Length: " +
+		       std::to_string(body.size()) + "\r\n" + headers + "\r\n" + body;
+	}
+
+	//! Answer the requests on a connection, returns false to stop serving
+	bool serve(int fd)
+	{
+		std::string request;
+		char buf[4096];
+		while(true) {
+			auto end = request.find("\r\n\r\n");
+			if(end == std::string::npos) {
+				ssize_t len = recv(fd, buf, sizeof(buf), 0);
+				if(len <= 0) {
+					return true;
+				}
+				request.append(buf, static_cast<size_t>(len));
+				continue;
+			}
+			auto space = request.find(' ');
+			std::string method = request.substr(0, space);
+			std::string path =
+			    request.substr(space + 1, request.find(' ', space + 1) - space - 1);
+			std::string headers = request.substr(0, end);
+			request.erase(0, end + 4);
+			this->requests++;
+			if(method == "PUT") {
+				auto length = headers.find("Content-Length: ");
+				size_t size = std::stoul(headers.substr(length + 16));
+				while(request.size() < size) {
+					ssize_t len = recv(fd, buf, sizeof(buf), 0);
+					if(len <= 0) {
+						return true;
+					}
+					request.append(buf, static_cast<size_t>(len));
+				}
+				std::unique_lock<std::mutex> lk(this->lock);
+				this->uploads.push_back({path, request.substr(0, size)});
+				lk.unlock();
+				request.erase(0, size);
+				bool forbidden = path == "/forbidden";
+				send_all(fd, response(forbidden ? "403 Forbidden" : "201 Created", ""));
+			} else if(method == "HEAD") {
+				// The headers of the GET response, without the body
+				std::string reply = path == "/file"
+				                        ? response("200 OK", "hello")
+				                        : response("404 Not Found", "not found");
+				send_all(fd, reply.substr(0, reply.find("\r\n\r\n") + 4));
+			} else if(path == "/file") {
+				send_all(fd, response("200 OK", "hello"));
+			} else if(path == "/chunked") {
+				send_all(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+				             "3\r\nhel\r\n8;ext=1\r\nlo world\r\n"
+				             "0\r\nX-Trailer: 1\r\n\r\n");
+			} else if(path == "/redirect") {
+				send_all(fd, response("302 Found", "moved", "Location: /file\r\n"));
+			} else if(path == "/close") {
+				// Close the connection without saying so, like an idle timeout
+				send_all(fd, response("200 OK", "closing"));
+				return true;
+			} else if(path == "/unframed") {
+				send_all(fd, "HTTP/1.0 200 OK\r\n\r\nuntil the end");
+				return true;
+			} else if(path == "/big") {
+				send_all(fd, response("200 OK", std::string(1024 * 1024, 'x')));
+			} else if(path == "/stop") {
+				send_all(fd, response("200 OK", "", "Connection: close\r\n"));
+				return false;
+			} else {
+				send_all(fd, response("404 Not Found", "not found"));
+			}
+		}
+	}
+
+public:
+	int port{0};
+	std::atomic<int> connections{0};
+	std::atomic<int> requests{0};
+	std::mutex lock;
+	//! The paths and bodies of the PUT requests, in order
+	std::vector<std::pair<std::string, std::string>> uploads;
+
+	TestServer()
+	{
+		this->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		struct sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t addr_len = sizeof(addr);
+		bind(this->listen_fd, reinterpret_cast<struct sockaddr *>(&addr), addr_len);
+		listen(this->listen_fd, 16);
+		getsockname(this->listen_fd, reinterpret_cast<struct sockaddr *>(&addr), &addr_len);
+		this->port = ntohs(addr.sin_port);
+		this->thread = std::thread([this]() {
+			while(true) {
+				int fd = accept(this->listen_fd, nullptr, nullptr);
+				if(fd < 0) {
+					return;
+				}
+				this->connections++;
+				bool more = this->serve(fd);
+				close(fd);
+				if(!more) {
+					return;
+				}
+			}
+		});
+	}
+	~TestServer()
+	{
+		Logger logger("stop");
+		int fd = open("/dev/null", O_WRONLY);
+		HttpClient::get()->fetch(this->url("/stop"), fd, &logger);
+		close(fd);
+		this->thread.join();
+		close(this->listen_fd);
+	}
+	std::string url(const std::string &path) const
+	{
+		return "http://127.0.0.1:" + std::to_string(this->port) + path;
+	}
+};
+
+class HttpClientTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("httpclient_test_dir")};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+	TestServer server;
+
+	//! Fetch a path from the test server, returning the status and the body
+	int fetch(const std::string &path, std::string *body)
+	{
+		std::string file = this->cwd + "/out";
+		int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		int status = HttpClient::get()->fetch(this->server.url(path), fd, &this->logger);
+		close(fd);
+		std::ifstream in(file);
+		*body = std::string((std::istreambuf_iterator<char>(in)),
+		                    std::istreambuf_iterator<char>());
+		return status;
+	}
+
+public:
+	HttpClientTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->cwd);
+	}
+	~HttpClientTestsFixture()
+	{
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE("Test HttpUrl::parse()", "")
+{
+	HttpUrl url;
+	REQUIRE(HttpUrl::parse("http://cache.example.com/ns/pkg", &url));
+	REQUIRE(url.host == "cache.example.com");
+	REQUIRE(url.port == "80");
+	REQUIRE(url.path == "/ns/pkg");
+	REQUIRE(HttpUrl::parse("HTTP://cache:8080", &url));
+	REQUIRE(url.host == "cache");
+	REQUIRE(url.port == "8080");
+	REQUIRE(url.path == "/");
+	REQUIRE(HttpUrl::parse("http://[::1]:81/a#b", &url));
+	REQUIRE(url.host == "::1");
+	REQUIRE(url.port == "81");
+	REQUIRE(url.path == "/a");
+	REQUIRE(!HttpUrl::parse("https://cache/a", &url));
+	REQUIRE(!HttpUrl::parse("file:///cache/a", &url));
+	REQUIRE(!HttpUrl::parse("http://user@cache/a", &url));
+	REQUIRE(!HttpUrl::parse("http://cache:/a", &url));
+	REQUIRE(!HttpUrl::parse("http:///a", &url));
+	REQUIRE(HttpClient::supported("http://cache/a"));
+	REQUIRE(!HttpClient::supported("ftp://cache/a"));
+}
+
+TEST_CASE_METHOD(HttpClientTestsFixture, "Test HttpClient::fetch() reuses connections", "")
+{
+	std::string body;
+	REQUIRE(this->fetch("/file", &body) == 200);
+	REQUIRE(body == "hello");
+	REQUIRE(this->fetch("/chunked", &body) == 200);
+	REQUIRE(body == "hello world");
+	// A miss writes nothing
+	REQUIRE(this->fetch("/missing", &body) == 404);
+	REQUIRE(body.empty());
+	REQUIRE(this->fetch("/redirect", &body) == 200);
+	REQUIRE(body == "hello");
+	REQUIRE(this->fetch("/big", &body) == 200);
+	REQUIRE(body == std::string(1024 * 1024, 'x'));
+	REQUIRE(this->server.connections == 1);
+	REQUIRE(this->server.requests == 6);
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(HttpClientTestsFixture, "Test HttpClient::fetch() reconnects", "")
+{
+	std::string body;
+	REQUIRE(this->fetch("/close", &body) == 200);
+	REQUIRE(body == "closing");
+	// The kept connection was closed by the server, the request is retried
+	REQUIRE(this->fetch("/file", &body) == 200);
+	REQUIRE(body == "hello");
+	REQUIRE(this->fetch("/unframed", &body) == 200);
+	REQUIRE(body == "until the end");
+	REQUIRE(this->fetch("/file", &body) == 200);
+	REQUIRE(body == "hello");
+	REQUIRE(this->server.connections == 3);
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(HttpClientTestsFixture, "Test HttpClient::fetch() errors", "")
+{
+	TestServer *stopped = new TestServer();
+	std::string url = stopped->url("/file");
+	delete stopped;
+	int fd = open("/dev/null", O_WRONLY);
+	REQUIRE(HttpClient::get()->fetch(url, fd, &this->logger) == -1);
+	REQUIRE(HttpClient::get()->fetch("https://127.0.0.1/", fd, &this->logger) == -1);
+	close(fd);
+	REQUIRE(this->stdout_buffer.str() ==
+	        "test: 127.0.0.1:" + url.substr(17, url.find('/', 17) - 17) +
+	            ": Cannot connect: Connection refused\n"
+	            "test: https://127.0.0.1/: Unsupported URL\n");
+}
+
+TEST_CASE_METHOD(HttpClientTestsFixture, "Test HttpClient::put()", "")
+{
+	std::string file = this->cwd + "/in";
+	std::ofstream(file) << "uploaded";
+	int fd = open(file.c_str(), O_RDONLY);
+	// The whole file is sent, whatever its offset
+	char c;
+	REQUIRE(read(fd, &c, 1) == 1);
+	REQUIRE(HttpClient::get()->put(this->server.url("/ns/pkg/staging.tar"), fd,
+	                               &this->logger) == 201);
+	REQUIRE(HttpClient::get()->put(this->server.url("/forbidden"), fd, &this->logger) ==
+	        403);
+	close(fd);
+	// The connection is kept for the next request
+	std::string body;
+	REQUIRE(this->fetch("/file", &body) == 200);
+	REQUIRE(this->server.connections == 1);
+	REQUIRE(this->server.uploads.size() == 2);
+	REQUIRE(this->server.uploads.at(0).first == "/ns/pkg/staging.tar");
+	REQUIRE(this->server.uploads.at(0).second == "uploaded");
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(HttpClientTestsFixture, "Test HttpClient::head()", "")
+{
+	REQUIRE(HttpClient::get()->head(this->server.url("/file"), &this->logger) == 200);
+	REQUIRE(HttpClient::get()->head(this->server.url("/missing"), &this->logger) == 404);
+	// The bodies were not waited for, the connection is still usable
+	std::string body;
+	REQUIRE(this->fetch("/file", &body) == 200);
+	REQUIRE(body == "hello");
+	REQUIRE(this->server.connections == 1);
+	REQUIRE(this->stdout_buffer.str() == "");
+}
@@ -0,0 +1,166 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "hash.hpp"
+#include "interfacedigest.hpp"
+#include "logger.hpp"
+#include "tar.hpp"
+#include <catch2/catch.hpp>
+#include <fstream>
+#include <link.h>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class InterfaceDigestTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("interfacedigest_test_dir")};
+	std::string src{cwd + "/src"};
+	std::string archive{cwd + "/test.tar"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	void write_file(const std::string &path, const std::string &contents)
+	{
+		filesystem::create_directories(filesystem::path(path).parent_path());
+		std::ofstream file(path);
+		file << contents;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+	//! A shared library loaded by the test (libcrypto, used for hashing)
+	static std::string shared_library()
+	{
+		std::string path;
+		dl_iterate_phdr(
+		    [](struct dl_phdr_info *info, size_t, void *data) {
+			    std::string name(info->dlpi_name); // NOLINT
+			    if(name.find("libcrypto.so") == std::string::npos) {
+				    return 0;
+			    }
+			    *static_cast<std::string *>(data) = name;
+			    return 1;
+		    },
+		    &path);
+		return path;
+	}
+
+	std::string digest()
+	{
+		std::string result;
+		REQUIRE(tar_create(this->src, this->archive, &this->logger));
+		REQUIRE(archive_interface_digest(this->archive, &result, &this->logger));
+		return result;
+	}
+
+public:
+	InterfaceDigestTestsFixture()
+	{
+		hash_setup();
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->src);
+	}
+	~InterfaceDigestTestsFixture()
+	{
+		hash_shutdown();
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(InterfaceDigestTestsFixture, "Test elf_interface() function", "")
+{
+	std::string library = shared_library();
+	REQUIRE(!library.empty());
+	std::string data = this->read_file(library);
+
+	std::vector<std::string> lines;
+	REQUIRE(elf_interface(data, &lines));
+	REQUIRE(std::is_sorted(lines.begin(), lines.end()));
+	auto has = [&lines](const std::string &start) {
+		return std::any_of(lines.begin(), lines.end(), [&start](const std::string &line) {
+			return line.compare(0, start.size(), start) == 0;
+		});
+	};
+	REQUIRE(has("soname libcrypto.so"));
+	REQUIRE(has("symbol EVP_sha256"));
+	// Symbols the library uses (but does not define) are not part of its interface
+	REQUIRE(!has("symbol malloc"));
+
+	// Changes that leave the symbols alone do not change the interface
+	std::vector<std::string> other;
+	REQUIRE(elf_interface(data + std::string(100, 'x'), &other));
+	REQUIRE(other == lines);
+
+	REQUIRE(!elf_interface(data.substr(0, 100), &other));
+	REQUIRE(other.empty());
+	REQUIRE(!elf_interface("INPUT(libfoo.so.1)\n", &other));
+	REQUIRE(!elf_interface("", &other));
+}
+
+TEST_CASE_METHOD(InterfaceDigestTestsFixture, "Test ar_symbols() function", "")
+{
+	// A symbol table with two symbols (both defined by the member at offset 100)
+	std::string table = std::string("\0\0\0\x02\0\0\0\x64\0\0\0\x64", 12) +
+	                    std::string("foo\0bar\0", 8);
+	// Name, date, uid, gid, mode, size and magic
+	std::string size = std::to_string(table.size());
+	std::string header = "/               " + std::string(12 + 6 + 6 + 8, ' ') + size +
+	                     std::string(10 - size.size(), ' ') + "`\n";
+	REQUIRE(header.size() == 60);
+
+	std::vector<std::string> symbols;
+	REQUIRE(ar_symbols("!<arch>\n" + header + table, &symbols));
+	REQUIRE(symbols == std::vector<std::string>{"bar", "foo"});
+
+	// Truncated, or without a symbol table
+	REQUIRE(!ar_symbols("!<arch>\n" + header + table.substr(0, 10), &symbols));
+	REQUIRE(symbols.empty());
+	header.replace(0, 16, "foo.o/          ");
+	REQUIRE(!ar_symbols("!<arch>\n" + header + table, &symbols));
+	REQUIRE(!ar_symbols("not an archive", &symbols));
+}
+
+TEST_CASE_METHOD(InterfaceDigestTestsFixture, "Test archive_interface_digest() function",
+                 "")
+{
+	std::string data = this->read_file(shared_library());
+	this->write_file(this->src + "/usr/include/foo.h", "int foo(void);\n");
+	this->write_file(this->src + "/usr/lib/pkgconfig/foo.pc", "Name: foo\n");
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", data);
+	filesystem::create_symlink("libfoo.so.1", this->src + "/usr/lib/libfoo.so");
+	std::string digest = this->digest();
+
+	// A new implementation of the library
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", data + "new");
+	REQUIRE(this->digest() == digest);
+
+	// Changes to headers, pkg-config files and links change the interface
+	this->write_file(this->src + "/usr/include/foo.h", "int foo(int);\n");
+	REQUIRE(this->digest() != digest);
+	this->write_file(this->src + "/usr/include/foo.h", "int foo(void);\n");
+	this->write_file(this->src + "/usr/lib/pkgconfig/foo.pc", "Name: bar\n");
+	REQUIRE(this->digest() != digest);
+	this->write_file(this->src + "/usr/lib/pkgconfig/foo.pc", "Name: foo\n");
+	filesystem::remove(this->src + "/usr/lib/libfoo.so");
+	REQUIRE(this->digest() != digest);
+	filesystem::create_symlink("libfoo.so.1", this->src + "/usr/lib/libfoo.so");
+	REQUIRE(this->digest() == digest);
+
+	// As does a library that is not one
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", "not a library");
+	REQUIRE(this->digest() != digest);
+
+	REQUIRE(!archive_interface_digest(this->cwd + "/missing.tar", &digest, &this->logger));
+}
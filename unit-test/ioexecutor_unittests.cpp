@@ -0,0 +1,105 @@
+#define CATCH_CONFIG_MAIN
+
+#include "ioexecutor.hpp"
+#include <atomic>
+#include <catch2/catch.hpp>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace buildsys;
+
+class IoExecutorTestsFixture
+{
+public:
+	IoExecutorTestsFixture()
+	{
+		// A single worker, so the order tasks are run in is predictable
+		IoExecutor::set_jobs(1);
+	}
+};
+
+TEST_CASE_METHOD(IoExecutorTestsFixture, "Test IoBatch class", "")
+{
+	std::atomic<int> count{0};
+	std::atomic<int> running{0};
+	std::atomic<int> max_running{0};
+	auto task = [&]() {
+		int now = ++running;
+		if(now > max_running) {
+			max_running = now;
+		}
+		count++;
+		running--;
+		return true;
+	};
+
+	IoBatch batch;
+	for(int i = 0; i < 20; i++) {
+		batch.add(static_cast<dev_t>(i % 3), task);
+	}
+	REQUIRE(batch.wait());
+	REQUIRE(count == 20);
+	REQUIRE(max_running == 1);
+	// Waiting again is harmless
+	REQUIRE(batch.wait());
+}
+
+TEST_CASE_METHOD(IoExecutorTestsFixture, "Test IoBatch class with a failing task", "")
+{
+	std::atomic<int> count{0};
+	IoBatch batch;
+	batch.add(1, [&count] {
+		count++;
+		return true;
+	});
+	batch.add(1, [&count] {
+		count++;
+		return false;
+	});
+	batch.add(1, [&count]() -> bool {
+		count++;
+		throw std::runtime_error("Test exception");
+	});
+	REQUIRE(!batch.wait());
+	// The other tasks are still run
+	REQUIRE(count == 3);
+}
+
+TEST_CASE_METHOD(IoExecutorTestsFixture, "Test IoExecutor serves devices in turn", "")
+{
+	std::promise<void> gate;
+	std::shared_future<void> released = gate.get_future().share();
+	std::mutex lock;
+	std::vector<std::string> order;
+	auto task = [&](const std::string &name) {
+		return [&, name] {
+			std::unique_lock<std::mutex> lk(lock);
+			order.push_back(name);
+			return true;
+		};
+	};
+
+	IoBatch batch;
+	// Hold up the worker until everything is queued
+	batch.add(1, [released] {
+		released.wait();
+		return true;
+	});
+	batch.add(1, task("a1"));
+	batch.add(1, task("a2"));
+	batch.add(1, task("a3"));
+	batch.add(2, task("b1"));
+	batch.add(3, task("c1"));
+	gate.set_value();
+	REQUIRE(batch.wait());
+
+	REQUIRE(order == std::vector<std::string>{"b1", "c1", "a1", "a2", "a3"});
+}
+
+TEST_CASE("Test IoExecutor::device() function", "")
+{
+	REQUIRE(IoExecutor::device(".") != 0);
+	REQUIRE(IoExecutor::device("qwekjh123/missing") == 0);
+}
@@ -0,0 +1,136 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "localcache.hpp"
+#include <catch2/catch.hpp>
+#include <fstream>
+#include <sys/stat.h>
+#include <thread>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class LocalCacheTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("localcache_test_dir")};
+	std::string cache{cwd + "/cache"};
+	std::string out{cwd + "/out"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	void write_file(const std::string &path, const std::string &contents)
+	{
+		filesystem::create_directories(filesystem::path(path).parent_path());
+		std::ofstream file(path);
+		file << contents;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+public:
+	LocalCacheTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->out);
+	}
+	~LocalCacheTestsFixture()
+	{
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(LocalCacheTestsFixture, "Test local_cache_put() and local_cache_get()", "")
+{
+	std::string key = "ns/pkg/abcd";
+	std::vector<LocalCacheFile> got = {
+	    {"staging.tar", this->out + "/staging.tar", false},
+	    {"staging.tar.idx", this->out + "/staging.tar.idx", true},
+	    {"install.tar", this->out + "/install.tar", false},
+	};
+	REQUIRE(!local_cache_get(this->cache, key, got, &this->logger));
+
+	this->write_file(this->cwd + "/build/staging.tar", "staging");
+	this->write_file(this->cwd + "/build/install.tar", "install");
+	std::vector<LocalCacheFile> built = {
+	    {"staging.tar", this->cwd + "/build/staging.tar", false},
+	    {"staging.tar.idx", this->cwd + "/build/staging.tar.idx", true},
+	    {"install.tar", this->cwd + "/build/install.tar", false},
+	};
+	REQUIRE(local_cache_put(this->cache, key, built, UINT64_MAX, &this->logger));
+	REQUIRE(this->read_file(this->cache + "/" + key + "/size") == "14\n");
+	REQUIRE(!filesystem::exists(this->cache + "/" + key + "/staging.tar.idx"));
+	// Adding the same entry again keeps the existing one
+	REQUIRE(local_cache_put(this->cache, key, built, UINT64_MAX, &this->logger));
+
+	// A stale optional file is removed
+	this->write_file(this->out + "/staging.tar.idx", "stale");
+	REQUIRE(local_cache_get(this->cache, key, got, &this->logger));
+	REQUIRE(this->read_file(this->out + "/staging.tar") == "staging");
+	REQUIRE(this->read_file(this->out + "/install.tar") == "install");
+	REQUIRE(!filesystem::exists(this->out + "/staging.tar.idx"));
+	// The files are linked, not copied
+	struct stat cached = {};
+	struct stat linked = {};
+	REQUIRE(stat((this->cache + "/" + key + "/staging.tar").c_str(), &cached) == 0);
+	REQUIRE(stat((this->out + "/staging.tar").c_str(), &linked) == 0);
+	REQUIRE(cached.st_ino == linked.st_ino);
+
+	// Nothing is left behind when a file is missing from the entry
+	filesystem::remove(this->out + "/staging.tar");
+	filesystem::remove(this->out + "/install.tar");
+	filesystem::remove(this->cache + "/" + key + "/install.tar");
+	REQUIRE(!local_cache_get(this->cache, key, got, &this->logger));
+	REQUIRE(!filesystem::exists(this->out + "/staging.tar"));
+
+	// A missing required file can not be added
+	filesystem::remove(this->cwd + "/build/install.tar");
+	REQUIRE(!local_cache_put(this->cache, "ns/pkg/efgh", built, UINT64_MAX, &this->logger));
+	REQUIRE(!filesystem::exists(this->cache + "/ns/pkg/efgh"));
+	REQUIRE(this->stdout_buffer.str() == "test: " + this->cwd +
+	                                         "/build/install.tar: Cannot stat: No such "
+	                                         "file or directory\n");
+}
+
+TEST_CASE_METHOD(LocalCacheTestsFixture, "Test local_cache_put() evicts old entries", "")
+{
+	for(const std::string key : {"ns/a/1", "ns/b/1", "ns/c/1"}) {
+		std::string file = this->cwd + "/" + key + "/staging.tar";
+		this->write_file(file, std::string(1000, 'x'));
+		REQUIRE(local_cache_put(this->cache, key, {{"staging.tar", file, false}}, 2500,
+		                        &this->logger));
+		// Entry timestamps come from the coarse kernel clock
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		if(key == "ns/b/1") {
+			// Using the first entry makes the second the least recently used
+			REQUIRE(local_cache_get(this->cache, "ns/a/1",
+			                        {{"staging.tar", this->out + "/a.tar", false}},
+			                        &this->logger));
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+	}
+	REQUIRE(filesystem::exists(this->cache + "/ns/a/1"));
+	REQUIRE(!filesystem::exists(this->cache + "/ns/b/1"));
+	REQUIRE(filesystem::exists(this->cache + "/ns/c/1"));
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(LocalCacheTestsFixture, "Test local_cache_link()", "")
+{
+	this->write_file(this->cwd + "/src", "contents");
+	this->write_file(this->out + "/dst", "old");
+	REQUIRE(local_cache_link(this->cwd + "/src", this->out + "/dst", &this->logger));
+	REQUIRE(this->read_file(this->out + "/dst") == "contents");
+	REQUIRE(!local_cache_link(this->cwd + "/missing", this->out + "/dst", &this->logger));
+	REQUIRE(this->read_file(this->out + "/dst") == "contents");
+}
@@ -135,6 +135,89 @@ TEST_CASE_METHOD(PackageTestsFixture, "Test relative_fetch_path method (package
 	REQUIRE(p.relative_fetch_path(file_path2, true) == ("./" + file_path1));
 }
 
+TEST_CASE_METHOD(PackageTestsFixture, "Test isDependedOn method", "")
+{
+	Package p1(this->ns, "test_package1", ".", ".");
+	Package p2(this->ns, "test_package2", ".", ".");
+
+	REQUIRE(!p1.isDependedOn());
+	REQUIRE(!p2.isDependedOn());
+
+	p2.depend(&p1, false);
+
+	REQUIRE(p1.isDependedOn());
+	REQUIRE(!p2.isDependedOn());
+}
+
+TEST_CASE_METHOD(PackageTestsFixture, "Test named outputs", "")
+{
+	Package p1(this->ns, "test_package1", ".", ".");
+	Package p2(this->ns, "test_package2", ".", ".");
+
+	REQUIRE(!p1.hasOutput("dev"));
+	p1.addOutput("dev", {"./usr/include/*", "/usr/lib/*.a"});
+	p1.addOutput("bin", {"usr/bin/*"});
+	REQUIRE(p1.hasOutput("dev"));
+	REQUIRE(p1.hasOutput("bin"));
+
+	auto filter = p1.outputFilter({"dev"});
+	REQUIRE(filter("usr/include/foo.h"));
+	REQUIRE(filter("usr/include/sub/bar.h"));
+	REQUIRE(filter("usr/lib/libfoo.a"));
+	REQUIRE(!filter("usr/lib/libfoo.so"));
+	REQUIRE(!filter("usr/bin/tool"));
+	REQUIRE(p1.outputFilter({"dev", "bin"})("usr/bin/tool"));
+	REQUIRE_THROWS_AS(p1.outputFilter({"doc"}), CustomException);
+
+	std::string path;
+	std::string hash;
+	REQUIRE(!p1.outputKey("dev", &path, &hash));
+	REQUIRE_THROWS_AS(p1.outputKey("doc", &path, &hash), CustomException);
+
+	p2.depend(&p1, false, {"dev"});
+	REQUIRE(p2.getDepends().front().getOutputs() == std::vector<std::string>{"dev"});
+}
+
+TEST_CASE_METHOD(PackageTestsFixture, "Test extractsHashedInterface method", "")
+{
+	Package lib(this->ns, "test_lib", ".", ".");
+	Package p1(this->ns, "test_package1", ".", ".");
+	Package p2(this->ns, "test_package2", ".", ".");
+
+	lib.setHashInterface(true);
+	p1.depend(&lib, false);
+	p2.depend(&p1, false);
+
+	// Only packages extracting the installed files of their dependencies are affected
+	REQUIRE(!p1.extractsHashedInterface());
+	REQUIRE(!p2.extractsHashedInterface());
+
+	// Directly
+	p1.setDepsExtract("deps", false);
+	REQUIRE(p1.extractsHashedInterface());
+
+	// Through another package
+	p2.setDepsExtract("deps", false);
+	REQUIRE(p2.extractsHashedInterface());
+
+	// Unless only the listed dependencies are extracted
+	p2.setDepsExtract("deps", true);
+	REQUIRE(!p2.extractsHashedInterface());
+
+	lib.setHashInterface(false);
+	REQUIRE(!p1.extractsHashedInterface());
+}
+
+TEST_CASE_METHOD(PackageTestsFixture, "Test addStageFilter method", "")
+{
+	Package p(this->ns, "test_package", ".", ".");
+
+	REQUIRE(p.getStageFilter().empty());
+	p.addStageFilter({"./usr/include/*", "/usr/lib/*.so*"});
+	std::vector<std::string> expected{"usr/include/*", "usr/lib/*.so*"};
+	REQUIRE(p.getStageFilter() == expected);
+}
+
 TEST_CASE_METHOD(PackageTestsFixture, "Test buildInfo method", "")
 {
 	Package p(this->ns, "test_package", ".", ".");
@@ -165,5 +248,23 @@ TEST_CASE_METHOD(PackageTestsFixture, "Test buildInfo method", "")
 	REQUIRE(type == Package::BuildInfoType::Output);
 	REQUIRE(path == "output/test_namespace/test_package/work/.output.info");
 	REQUIRE(hash == "8b7df143d91c716ecfa5fc1730022f6b421b05cedee8fd52b1fc65a96030ad52");
+
+	// A build key is used in place of the build info
+	std::string file_path2 = "output/test_namespace/test_package/work/.build.key";
+	std::ofstream test_file2;
+	test_file2.open(file_path2);
+	test_file2 << "blah";
+	test_file2.close();
+
+	path = "";
+	hash = "";
+	type = p.buildInfo(&path, &hash);
+	REQUIRE(type == Package::BuildInfoType::Output);
+
+	p.setHashOutput(false);
+	type = p.buildInfo(&path, &hash);
+	REQUIRE(type == Package::BuildInfoType::Key);
+	REQUIRE(path == file_path2);
+	REQUIRE(hash == "8b7df143d91c716ecfa5fc1730022f6b421b05cedee8fd52b1fc65a96030ad52");
 }
 
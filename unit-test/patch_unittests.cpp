@@ -0,0 +1,219 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "patch.hpp"
+#include <catch2/catch.hpp>
+#include <fstream>
+#include <sys/stat.h>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class PatchTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("patch_test_dir")};
+	std::string dir{cwd + "/src"};
+	std::string patch_file{cwd + "/test.patch"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	void write_file(const std::string &path, const std::string &contents)
+	{
+		filesystem::create_directories(filesystem::path(path).parent_path());
+		std::ofstream file(path);
+		file << contents;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+	std::string numbered(int first, int last)
+	{
+		std::string result;
+		for(int i = first; i <= last; i++) {
+			result += "line " + std::to_string(i) + "\n";
+		}
+		return result;
+	}
+
+public:
+	PatchTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->dir);
+	}
+	~PatchTestsFixture()
+	{
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(PatchTestsFixture, "Test patch_apply() with a git patch", "")
+{
+	this->write_file(this->dir + "/lib/a.c", this->numbered(1, 20));
+	this->write_file(this->dir + "/b.c", "old\n");
+	chmod((this->dir + "/b.c").c_str(), 0755);
+	this->write_file(this->dir + "/gone.c", "one\ntwo\n");
+	this->write_file(this->patch_file, "From 0123 Mon Sep 17 00:00:00 2001\n"
+	                                   "Subject: [PATCH] Test\n"
+	                                   "\n"
+	                                   "---\n"
+	                                   " lib/a.c | 3 ++-\n"
+	                                   "\n"
+	                                   "diff --git a/lib/a.c b/lib/a.c\n"
+	                                   "index 1111111..2222222 100644\n"
+	                                   "--- a/lib/a.c\n"
+	                                   "+++ b/lib/a.c\n"
+	                                   "@@ -2,3 +2,4 @@\n"
+	                                   " line 2\n"
+	                                   "-line 3\n"
+	                                   "+line three\n"
+	                                   "+line 3.5\n"
+	                                   " line 4\n"
+	                                   "@@ -17,4 +18,3 @@\n"
+	                                   " line 17\n"
+	                                   "-line 18\n"
+	                                   " line 19\n"
+	                                   " line 20\n"
+	                                   "diff --git a/b.c b/b.c\n"
+	                                   "--- a/b.c\n"
+	                                   "+++ b/b.c\n"
+	                                   "@@ -1 +1 @@\n"
+	                                   "-old\n"
+	                                   "+new\n"
+	                                   "\\ No newline at end of file\n"
+	                                   "diff --git a/new/c.h b/new/c.h\n"
+	                                   "new file mode 100755\n"
+	                                   "--- /dev/null\n"
+	                                   "+++ b/new/c.h\n"
+	                                   "@@ -0,0 +1,2 @@\n"
+	                                   "+#define C 1\n"
+	                                   "+\n"
+	                                   "diff --git a/gone.c b/gone.c\n"
+	                                   "deleted file mode 100644\n"
+	                                   "--- a/gone.c\n"
+	                                   "+++ /dev/null\n"
+	                                   "@@ -1,2 +0,0 @@\n"
+	                                   "-one\n"
+	                                   "-two\n"
+	                                   "-- \n"
+	                                   "2.30.0\n");
+
+	Patch patch;
+	REQUIRE(patch.parse(this->patch_file, 1, &this->logger));
+	REQUIRE(patch.paths() ==
+	        std::vector<std::string>{"lib/a.c", "b.c", "new/c.h", "gone.c"});
+	REQUIRE(patch.apply(this->dir, &this->logger));
+
+	std::string expected = this->numbered(1, 20);
+	expected.replace(expected.find("line 3\n"), 7, "line three\nline 3.5\n");
+	expected.erase(expected.find("line 18\n"), 8);
+	REQUIRE(this->read_file(this->dir + "/lib/a.c") == expected);
+	REQUIRE(this->read_file(this->dir + "/b.c") == "new");
+	struct stat st = {};
+	REQUIRE(stat((this->dir + "/b.c").c_str(), &st) == 0);
+	REQUIRE((st.st_mode & 07777) == 0755);
+	REQUIRE(this->read_file(this->dir + "/new/c.h") == "#define C 1\n\n");
+	REQUIRE(stat((this->dir + "/new/c.h").c_str(), &st) == 0);
+	REQUIRE((st.st_mode & 07777) == 0755);
+	REQUIRE(!filesystem::exists(this->dir + "/gone.c"));
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(PatchTestsFixture, "Test patch_apply() finds moved hunks", "")
+{
+	// The hunks apply 5 lines later than the patch expects, like 'patch -p0'
+	this->write_file(this->dir + "/a.c", this->numbered(1, 30));
+	this->write_file(this->patch_file, "--- a.c.orig\t2020-01-01 00:00:00.000000000 +1200\n"
+	                                   "+++ a.c\t2020-01-01 00:00:00.000000000 +1200\n"
+	                                   "@@ -3,3 +3,3 @@\n"
+	                                   " line 8\n"
+	                                   "-line 9\n"
+	                                   "+line nine\n"
+	                                   " line 10\n"
+	                                   "@@ -11,2 +11,3 @@\n"
+	                                   " line 16\n"
+	                                   "+line 16.5\n"
+	                                   " line 17\n");
+	REQUIRE(patch_apply(this->patch_file, this->dir, 0, &this->logger));
+
+	std::string expected = this->numbered(1, 30);
+	expected.replace(expected.find("line 9\n"), 7, "line nine\n");
+	expected.insert(expected.find("line 17\n"), "line 16.5\n");
+	REQUIRE(this->read_file(this->dir + "/a.c") == expected);
+	REQUIRE(!filesystem::exists(this->dir + "/a.c.orig"));
+}
+
+TEST_CASE_METHOD(PatchTestsFixture, "Test patch_apply() changes nothing on failure", "")
+{
+	this->write_file(this->dir + "/a.c", "a\nb\nc\n");
+	this->write_file(this->dir + "/b.c", "a\nb\nc\n");
+	this->write_file(this->patch_file, "--- a/a.c\n"
+	                                   "+++ b/a.c\n"
+	                                   "@@ -1,3 +1,3 @@\n"
+	                                   " a\n"
+	                                   "-b\n"
+	                                   "+B\n"
+	                                   " c\n"
+	                                   "--- a/b.c\n"
+	                                   "+++ b/b.c\n"
+	                                   "@@ -1,3 +1,3 @@\n"
+	                                   " a\n"
+	                                   "-x\n"
+	                                   "+X\n"
+	                                   " c\n");
+	REQUIRE(!patch_apply(this->patch_file, this->dir, 1, &this->logger));
+	REQUIRE(this->read_file(this->dir + "/a.c") == "a\nb\nc\n");
+	REQUIRE(this->read_file(this->dir + "/b.c") == "a\nb\nc\n");
+	REQUIRE(this->stdout_buffer.str() ==
+	        "test: " + this->patch_file + ": Hunk #1 for b.c does not apply at line 1\n");
+
+	// An applied patch does not apply again
+	this->write_file(this->dir + "/b.c", "a\nx\nc\n");
+	REQUIRE(patch_apply(this->patch_file, this->dir, 1, &this->logger));
+	REQUIRE(this->read_file(this->dir + "/a.c") == "a\nB\nc\n");
+	REQUIRE(this->read_file(this->dir + "/b.c") == "a\nX\nc\n");
+	REQUIRE(!patch_apply(this->patch_file, this->dir, 1, &this->logger));
+}
+
+TEST_CASE_METHOD(PatchTestsFixture, "Test patch_apply() with unusable patches", "")
+{
+	this->write_file(this->dir + "/a.c", "a\n");
+	Patch patch;
+
+	this->write_file(this->patch_file, "Nothing to see here\n");
+	REQUIRE(!patch.parse(this->patch_file, 1, &this->logger));
+
+	this->write_file(this->patch_file, "--- a/../a.c\n"
+	                                   "+++ b/../a.c\n"
+	                                   "@@ -1 +1 @@\n"
+	                                   "-a\n"
+	                                   "+b\n");
+	REQUIRE(!patch.parse(this->patch_file, 1, &this->logger));
+	REQUIRE(patch.parse(this->patch_file, 2, &this->logger));
+
+	this->write_file(this->patch_file, "--- a.c\n"
+	                                   "+++ a.c\n"
+	                                   "@@ -1 +1 @@\n"
+	                                   "-a\n");
+	REQUIRE(!patch.parse(this->patch_file, 0, &this->logger));
+
+	this->write_file(this->patch_file, "--- a/missing.c\n"
+	                                   "+++ b/missing.c\n"
+	                                   "@@ -1 +1 @@\n"
+	                                   "-a\n"
+	                                   "+b\n");
+	REQUIRE(patch.parse(this->patch_file, 1, &this->logger));
+	REQUIRE(!patch.apply(this->dir, &this->logger));
+	REQUIRE(this->read_file(this->dir + "/a.c") == "a\n");
+}
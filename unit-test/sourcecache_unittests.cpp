@@ -0,0 +1,151 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "sourcecache.hpp"
+#include <catch2/catch.hpp>
+#include <fstream>
+#include <thread>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class SourceCacheTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("sourcecache_test_dir")};
+	std::string cache{cwd + "/cache"};
+	std::string work{cwd + "/work"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	void write_file(const std::string &path, const std::string &contents)
+	{
+		filesystem::create_directories(filesystem::path(path).parent_path());
+		std::ofstream file(path);
+		file << contents;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+	//! Create the work directory as left by a previous build
+	void previous_build(const std::string &dir)
+	{
+		this->write_file(dir + "/.extraction.info", "old");
+		this->write_file(dir + "/src/main.c", "old");
+		this->write_file(dir + "/src/unchanged.c", "unchanged");
+		this->write_file(dir + "/src/removed.c", "removed");
+		this->write_file(dir + "/build/main.o", "object");
+	}
+
+	//! What extracting the new sources does to the work directory
+	void extract(const std::string &dir)
+	{
+		filesystem::remove(dir + "/src/main.c");
+		this->write_file(dir + "/src/main.c", "new");
+		filesystem::remove(dir + "/src/removed.c");
+		this->write_file(dir + "/src/include/new.h", "header");
+		this->write_file(dir + "/other-1.0/README", "readme");
+		filesystem::create_symlink("README", dir + "/other-1.0/LINK");
+		this->write_file(dir + "/.extraction.info.new", "new");
+	}
+
+public:
+	SourceCacheTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->cache);
+		filesystem::create_directories(this->work);
+	}
+	~SourceCacheTestsFixture()
+	{
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(SourceCacheTestsFixture, "Test source_cache_store() and restore", "")
+{
+	REQUIRE(!source_cache_restore(this->cache, "abcd", this->work, &this->logger));
+
+	this->previous_build(this->work);
+	WorkSnapshot before = source_cache_snapshot(this->work);
+	REQUIRE(before.count("src/main.c") == 1);
+	REQUIRE(before.count(".extraction.info") == 0);
+	this->extract(this->work);
+	REQUIRE(source_cache_store(this->cache, "abcd", this->work, before, UINT64_MAX,
+	                           &this->logger));
+
+	// Only what the extraction changed is stored
+	std::string tree = this->cache + "/abcd/tree";
+	REQUIRE(this->read_file(tree + "/src/main.c") == "new");
+	REQUIRE(this->read_file(tree + "/other-1.0/README") == "readme");
+	REQUIRE(!filesystem::exists(tree + "/src/unchanged.c"));
+	REQUIRE(!filesystem::exists(tree + "/build"));
+	REQUIRE(!filesystem::exists(tree + "/.extraction.info.new"));
+
+	// Restoring into another copy of the previous build gives the same result
+	std::string other = this->cwd + "/other";
+	this->previous_build(other);
+	REQUIRE(source_cache_restore(this->cache, "abcd", other, &this->logger));
+	REQUIRE(this->read_file(other + "/src/main.c") == "new");
+	REQUIRE(this->read_file(other + "/src/unchanged.c") == "unchanged");
+	REQUIRE(!filesystem::exists(other + "/src/removed.c"));
+	REQUIRE(this->read_file(other + "/src/include/new.h") == "header");
+	REQUIRE(this->read_file(other + "/build/main.o") == "object");
+	REQUIRE(filesystem::read_symlink(other + "/other-1.0/LINK") == "README");
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(SourceCacheTestsFixture,
+                 "Test source_cache_store() keeps top level dotfiles", "")
+{
+	WorkSnapshot before = source_cache_snapshot(this->work);
+	// As from fetch{method="copyfile"} of a .config, alongside the bookkeeping
+	this->write_file(this->work + "/.config", "CONFIG_FOO=y");
+	this->write_file(this->work + "/.extraction.info.new", "new");
+	this->write_file(this->work + "/.build.key.dev", "key");
+	REQUIRE(source_cache_store(this->cache, "abcd", this->work, before, UINT64_MAX,
+	                           &this->logger));
+
+	std::string tree = this->cache + "/abcd/tree";
+	REQUIRE(!filesystem::exists(tree + "/.extraction.info.new"));
+	REQUIRE(!filesystem::exists(tree + "/.build.key.dev"));
+
+	std::string other = this->cwd + "/other";
+	filesystem::create_directories(other);
+	REQUIRE(source_cache_restore(this->cache, "abcd", other, &this->logger));
+	REQUIRE(this->read_file(other + "/.config") == "CONFIG_FOO=y");
+	REQUIRE(!filesystem::exists(other + "/.extraction.info.new"));
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(SourceCacheTestsFixture, "Test source_cache_store() evicts old entries",
+                 "")
+{
+	for(const std::string key : {"first", "second", "third"}) {
+		std::string dir = this->cwd + "/" + key;
+		filesystem::create_directories(dir);
+		WorkSnapshot before = source_cache_snapshot(dir);
+		this->write_file(dir + "/" + key + "/file", std::string(1000, 'x'));
+		REQUIRE(source_cache_store(this->cache, key, dir, before, 2500, &this->logger));
+		// Entry timestamps come from the coarse kernel clock
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		if(key == "second") {
+			// Using the first entry makes the second the least recently used
+			REQUIRE(source_cache_restore(this->cache, "first", dir, &this->logger));
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+	}
+	REQUIRE(filesystem::exists(this->cache + "/first"));
+	REQUIRE(!filesystem::exists(this->cache + "/second"));
+	REQUIRE(filesystem::exists(this->cache + "/third"));
+}
@@ -0,0 +1,172 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "hash.hpp"
+#include "stagingmanifest.hpp"
+#include "tar.hpp"
+#include <catch2/catch.hpp>
+#include <fstream>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class StagingManifestTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("stagingmanifest_test_dir")};
+	std::string staging{cwd + "/staging"};
+	std::string manifest_file{cwd + "/.staging.manifest"};
+	std::string archive_a{cwd + "/a.tar"};
+	std::string archive_b{cwd + "/b.tar"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	void write_file(const std::string &path, const std::string &contents)
+	{
+		filesystem::create_directories(filesystem::path(path).parent_path());
+		std::ofstream file(path);
+		file << contents;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+	//! Create a staging archive from a set of files
+	void create_archive(const std::string &archive,
+	                    const std::map<std::string, std::string> &files)
+	{
+		std::string src = archive + ".src";
+		filesystem::remove_all(src);
+		filesystem::create_directories(src);
+		for(const auto &file : files) {
+			this->write_file(src + "/" + file.first, file.second);
+		}
+		REQUIRE(tar_create(src, archive, &this->logger));
+	}
+
+	//! Extract archives into the staging directory, recording them in the manifest
+	void extract(StagingManifest *manifest, const std::vector<std::string> &archives)
+	{
+		for(const auto &archive : archives) {
+			std::vector<std::string> members;
+			REQUIRE(tar_extract(archive, this->staging, &this->logger, &members));
+			REQUIRE(manifest->record(archive, this->staging, members, &this->logger));
+		}
+		REQUIRE(manifest->save(this->manifest_file));
+	}
+
+public:
+	StagingManifestTestsFixture()
+	{
+		hash_setup();
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->staging);
+
+		this->create_archive(this->archive_a, {{"usr/include/a.h", "a"},
+		                                       {"usr/lib/liba.so", "liba"}});
+		this->create_archive(this->archive_b, {{"usr/include/b.h", "b"},
+		                                       {"usr/include/b/b2.h", "b2"}});
+		StagingManifest manifest;
+		this->extract(&manifest, {this->archive_a, this->archive_b});
+	}
+	~StagingManifestTestsFixture()
+	{
+		hash_shutdown();
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(StagingManifestTestsFixture, "Test update() with nothing changed", "")
+{
+	// Something created in the staging directory by the previous build
+	this->write_file(this->staging + "/usr/include/generated.h", "generated");
+	this->write_file(this->staging + "/extra/file", "extra");
+
+	StagingManifest manifest;
+	REQUIRE(manifest.load(this->manifest_file));
+	auto extract = manifest.update(this->staging, {this->archive_a, this->archive_b},
+	                               &this->logger);
+	REQUIRE(extract.empty());
+	REQUIRE(this->read_file(this->staging + "/usr/include/a.h") == "a");
+	REQUIRE(this->read_file(this->staging + "/usr/include/b/b2.h") == "b2");
+	REQUIRE(!filesystem::exists(this->staging + "/usr/include/generated.h"));
+	REQUIRE(!filesystem::exists(this->staging + "/extra"));
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(StagingManifestTestsFixture, "Test update() with a changed archive", "")
+{
+	this->create_archive(this->archive_b, {{"usr/include/b.h", "new b"},
+	                                       {"usr/share/b/data", "data"}});
+
+	StagingManifest manifest;
+	REQUIRE(manifest.load(this->manifest_file));
+	auto extract = manifest.update(this->staging, {this->archive_a, this->archive_b},
+	                               &this->logger);
+	REQUIRE(extract == std::vector<std::string>{this->archive_b});
+	REQUIRE(this->read_file(this->staging + "/usr/lib/liba.so") == "liba");
+	REQUIRE(!filesystem::exists(this->staging + "/usr/include/b.h"));
+	REQUIRE(!filesystem::exists(this->staging + "/usr/include/b"));
+	// Directories that are still used are kept
+	REQUIRE(filesystem::exists(this->staging + "/usr/include"));
+
+	this->extract(&manifest, extract);
+	REQUIRE(this->read_file(this->staging + "/usr/include/b.h") == "new b");
+	REQUIRE(this->read_file(this->staging + "/usr/share/b/data") == "data");
+
+	// The saved manifest describes the new contents
+	REQUIRE(manifest.load(this->manifest_file));
+	extract = manifest.update(this->staging, {this->archive_a, this->archive_b},
+	                          &this->logger);
+	REQUIRE(extract.empty());
+	REQUIRE(this->read_file(this->staging + "/usr/share/b/data") == "data");
+}
+
+TEST_CASE_METHOD(StagingManifestTestsFixture, "Test update() with a modified file", "")
+{
+	this->write_file(this->staging + "/usr/include/a.h", "modified");
+
+	StagingManifest manifest;
+	REQUIRE(manifest.load(this->manifest_file));
+	auto extract = manifest.update(this->staging, {this->archive_a, this->archive_b},
+	                               &this->logger);
+	// All of the archive the file came from is extracted again
+	REQUIRE(extract == std::vector<std::string>{this->archive_a});
+	REQUIRE(!filesystem::exists(this->staging + "/usr/include/a.h"));
+	REQUIRE(!filesystem::exists(this->staging + "/usr/lib/liba.so"));
+	REQUIRE(this->read_file(this->staging + "/usr/include/b.h") == "b");
+
+	this->extract(&manifest, extract);
+	REQUIRE(this->read_file(this->staging + "/usr/include/a.h") == "a");
+}
+
+TEST_CASE_METHOD(StagingManifestTestsFixture, "Test update() with a removed archive", "")
+{
+	StagingManifest manifest;
+	REQUIRE(manifest.load(this->manifest_file));
+	auto extract = manifest.update(this->staging, {this->archive_a}, &this->logger);
+	REQUIRE(extract.empty());
+	REQUIRE(this->read_file(this->staging + "/usr/include/a.h") == "a");
+	REQUIRE(!filesystem::exists(this->staging + "/usr/include/b.h"));
+	REQUIRE(!filesystem::exists(this->staging + "/usr/include/b"));
+}
+
+TEST_CASE_METHOD(StagingManifestTestsFixture, "Test load() with an invalid manifest", "")
+{
+	StagingManifest manifest;
+	REQUIRE(!manifest.load(this->cwd + "/missing"));
+	this->write_file(this->manifest_file, "E\t7\tf\t1\t1\tusr/include/a.h\n");
+	REQUIRE(!manifest.load(this->manifest_file));
+	// An empty manifest extracts everything again
+	auto extract = manifest.update(this->staging, {this->archive_a}, &this->logger);
+	REQUIRE(extract == std::vector<std::string>{this->archive_a});
+}
@@ -0,0 +1,189 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "stagingstore.hpp"
+#include "tar.hpp"
+#include <catch2/catch.hpp>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/stat.h>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class StagingStoreTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("stagingstore_test_dir")};
+	std::string src{cwd + "/src"};
+	std::string store{cwd + "/store"};
+	std::string dst{cwd + "/dst"};
+	std::string archive{cwd + "/staging.tar"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	void write_file(const std::string &path, const std::string &contents)
+	{
+		filesystem::create_directories(filesystem::path(path).parent_path());
+		std::ofstream file(path);
+		file << contents;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+public:
+	StagingStoreTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->src);
+		filesystem::create_directories(this->store);
+		filesystem::create_directories(this->dst);
+
+		this->write_file(this->src + "/usr/include/foo.h", "#define FOO 1\n");
+		this->write_file(this->src + "/usr/lib/libfoo.so.1", "elf");
+		filesystem::create_symlink("libfoo.so.1", this->src + "/usr/lib/libfoo.so");
+		filesystem::permissions(this->src + "/usr/lib/libfoo.so.1",
+		                        filesystem::perms::owner_all);
+		tar_create(this->src, this->archive, &this->logger);
+	}
+	~StagingStoreTestsFixture()
+	{
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(StagingStoreTestsFixture, "Test staging_store_populate() function", "")
+{
+	std::string tree = this->store + "/abcd/tree";
+	REQUIRE(staging_store_populate(this->store, this->archive, "abcd", UINT64_MAX,
+	                               &this->logger) == tree);
+	REQUIRE(this->read_file(tree + "/usr/include/foo.h") == "#define FOO 1\n");
+	REQUIRE(this->read_file(this->store + "/abcd/size") == "17\n");
+
+	// A second populate leaves the existing tree alone
+	filesystem::remove(this->archive);
+	REQUIRE(staging_store_populate(this->store, this->archive, "abcd", UINT64_MAX,
+	                               &this->logger) == tree);
+	REQUIRE(std::distance(filesystem::directory_iterator(this->store),
+	                      filesystem::directory_iterator()) == 1);
+	REQUIRE(this->stdout_buffer.str() == "");
+}
+
+TEST_CASE_METHOD(StagingStoreTestsFixture,
+                 "Test staging_store_populate() function with a missing archive", "")
+{
+	filesystem::remove(this->archive);
+	REQUIRE(staging_store_populate(this->store, this->archive, "abcd", UINT64_MAX,
+	                               &this->logger)
+	            .empty());
+	// Nothing (not even a partial tree) is left in the store
+	REQUIRE(filesystem::is_empty(this->store));
+}
+
+TEST_CASE_METHOD(StagingStoreTestsFixture, "Test staging_store_materialise() function", "")
+{
+	REQUIRE(!staging_store_populate(this->store, this->archive, "abcd", UINT64_MAX,
+	                                &this->logger)
+	             .empty());
+	this->write_file(this->dst + "/usr/include/other.h", "other");
+
+	REQUIRE(
+	    staging_store_materialise(this->store + "/abcd/tree", this->dst, &this->logger));
+	REQUIRE(this->stdout_buffer.str() == "");
+	REQUIRE(this->read_file(this->dst + "/usr/include/foo.h") == "#define FOO 1\n");
+	REQUIRE(this->read_file(this->dst + "/usr/include/other.h") == "other");
+	REQUIRE(filesystem::read_symlink(this->dst + "/usr/lib/libfoo.so") == "libfoo.so.1");
+	REQUIRE((filesystem::status(this->dst + "/usr/lib/libfoo.so.1").permissions() &
+	         filesystem::perms::owner_exec) != filesystem::perms::none);
+
+	// The same tree can be materialised into several directories
+	std::string dst2 = this->cwd + "/dst2";
+	filesystem::create_directories(dst2);
+	REQUIRE(staging_store_materialise(this->store + "/abcd/tree", dst2, &this->logger));
+	REQUIRE(this->read_file(dst2 + "/usr/include/foo.h") == "#define FOO 1\n");
+}
+
+TEST_CASE_METHOD(StagingStoreTestsFixture,
+                 "Test staging_store_materialise() does not replace existing files", "")
+{
+	REQUIRE(!staging_store_populate(this->store, this->archive, "abcd", UINT64_MAX,
+	                                &this->logger)
+	             .empty());
+	this->write_file(this->dst + "/usr/include/foo.h", "old");
+
+	REQUIRE(
+	    !staging_store_materialise(this->store + "/abcd/tree", this->dst, &this->logger));
+	REQUIRE(this->read_file(this->dst + "/usr/include/foo.h") == "old");
+	REQUIRE(this->read_file(this->dst + "/usr/lib/libfoo.so.1") == "elf");
+	REQUIRE(this->stdout_buffer.str().find(
+	            "usr/include/foo.h: Cannot create: File exists") != std::string::npos);
+}
+
+TEST_CASE_METHOD(StagingStoreTestsFixture,
+                 "Test staging_store_materialise() with read-only directories", "")
+{
+	filesystem::permissions(this->src + "/usr/include",
+	                        filesystem::perms::owner_read | filesystem::perms::owner_exec);
+	filesystem::last_write_time(this->src + "/usr/include",
+	                            filesystem::file_time_type::clock::now() -
+	                                std::chrono::hours(24));
+	filesystem::remove(this->archive);
+	tar_create(this->src, this->archive, &this->logger);
+	filesystem::permissions(this->src + "/usr/include", filesystem::perms::owner_all);
+
+	REQUIRE(!staging_store_populate(this->store, this->archive, "abcd", UINT64_MAX,
+	                                &this->logger)
+	             .empty());
+	REQUIRE(
+	    staging_store_materialise(this->store + "/abcd/tree", this->dst, &this->logger));
+	REQUIRE(this->stdout_buffer.str() == "");
+	REQUIRE(this->read_file(this->dst + "/usr/include/foo.h") == "#define FOO 1\n");
+
+	// The mode and mtime of the directory are set once its contents are in place
+	REQUIRE((filesystem::status(this->dst + "/usr/include").permissions() &
+	         filesystem::perms::owner_write) == filesystem::perms::none);
+	REQUIRE(filesystem::last_write_time(this->dst + "/usr/include") ==
+	        filesystem::last_write_time(this->store + "/abcd/tree/usr/include"));
+	filesystem::permissions(this->dst + "/usr/include", filesystem::perms::owner_all);
+	filesystem::permissions(this->store + "/abcd/tree/usr/include",
+	                        filesystem::perms::owner_all);
+}
+
+TEST_CASE_METHOD(StagingStoreTestsFixture,
+                 "Test staging_store_populate() evicts old trees", "")
+{
+	// The trees used by this process are never evicted
+	REQUIRE(!staging_store_populate(this->store, this->archive, "used", 0, &this->logger)
+	             .empty());
+
+	// Trees left by another process, least recently used first
+	for(const auto &name : {"old", "new"}) {
+		this->write_file(this->store + "/" + name + "/tree/file", "0123456789");
+		this->write_file(this->store + "/" + name + "/size", "10\n");
+		filesystem::permissions(this->store + "/" + name + "/tree",
+		                        filesystem::perms::owner_read |
+		                            filesystem::perms::owner_exec);
+	}
+	struct timespec times[2] = {{0, UTIME_OMIT}, {1, 0}};
+	utimensat(AT_FDCWD, (this->store + "/old").c_str(), times, 0);
+
+	// The new tree takes the store over the limit
+	REQUIRE(!staging_store_populate(this->store, this->archive, "abcd", 17 + 17 + 10,
+	                                &this->logger)
+	             .empty());
+	REQUIRE(!filesystem::exists(this->store + "/old"));
+	REQUIRE(filesystem::exists(this->store + "/new/tree/file"));
+	REQUIRE(filesystem::exists(this->store + "/used/tree"));
+	REQUIRE(filesystem::exists(this->store + "/abcd/tree"));
+	filesystem::permissions(this->store + "/new/tree", filesystem::perms::owner_all);
+}
@@ -0,0 +1,471 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "exceptions.hpp"
+#include "hash.hpp"
+#include "packagecmd.hpp"
+#include "tar.hpp"
+#include <catch2/catch.hpp>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class TarTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("tar_test_dir")};
+	std::string src{cwd + "/src"};
+	std::string dst{cwd + "/dst"};
+	std::string archive{cwd + "/test.tar"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	void write_file(const std::string &path, const std::string &contents)
+	{
+		filesystem::create_directories(filesystem::path(path).parent_path());
+		std::ofstream file(path);
+		file << contents;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+public:
+	TarTestsFixture()
+	{
+		hash_setup();
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->src);
+		filesystem::create_directories(this->dst);
+	}
+	~TarTestsFixture()
+	{
+		hash_shutdown();
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+//! Reads an (uncompressed) archive from a file
+class FdArchiveInput : public ArchiveInput
+{
+private:
+	int fd;
+
+public:
+	explicit FdArchiveInput(int _fd) : fd(_fd)
+	{
+	}
+	size_t read(char *data, size_t len) override
+	{
+		ssize_t res = ::read(this->fd, data, len);
+		return (res > 0) ? static_cast<size_t>(res) : 0;
+	}
+};
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_create() and tar_extract() round trip", "")
+{
+	std::string long_name = this->src + "/usr/" + std::string(150, 'a') + "/" +
+	                        std::string(120, 'b');
+	this->write_file(this->src + "/usr/bin/tool", "#!/bin/sh\n");
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", std::string(70000, 'x'));
+	this->write_file(long_name, "long");
+	this->write_file(this->src + "/empty", "");
+	filesystem::create_directories(this->src + "/usr/share/empty_dir");
+	filesystem::permissions(this->src + "/usr/bin/tool", filesystem::perms::owner_all);
+	filesystem::create_symlink("libfoo.so.1", this->src + "/usr/lib/libfoo.so");
+	filesystem::create_hard_link(this->src + "/usr/bin/tool", this->src + "/usr/bin/tool2");
+
+	REQUIRE(tar_create(this->src, this->archive, &this->logger));
+	REQUIRE(!filesystem::exists(this->archive + ".tmp"));
+	REQUIRE(filesystem::file_size(this->archive) % (256 * 512) == 0);
+	REQUIRE(tar_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(this->stdout_buffer.str() == "");
+
+	REQUIRE(this->read_file(this->dst + "/usr/bin/tool") == "#!/bin/sh\n");
+	REQUIRE(this->read_file(this->dst + "/usr/lib/libfoo.so.1") == std::string(70000, 'x'));
+	REQUIRE(this->read_file(this->dst + long_name.substr(this->src.size())) == "long");
+	REQUIRE(filesystem::file_size(this->dst + "/empty") == 0);
+	REQUIRE(filesystem::is_directory(this->dst + "/usr/share/empty_dir"));
+	REQUIRE(filesystem::is_symlink(this->dst + "/usr/lib/libfoo.so"));
+	REQUIRE(filesystem::read_symlink(this->dst + "/usr/lib/libfoo.so") == "libfoo.so.1");
+	REQUIRE(
+	    filesystem::equivalent(this->dst + "/usr/bin/tool", this->dst + "/usr/bin/tool2"));
+	REQUIRE((filesystem::status(this->dst + "/usr/bin/tool").permissions() &
+	         filesystem::perms::owner_exec) != filesystem::perms::none);
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_create() output can be read by tar", "")
+{
+	std::string long_name = "/" + std::string(120, 'c') + "/" + std::string(110, 'd');
+	this->write_file(this->src + "/dir/file", "data");
+	this->write_file(this->src + long_name, "long");
+	filesystem::create_symlink("dir/file", this->src + "/link");
+
+	REQUIRE(tar_create(this->src, this->archive, &this->logger));
+
+	PackageCmd pc(this->dst, "tar");
+	pc.addArg("-xf");
+	pc.addArg(this->archive);
+	REQUIRE(pc.Run(&this->logger));
+
+	REQUIRE(this->read_file(this->dst + "/dir/file") == "data");
+	REQUIRE(this->read_file(this->dst + long_name) == "long");
+	REQUIRE(filesystem::read_symlink(this->dst + "/link") == "dir/file");
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_extract() can read archives created by tar", "")
+{
+	std::string long_name = "/" + std::string(120, 'e') + "/" + std::string(110, 'f');
+	this->write_file(this->src + "/dir/file", "data");
+	this->write_file(this->src + long_name, "long");
+	filesystem::create_symlink("dir/file", this->src + "/link");
+
+	std::string format = GENERATE("gnu", "pax");
+	PackageCmd pc(this->src, "tar");
+	pc.addArg("--format=" + format);
+	pc.addArg("-cf");
+	pc.addArg(this->archive);
+	pc.addArg(".");
+	REQUIRE(pc.Run(&this->logger));
+
+	REQUIRE(tar_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(this->read_file(this->dst + "/dir/file") == "data");
+	REQUIRE(this->read_file(this->dst + long_name) == "long");
+	REQUIRE(filesystem::read_symlink(this->dst + "/link") == "dir/file");
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_extract() does not replace existing files", "")
+{
+	this->write_file(this->src + "/dir/file", "new");
+	this->write_file(this->src + "/dir/other", "other");
+	REQUIRE(tar_create(this->src, this->archive, &this->logger));
+
+	this->write_file(this->dst + "/dir/file", "old");
+	REQUIRE(!tar_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(this->read_file(this->dst + "/dir/file") == "old");
+	// The rest of the archive is still extracted
+	REQUIRE(this->read_file(this->dst + "/dir/other") == "other");
+	REQUIRE(this->stdout_buffer.str().find("./dir/file: Cannot create: File exists") !=
+	        std::string::npos);
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_extract() replacing existing files", "")
+{
+	this->write_file(this->src + "/dir/file", "new");
+	this->write_file(this->src + "/dir/link_target", "target");
+	filesystem::create_symlink("link_target", this->src + "/dir/link");
+	REQUIRE(tar_create(this->src, this->archive, &this->logger));
+
+	this->write_file(this->dst + "/dir/file", "old");
+	this->write_file(this->dst + "/dir/link", "old");
+	REQUIRE(tar_extract(this->archive, this->dst, &this->logger, nullptr, true));
+	REQUIRE(this->stdout_buffer.str() == "");
+	REQUIRE(this->read_file(this->dst + "/dir/file") == "new");
+	REQUIRE(filesystem::read_symlink(this->dst + "/dir/link") == "link_target");
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_extract() with a filter", "")
+{
+	this->write_file(this->src + "/usr/include/foo.h", "header");
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", "library");
+	REQUIRE(tar_create(this->src, this->archive, &this->logger));
+
+	std::vector<std::string> members;
+	auto include = [](const std::string &path) {
+		return path.compare(0, 12, "usr/include/") == 0;
+	};
+	REQUIRE(tar_extract(this->archive, this->dst, &this->logger, &members, false, include));
+	REQUIRE(this->read_file(this->dst + "/usr/include/foo.h") == "header");
+	REQUIRE(!filesystem::exists(this->dst + "/usr/lib/libfoo.so.1"));
+	REQUIRE(members == std::vector<std::string>{"usr/include/foo.h"});
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_extract() with compressed archives", "")
+{
+	this->write_file(this->src + "/dir/file", std::string(200000, 'x'));
+	this->write_file(this->src + "/dir/other", "other");
+
+	std::string option = GENERATE("-z", "-j", "-J");
+	PackageCmd pc(this->src, "tar");
+	pc.addArg(option);
+	pc.addArg("-cf");
+	pc.addArg(this->archive);
+	pc.addArg(".");
+	REQUIRE(pc.Run(&this->logger));
+
+	REQUIRE(tar_can_extract(this->archive));
+	REQUIRE(tar_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(this->read_file(this->dst + "/dir/file") == std::string(200000, 'x'));
+	REQUIRE(this->read_file(this->dst + "/dir/other") == "other");
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_extract() with a corrupt gzip archive", "")
+{
+	this->write_file(this->src + "/file", std::string(200000, 'x'));
+	PackageCmd pc(this->src, "tar");
+	pc.addArg("-zcf");
+	pc.addArg(this->archive);
+	pc.addArg(".");
+	REQUIRE(pc.Run(&this->logger));
+	filesystem::resize_file(this->archive, filesystem::file_size(this->archive) / 2);
+
+	REQUIRE(!tar_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(!this->stdout_buffer.str().empty());
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_extract() with a missing archive", "")
+{
+	REQUIRE(!tar_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(!this->stdout_buffer.str().empty());
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test the index written by tar_create()", "")
+{
+	std::string data(5000, 'd');
+	std::string odd_name = "/usr/share/tab\tand\nnewline";
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", data);
+	this->write_file(this->src + odd_name, "odd");
+	this->write_file(this->src + "/empty", "");
+	filesystem::create_symlink("libfoo.so.1", this->src + "/usr/lib/libfoo.so");
+
+	REQUIRE(tar_create(this->src, this->archive, &this->logger));
+	std::vector<ArchiveIndexEntry> entries;
+	REQUIRE(archive_index_load(this->archive + ".idx", &entries));
+
+	std::map<std::string, ArchiveIndexEntry> by_path;
+	for(const auto &entry : entries) {
+		by_path[entry.path] = entry;
+	}
+	REQUIRE(by_path.size() == entries.size());
+	REQUIRE(by_path.count("usr") == 1);
+	REQUIRE(by_path["usr/lib"].type == '5');
+	REQUIRE(by_path["usr/lib/libfoo.so"].type == '2');
+	REQUIRE(by_path["usr/lib/libfoo.so"].hash.empty());
+	REQUIRE(by_path["usr/lib/libfoo.so"].linkname == "libfoo.so.1");
+	REQUIRE(by_path[odd_name.substr(1)].size == 3);
+	REQUIRE(by_path["empty"].size == 0);
+	REQUIRE(!by_path["empty"].hash.empty());
+
+	const ArchiveIndexEntry &lib = by_path["usr/lib/libfoo.so.1"];
+	REQUIRE(lib.type == '0');
+	REQUIRE(lib.size == data.size());
+	REQUIRE(lib.hash == hash_file(this->src + "/usr/lib/libfoo.so.1"));
+	// The data can be read directly from the archive
+	std::string read(lib.size, '\0');
+	int fd = open(this->archive.c_str(), O_RDONLY);
+	REQUIRE(pread(fd, &read[0], read.size(), static_cast<off_t>(lib.offset)) ==
+	        static_cast<ssize_t>(read.size()));
+	close(fd);
+	REQUIRE(read == data);
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test archive_index_create() function", "")
+{
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", std::string(70000, 'f'));
+	this->write_file(this->src + "/usr/share/tab\tand\nnewline", "odd");
+	this->write_file(this->src + "/empty", "");
+	filesystem::create_symlink("libfoo.so.1", this->src + "/usr/lib/libfoo.so");
+
+	REQUIRE(tar_create(this->src, this->archive, &this->logger));
+	std::string index = this->read_file(this->archive + ".idx");
+	REQUIRE(!index.empty());
+
+	// The index matches the one written by tar_create()
+	filesystem::remove(this->archive + ".idx");
+	REQUIRE(archive_index_create(this->archive, &this->logger));
+	REQUIRE(this->read_file(this->archive + ".idx") == index);
+	REQUIRE(!filesystem::exists(this->archive + ".idx.tmp"));
+
+	REQUIRE(!archive_index_create(this->cwd + "/missing.tar", &this->logger));
+	REQUIRE(!filesystem::exists(this->cwd + "/missing.tar.idx"));
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test archive_index_digest() function", "")
+{
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", "foo");
+	filesystem::create_symlink("libfoo.so.1", this->src + "/usr/lib/libfoo.so");
+	REQUIRE(tar_create(this->src, this->archive, &this->logger));
+	std::string digest;
+	REQUIRE(archive_index_digest(this->archive, &digest, &this->logger));
+	REQUIRE(digest.size() == 64);
+
+	// The same tree at a later time, without an index, has the same digest
+	std::string other = this->cwd + "/other.tar";
+	filesystem::last_write_time(this->src + "/usr/lib/libfoo.so.1",
+	                            filesystem::file_time_type::clock::now() +
+	                                std::chrono::hours(1));
+	REQUIRE(tar_create(this->src, other, &this->logger));
+	filesystem::remove(other + ".idx");
+	std::string other_digest;
+	REQUIRE(archive_index_digest(other, &other_digest, &this->logger));
+	REQUIRE(other_digest == digest);
+	REQUIRE(filesystem::exists(other + ".idx"));
+
+	// Different contents or link targets do not
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", "bar");
+	REQUIRE(tar_create(this->src, other, &this->logger));
+	REQUIRE(archive_index_digest(other, &other_digest, &this->logger));
+	REQUIRE(other_digest != digest);
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", "foo");
+	filesystem::remove(this->src + "/usr/lib/libfoo.so");
+	filesystem::create_symlink("libfoo.so.2", this->src + "/usr/lib/libfoo.so");
+	REQUIRE(tar_create(this->src, other, &this->logger));
+	REQUIRE(archive_index_digest(other, &other_digest, &this->logger));
+	REQUIRE(other_digest != digest);
+
+	REQUIRE(!archive_index_digest(this->cwd + "/missing.tar", &digest, &this->logger));
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test archive_index_digest() function with a filter", "")
+{
+	this->write_file(this->src + "/usr/include/foo.h", "header");
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", "foo");
+	REQUIRE(tar_create(this->src, this->archive, &this->logger));
+	auto include = [](const std::string &path) {
+		return path.compare(0, 12, "usr/include/") == 0;
+	};
+	std::string digest;
+	REQUIRE(archive_index_digest(this->archive, &digest, &this->logger, include));
+
+	// Changes to files that are not included do not change the digest
+	std::string other = this->cwd + "/other.tar";
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", "bar");
+	REQUIRE(tar_create(this->src, other, &this->logger));
+	std::string other_digest;
+	REQUIRE(archive_index_digest(other, &other_digest, &this->logger, include));
+	REQUIRE(other_digest == digest);
+	REQUIRE(archive_index_digest(other, &other_digest, &this->logger));
+	REQUIRE(other_digest != digest);
+
+	this->write_file(this->src + "/usr/include/foo.h", "changed");
+	REQUIRE(tar_create(this->src, other, &this->logger));
+	REQUIRE(archive_index_digest(other, &other_digest, &this->logger, include));
+	REQUIRE(other_digest != digest);
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test archive_index_load() function", "")
+{
+	std::vector<ArchiveIndexEntry> entries;
+	REQUIRE(!archive_index_load(this->cwd + "/missing.idx", &entries));
+	this->write_file(this->cwd + "/bad.idx", "0\t644\tx\t0\t-\tpath\n");
+	REQUIRE(!archive_index_load(this->cwd + "/bad.idx", &entries));
+	REQUIRE(entries.empty());
+	// Indexes without link targets can still be loaded
+	this->write_file(this->cwd + "/old.idx", "2\t777\t0\t512\t-\tlib/libfoo.so\n");
+	REQUIRE(archive_index_load(this->cwd + "/old.idx", &entries));
+	REQUIRE(entries.size() == 1);
+	REQUIRE(entries[0].linkname.empty());
+}
+
+TEST_CASE("Test ArchiveCodec::parse() function", "")
+{
+	REQUIRE(!ArchiveCodec::parse("none").zstd);
+	REQUIRE_THROWS_AS(ArchiveCodec::parse("gzip"), CustomException);
+	REQUIRE_THROWS_AS(ArchiveCodec::parse("zstd:x"), CustomException);
+	REQUIRE_THROWS_AS(ArchiveCodec::parse("zstd:3:2:1"), CustomException);
+#ifdef BUILDSYS_HAVE_ZSTD
+	ArchiveCodec codec = ArchiveCodec::parse("zstd:19:4");
+	REQUIRE(codec.zstd);
+	REQUIRE(codec.level == 19);
+	REQUIRE(codec.threads == 4);
+	REQUIRE(ArchiveCodec::parse("zstd").zstd);
+#else
+	REQUIRE_THROWS_AS(ArchiveCodec::parse("zstd"), CustomException);
+#endif
+}
+
+#ifdef BUILDSYS_HAVE_ZSTD
+TEST_CASE("Test ArchiveReproducible::parse() function", "")
+{
+	REQUIRE(ArchiveReproducible::parse(nullptr).enabled);
+	REQUIRE(ArchiveReproducible::parse(nullptr).mtime == 0);
+	REQUIRE(ArchiveReproducible::parse("").mtime == 0);
+	REQUIRE(ArchiveReproducible::parse("1600000000").mtime == 1600000000);
+	REQUIRE_THROWS_AS(ArchiveReproducible::parse("x"), CustomException);
+	REQUIRE_THROWS_AS(ArchiveReproducible::parse("10x"), CustomException);
+	REQUIRE_THROWS_AS(ArchiveReproducible::parse("-1"), CustomException);
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_create() reproducible archives", "")
+{
+	ArchiveReproducible repro = ArchiveReproducible::parse("1600000000");
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", "foo");
+	this->write_file(this->src + "/usr/share/old", "old");
+	filesystem::create_symlink("libfoo.so.1", this->src + "/usr/lib/libfoo.so");
+	filesystem::last_write_time(this->src + "/usr/share/old",
+	                            filesystem::file_time_type::clock::now() -
+	                                std::chrono::hours(24 * 365 * 20));
+	REQUIRE(tar_create(this->src, this->archive, &this->logger, ArchiveCodec(), repro));
+
+	// The same tree at a later time gives the same archive
+	std::string other = this->cwd + "/other.tar";
+	filesystem::last_write_time(this->src + "/usr/lib/libfoo.so.1",
+	                            filesystem::file_time_type::clock::now() +
+	                                std::chrono::hours(1));
+	REQUIRE(tar_create(this->src, other, &this->logger, ArchiveCodec(), repro));
+	REQUIRE(this->read_file(other) == this->read_file(this->archive));
+
+	int fd = open(this->archive.c_str(), O_RDONLY);
+	REQUIRE(fd >= 0);
+	std::map<std::string, TarEntry> members;
+	FdArchiveInput in(fd);
+	TarReader reader(&in);
+	TarEntry entry;
+	while(reader.next(&entry)) {
+		members[entry.path] = entry;
+	}
+	close(fd);
+	REQUIRE(!members.empty());
+	for(const auto &member : members) {
+		REQUIRE(member.second.uid == 0);
+		REQUIRE(member.second.gid == 0);
+		REQUIRE(member.second.mtime <= 1600000000);
+	}
+	REQUIRE(members["./usr/lib/libfoo.so.1"].mtime == 1600000000);
+	// Older files keep their time
+	REQUIRE(members["./usr/share/old"].mtime < 1600000000);
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_create() and tar_extract() with zstd", "")
+{
+	this->write_file(this->src + "/usr/lib/libfoo.so.1", std::string(3000000, 'x'));
+	this->write_file(this->src + "/usr/bin/tool", "#!/bin/sh\n");
+
+	ArchiveCodec codec = ArchiveCodec::parse(GENERATE("zstd", "zstd:1:2"));
+	REQUIRE(tar_create(this->src, this->archive, &this->logger, codec));
+	REQUIRE(filesystem::file_size(this->archive) < 100000);
+	std::string magic = this->read_file(this->archive).substr(0, 4);
+	REQUIRE(magic == "\x28\xb5\x2f\xfd");
+
+	REQUIRE(tar_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(this->stdout_buffer.str() == "");
+	REQUIRE(this->read_file(this->dst + "/usr/lib/libfoo.so.1") ==
+	        std::string(3000000, 'x'));
+	REQUIRE(this->read_file(this->dst + "/usr/bin/tool") == "#!/bin/sh\n");
+}
+
+TEST_CASE_METHOD(TarTestsFixture, "Test tar_extract() with a truncated zstd archive", "")
+{
+	this->write_file(this->src + "/file", std::string(3000000, 'x'));
+	REQUIRE(
+	    tar_create(this->src, this->archive, &this->logger, ArchiveCodec::parse("zstd")));
+	filesystem::resize_file(this->archive, filesystem::file_size(this->archive) / 2);
+
+	REQUIRE(!tar_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(!this->stdout_buffer.str().empty());
+}
+#endif
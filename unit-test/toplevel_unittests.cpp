@@ -185,6 +185,77 @@ TEST_CASE_METHOD(TopLevelTestsFixture, "Test invalid 'hashoutput' function usage
 	REQUIRE(!p.isHashingOutput());
 }
 
+TEST_CASE_METHOD(TopLevelTestsFixture, "Test valid 'hashinterface' function usage", "")
+{
+	Package p(this->ns, "test_package", ".", ".");
+
+	// Should default to false
+	REQUIRE(!p.isHashingInterface());
+
+	REQUIRE(execute_lua(p, "hashinterface()"));
+
+	// Should now be true
+	REQUIRE(p.isHashingInterface());
+}
+
+TEST_CASE_METHOD(TopLevelTestsFixture, "Test invalid 'hashinterface' function usage", "")
+{
+	Package p(this->ns, "test_package", ".", ".");
+
+	REQUIRE(!execute_lua(p, "hashinterface(true)"));
+
+	// Should still be false
+	REQUIRE(!p.isHashingInterface());
+}
+
+TEST_CASE_METHOD(TopLevelTestsFixture, "Test valid 'outputs' function usage", "")
+{
+	Package p(this->ns, "test_package", ".", ".");
+
+	REQUIRE(execute_lua(p, "outputs{dev={'usr/include/*', 'usr/lib/*.a'}, bin='usr/bin/*'}"));
+
+	REQUIRE(p.hasOutput("dev"));
+	REQUIRE(p.hasOutput("bin"));
+	REQUIRE(p.outputFilter({"dev"})("usr/lib/libfoo.a"));
+	REQUIRE(!p.outputFilter({"dev"})("usr/bin/tool"));
+}
+
+TEST_CASE_METHOD(TopLevelTestsFixture, "Test invalid 'outputs' function usage", "")
+{
+	Package p(this->ns, "test_package", ".", ".");
+
+	REQUIRE(!execute_lua(p, "outputs('usr/include/*')"));
+	REQUIRE(!execute_lua(p, "outputs{dev=true}"));
+	REQUIRE(!execute_lua(p, "outputs{['a/b']='usr/include/*'}"));
+
+	REQUIRE(!p.hasOutput("dev"));
+}
+
+TEST_CASE_METHOD(TopLevelTestsFixture, "Test valid 'stage_filter' function usage", "")
+{
+	Package p(this->ns, "test_package", ".", ".");
+
+	// Should default to empty
+	REQUIRE(p.getStageFilter().empty());
+
+	REQUIRE(execute_lua(p, "stage_filter{'/usr/include/*', './usr/lib/*.so*'}"));
+	REQUIRE(execute_lua(p, "stage_filter('usr/lib/pkgconfig/*')"));
+
+	REQUIRE(p.getStageFilter() == std::vector<std::string>{"usr/include/*", "usr/lib/*.so*",
+	                                                        "usr/lib/pkgconfig/*"});
+}
+
+TEST_CASE_METHOD(TopLevelTestsFixture, "Test invalid 'stage_filter' function usage", "")
+{
+	Package p(this->ns, "test_package", ".", ".");
+
+	REQUIRE(!execute_lua(p, "stage_filter()"));
+	REQUIRE(!execute_lua(p, "stage_filter(true)"));
+	REQUIRE(!execute_lua(p, "stage_filter{'usr/include/*', 1}"));
+
+	REQUIRE(p.getStageFilter().empty());
+}
+
 TEST_CASE_METHOD(TopLevelTestsFixture, "Test valid 'builddir' function usage (no parameter)", "")
 {
 	Package p(this->ns, "test_package", ".", ".");
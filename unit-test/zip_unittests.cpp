@@ -0,0 +1,117 @@
+#define CATCH_CONFIG_MAIN
+
+#include <filesystem>
+#include "packagecmd.hpp"
+#include "zip.hpp"
+#include <catch2/catch.hpp>
+#include <fstream>
+#include <sys/stat.h>
+
+using namespace buildsys;
+namespace filesystem = std::filesystem;
+
+class ZipTestsFixture
+{
+protected:
+	std::string cwd{filesystem::absolute("zip_test_dir")};
+	std::string src{cwd + "/src"};
+	std::string dst{cwd + "/dst"};
+	std::string archive{cwd + "/test.zip"};
+	std::streambuf *coutbuf{nullptr};
+	std::stringstream stdout_buffer;
+	Logger logger{"test"};
+
+	void write_file(const std::string &path, const std::string &contents)
+	{
+		filesystem::create_directories(filesystem::path(path).parent_path());
+		std::ofstream file(path);
+		file << contents;
+	}
+
+	std::string read_file(const std::string &path)
+	{
+		std::ifstream file(path);
+		return std::string((std::istreambuf_iterator<char>(file)),
+		                   std::istreambuf_iterator<char>());
+	}
+
+	bool zip(const std::string &options)
+	{
+		PackageCmd pc(this->src, "zip");
+		pc.addArg(options);
+		pc.addArg(this->archive);
+		pc.addArg(".");
+		return pc.Run(&this->logger);
+	}
+
+public:
+	ZipTestsFixture()
+	{
+		// Ensure that we restore std::cout at the end of each test.
+		this->coutbuf = std::cout.rdbuf();
+		// Redirect std::cout so we can verify what is printed.
+		std::cout.rdbuf(this->stdout_buffer.rdbuf());
+		filesystem::create_directories(this->src);
+		filesystem::create_directories(this->dst);
+	}
+	~ZipTestsFixture()
+	{
+		std::cout.rdbuf(this->coutbuf);
+		filesystem::remove_all(this->cwd);
+	}
+};
+
+TEST_CASE_METHOD(ZipTestsFixture, "Test zip_extract() function", "")
+{
+	if(!zip_can_extract()) {
+		REQUIRE(!zip_extract(this->archive, this->dst, &this->logger));
+		return;
+	}
+	this->write_file(this->src + "/dir/file", std::string(200000, 'x'));
+	this->write_file(this->src + "/dir/tool", "#!/bin/sh\n");
+	filesystem::create_directories(this->src + "/empty");
+	filesystem::create_symlink("file", this->src + "/dir/link");
+	filesystem::permissions(this->src + "/dir/tool", filesystem::perms::owner_all);
+	// Stored and deflated
+	REQUIRE(this->zip(GENERATE("-0ryq", "-9ryq")));
+
+	this->write_file(this->dst + "/dir/file", "old");
+	REQUIRE(zip_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(this->read_file(this->dst + "/dir/file") == std::string(200000, 'x'));
+	REQUIRE(this->read_file(this->dst + "/dir/tool") == "#!/bin/sh\n");
+	REQUIRE((filesystem::status(this->dst + "/dir/tool").permissions() &
+	         filesystem::perms::owner_exec) != filesystem::perms::none);
+	REQUIRE(filesystem::read_symlink(this->dst + "/dir/link") == "file");
+	REQUIRE(filesystem::is_directory(this->dst + "/empty"));
+	auto mtime = [](const std::string &path) {
+		struct stat st = {};
+		stat(path.c_str(), &st);
+		return st.st_mtim.tv_sec;
+	};
+	REQUIRE(mtime(this->dst + "/dir/tool") == mtime(this->src + "/dir/tool"));
+}
+
+TEST_CASE_METHOD(ZipTestsFixture, "Test zip_extract() with a corrupt archive", "")
+{
+	if(!zip_can_extract()) {
+		return;
+	}
+	this->write_file(this->src + "/file", "data");
+	REQUIRE(this->zip("-0rq"));
+	// Corrupt the data of the only member
+	std::fstream file(this->archive, std::ios::in | std::ios::out | std::ios::binary);
+	std::string contents = this->read_file(this->archive);
+	file.seekp(static_cast<std::streamoff>(contents.find("data")));
+	file << "DATA";
+	file.close();
+
+	REQUIRE(!zip_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(this->stdout_buffer.str().find("Bad CRC") != std::string::npos);
+}
+
+TEST_CASE_METHOD(ZipTestsFixture, "Test zip_extract() with an invalid archive", "")
+{
+	this->write_file(this->archive, "not a zip archive");
+	REQUIRE(!zip_extract(this->archive, this->dst, &this->logger));
+	REQUIRE(!zip_extract(this->cwd + "/missing.zip", this->dst, &this->logger));
+}